@@ -7,6 +7,8 @@
 #include <time.h>
 #include <pthread.h>
 #include <assert.h>
+#include <inttypes.h>
+#include <arpa/inet.h>
 
 #include "lib/packet.h"
 #include "lib/mgmt.h"
@@ -23,6 +25,7 @@
 #include "lib/trace_util.h"
 #include "lib/abc.h"
 #include "lib/ai.h"
+#include "lib/metrics.h"
 
 #define PROCESS_PACKET_DROP	0
 #define PROCESS_PACKET_LOCAL	1  /* only forward to alocal */
@@ -115,6 +118,8 @@ static void initialize_sockets ()
 }
 
 static struct allnet_log * alog = NULL;
+/* alog is shared by the threads of the forwarding pipeline */
+static pthread_mutex_t log_mutex = PTHREAD_MUTEX_INITIALIZER;
 static struct social_info * social_net = NULL;
 static unsigned char my_address [ADDRESS_SIZE];
 
@@ -225,10 +230,12 @@ static void send_routing_keepalive (int sockfd, struct sockaddr_storage addr,
   char * receiver_auth = ((index < 0) ? NULL :
                           routing_keepalives [index].keepalive_auth);
   char message [ALLNET_MTU];
+  /* stamped, so the answer can be timed */
+  unsigned int stamp = routing_keepalive_sent (&addr, alen);
   int msize = keepalive_auth (message, sizeof (message),
                               addr, sockets.random_secret,
                               sizeof (sockets.random_secret),
-                              sockets.counter, receiver_auth);
+                              sockets.counter, stamp, receiver_auth);
   if (! socket_send_to_ip (sockfd, message, msize, addr, alen, "sending probe"))
     print_buffer ((char *)&(addr), alen, "error sending probe keepalive to",
                   100, 1);
@@ -244,7 +251,7 @@ static void send_one_keepalive (const char * desc,
   char auth_msg [ALLNET_MTU];
   if (sock->is_global_v4 || sock->is_global_v6) {
     msize = keepalive_auth (auth_msg, sizeof (auth_msg),
-                            sav->addr, secret, slen, counter,
+                            sav->addr, secret, slen, counter, 0,
                             sav->keepalive_auth);
     message = auth_msg;
 #ifdef DEBUG_PRINT
@@ -275,14 +282,15 @@ static void send_auth_response (int sockfd, struct sockaddr_storage addr,
     return;
   char response [ALLNET_MTU];
   unsigned int rsize = keepalive_auth (response, sizeof (response),
-                                       addr, secret, slen, counter,
+                                       addr, secret, slen, counter, 0,
                                        message + hsize);
   socket_send_to_ip (sockfd, response, rsize, addr, alen,
                      "ad.c/send_auth_response");
 }
 
 /* send to a limited number of DHT addresses and to socket_send_out */
-static void send_out (const char * message, int msize, int max_addrs,
+static void send_out (const char * message, int msize, unsigned int priority,
+                      int max_addrs,
                       const struct sockaddr_storage * except, /* may be NULL */
                       socklen_t elen)  /* should be 0 if except is NULL */
 {
@@ -314,6 +322,12 @@ print_buffer (&addrs [i], alens [i], NULL, alens [i], 1);
     sent_count = 0;
     send_keepalives = 1;
   }
+  /* the DHT addresses are sent together with the socket set addresses */
+  int dht_fds [ADDRS_MAX];
+  struct sockaddr_storage dht_addrs [ADDRS_MAX];
+  socklen_t dht_alens [ADDRS_MAX];
+  int dht_sent [ADDRS_MAX];
+  int num_dht = 0;
   for (i = 0; i < num_addrs; i++) {
     struct sockaddr_storage dest = addrs [i];
     socklen_t alen = alens [i];
@@ -327,17 +341,28 @@ print_buffer (&addrs [i], alens [i], NULL, alens [i], 1);
     if (sockfd >= 0) {
       if (send_keepalives)
         send_routing_keepalive (sockfd, dest, alen);
-      if (! socket_send_to_ip (sockfd, message, msize, dest, alen,
-                               "ad.c/send_out"))
-        dht_send_error = 1;
+      dht_fds [num_dht] = sockfd;
+      dht_addrs [num_dht] = dest;
+      dht_alens [num_dht] = alen;
+      num_dht++;
     }
   }
   if (send_keepalives)
     socket_send_keepalives (&sockets, virtual_clock, SEND_KEEPALIVES_LOCAL,
                             SEND_KEEPALIVES_REMOTE);
   static struct sockaddr_storage empty;  /* used if except is null */
-  socket_send_out (&sockets, message, msize, virtual_clock,
-                   ((except == NULL) ? empty : *except), elen);
+  socket_send_out_extra (&sockets, message, msize, priority, virtual_clock,
+                         ((except == NULL) ? empty : *except), elen,
+                         num_dht, dht_fds, dht_addrs, dht_alens,
+                         dht_sent, &dht_send_error);
+  /* evict peers that keep failing.  If several sends all failed, the
+   * problem is more likely ours than the peers', so do not count it */
+  int any_sent = (num_dht <= 1);
+  for (i = 0; i < num_dht; i++)
+    if (dht_sent [i] > 0)
+      any_sent = 1;
+  for (i = 0; (any_sent) && (i < num_dht); i++)
+    routing_send_result (dht_addrs + i, dht_alens [i], dht_sent [i]);
   if (dht_send_error)
     routing_expire_dht (&sockets);
 }
@@ -351,13 +376,13 @@ static void update_dht ()
     memset (&sas, 0, sizeof (sas));
     socket_send_local (&sockets, dht_message, msize, ALLNET_PRIORITY_LOCAL_LOW,
                        virtual_clock, sas, 0);
-    send_out (dht_message, msize, ROUTING_DHT_ADDRS_MAX, NULL, 0);
+    send_out (dht_message, msize, ALLNET_PRIORITY_MAX, ROUTING_DHT_ADDRS_MAX,
+              NULL, 0);
     free (dht_message);
   }
 }
 
-static struct socket_address_validity *
-  add_received_address (struct socket_read_result r)
+static void add_received_address (struct socket_read_result r)
 {
   int send_keepalive = 0;
   long long int limit = virtual_clock + ((r.sock->is_local) ? 6 : 180);
@@ -378,24 +403,28 @@ static struct socket_address_validity *
                          r.message, r.msize))) {
     memcpy (&(sav.keepalive_auth), r.message + hsize,  /* sender auth */
             sizeof (sav.keepalive_auth));
+    /* times the answer to our last stamped keepalive, if this is it */
+    routing_keepalive_answered (&(r.from), r.alen,
+                                readb16 (r.message + hsize +
+                                         KEEPALIVE_AUTHENTICATION_SIZE));
     if ((is_in_routing_table ((struct sockaddr *) &(r.from), r.alen)) &&
         (add_routing_keepalive (r.from, r.alen, sav.keepalive_auth)))
       send_keepalive = 1;
   }
   memcpy (&(sav.addr), &(r.from), sizeof (r.from));
-  struct socket_address_validity * result = NULL;
   if (! is_in_routing_table ((struct sockaddr *) &(r.from), r.alen)) {
-    result = socket_address_add (&sockets, r.sock->sockfd, sav);
-    if (result == NULL)
+    /* the transmit thread may move or delete the new sav at any time,
+     * so look it up again (under the lock) to send the keepalive */
+    if (socket_address_add (&sockets, r.sock->sockfd, sav) == NULL)
       printf ("odd: unable to add new address\n");
-    send_keepalive = 1;
-  }
-  if (send_keepalive)
-    send_one_keepalive ("add_received_address", r.sock,
-                        ((result != NULL) ? result : &sav),
+    else
+      socket_send_keepalive (&sockets, r.sock->sockfd, r.from, r.alen,
+                             virtual_clock);
+  } else if (send_keepalive) {  /* sav is our own copy */
+    send_one_keepalive ("add_received_address", r.sock, &sav,
                         sockets.random_secret, sizeof (sockets.random_secret),
                         sockets.counter);
-  return result;
+  }
 }
 
 #define LOG_PACKETS
@@ -405,6 +434,7 @@ static int send_message_to_one (const char * message, int msize, int priority,
                                 struct sockaddr_storage addr, socklen_t alen)
 {
 #ifdef LOG_PACKETS
+  pthread_mutex_lock (&log_mutex);
   snprintf (alog->b, alog->s, "%s (%d bytes, prio %d, to pipe %d)\n",
             "send_one_message_to", msize, priority, sock->sockfd);
 #ifdef DEBUG_FOR_DEVELOPER_OFF
@@ -413,6 +443,7 @@ static int send_message_to_one (const char * message, int msize, int priority,
 #endif /* DEBUG_FOR_DEVELOPER_OFF */
   log_print (alog);
   log_packet (alog, "message to pipe", message, msize);
+  pthread_mutex_unlock (&log_mutex);
 #endif /* LOG_PACKETS */
   char message_with_priority [ALLNET_MTU + 2];
   if (sock->is_local) {
@@ -466,10 +497,12 @@ static unsigned int message_priority (char * message, struct allnet_header * hp,
        social_connection (social_net, verify, vsize, hp->source, hp->src_nbits,
                           hp->sig_algo, sig, sig_size, &valid);
   } else if (sig_size > 0) {
+    pthread_mutex_lock (&log_mutex);
     snprintf (alog->b, alog->s,
               "invalid sigsize: %d, %d + %d + 2 = %d <? %d\n",
               hp->sig_algo, hsize, sig_size, (hsize + sig_size + 2), size);
     log_print (alog);
+    pthread_mutex_unlock (&log_mutex);
   }
   /* track_rate is in track.[hc] */
   if (valid)
@@ -586,7 +619,8 @@ static struct message_process process_mgmt (struct socket_read_result *r)
                                ALLNET_PRIORITY_TRACE, NULL, r->sock,
                                r->from, r->alen);
         else
-          send_out (trace_reply, trace_reply_size, ROUTING_ADDRS_MAX, NULL, 0);
+          send_out (trace_reply, trace_reply_size, ALLNET_PRIORITY_TRACE,
+                    ROUTING_ADDRS_MAX, NULL, 0);
       }
       pcache_save_packet (trace_reply, trace_reply_size, ALLNET_PRIORITY_TRACE);
       free (trace_reply);
@@ -610,9 +644,11 @@ static struct message_process process_mgmt (struct socket_read_result *r)
     pcache_save_packet (r->message, r->msize, ALLNET_PRIORITY_TRACE);
     return all;
   default:
+    pthread_mutex_lock (&log_mutex);
     snprintf (alog->b, alog->s, "unknown management message type %d\n",
               ahm->mgmt_type);
     log_print (alog);   /* forward unknown management messages */
+    pthread_mutex_unlock (&log_mutex);
     all.priority = ALLNET_PRIORITY_TRACE;
     return all;
   }
@@ -650,9 +686,6 @@ static struct message_process process_message (struct socket_read_result *r)
     if (hp->message_type == ALLNET_TYPE_DATA_REQ) {
       char * data = ALLNET_DATA_START (hp, hp->transport, r->msize);
       struct allnet_data_request * req = (struct allnet_data_request *) data;
-      struct sockaddr_storage saddr = ((r->sav != NULL) ? r->sav->addr
-                                                        : r->from);
-      socklen_t salen = ((r->sav != NULL) ? r->sav->alen : r->alen);
       int max_messages = ((r->sock->is_local) ? 0 : SEND_EXTERNAL_MAX);
 #ifdef DEBUG_FOR_DEVELOPER
 #ifdef DEBUG_PRINT
@@ -663,7 +696,8 @@ print_packet (r->message, r->msize, "received data request", 1);
       struct pcache_result cached_messages =
         pcache_request (req, max_messages,
                         request_buffer, sizeof (request_buffer));
-      send_messages_to_one (cached_messages, req->token, r->sock, saddr, salen);
+      send_messages_to_one (cached_messages, req->token, r->sock,
+                            r->from, r->alen);
       /* replace the token in the message with our own token */
       pcache_current_token ((char *) (req->token));
       /* and then do normal packet processing (forward) this data request */
@@ -684,71 +718,582 @@ print_packet (r->message, r->msize, "received data request", 1);
   return result;
 }
 
-void allnet_daemon_loop ()
+/* metrics for each message type, indexed by message type, with
+ * index 0 for any type that is not known */
+#define AD_METRICS_TYPES	(ALLNET_TYPE_MGMT + 1)
+static int received_metrics [AD_METRICS_TYPES];
+static int forwarded_metrics [AD_METRICS_TYPES];
+static int dropped_metrics [AD_METRICS_TYPES];
+static int process_metric = -1;
+
+static int metrics_type (const char * message)
 {
-  while (1) {
-    char message [SOCKET_READ_MIN_BUFFER];
-    struct socket_read_result r = socket_read (&sockets, message,
-                                               10, virtual_clock);
-    if ((r.message == NULL) || (r.msize < ALLNET_HEADER_SIZE) ||
-        (! is_valid_message (r.message, r.msize, NULL)))
-      continue;   /* no valid message, no action needed, restart the loop */
+  const struct allnet_header * hp = (const struct allnet_header *) message;
+  return ((hp->message_type < AD_METRICS_TYPES) ? hp->message_type : 0);
+}
+
+/* returns 1 if the packet should be processed, 0 otherwise.
+ * also updates the socket set and sends keepalives as needed, so
+ * must be called by the thread that calls socket_read_batch.
+ * The transmit thread may delete addresses from the socket set at any
+ * time, so r->sav is never used, and is set to NULL */
+static int receive_packet (struct socket_read_result * r)
+{
+  if ((r->message == NULL) || (r->msize < ALLNET_HEADER_SIZE) ||
+      (! is_valid_message (r->message, r->msize, NULL))) {
+    if (r->message != NULL)
+      METRICS_COUNT ("ad.received.invalid", 1);
+    return 0;   /* no valid message, no action needed */
+  }
+  metrics_add (received_metrics [metrics_type (r->message)], 1);
 #ifdef DEBUG_FOR_DEVELOPER
 #ifdef DEBUG_PRINT
-printf ("received %d bytes\n", r.msize);
-if (is_in_routing_table ((struct sockaddr *) &(r.from), r.alen))
-print_buffer (&(r.from), r.alen, "routing address", r.alen, 0);
-else if (r.socket_address_is_new)
-print_buffer (&(r.from), r.alen, "new address", r.alen, 0);
+printf ("received %d bytes\n", r->msize);
+if (is_in_routing_table ((struct sockaddr *) &(r->from), r->alen))
+print_buffer (&(r->from), r->alen, "routing address", r->alen, 0);
+else if (r->socket_address_is_new)
+print_buffer (&(r->from), r->alen, "new address", r->alen, 0);
 else
-print_buffer (&(r.from), r.alen, "existing address", r.alen, 0);
-print_packet (r.message, r.msize, ", packet", 1);
+print_buffer (&(r->from), r->alen, "existing address", r->alen, 0);
+print_packet (r->message, r->msize, ", packet", 1);
 print_socket_set (&sockets);
 #endif /* DEBUG_PRINT */
 #endif /* DEBUG_FOR_DEVELOPER */
-    if ((r.socket_address_is_new) &&
-        ((r.sock->is_global_v4) || (r.sock->is_global_v6)) &&
-        (! is_auth_keepalive (r.from, sockets.random_secret,
-                              sizeof (sockets.random_secret),
-                              sockets.counter, r.message, r.msize))) {
-      /* respond with a challenge, see if they get back to us */
-      send_auth_response (r.sock->sockfd, r.from, r.alen, sockets.random_secret,
-                          sizeof (sockets.random_secret),
-                          sockets.counter, r.message, r.msize);
+  if ((r->socket_address_is_new) &&
+      ((r->sock->is_global_v4) || (r->sock->is_global_v6)) &&
+      (! is_auth_keepalive (r->from, sockets.random_secret,
+                            sizeof (sockets.random_secret),
+                            sockets.counter, r->message, r->msize))) {
+    /* respond with a challenge, see if they get back to us */
+    send_auth_response (r->sock->sockfd, r->from, r->alen,
+                        sockets.random_secret, sizeof (sockets.random_secret),
+                        sockets.counter, r->message, r->msize);
 #ifdef DEBUG_FOR_DEVELOPER
 #define STRICT_AUTHENTICATION
 #endif /* DEBUG_FOR_DEVELOPER */
 #ifdef STRICT_AUTHENTICATION
-      if (! is_in_routing_table ((struct sockaddr *) &(r.from), r.alen))
-        continue;   /* not authenticated, do not process this packet */
+    if (! is_in_routing_table ((struct sockaddr *) &(r->from), r->alen))
+      return 0;   /* not authenticated, do not process this packet */
 #endif /* STRICT_AUTHENTICATION */
+  }
+  long long int limit = virtual_clock + ((r->sock->is_local) ? 6 : 180);
+  if ((r->socket_address_is_new) ||
+      (! socket_update_time_limit (limit, &sockets, r->sock->sockfd,
+                                   r->from, r->alen)))
+    add_received_address (*r);   /* new, or deleted since it was read */
+  else if (r->recv_limit_reached) {  /* time to send a keepalive */
+    socket_update_recv_limit (RECV_LIMIT_DEFAULT, &sockets, r->from, r->alen);
+    socket_send_keepalive (&sockets, r->sock->sockfd, r->from, r->alen,
+                           virtual_clock);
+  }
+  r->sav = NULL;
+  struct allnet_header * hp = (struct allnet_header *) r->message;
+  if ((hp->hops < 255) && (! r->sock->is_local))  /* for non-local messages */
+    hp->hops++;            /* before processing, increment number of hops */
+  return 1;
+}
+
+/* management messages update state shared with update_dht, so only
+ * one thread at a time may process them */
+static pthread_mutex_t mgmt_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static struct message_process process_packet (struct socket_read_result * r)
+{
+  unsigned long long int start = metrics_now_ns ();
+  int type = metrics_type (r->message);
+  struct allnet_header * hp = (struct allnet_header *) r->message;
+  struct message_process m;
+  if (hp->message_type != ALLNET_TYPE_MGMT) {
+    m = process_message (r);
+  } else {
+    pthread_mutex_lock (&mgmt_mutex);
+    m = process_mgmt (r);
+    pthread_mutex_unlock (&mgmt_mutex);
+  }
+  metrics_record (process_metric, metrics_now_ns () - start);
+  if (m.process == PROCESS_PACKET_DROP)
+    metrics_add (dropped_metrics [type], 1);
+  else
+    metrics_add (forwarded_metrics [type], 1);
+  return m;
+}
+
+static void forward_packet (struct message_process m,
+                            struct sockaddr_storage from, socklen_t alen)
+{
+  if (m.process & PROCESS_PACKET_LOCAL)
+    socket_send_local (&sockets, m.message, m.msize, m.priority,
+                       virtual_clock, from, alen);
+  if (m.process & PROCESS_PACKET_OUT)
+    send_out (m.message, m.msize, m.priority, ROUTING_ADDRS_MAX, &from, alen);
+  if ((m.allocated) && (m.message != NULL))
+    free (m.message);
+}
+
+static void periodic_tasks ()
+{
+  update_virtual_clock ();
+  pthread_mutex_lock (&mgmt_mutex);
+  update_dht ();
+  pthread_mutex_unlock (&mgmt_mutex);
+}
+
+/* the forwarding pipeline.  The thread running allnet_daemon_loop
+ * receives packets and updates the socket set, a pool of worker threads
+ * processes them (signature verification, priority, pcache), and one
+ * transmit thread forwards them.  Packets from the same source address
+ * always go to the same worker, so they are forwarded in the order
+ * they were received (unless they have different priorities).
+ * A fixed number of jobs circulates through bounded queues, so a slow
+ * stage eventually stops the receive stage from reading more packets.
+ * The transmit thread always forwards the highest priority packet first.
+ * If too many packets are waiting to be forwarded, the lowest priority
+ * packets are dropped. */
+#define AD_MAX_WORKERS		16
+#define AD_QUEUE_SIZE		256   /* also the number of jobs */
+#define AD_STATS_SECONDS	60
+#define AD_PRIORITY_LEVELS	8
+#define AD_TRANSMIT_MAX		(AD_QUEUE_SIZE / 2)
+
+struct ad_job {
+  /* r.message and r.sock point into the job, r.sav is NULL */
+  struct socket_read_result r;
+  char message [SOCKET_READ_MIN_BUFFER];
+  struct socket_address_set sock;
+  struct message_process m;
+};
+
+struct ad_queue {
+  pthread_mutex_t mutex;
+  pthread_cond_t not_empty;
+  pthread_cond_t not_full;
+  struct ad_job * jobs [AD_QUEUE_SIZE];
+  int first;
+  int count;
+  int max_count;                  /* largest count since the last stats */
+  unsigned long long int total;   /* number of jobs ever added */
+};
+
+/* the packets waiting to be transmitted, one FIFO for each priority level
+ * (each 1/AD_PRIORITY_LEVELS of ALLNET_PRIORITY_MAX) */
+struct ad_schedule {
+  pthread_mutex_t mutex;
+  pthread_cond_t not_empty;
+  struct ad_job * jobs [AD_PRIORITY_LEVELS] [AD_TRANSMIT_MAX];
+  int first [AD_PRIORITY_LEVELS];
+  int count [AD_PRIORITY_LEVELS];
+  int total_count;                /* sum of count */
+  int max_count;                  /* largest total_count since the last stats */
+  unsigned long long int sent;    /* number of jobs ever removed */
+  unsigned long long int drops [AD_PRIORITY_LEVELS];
+};
+
+static int num_workers = 0;
+static struct ad_queue free_jobs;
+static struct ad_queue worker_queues [AD_MAX_WORKERS];
+static struct ad_schedule transmit_schedule;
+
+static void queue_init (struct ad_queue * q)
+{
+  pthread_mutex_init (&(q->mutex), NULL);
+  pthread_cond_init (&(q->not_empty), NULL);
+  pthread_cond_init (&(q->not_full), NULL);
+  q->first = 0;
+  q->count = 0;
+  q->max_count = 0;
+  q->total = 0;
+}
+
+static void queue_add (struct ad_queue * q, struct ad_job * job)
+{
+  pthread_mutex_lock (&(q->mutex));
+  while (q->count >= AD_QUEUE_SIZE)
+    pthread_cond_wait (&(q->not_full), &(q->mutex));
+  q->jobs [(q->first + q->count) % AD_QUEUE_SIZE] = job;
+  q->count++;
+  if (q->count > q->max_count)
+    q->max_count = q->count;
+  q->total++;
+  pthread_cond_signal (&(q->not_empty));
+  pthread_mutex_unlock (&(q->mutex));
+}
+
+static struct ad_job * queue_remove (struct ad_queue * q)
+{
+  pthread_mutex_lock (&(q->mutex));
+  while (q->count <= 0)
+    pthread_cond_wait (&(q->not_empty), &(q->mutex));
+  struct ad_job * job = q->jobs [q->first];
+  q->first = (q->first + 1) % AD_QUEUE_SIZE;
+  q->count--;
+  pthread_cond_signal (&(q->not_full));
+  pthread_mutex_unlock (&(q->mutex));
+  return job;
+}
+
+/* copy the received packet into the job, so the job no longer refers
+ * to the socket set or the receive buffer */
+static void job_from_result (struct ad_job * job, struct socket_read_result * r)
+{
+  job->r = *r;
+  memcpy (job->message, r->message, r->msize);
+  job->r.message = job->message;
+  job->sock = *(r->sock);
+  job->sock.num_addrs = 0;        /* the copy has no addresses */
+  job->sock.send_addrs = NULL;
+  job->sock.addr_index = NULL;
+  job->sock.addr_index_size = 0;
+  job->r.sock = &(job->sock);
+  job->r.sav = NULL;
+}
+
+/* all packets from the same address go to the same worker */
+static int worker_for (struct sockaddr_storage * from, socklen_t alen)
+{
+  const unsigned char * p = (const unsigned char *) from;
+  uint32_t hash = 0;
+  int i;
+  for (i = 0; (i < alen) && (i < sizeof (*from)); i++)
+    hash = (hash * 31) + p [i];
+  return (int) (hash % num_workers);
+}
+
+static void free_job (struct ad_job * job)
+{
+  if ((job->m.allocated) && (job->m.message != NULL))
+    free (job->m.message);
+  queue_add (&free_jobs, job);
+}
+
+static void schedule_init (struct ad_schedule * sch)
+{
+  memset (sch, 0, sizeof (struct ad_schedule));
+  pthread_mutex_init (&(sch->mutex), NULL);
+  pthread_cond_init (&(sch->not_empty), NULL);
+}
+
+static int schedule_level (int priority)
+{
+  int level = priority / (ALLNET_PRIORITY_MAX / AD_PRIORITY_LEVELS);
+  if (level < 0)
+    return 0;
+  if (level >= AD_PRIORITY_LEVELS)
+    return AD_PRIORITY_LEVELS - 1;
+  return level;
+}
+
+/* never blocks.  If the schedule is full, either drops the most recent
+ * job of the lowest priority level, if lower than the new job's,
+ * or drops the new job */
+static void schedule_add (struct ad_schedule * sch, struct ad_job * job)
+{
+  struct ad_job * dropped = NULL;
+  int level = schedule_level (job->m.priority);
+  pthread_mutex_lock (&(sch->mutex));
+  if (sch->total_count >= AD_TRANSMIT_MAX) {
+    int lowest = 0;
+    while ((lowest < level) && (sch->count [lowest] <= 0))
+      lowest++;
+    METRICS_COUNT ("ad.transmit_drops", 1);
+    if (lowest >= level) {    /* the new job has the lowest priority */
+      sch->drops [level]++;
+      pthread_mutex_unlock (&(sch->mutex));
+      free_job (job);
+      return;
     }
-    if ((r.socket_address_is_new) || (r.sav == NULL))
-      r.sav = add_received_address (r);
-    else if ((r.sav != NULL) && (r.sav->time_limit != 0))
-      r.sav->time_limit = virtual_clock + ((r.sock->is_local) ? 6 : 180);
-    struct allnet_header * hp = (struct allnet_header *) r.message;
-    if ((hp->hops < 255) && (! r.sock->is_local))  /* for non-local messages */
-      hp->hops++;            /* before processing, increment number of hops */
-    struct message_process m =
-         ((hp->message_type == ALLNET_TYPE_MGMT) ? process_mgmt (&r)
-                                                 : process_message (&r));
-    if (m.process & PROCESS_PACKET_LOCAL)
-      socket_send_local (&sockets, m.message, m.msize, m.priority,
-                         virtual_clock, r.from, r.alen);
-    if (m.process & PROCESS_PACKET_OUT)
-      send_out (m.message, m.msize, ROUTING_ADDRS_MAX, &(r.from), r.alen);
-    if ((m.allocated) && (m.message != NULL))
-      free (m.message);
-    if (r.recv_limit_reached) {  /* time to send a keepalive */
-      socket_update_recv_limit (RECV_LIMIT_DEFAULT, &sockets, r.from, r.alen);
-      if (r.sav != NULL)
-        send_one_keepalive ("update_recv_limit", r.sock, r.sav,
-                            sockets.random_secret,
-                            sizeof (sockets.random_secret), sockets.counter);
+    sch->count [lowest]--;
+    sch->total_count--;
+    sch->drops [lowest]++;
+    int last = (sch->first [lowest] + sch->count [lowest]) % AD_TRANSMIT_MAX;
+    dropped = sch->jobs [lowest] [last];
+  }
+  int index = (sch->first [level] + sch->count [level]) % AD_TRANSMIT_MAX;
+  sch->jobs [level] [index] = job;
+  sch->count [level]++;
+  sch->total_count++;
+  if (sch->total_count > sch->max_count)
+    sch->max_count = sch->total_count;
+  pthread_cond_signal (&(sch->not_empty));
+  pthread_mutex_unlock (&(sch->mutex));
+  if (dropped != NULL)
+    free_job (dropped);
+}
+
+/* returns the oldest job with the highest priority */
+static struct ad_job * schedule_remove (struct ad_schedule * sch)
+{
+  pthread_mutex_lock (&(sch->mutex));
+  while (sch->total_count <= 0)
+    pthread_cond_wait (&(sch->not_empty), &(sch->mutex));
+  int level = AD_PRIORITY_LEVELS - 1;
+  while (sch->count [level] <= 0)
+    level--;
+  struct ad_job * job = sch->jobs [level] [sch->first [level]];
+  sch->first [level] = (sch->first [level] + 1) % AD_TRANSMIT_MAX;
+  sch->count [level]--;
+  sch->total_count--;
+  sch->sent++;
+  pthread_mutex_unlock (&(sch->mutex));
+  return job;
+}
+
+static void * worker_thread (void * arg)
+{
+  struct ad_queue * q = (struct ad_queue *) arg;
+  while (1) {
+    struct ad_job * job = queue_remove (q);
+    job->m = process_packet (&(job->r));
+    if (job->m.process != PROCESS_PACKET_DROP)
+      schedule_add (&transmit_schedule, job);
+    else
+      free_job (job);
+  }
+  return NULL;
+}
+
+static void * transmit_thread (void * arg)
+{
+  while (1) {
+    struct ad_job * job = schedule_remove (&transmit_schedule);
+    forward_packet (job->m, job->r.from, job->r.alen);
+    job->m.allocated = 0;   /* forward_packet freed the message */
+    free_job (job);
+  }
+  return NULL;
+}
+
+/* the number of jobs added to q since the previous call for this q,
+ * and the largest number of jobs in q since the previous call */
+static unsigned long long int queue_stats (struct ad_queue * q,
+                                           unsigned long long int * last,
+                                           int * max_count)
+{
+  pthread_mutex_lock (&(q->mutex));
+  unsigned long long int result = q->total - *last;
+  *last = q->total;
+  if (q->max_count > *max_count)
+    *max_count = q->max_count;
+  q->max_count = q->count;
+  pthread_mutex_unlock (&(q->mutex));
+  return result;
+}
+
+/* the number of jobs removed from sch since the previous call, and the
+ * largest number of jobs in sch since the previous call.  Also copies
+ * the total number of drops and the current counts */
+static unsigned long long int schedule_stats (struct ad_schedule * sch,
+                                              unsigned long long int * last,
+                                              int * max_count,
+                                              unsigned long long int * drops,
+                                              int * counts)
+{
+  pthread_mutex_lock (&(sch->mutex));
+  unsigned long long int result = sch->sent - *last;
+  *last = sch->sent;
+  *max_count = sch->max_count;
+  sch->max_count = sch->total_count;
+  int i;
+  for (i = 0; i < AD_PRIORITY_LEVELS; i++) {
+    drops [i] = sch->drops [i];
+    counts [i] = sch->count [i];
+  }
+  pthread_mutex_unlock (&(sch->mutex));
+  return result;
+}
+
+/* log the number of packets per second processed by each stage, and
+ * the state of the transmit schedule */
+static void pipeline_stats ()
+{
+  static unsigned long long int last_time = 0;
+  static unsigned long long int last_worker [AD_MAX_WORKERS];
+  static unsigned long long int last_transmit = 0;
+  unsigned long long int now = allnet_time_us ();
+  if (last_time == 0)
+    last_time = now;
+  if (now < last_time + AD_STATS_SECONDS * 1000000LL)
+    return;
+  unsigned long long int received = 0;
+  int max_worker_queue = 0;
+  int i;
+  for (i = 0; i < num_workers; i++)
+    received += queue_stats (worker_queues + i, last_worker + i,
+                             &max_worker_queue);
+  int max_transmit_queue = 0;
+  unsigned long long int drops [AD_PRIORITY_LEVELS];
+  int counts [AD_PRIORITY_LEVELS];
+  unsigned long long int forwarded =
+    schedule_stats (&transmit_schedule, &last_transmit, &max_transmit_queue,
+                    drops, counts);
+  unsigned long long int delta_ms = (now - last_time) / 1000;
+  if (delta_ms == 0)
+    delta_ms = 1;
+  pthread_mutex_lock (&log_mutex);
+  snprintf (alog->b, alog->s,
+            "pipeline with %d workers: %llu packets/s processed, "
+            "%llu/s forwarded, max queues %d/%d\n", num_workers,
+            received * 1000 / delta_ms, forwarded * 1000 / delta_ms,
+            max_worker_queue, max_transmit_queue);
+  log_print (alog);
+  int off = snprintf (alog->b, alog->s, "transmit queue (depth/drops):");
+  for (i = AD_PRIORITY_LEVELS - 1; i >= 0; i--)
+    off += snprintf (alog->b + off, alog->s - off, " %d/%llu",
+                     counts [i], drops [i]);
+  snprintf (alog->b + off, alog->s - off, ", %llu paced\n",
+            sockets.paced_drops);
+  log_print (alog);
+  pthread_mutex_unlock (&log_mutex);
+  last_time = now;
+}
+
+/* by default use one worker for each core not used by the receive
+ * and transmit threads.  ALLNET_AD_WORKERS may be set to override this,
+ * with 0 meaning all processing is done by a single thread */
+static int compute_num_workers ()
+{
+  char * env = getenv ("ALLNET_AD_WORKERS");
+  int result = 0;
+  if (env != NULL)
+    result = atoi (env);
+  else
+    result = (int) sysconf (_SC_NPROCESSORS_ONLN) - 2;
+  if ((env == NULL) && (result < 1))
+    result = 1;
+  if (result < 0)
+    result = 0;
+  if (result > AD_MAX_WORKERS)
+    result = AD_MAX_WORKERS;
+  return result;
+}
+
+/* process_message has a 500KB request buffer on the stack, more than
+ * the default thread stack size on some systems */
+#define AD_WORKER_STACK_SIZE	(2 * 1024 * 1024)
+
+static void start_pipeline ()
+{
+  queue_init (&free_jobs);
+  schedule_init (&transmit_schedule);
+  pthread_attr_t attr;
+  pthread_attr_init (&attr);
+  if (pthread_attr_setstacksize (&attr, AD_WORKER_STACK_SIZE) != 0)
+    perror ("pthread_attr_setstacksize ad worker");
+  int i;
+  for (i = 0; i < AD_QUEUE_SIZE; i++)
+    queue_add (&free_jobs,
+               malloc_or_fail (sizeof (struct ad_job), "ad.c job"));
+  free_jobs.total = 0;
+  for (i = 0; i < num_workers; i++) {
+    queue_init (worker_queues + i);
+    pthread_t thread;
+    if (pthread_create (&thread, &attr, worker_thread, worker_queues + i)
+        != 0) {
+      perror ("pthread_create ad worker");
+      exit (1);
     }
-    update_virtual_clock ();
-    update_dht ();
+    pthread_detach (thread);
+  }
+  pthread_attr_destroy (&attr);
+  pthread_t thread;
+  if (pthread_create (&thread, NULL, transmit_thread, NULL) != 0) {
+    perror ("pthread_create ad transmit");
+    exit (1);
+  }
+  pthread_detach (thread);
+}
+
+struct report_peers_data {
+  char * buffer;
+  int bsize;
+  int off;
+};
+
+static int report_peer (struct socket_address_set * sock,
+                        struct socket_address_validity * sav, void * ref)
+{
+  struct report_peers_data * d = (struct report_peers_data *) ref;
+  char addr [INET6_ADDRSTRLEN] = "unknown";
+  int port = 0;
+  if (sav->addr.ss_family == AF_INET) {
+    struct sockaddr_in * sin = (struct sockaddr_in *) (&(sav->addr));
+    inet_ntop (AF_INET, &(sin->sin_addr), addr, sizeof (addr));
+    port = ntohs (sin->sin_port);
+  } else if (sav->addr.ss_family == AF_INET6) {
+    struct sockaddr_in6 * sin6 = (struct sockaddr_in6 *) (&(sav->addr));
+    inet_ntop (AF_INET6, &(sin6->sin6_addr), addr, sizeof (addr));
+    port = ntohs (sin6->sin6_port);
+  }
+  char line [200];
+  int n = snprintf (line, sizeof (line), "peer %s %d %s sent %llu rcvd %llu\n",
+                    addr, port, ((sock->is_local) ? "local" :
+                                 ((sock->is_broadcast) ? "broadcast"
+                                                       : "remote")),
+                    sav->packets_sent, sav->packets_rcvd);
+  if ((n > 0) && (n < (int) sizeof (line)) && (d->off + n < d->bsize)) {
+    memcpy (d->buffer + d->off, line, n + 1);
+    d->off += n;
+  }
+  return 1;  /* keep the address */
+}
+
+/* metrics reporter with the packets sent to and received from each peer */
+static int report_peers (char * buffer, int bsize, void * ref)
+{
+  struct report_peers_data d = { .buffer = buffer, .bsize = bsize, .off = 0 };
+  socket_addr_loop (&sockets, report_peer, &d);
+  return d.off;
+}
+
+static void init_metrics ()
+{
+  static const char * names [AD_METRICS_TYPES] =
+    { "other", "data", "ack", "data_req", "key_xchg", "key_req",
+      "clear", "mgmt" };
+  int i;
+  for (i = 0; i < AD_METRICS_TYPES; i++) {
+    char name [100];
+    snprintf (name, sizeof (name), "ad.received.%s", names [i]);
+    received_metrics [i] = metrics_counter (name);
+    snprintf (name, sizeof (name), "ad.forwarded.%s", names [i]);
+    forwarded_metrics [i] = metrics_counter (name);
+    snprintf (name, sizeof (name), "ad.dropped.%s", names [i]);
+    dropped_metrics [i] = metrics_counter (name);
+  }
+  process_metric = metrics_histogram ("ad.process_ns");
+  metrics_add_reporter (report_peers, NULL);
+}
+
+void allnet_daemon_loop ()
+{
+  num_workers = compute_num_workers ();
+  snprintf (alog->b, alog->s, "ad using %d worker threads\n", num_workers);
+  log_print (alog);
+  if (num_workers > 0)
+    start_pipeline ();
+  while (1) {
+    /* all the packets that are ready, with as few system calls as
+     * possible.  The messages are in the socket set, and only valid
+     * until the next call to socket_read_batch */
+    struct socket_read_result results [SOCKET_READ_BATCH];
+    int n = socket_read_batch (&sockets, results, SOCKET_READ_BATCH,
+                               10, virtual_clock);
+    int i;
+    for (i = 0; i < n; i++) {
+      struct socket_read_result * r = results + i;
+      if (! receive_packet (r))
+        continue;
+      if (num_workers > 0) {
+        struct ad_job * job = queue_remove (&free_jobs);
+        job_from_result (job, r);
+        queue_add (worker_queues + worker_for (&(r->from), r->alen), job);
+      } else {
+        struct message_process m = process_packet (r);
+        forward_packet (m, r->from, r->alen);
+      }
+    }
+    periodic_tasks ();
+    if (num_workers > 0)
+      pipeline_stats ();
   }
 }
 
@@ -757,9 +1302,450 @@ void allnet_daemon_main ()
   alog = init_log ("ad");
   sockets.num_sockets = 0;
   sockets.sockets = NULL;
-  social_net = init_social (30000, 5, alog);
+  social_net = init_social (30000, 5);
   routing_my_address (my_address);
   initialize_sockets ();
+  init_metrics ();
+  if (! metrics_start_server (ALLNET_METRICS_PORT)) {
+    snprintf (alog->b, alog->s, "unable to answer metrics requests\n");
+    log_print (alog);
+  }
   update_virtual_clock ();  /* 2018/08/03: not sure if this is useful */
   allnet_daemon_loop ();
 }
+
+#ifdef ALLNETD_REPLAY_BENCHMARK
+/* offline benchmark of the forwarding path, run by make check.
+ * Replays a capture made with allnet-sniffer -w or, by default, a
+ * synthetic trace generated from a fixed seed, calling receive_packet,
+ * process_packet, and forward_packet just as allnet_daemon_loop does
+ * with no worker threads.  Packets come from stub peers in a socket set
+ * whose sockets are bound to the loopback address, so forwarded packets
+ * are really sent, but never leave this machine (sock_v4 and sock_v6
+ * are not set, so nothing is sent to DHT peers).  The caches and logs
+ * are kept in a temporary HOME directory which is removed at the end.
+ * pcache's random choices are seeded from the same seed, so the
+ * synthetic trace always forwards, drops, and caches the same packets.
+ * For the default trace, which is what make check runs, the exit status
+ * is 0 only if those counts are the ones expected.
+ *
+ * usage: ad_replay_benchmark [-n packets] [-s seed] [-r speed] [-k] [-m]
+ *                            [capture-file]
+ *    -r replays the capture at its original pace (1) or n times faster,
+ *       rather than as fast as possible
+ *    -k keeps the temporary directory
+ *    -m also prints the metrics, as allnet-print-metrics would */
+
+#include <netinet/in.h>
+
+#include "lib/capture.h"
+
+#define REPLAY_DEFAULT_PACKETS	20000
+#define REPLAY_DEFAULT_SEED	1
+/* what the default trace should do.  If a change to the forwarding path
+ * changes these, make sure that is intended, then update them */
+#define REPLAY_EXPECTED_FORWARDED	15942
+#define REPLAY_EXPECTED_DROPPED		4058
+#define REPLAY_EXPECTED_CACHED		11953
+#define REPLAY_REMOTE_PEERS	32
+#define REPLAY_LOCAL_PEERS	2
+#define REPLAY_HISTORY		1024    /* recent data packets, for dups/acks */
+#define REPLAY_STAGES		4
+
+static const char * replay_stage_names [REPLAY_STAGES] =
+  { "receive", "process", "forward", "total" };
+
+/* xorshift64*, so the same seed always gives the same trace */
+static uint64_t replay_state = 1;
+
+static uint64_t replay_random ()
+{
+  replay_state ^= replay_state >> 12;
+  replay_state ^= replay_state << 25;
+  replay_state ^= replay_state >> 27;
+  return replay_state * 2685821657736338717ULL;
+}
+
+static void replay_random_bytes (char * buffer, int bsize)
+{
+  int i;
+  for (i = 0; i < bsize; i++)
+    buffer [i] = (char) (replay_random () >> 56);
+}
+
+struct replay_peer {
+  struct sockaddr_storage addr;
+  socklen_t alen;
+  int sockfd;
+  unsigned char address [ADDRESS_SIZE];   /* allnet source address */
+};
+
+static struct replay_peer replay_peers [REPLAY_REMOTE_PEERS +
+                                        REPLAY_LOCAL_PEERS];
+
+/* returns a UDP socket bound to an ephemeral port on the loopback
+ * address, added to the socket set */
+static int replay_socket (int is_local)
+{
+  int fd = socket (AF_INET, SOCK_DGRAM, 0);
+  struct sockaddr_in sin;
+  memset (&sin, 0, sizeof (sin));
+  sin.sin_family = AF_INET;
+  sin.sin_addr.s_addr = htonl (INADDR_LOOPBACK);
+  sin.sin_port = 0;
+  if ((fd < 0) ||
+      (bind (fd, (struct sockaddr *) (&sin), sizeof (sin)) != 0)) {
+    perror ("replay socket/bind");
+    exit (1);
+  }
+  socket_add (&sockets, fd, is_local, 0, 0, 0);
+  return fd;
+}
+
+/* nobody listens on these ports, so packets sent to them are discarded */
+static void replay_init_peers ()
+{
+  int local_fd = replay_socket (1);
+  int remote_fd = replay_socket (0);
+  int i;
+  for (i = 0; i < REPLAY_REMOTE_PEERS + REPLAY_LOCAL_PEERS; i++) {
+    struct replay_peer * p = replay_peers + i;
+    struct sockaddr_in * sin = (struct sockaddr_in *) (&(p->addr));
+    memset (&(p->addr), 0, sizeof (p->addr));
+    sin->sin_family = AF_INET;
+    sin->sin_addr.s_addr = htonl (INADDR_LOOPBACK);
+    sin->sin_port = htons (41000 + i);
+    p->alen = sizeof (struct sockaddr_in);
+    p->sockfd = ((i < REPLAY_REMOTE_PEERS) ? remote_fd : local_fd);
+    replay_random_bytes ((char *) (p->address), ADDRESS_SIZE);
+    /* no time, send, or receive limits */
+    struct socket_address_validity sav =
+      { .alive_rcvd = virtual_clock, .alive_sent = virtual_clock,
+        .send_limit = 0, .send_limit_on_recv = 0, .recv_limit = 0,
+        .time_limit = 0, .alen = p->alen };
+    memset (&(sav.keepalive_auth), 0, sizeof (sav.keepalive_auth));
+    memcpy (&(sav.addr), &(p->addr), sizeof (p->addr));
+    if (socket_address_add (&sockets, p->sockfd, sav) == NULL) {
+      printf ("replay: unable to add peer %d\n", i);
+      exit (1);
+    }
+  }
+}
+
+struct replay_find {
+  const struct replay_peer * peer;
+  struct socket_address_set * sock;
+  struct socket_address_validity * sav;
+};
+
+static int replay_find_sav (struct socket_address_set * sock,
+                            struct socket_address_validity * sav, void * ref)
+{
+  struct replay_find * f = (struct replay_find *) ref;
+  if ((sock->sockfd == f->peer->sockfd) && (sav->alen == f->peer->alen) &&
+      (memcmp (&(sav->addr), &(f->peer->addr), sav->alen) == 0)) {
+    f->sock = sock;
+    f->sav = sav;
+  }
+  return 1;  /* keep */
+}
+
+/* fill in r as socket_read would for a packet from this peer */
+static void replay_result (int peer, char * message, int msize,
+                           unsigned int priority, struct socket_read_result * r)
+{
+  struct replay_find f = { .peer = replay_peers + peer,
+                           .sock = NULL, .sav = NULL };
+  socket_addr_loop (&sockets, replay_find_sav, &f);
+  memset (r, 0, sizeof (struct socket_read_result));
+  r->success = 1;
+  r->message = message;
+  r->msize = msize;
+  r->priority = ((f.sock != NULL) && (f.sock->is_local)) ? priority : 1;
+  r->sock = f.sock;
+  r->from = replay_peers [peer].addr;
+  r->alen = replay_peers [peer].alen;
+  r->socket_address_is_new = (f.sav == NULL);
+  r->sav = f.sav;
+  r->recv_limit_reached = 0;
+}
+
+/* synthetic traffic: mostly new data packets, some of which are later
+ * received again or acked, and a few data requests and traces */
+struct replay_generator {
+  char history [REPLAY_HISTORY] [ALLNET_MTU];
+  int history_size [REPLAY_HISTORY];
+  char history_ack [REPLAY_HISTORY] [MESSAGE_ID_SIZE];
+  int num_history;
+};
+
+/* returns the size of the packet written to buffer, and sets *peer */
+static int replay_generate (struct replay_generator * g, char * buffer,
+                            int * peer, unsigned int * priority)
+{
+  *peer = (int) (replay_random () % REPLAY_REMOTE_PEERS);
+  if (replay_random () % 10 == 0)   /* from a local application */
+    *peer = REPLAY_REMOTE_PEERS + (int) (replay_random () % REPLAY_LOCAL_PEERS);
+  *priority = ALLNET_PRIORITY_LOCAL;
+  const unsigned char * src = replay_peers [*peer].address;
+  unsigned char dst [ADDRESS_SIZE];
+  replay_random_bytes ((char *) dst, sizeof (dst));
+  int choice = (int) (replay_random () % 100);
+  int old = -1;
+  if (g->num_history > 0)
+    old = (int) (replay_random () %
+                 ((g->num_history < REPLAY_HISTORY) ? g->num_history
+                                                    : REPLAY_HISTORY));
+  if ((choice < 20) && (old >= 0)) {      /* receive a data packet again */
+    memcpy (buffer, g->history [old], g->history_size [old]);
+    return g->history_size [old];
+  }
+  if ((choice < 37) && (old >= 0)) {      /* ack a data packet */
+    int hsize = ALLNET_SIZE (0);
+    int psize = hsize + MESSAGE_ID_SIZE;
+    init_packet (buffer, psize, ALLNET_TYPE_ACK, 10, ALLNET_SIGTYPE_NONE,
+                 src, 16, dst, 0, NULL, NULL);
+    memcpy (buffer + hsize, g->history_ack [old], MESSAGE_ID_SIZE);
+    return psize;
+  }
+  if (choice < 40) {                      /* data request, send everything */
+    int hsize = ALLNET_SIZE (0);
+    int psize = hsize + sizeof (struct allnet_data_request);
+    init_packet (buffer, psize, ALLNET_TYPE_DATA_REQ, 10, ALLNET_SIGTYPE_NONE,
+                 src, 16, dst, 0, NULL, NULL);
+    struct allnet_data_request * req =
+      (struct allnet_data_request *) (buffer + hsize);
+    replay_random_bytes ((char *) (req->token), sizeof (req->token));
+    return psize;
+  }
+  if (choice < 42) {                      /* trace request */
+    int psize = ALLNET_TRACE_REQ_SIZE (0, 1, 0);
+    init_packet (buffer, psize, ALLNET_TYPE_MGMT, 10, ALLNET_SIGTYPE_NONE,
+                 src, 16, dst, 16, NULL, NULL);
+    struct allnet_mgmt_header * mp =
+      (struct allnet_mgmt_header *) (buffer + ALLNET_SIZE (0));
+    mp->mgmt_type = ALLNET_MGMT_TRACE_REQ;
+    struct allnet_mgmt_trace_req * trp =
+      (struct allnet_mgmt_trace_req *) (buffer + ALLNET_MGMT_HEADER_SIZE (0));
+    trp->num_entries = 1;
+    replay_random_bytes ((char *) (trp->trace_id), MESSAGE_ID_SIZE);
+    trp->trace [0].nbits = 16;
+    memcpy (trp->trace [0].address, src, ADDRESS_SIZE);
+    return psize;
+  }
+  /* new data packet, 100 to 1000 bytes of payload */
+  char ack [MESSAGE_ID_SIZE];
+  replay_random_bytes (ack, sizeof (ack));
+  int dsize = 100 + (int) (replay_random () % 901);
+  int hsize = ALLNET_SIZE (ALLNET_TRANSPORT_ACK_REQ);
+  int psize = hsize + dsize;
+  init_packet (buffer, psize, ALLNET_TYPE_DATA, 10, ALLNET_SIGTYPE_NONE,
+               src, 16, dst, 16, NULL, (unsigned char *) ack);
+  replay_random_bytes (buffer + hsize, dsize);
+  int index = g->num_history % REPLAY_HISTORY;
+  memcpy (g->history [index], buffer, psize);
+  g->history_size [index] = psize;
+  memcpy (g->history_ack [index], ack, MESSAGE_ID_SIZE);
+  g->num_history++;
+  return psize;
+}
+
+static unsigned long long int replay_ns ()
+{
+  struct timespec ts;
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int replay_compare (const void * a, const void * b)
+{
+  unsigned int x = * ((const unsigned int *) a);
+  unsigned int y = * ((const unsigned int *) b);
+  return ((x < y) ? -1 : ((x > y) ? 1 : 0));
+}
+
+/* sorts the latencies (in ns), and prints percentiles in microseconds */
+static void replay_print_stage (const char * name, unsigned int * ns, int n)
+{
+  static const double percents [] = { 50, 90, 99, 99.9 };
+  int np = sizeof (percents) / sizeof (percents [0]);
+  qsort (ns, n, sizeof (unsigned int), replay_compare);
+  printf ("%-8s", name);
+  int i;
+  for (i = 0; i < np; i++) {
+    int index = (int) ((n - 1) * percents [i] / 100.0);
+    printf (" %9.2f", ns [index] / 1000.0);
+  }
+  printf (" %9.2f\n", ns [n - 1] / 1000.0);
+}
+
+int main (int argc, char ** argv)
+{
+  int max_packets = REPLAY_DEFAULT_PACKETS;
+  uint64_t seed = REPLAY_DEFAULT_SEED;
+  int keep = 0;
+  int print_metrics = 0;
+  double speed = 0;
+  char * capture_file = NULL;
+  int opt;
+  while ((opt = getopt (argc, argv, "n:s:r:km")) != -1) {
+    switch (opt) {
+    case 'n': max_packets = atoi (optarg); break;
+    case 's': seed = strtoull (optarg, NULL, 10); break;
+    case 'r': speed = atof (optarg); break;
+    case 'k': keep = 1; break;
+    case 'm': print_metrics = 1; break;
+    default:
+      printf ("usage: %s [-n packets] [-s seed] [-r speed] [-k] [-m] "
+              "[capture-file]\n", argv [0]);
+      return 1;
+    }
+  }
+  if (optind < argc)
+    capture_file = argv [optind];
+  if ((max_packets <= 0) || (seed == 0)) {
+    printf ("the number of packets and the seed must be positive\n");
+    return 1;
+  }
+  struct allnet_capture_reader * reader = NULL;
+  if ((capture_file != NULL) &&
+      ((reader = capture_reader_open (capture_file, speed)) == NULL))
+    return 1;
+  char home [] = "/tmp/allnet-replay-XXXXXX";
+  if (mkdtemp (home) == NULL) {
+    perror ("mkdtemp");
+    return 1;
+  }
+  setenv ("HOME", home, 1);
+  replay_state = seed;
+  pcache_random_seed (seed);
+  alog = init_log ("ad-replay");
+  sockets.num_sockets = 0;
+  sockets.sockets = NULL;
+  social_net = init_social (30000, 5);
+  routing_my_address (my_address);
+  update_virtual_clock ();
+  replay_init_peers ();
+  init_metrics ();
+  random_bytes (sockets.random_secret, sizeof (sockets.random_secret));
+  sockets.counter = 1;
+
+  unsigned int * latency [REPLAY_STAGES];
+  int i;
+  for (i = 0; i < REPLAY_STAGES; i++)
+    latency [i] = malloc_or_fail (max_packets * sizeof (unsigned int),
+                                  "replay latencies");
+  struct replay_generator * gen =
+    malloc_or_fail (sizeof (struct replay_generator), "replay generator");
+  gen->num_history = 0;
+  int count = 0;
+  int forwarded = 0;
+  int dropped = 0;   /* invalid, or dropped by process_packet */
+  unsigned long long int total_ns = 0;
+  while (count < max_packets) {
+    char original [SOCKET_READ_MIN_BUFFER];
+    int msize = 0;
+    int peer = 0;
+    unsigned int priority = ALLNET_PRIORITY_LOCAL;
+    if (reader != NULL) {
+      struct allnet_capture_record rec;
+      if (capture_read (reader, &rec) <= 0)
+        break;
+      msize = rec.psize;
+      memcpy (original, rec.packet, msize);
+      priority = rec.priority;
+      /* the capture does not record the sender, so pick one that
+       * is the same for all the packets from the same source address */
+      const struct allnet_header * hp = (const struct allnet_header *) original;
+      int spread = ((msize >= ALLNET_HEADER_SIZE) ? hp->source [0] : 0);
+      if (rec.source == CAPTURE_SOURCE_LOCAL)
+        peer = REPLAY_REMOTE_PEERS + (spread % REPLAY_LOCAL_PEERS);
+      else
+        peer = spread % REPLAY_REMOTE_PEERS;
+    } else {
+      msize = replay_generate (gen, original, &peer, &priority);
+    }
+    char message [SOCKET_READ_MIN_BUFFER];   /* processing changes it */
+    memcpy (message, original, msize);
+    struct socket_read_result r;
+    replay_result (peer, message, msize, priority, &r);
+    unsigned long long int start = replay_ns ();
+    int valid = receive_packet (&r);
+    unsigned long long int received = replay_ns ();
+    unsigned long long int processed = received;
+    if (valid) {
+      struct message_process m = process_packet (&r);
+      processed = replay_ns ();
+      if (m.process != PROCESS_PACKET_DROP)
+        forwarded++;
+      else
+        dropped++;
+      forward_packet (m, r.from, r.alen);
+    } else {
+      dropped++;
+    }
+    unsigned long long int finish = replay_ns ();
+    latency [0] [count] = (unsigned int) (received - start);
+    latency [1] [count] = (unsigned int) (processed - received);
+    latency [2] [count] = (unsigned int) (finish - processed);
+    latency [3] [count] = (unsigned int) (finish - start);
+    total_ns += finish - start;
+    count++;
+  }
+  capture_reader_close (reader);
+  if (count == 0) {
+    printf ("no packets to replay\n");
+    return 1;
+  }
+  double seconds = total_ns / 1e9;
+  if (capture_file != NULL)
+    printf ("replayed %d packets from %s", count, capture_file);
+  else
+    printf ("replayed %d synthetic packets (seed %" PRIu64 ")", count, seed);
+  printf (" in %.3fs of processing, %.0f packets/s\n", seconds,
+          ((seconds > 0) ? count / seconds : 0.0));
+  printf ("%d forwarded, %d dropped\n", forwarded, dropped);
+  printf ("stage     us: p50       p90       p99     p99.9       max\n");
+  for (i = 0; i < REPLAY_STAGES; i++)
+    replay_print_stage (replay_stage_names [i], latency [i], count);
+  struct pcache_stats ps;
+  pcache_get_stats (&ps);
+  printf ("pcache: %llu/%llu ids found, %llu/%llu acks found, %llu saved\n",
+          ps.id_hits, ps.id_lookups, ps.ack_hits, ps.ack_lookups, ps.saved);
+  printf ("pcache gc: %llu steps, %llu cycles, "
+          "%llu messages and %llu acks removed\n",
+          ps.gc_steps, ps.gc_cycles, ps.gc_messages, ps.gc_acks);
+  printf ("sockets: %llu sends paced\n", sockets.paced_drops);
+  if (print_metrics) {
+    static char text [100000];
+    metrics_to_string (text, sizeof (text));
+    printf ("%s", text);
+  }
+  if (keep)
+    printf ("caches and logs are in %s\n", home);
+  else
+    rmdir_and_all_files (home);
+  if ((capture_file != NULL) || (seed != REPLAY_DEFAULT_SEED) ||
+      (max_packets != REPLAY_DEFAULT_PACKETS))
+    /* fail if nothing made it through the pipeline */
+    return (((forwarded > 0) && (ps.id_lookups > 0)) ? 0 : 1);
+  /* the default trace must give exactly the expected counts */
+  int result = 0;
+  if (forwarded != REPLAY_EXPECTED_FORWARDED) {
+    printf ("error: forwarded %d, expected %d\n",
+            forwarded, REPLAY_EXPECTED_FORWARDED);
+    result = 1;
+  }
+  if (dropped != REPLAY_EXPECTED_DROPPED) {
+    printf ("error: dropped %d, expected %d\n",
+            dropped, REPLAY_EXPECTED_DROPPED);
+    result = 1;
+  }
+  if (ps.saved != REPLAY_EXPECTED_CACHED) {
+    printf ("error: cached %llu, expected %d\n",
+            ps.saved, REPLAY_EXPECTED_CACHED);
+    result = 1;
+  }
+  return result;
+}
+#endif /* ALLNETD_REPLAY_BENCHMARK */
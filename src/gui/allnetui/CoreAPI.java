@@ -77,6 +77,12 @@ public interface CoreAPI {
     //         a negative value of max requests all messages
     Message[] getMessages(String contact, int max);
 
+    // @return up to max saved messages to/from this contact, most recent
+    //         first, sent before the cursor time (0 for the most recent).
+    //         The next page starts at the sentTime of the oldest message
+    //         returned, and the result is empty after the last page.
+    Message[] getMessages(String contact, long cursor, int max);
+
     // set that the contact was read now
     void setReadTime(String contact);
 
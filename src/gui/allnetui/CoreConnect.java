@@ -19,8 +19,12 @@ public class CoreConnect extends Thread implements CoreAPI {
     java.net.Socket sock;
     java.io.DataInputStream sockIn;
     java.io.DataOutputStream sockOut;
-    byte[] bufferedResponse = null;
-    // mutex is used to serialize access to bufferedResponse and sockIn
+    // replies read by one thread on behalf of another, oldest first
+    java.util.LinkedList<byte[]> bufferedResponses =
+        new java.util.LinkedList<byte[]>();
+    // true while some thread is reading from sockIn
+    boolean reading = false;
+    // mutex is used to serialize access to bufferedResponses and reading
     private final Object mutex = new Object();
 
     static final byte guiContacts = 1;
@@ -55,6 +59,14 @@ public class CoreConnect extends Thread implements CoreAPI {
     static final byte guiGetMessages = 40;
     static final byte guiSendMessage = 41;
     static final byte guiSendBroadcast = 42;
+    static final byte guiGetMessagesPage = 43;
+    // the most messages requested at once, and in the first page
+    static final int messagesPageSize = 1000;
+    static final int messagesFirstPageSize = 100;
+    // the most requests sent before reading their replies.  xchat does
+    // not read the next request until it has sent the current reply,
+    // so all the pipelined requests must fit in the socket buffers
+    static final int maxPipelined = 64;
 
     static final byte guiKeyExchange = 50;
     static final byte guiSubscribe = 51;
@@ -84,10 +96,10 @@ public class CoreConnect extends Thread implements CoreAPI {
         this.incompletes = new java.util.HashSet<String>();
         try {
             this.sock = new java.net.Socket("127.0.0.1", xchatSocketPort);
-            this.sockIn =
-                new java.io.DataInputStream(this.sock.getInputStream());
-            this.sockOut =
-                new java.io.DataOutputStream(this.sock.getOutputStream());
+            this.sockIn = new java.io.DataInputStream(
+                new java.io.BufferedInputStream(this.sock.getInputStream()));
+            this.sockOut = new java.io.DataOutputStream(
+                new java.io.BufferedOutputStream(this.sock.getOutputStream()));
         } catch (java.lang.Exception e) {
             System.out.println("exception " + e + " creating socket");
         }
@@ -211,26 +223,30 @@ public class CoreConnect extends Thread implements CoreAPI {
     // 1. it's OK to send while receiving, there is no conflict
     // 2. if the CoreConnect thread is stuck on receiving, we want it
     //    to complete the receive and save the buffer
+    // xchat answers requests in the order they are sent, so several
+    // requests may be sent before reading any of the replies (pipelining)
 
     // synchronized, so nobody else gets to send on the same socket
-    // until we are done
-    private synchronized void sendRPC(byte[] arg) {
+    // until we are done.  The requests are sent in a single flush
+    private synchronized void sendRPCs(byte[][] args) {
         try {
-            this.sockOut.writeLong(arg.length);
-            this.sockOut.write(arg);
+            for (byte[] arg: args) {
+                this.sockOut.writeLong(arg.length);
+                this.sockOut.write(arg);
+            }
+            this.sockOut.flush();
         } catch (java.lang.Exception e) {
             System.out.println("exception " + e + " writing to socket");
             System.exit(0);
         }
     }
 
-    // synchronized by the caller
+    private void sendRPC(byte[] arg) {
+        sendRPCs(new byte[][] { arg });
+    }
+
+    // only one thread at a time reads, as controlled by this.reading
     private byte[] receiveBuffer() {
-        if (this.bufferedResponse != null) {
-            byte[] result = this.bufferedResponse;
-            this.bufferedResponse = null;
-            return result;
-        }
         try {
             long length = this.sockIn.readLong();
             if (length > 0) {
@@ -250,39 +266,53 @@ public class CoreConnect extends Thread implements CoreAPI {
     }
 
     // synchronized by the caller
-    private boolean saveBuffer(byte[] buffer) {
-        if (this.bufferedResponse == null) {
-            this.bufferedResponse = buffer;
-            return true;
-        } else {
-            System.out.println("saveBuffer discarding " + buffer.length +
-                               "-byte buffer with code " + buffer[0]);
+    // removes and returns the oldest saved reply with this code, if any
+    private byte[] takeBuffer(byte code) {
+        java.util.Iterator<byte[]> it = this.bufferedResponses.iterator();
+        while (it.hasNext()) {
+            byte[] buffer = it.next();
+            if (buffer[0] == code) {
+                it.remove();
+                return buffer;
+            }
         }
-        return false;
+        return null;
     }
 
     // code is 0 to loop forever, just dispatching and/or saving the buffer
-    // multiple threads may call this at the same time, only one of them
-    // at a time should proceed through the synchronized block
+    // multiple threads may call this at the same time.  Whichever thread
+    // is reading saves the replies for other threads, and wakes them up
     private byte[] receiveRPC(byte code) {
         while(true) {  // repeat until we get our match
-            boolean sleep = false;
             synchronized (this.mutex) {
-                byte[] result = receiveBuffer();
-                if (result != null) {
-                    // System.out.println ("receiveRPC (" + code + ") got " + result.length + " bytes, code " + result[0]);
-                    if ((code != 0) && (result[0] == code))   // rpc complete
-                        return result;
-                    if (! dispatch(result)) { // not a dispatch, save buffer
-                        saveBuffer(result);
-                        sleep = true;
-                    }
+                byte[] saved = (code != 0) ? takeBuffer(code) : null;
+                if (saved != null)
+                    return saved;
+                if (this.reading) {   // wait for the reader to save a reply
+                    try {
+                        this.mutex.wait();
+                    } catch (InterruptedException e) {} // ignore
+                    continue;
                 }
+                this.reading = true;
+            }
+            // read without holding the mutex, so others may take replies
+            byte[] result = receiveBuffer();
+            synchronized (this.mutex) {
+                this.reading = false;
+                this.mutex.notifyAll();
+                if (result == null)
+                    continue;
+                // System.out.println ("receiveRPC (" + code + ") got " + result.length + " bytes, code " + result[0]);
+                if ((code != 0) && (result[0] == code))   // rpc complete
+                    return result;
             }
-            if (sleep) {
-                try {  // let somebody else run
-                    Thread.sleep(100);
-                } catch (Exception e) {} // ignore InterruptedException
+            // callbacks may themselves do RPCs, so call without the mutex
+            if (! dispatch(result)) {   // not a dispatch, save buffer
+                synchronized (this.mutex) {
+                    this.bufferedResponses.addLast(result);
+                    this.mutex.notifyAll();
+                }
             }
         }
     }
@@ -293,6 +323,20 @@ public class CoreConnect extends Thread implements CoreAPI {
         return result;
     }
 
+    // sends all the requests before waiting for any of the replies.
+    // Replies are matched to requests by code and order, so other threads
+    // should not be sending requests with the same codes at the same time
+    private byte[][] doRPCs(byte[][] args) {
+        byte[][] results = new byte[args.length][];
+        for (int start = 0; start < args.length; start += maxPipelined) {
+            int end = Math.min(args.length, start + maxPipelined);
+            sendRPCs(java.util.Arrays.copyOfRange(args, start, end));
+            for (int i = start; i < end; i++)
+                results[i] = receiveRPC(args[i][0]);
+        }
+        return results;
+    }
+
     // from lib/keys.h
 
     // return all the contacts, including all the groups
@@ -570,6 +614,40 @@ public class CoreConnect extends Thread implements CoreAPI {
         return result;
     }
 
+    private static byte[] messagesPageRequest(String contact, long cursor,
+                                              int max) {
+        byte[] request = new byte[17 + SocketUtils.numBytes(contact) + 1];
+        request[0] = guiGetMessagesPage;
+        SocketUtils.w64(request, 1, cursor);
+        SocketUtils.w64(request, 9, max);
+        SocketUtils.wString(request, 17, contact);
+        return request;
+    }
+
+    // @return the messages in a reply to guiGetMessagesPage
+    private static Message[] messagesPageResult(byte[] response,
+                                                String contact) {
+        long count = SocketUtils.b64(response, 1);
+        return SocketUtils.bMessages(response, 17, count, contact, false);
+    }
+
+    // @return up to max saved messages to/from this contact, most recent
+    //         first, sent before the cursor time (0 for the most recent).
+    //         The next page starts at the sentTime of the oldest message
+    //         returned, and the result is empty after the last page.
+    public Message[] getMessages(String contact, long cursor, int max) {
+        if ((! isValid(contact)) || (max <= 0))
+            return new Message[0];
+        // pages are bounded by times, so the oldest message's sentTime
+        // (in Java milliseconds) is the allnet time cursor for the next page
+        long allnetCursor = 0;
+        if (cursor > 0)
+            allnetCursor = (cursor / 1000) - allnetY2kSecondsInUnix;
+        byte[] response = doRPC(messagesPageRequest(contact, allnetCursor,
+                                                    max));
+        return messagesPageResult(response, contact);
+    }
+
     // set that the contact was read now
     public void setReadTime(String contact) {
         if (isValid(contact)) {
@@ -700,17 +778,67 @@ public class CoreConnect extends Thread implements CoreAPI {
         }
     }
 
+    // gets the next page of messages for every contact, sending all
+    // the requests before waiting for the replies
+    // @return the cursor for the next page of each contact, or
+    //         -1 if there are no more messages for that contact
+    private long[] pipelinedMessages(String[] contacts, long[] cursors,
+                                     int max) {
+        byte[][] requests = new byte[contacts.length][];
+        for (int i = 0; i < contacts.length; i++)
+            requests[i] = messagesPageRequest(contacts[i], cursors[i], max);
+        byte[][] responses = doRPCs(requests);
+        long[] result = new long[contacts.length];
+        for (int i = 0; i < contacts.length; i++) {
+            Message[] msgs = messagesPageResult(responses[i], contacts[i]);
+            long next = SocketUtils.b64(responses[i], 9);
+            this.handlers.savedMessages(msgs);
+            result[i] = next;
+            // the cursor is a time, older for each page, and 0 after the
+            // last page.  Also stop if a page is empty or makes no progress
+            if ((msgs.length == 0) || (next <= 0) ||
+                ((cursors[i] > 0) && (next >= cursors[i])))
+                result[i] = -1;
+        }
+        return result;
+    }
+
     public void run() {
         // System.out.println("AllNetConnect thread running");
-        for (String contact: contacts()) {
+        String[] contacts = contacts();
+        for (String contact: contacts)
             this.handlers.contactCreated(contact);
-            Message[] msgs = getMessages(contact, -1);  // get all
-            this.handlers.savedMessages(msgs);
-        }
+        // show the most recent messages first, then get the older ones
+        long[] cursors = new long[contacts.length];
+        long[] next = pipelinedMessages(contacts, cursors,
+                                        messagesFirstPageSize);
         for (String sender: subscriptions()) {
             this.handlers.subscriptionComplete(sender);
         }
         this.handlers.initializationComplete();
+        java.util.ArrayList<String> more = new java.util.ArrayList<String>();
+        java.util.ArrayList<Long> moreCursors = new java.util.ArrayList<Long>();
+        for (int i = 0; i < contacts.length; i++) {
+            if (next[i] >= 0) {
+                more.add(contacts[i]);
+                moreCursors.add(next[i]);
+            }
+        }
+        while (more.size() > 0) {
+            String[] c = more.toArray(new String[0]);
+            long[] cur = new long[c.length];
+            for (int i = 0; i < c.length; i++)
+                cur[i] = moreCursors.get(i);
+            next = pipelinedMessages(c, cur, messagesPageSize);
+            more.clear();
+            moreCursors.clear();
+            for (int i = 0; i < c.length; i++) {
+                if (next[i] >= 0) {
+                    more.add(c[i]);
+                    moreCursors.add(next[i]);
+                }
+            }
+        }
         receiveRPC((byte)0);  // loop forever
     }
 }
@@ -123,6 +123,10 @@ public class CoreDebug implements CoreAPI {
         return (new Message[0]);
     }
 
+    public Message[] getMessages(String contact, long cursor, int max) {
+        return (new Message[0]);
+    }
+
     // set that the contact was read now
     public void setReadTime(String contact) {
     }
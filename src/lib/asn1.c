@@ -324,6 +324,7 @@ int debug_dsize = dsize;
           read_key (data + epos [7], dsize - epos [7], nhalf, key->qinv,
                     NULL))))
     return 0;
+  wp_rsa_key_pair_prepare (key);
   if (num_elements > 2)
     return 1;
   return 2;
@@ -0,0 +1,263 @@
+/* capture.c: save packets to capture files, and read them back */
+/* the file format is described in capture.h */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "capture.h"
+#include "packet.h"
+#include "util.h"
+
+struct allnet_capture {
+  char * base;
+  FILE * file;
+  int file_index;                     /* the N in base.N */
+  long long int max_bytes;            /* 0 to never rotate by size */
+  long long int max_seconds;          /* 0 to never rotate by time */
+  long long int bytes;                /* written to the current file */
+  unsigned long long int opened;      /* allnet_time when it was created */
+  unsigned long long int flushed;     /* allnet_time of the last fflush */
+};
+
+struct allnet_capture_reader {
+  char * path;
+  int rotated;                        /* reading path.0, path.1, ... */
+  int file_index;
+  FILE * file;
+  double speed;
+  unsigned long long int first_capture_us;   /* time of the first record */
+  unsigned long long int first_replay_us;    /* when it was returned */
+  int num_read;
+  char packet [ALLNET_MTU];
+};
+
+static char * rotated_name (const char * base, int index)
+{
+  char suffix [20];
+  snprintf (suffix, sizeof (suffix), ".%d", index);
+  return strcat_malloc (base, suffix, "capture rotated_name");
+}
+
+/* returns 1 if the new file was opened, 0 otherwise */
+static int capture_new_file (struct allnet_capture * cap)
+{
+  if (cap->file != NULL)
+    fclose (cap->file);
+  char * fname = rotated_name (cap->base, cap->file_index);
+  cap->file = fopen (fname, "w");
+  if (cap->file == NULL) {
+    perror ("capture fopen");
+    printf ("unable to create capture file %s\n", fname);
+    free (fname);
+    return 0;
+  }
+  free (fname);
+  cap->bytes = 0;
+  cap->opened = allnet_time ();
+  cap->flushed = cap->opened;
+  if (fwrite (CAPTURE_MAGIC, 1, CAPTURE_MAGIC_SIZE, cap->file) !=
+      CAPTURE_MAGIC_SIZE) {
+    perror ("capture fwrite magic");
+    return 0;
+  }
+  fflush (cap->file);   /* so even an empty file is a valid capture */
+  cap->bytes = CAPTURE_MAGIC_SIZE;
+  return 1;
+}
+
+struct allnet_capture *
+  capture_open (const char * base,
+                long long int max_bytes, long long int max_seconds)
+{
+  struct allnet_capture * cap =
+    malloc_or_fail (sizeof (struct allnet_capture), "capture_open");
+  cap->base = strcpy_malloc (base, "capture_open base");
+  cap->file = NULL;
+  cap->file_index = 0;
+  cap->max_bytes = max_bytes;
+  cap->max_seconds = max_seconds;
+  if (! capture_new_file (cap)) {
+    capture_close (cap);
+    return NULL;
+  }
+  return cap;
+}
+
+int capture_write (struct allnet_capture * cap,
+                   const char * packet, unsigned int psize,
+                   unsigned int priority, int source)
+{
+  if ((cap == NULL) || (cap->file == NULL) || (psize > ALLNET_MTU))
+    return 0;
+  long long int rsize = CAPTURE_RECORD_HEADER_SIZE + psize;
+  unsigned long long int now = allnet_time ();
+  /* never rotate an empty file, so every record is saved */
+  if ((cap->bytes > CAPTURE_MAGIC_SIZE) &&
+      (((cap->max_bytes > 0) && (cap->bytes + rsize > cap->max_bytes)) ||
+       ((cap->max_seconds > 0) && (now >= cap->opened + cap->max_seconds)))) {
+    cap->file_index++;
+    if (! capture_new_file (cap))
+      return 0;
+  }
+  char header [CAPTURE_RECORD_HEADER_SIZE];
+  writeb32 (header, psize);
+  writeb64 (header + 4, allnet_time_us ());
+  writeb16 (header + 12, priority);
+  header [14] = source;
+  header [15] = 0;
+  if ((fwrite (header, 1, sizeof (header), cap->file) != sizeof (header)) ||
+      (fwrite (packet, 1, psize, cap->file) != psize)) {
+    perror ("capture fwrite");
+    return 0;
+  }
+  cap->bytes += rsize;
+  /* the sniffer is usually stopped by a signal, so do not keep
+   * more than about a second of packets in the stdio buffer */
+  if (now != cap->flushed) {
+    fflush (cap->file);
+    cap->flushed = now;
+  }
+  return 1;
+}
+
+void capture_close (struct allnet_capture * cap)
+{
+  if (cap == NULL)
+    return;
+  if (cap->file != NULL)
+    fclose (cap->file);
+  free (cap->base);
+  free (cap);
+}
+
+/* returns the open file, or NULL if it does not exist or is not a capture */
+static FILE * open_capture_file (const char * fname, int print_missing)
+{
+  FILE * file = fopen (fname, "r");
+  if (file == NULL) {
+    if (print_missing)
+      printf ("unable to open capture file %s\n", fname);
+    return NULL;
+  }
+  char magic [CAPTURE_MAGIC_SIZE];
+  if ((fread (magic, 1, sizeof (magic), file) != sizeof (magic)) ||
+      (memcmp (magic, CAPTURE_MAGIC, CAPTURE_MAGIC_SIZE) != 0)) {
+    printf ("%s is not an allnet capture file\n", fname);
+    fclose (file);
+    return NULL;
+  }
+  return file;
+}
+
+struct allnet_capture_reader *
+  capture_reader_open (const char * path, double speed)
+{
+  FILE * file = NULL;
+  int rotated = 0;
+  if (access (path, F_OK) == 0) {
+    file = open_capture_file (path, 1);
+  } else {
+    char * fname = rotated_name (path, 0);
+    file = open_capture_file (fname, 1);
+    free (fname);
+    rotated = 1;
+  }
+  if (file == NULL)
+    return NULL;
+  struct allnet_capture_reader * reader =
+    malloc_or_fail (sizeof (struct allnet_capture_reader),
+                    "capture_reader_open");
+  reader->path = strcpy_malloc (path, "capture_reader_open path");
+  reader->rotated = rotated;
+  reader->file_index = 0;
+  reader->file = file;
+  reader->speed = ((speed > 0) ? speed : 0);
+  reader->first_capture_us = 0;
+  reader->first_replay_us = 0;
+  reader->num_read = 0;
+  return reader;
+}
+
+/* returns 1 if a record header was read, 0 at the end of the capture */
+static int read_record_header (struct allnet_capture_reader * reader,
+                               char * header)
+{
+  while (1) {
+    size_t n = fread (header, 1, CAPTURE_RECORD_HEADER_SIZE, reader->file);
+    if (n == CAPTURE_RECORD_HEADER_SIZE)
+      return 1;
+    if (n != 0)   /* partial record at the end, e.g. if capture was killed */
+      printf ("ignoring %d bytes at the end of capture file %d\n",
+              (int) n, reader->file_index);
+    if (! reader->rotated)
+      return 0;
+    char * fname = rotated_name (reader->path, reader->file_index + 1);
+    FILE * next = open_capture_file (fname, 0);
+    free (fname);
+    if (next == NULL)
+      return 0;
+    fclose (reader->file);
+    reader->file = next;
+    reader->file_index++;
+  }
+}
+
+/* wait until it is time to return a record captured at time_us */
+static void replay_wait (struct allnet_capture_reader * reader,
+                         unsigned long long int time_us)
+{
+  unsigned long long int now = allnet_time_us ();
+  if (reader->num_read == 0) {
+    reader->first_capture_us = time_us;
+    reader->first_replay_us = now;
+    return;
+  }
+  if ((reader->speed <= 0) || (time_us <= reader->first_capture_us))
+    return;
+  unsigned long long int due = reader->first_replay_us +
+    (unsigned long long int)
+      ((time_us - reader->first_capture_us) / reader->speed);
+  if (due > now)
+    usleep (due - now);
+}
+
+int capture_read (struct allnet_capture_reader * reader,
+                  struct allnet_capture_record * rec)
+{
+  if ((reader == NULL) || (reader->file == NULL))
+    return 0;
+  char header [CAPTURE_RECORD_HEADER_SIZE];
+  if (! read_record_header (reader, header))
+    return 0;
+  unsigned int psize = (unsigned int) readb32 (header);
+  if ((psize > ALLNET_MTU) || (header [15] != 0)) {
+    printf ("corrupted record %d in capture file %d, size %u\n",
+            reader->num_read, reader->file_index, psize);
+    return -1;
+  }
+  if (fread (reader->packet, 1, psize, reader->file) != psize) {
+    printf ("capture file %d ends in the middle of a %u-byte packet\n",
+            reader->file_index, psize);
+    return 0;
+  }
+  rec->time_us = readb64 (header + 4);
+  rec->priority = readb16 (header + 12);
+  rec->source = header [14];
+  rec->psize = psize;
+  rec->packet = reader->packet;
+  replay_wait (reader, rec->time_us);
+  reader->num_read++;
+  return 1;
+}
+
+void capture_reader_close (struct allnet_capture_reader * reader)
+{
+  if (reader == NULL)
+    return;
+  if (reader->file != NULL)
+    fclose (reader->file);
+  free (reader->path);
+  free (reader);
+}
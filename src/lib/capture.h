@@ -0,0 +1,67 @@
+/* capture.h: save packets to capture files, and read them back */
+
+#ifndef ALLNET_CAPTURE_H
+#define ALLNET_CAPTURE_H
+
+/* a capture file begins with the CAPTURE_MAGIC_SIZE bytes of CAPTURE_MAGIC,
+ * followed by any number of records.  Each record has a
+ * CAPTURE_RECORD_HEADER_SIZE-byte header:
+ *    4 bytes: size of the packet (not including this header), big-endian
+ *    8 bytes: capture time, in microseconds since Y2K, big-endian
+ *    2 bytes: priority, big-endian
+ *    1 byte:  the kind of socket the packet came from, CAPTURE_SOURCE_*
+ *    1 byte:  reserved, always 0
+ * and is followed by the packet itself, at most ALLNET_MTU bytes.
+ * A capture that is rotated is stored in files named base.0, base.1, ... */
+#define CAPTURE_MAGIC			"AllNetC1"
+#define CAPTURE_MAGIC_SIZE		8
+#define CAPTURE_RECORD_HEADER_SIZE	16
+
+#define CAPTURE_SOURCE_UNKNOWN		0
+#define CAPTURE_SOURCE_LOCAL		1   /* from an application */
+#define CAPTURE_SOURCE_REMOTE		2   /* from another allnet daemon */
+
+struct allnet_capture;          /* internal to capture.c */
+struct allnet_capture_reader;   /* internal to capture.c */
+
+/* create the capture file base.0.  If max_bytes > 0, a new file is
+ * started when the file would become larger than max_bytes, and if
+ * max_seconds > 0, a new file is started max_seconds after the current
+ * one was created.  Returns NULL (after printing the error) on errors */
+extern struct allnet_capture *
+  capture_open (const char * base,
+                long long int max_bytes, long long int max_seconds);
+
+/* returns 1 if the packet was saved, 0 otherwise */
+extern int capture_write (struct allnet_capture * cap,
+                          const char * packet, unsigned int psize,
+                          unsigned int priority, int source);
+
+extern void capture_close (struct allnet_capture * cap);
+
+struct allnet_capture_record {
+  unsigned long long int time_us;   /* when it was captured */
+  unsigned int priority;
+  int source;                       /* one of CAPTURE_SOURCE_* */
+  unsigned int psize;
+  char * packet;                    /* valid until the next capture_read */
+};
+
+/* opens the capture in the file named path or, if there is no such file,
+ * the rotated capture path.0, path.1, ...
+ * if speed is 0, capture_read returns each record as soon as it is read.
+ * Otherwise capture_read waits to return each record until the time
+ * since the first record, divided by speed, has passed -- so 1 replays
+ * the capture at its original pace, and 10 replays it 10 times faster.
+ * Returns NULL (after printing the error) on errors */
+extern struct allnet_capture_reader *
+  capture_reader_open (const char * path, double speed);
+
+/* returns 1 and fills in rec, 0 at the end of the capture, or -1 if the
+ * capture is corrupted */
+extern int capture_read (struct allnet_capture_reader * reader,
+                         struct allnet_capture_record * rec);
+
+extern void capture_reader_close (struct allnet_capture_reader * reader);
+
+#endif /* ALLNET_CAPTURE_H */
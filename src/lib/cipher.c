@@ -5,6 +5,8 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
+#include <pthread.h>
 
 #include "crypt_sel.h"
 
@@ -13,42 +15,18 @@
 #include "sha.h"
 #include "keys.h"
 #include "cipher.h"
-
-static void inc_ctr (char * ctr)
-{
-  int i;
-  int carry = 1;  /* initially add 1 */
-  for (i = AES_BLOCK_SIZE - 1; i >= 0; i--) {
-    int value = (ctr [i] & 0xff) + carry;
-    ctr [i] = value % 256;
-    carry = value / 256;
-  }
-}
+#include "wp_aes.h"
 
 /* for CTR mode, encryption and decryption are identical */
 static void aes_ctr_crypt (char * key, char * ctr,
                            const char * data, int dsize, char * result)
 {
-/*
-  printf ("aes_ctr_crypt (AES %p/%02x%02x%02x%02x, ctr %p/%02x%02x%02x%02x, ",
-                          key, key [0] & 0xff, key [1] & 0xff,
-                               key [2] & 0xff, key [3] & 0xff,
-                          ctr, ctr [0] & 0xff, ctr [1] & 0xff,
-                               ctr [2] & 0xff, ctr [3] & 0xff);
-  printf ("data %p, dsize = %d)\n", data, dsize);
-*/
-  char in [AES_BLOCK_SIZE];
-  memcpy (in, ctr, AES_BLOCK_SIZE);
-  char out [AES_BLOCK_SIZE];
-  int i;
-  for (i = 0; i < dsize; i++) {
-    if ((i % AES_BLOCK_SIZE) == 0) {   /* compute the next block */
-      if (! allnet_aes_encrypt_block (key, in, out))
-        exit (1);
-      inc_ctr (in);
-    }
-    result [i] = data [i] ^ out [i % AES_BLOCK_SIZE];
-  }
+  struct wp_aes_context aes;
+  wp_aes_init (&aes, key);
+  char counter [AES_BLOCK_SIZE];  /* the caller's ctr is not modified */
+  memcpy (counter, ctr, AES_BLOCK_SIZE);
+  wp_aes_ctr_crypt (&aes, counter, data, result, dsize);
+  memset (&aes, 0, sizeof (aes));
 #ifdef DEBUG_PRINT
   printf ("AES encryption complete\n");
 #endif /* DEBUG_PRINT */
@@ -308,122 +286,410 @@ static char ** randomize_contacts (char ** original, int n, int max)
 }
 
 
-/* returns the data size > 0, and malloc's and fills in the contact, if able
- * to decrypt and verify the packet.
- * If there is no signature but it is able to decrypt, returns the
- * negative of the data size < 0, and fills in the contact matching
- * the public key used to decrypt.
- * With either of these, malloc's and fills in *text.
- * The contact and keyset always identify an individual contact, never a group
- * if decryption does not work, returns 0 and sets *contact and *text to NULL
- *
- * if maxcontacts > 0, only tries to match up to maxcontacts
- */
-int decrypt_verify (int sig_algo, char * encrypted, int esize,
-                    char ** contact, keyset * kset, char ** text,
-                    char * sender, int sbits, char * dest, int dbits,
-                    int maxcontacts)
+/* try to verify and decrypt with the given keyset, after checking
+ * that the addresses match.
+ * returns the result of allnet_decrypt, or 0 if not decrypted */
+static int decrypt_verify_keyset (keyset k, int sig_algo,
+                                  char * encrypted, int csize,
+                                  char * sig, int ssize, char ** text,
+                                  char * sender, int sbits,
+                                  char * dest, int dbits,
+                                  int * count, int * decrypt_count)
 {
+  int do_decrypt = 1;  /* for now, try to decrypt unsigned messages */
+  if ((dest != NULL) && (dbits > 0)) {
+    char laddr [ADDRESS_SIZE];
+    int lbits = get_local (k, (unsigned char *)laddr);
+    if ((lbits > 0) &&  /* if lbits or dbits is zero, we verify */
+        (matches ((unsigned char *) dest, dbits,
+                  (unsigned char *) laddr, lbits) <= 0))
+      do_decrypt = 0;
+  }
+  if ((sender != NULL) && (sbits > 0)) {
+    char raddr [ADDRESS_SIZE];
+    int rbits = get_remote (k, (unsigned char *)raddr);
+    if ((rbits > 0) &&  /* if lbits or dbits is zero, we verify */
+        (matches ((unsigned char *) sender, sbits,
+                  (unsigned char *) raddr, rbits) <= 0))
+      do_decrypt = 0;
+  }
+  if (do_decrypt && (sig_algo != ALLNET_SIGTYPE_NONE)) {
+    /* verify signature */
+    do_decrypt = 0;
+    allnet_rsa_pubkey pub_key;
+    if (get_contact_pubkey (k, &pub_key)) {
+      do_decrypt = allnet_verify (encrypted, csize, sig, ssize - 2, pub_key);
+      (*count)++;
+    }
+  }
+  if (! do_decrypt)
+    return 0;
 #ifdef DEBUG_PRINT
-  unsigned long long int start = allnet_time_us ();
+  printf ("signature match for keyset %d\n", k);
 #endif /* DEBUG_PRINT */
-  *contact = NULL;
-  *kset = -1;
-  *text = NULL;
-  int ssize = 0;
-  if (sig_algo != ALLNET_SIGTYPE_NONE)  /* has signature */
-    ssize = readb16 (encrypted + esize - 2) + 2;
-  if (ssize > esize)
-    return 0;
-  int csize = esize - ssize;  /* size of ciphertext to decrypt */
-  char * sig = encrypted + csize;  /* only used if ssize != 0 */
-  int i, j;
+  allnet_rsa_prvkey prv_key;
+  int priv_ksize = get_my_privkey (k, &prv_key);
+  int res = 0;
+  if (priv_ksize > 0) {
+    res = allnet_decrypt (encrypted, csize, prv_key, text);
+    (*decrypt_count)++;
+  }
+  if ((! res) && (sig_algo != ALLNET_SIGTYPE_NONE))
+    printf ("signed msg from keyset %d verifies but does not decrypt\n", k);
+  return res;
+}
+
+/* returns the number of keysets to try, and mallocs *keysets.
+ * if the sender or destination addresses are known, uses the key index
+ * to find the keysets with matching addresses.  Otherwise, returns all
+ * the keysets of up to maxcontacts randomly selected contacts */
+static int keysets_to_try (char * sender, int sbits, char * dest, int dbits,
+                           int maxcontacts, keyset ** keysets)
+{
+  *keysets = NULL;
+  if (((sender != NULL) && (sbits > 0)) || ((dest != NULL) && (dbits > 0)))
+    return keysets_matching_addresses ((unsigned char *) sender, sbits,
+                                       (unsigned char *) dest, dbits,
+                                       keysets);
   int count = 0;
-  int decrypt_count = 0;
+  if ((maxcontacts <= 0) || (maxcontacts >= num_contacts ())) {
+    /* try every contact: collect their keysets, growing the array as needed */
+    int available = 0;
+    int iter = 0;
+    char * contact = NULL;
+    int csize = 0;
+    while (next_individual_contact (&iter, &contact, &csize)) {
+      int nkeys = contact_keysets (contact, (*keysets) + count,
+                                   available - count);
+      if (nkeys > available - count) {
+        available = 2 * (count + nkeys);
+        *keysets = realloc (*keysets, available * sizeof (keyset));
+        if (*keysets == NULL) {
+          printf ("unable to allocate %d keysets\n", available);
+          exit (1);
+        }
+        nkeys = contact_keysets (contact, (*keysets) + count,
+                                 available - count);
+        if (nkeys > available - count)  /* added since the first call */
+          nkeys = available - count;
+      }
+      if (nkeys > 0)
+        count += nkeys;
+    }
+    if (contact != NULL)
+      free (contact);
+    return count;
+  }
   char ** contacts = NULL;
   int ncontacts = all_individual_contacts (&contacts);
   if ((maxcontacts > 0) && (maxcontacts < ncontacts)) {
-    contacts = randomize_contacts (contacts, ncontacts, maxcontacts);
+    char ** random = randomize_contacts (contacts, ncontacts, maxcontacts);
+    free (contacts);
+    contacts = random;
     ncontacts = maxcontacts;
   }
-  for (i = 0; ((*contact == NULL) && (i < ncontacts)); i++) {
+  int i;
+  for (i = 0; i < ncontacts; i++) {
     keyset * keys = NULL;
     int nkeys = all_keys (contacts [i], &keys);
-    for (j = 0; ((*contact == NULL) && (j < nkeys)); j++) {
-      int do_decrypt = 1;  /* for now, try to decrypt unsigned messages */
-      if ((dest != NULL) && (dbits > 0)) {
-        char laddr [ADDRESS_SIZE];
-        int lbits = get_local (keys [j], (unsigned char *)laddr);
-        if ((lbits > 0) &&  /* if lbits or dbits is zero, we verify */
-            (matches ((unsigned char *) dest, dbits,
-                      (unsigned char *) laddr, lbits) <= 0))
-          do_decrypt = 0;
-      }
-      if ((sender != NULL) && (sbits > 0)) {
-        char raddr [ADDRESS_SIZE];
-        int rbits = get_remote (keys [j], (unsigned char *)raddr);
-        if ((rbits > 0) &&  /* if lbits or dbits is zero, we verify */
-            (matches ((unsigned char *) sender, sbits,
-                      (unsigned char *) raddr, rbits) <= 0))
-          do_decrypt = 0;
-      }
-      if (do_decrypt && (sig_algo != ALLNET_SIGTYPE_NONE)) {
-        /* verify signature */
-        do_decrypt = 0;
-        allnet_rsa_pubkey pub_key;
-        if (get_contact_pubkey (keys [j], &pub_key)) {
-          do_decrypt =
-            allnet_verify (encrypted, csize, sig, ssize - 2, pub_key);
-          count++;
-        }
+    if (nkeys > 0) {
+      *keysets = realloc (*keysets, (count + nkeys) * sizeof (keyset));
+      if (*keysets == NULL) {
+        printf ("unable to allocate %d keysets\n", count + nkeys);
+        exit (1);
       }
+      memcpy ((*keysets) + count, keys, nkeys * sizeof (keyset));
+      count += nkeys;
+    }
+    if (keys != NULL)
+      free (keys);
+  }
+  if (contacts != NULL) free (contacts);
+  return count;
+}
+
+/* decrypt_verify tries its candidate keysets on a pool of worker threads,
+ * if the program has started one with decrypt_verify_start_workers.
+ * Each packet being decrypted is a dv_packet on the dv_pending list, and
+ * each worker (and the thread that submitted the packet) repeatedly takes
+ * the next untried keyset of the first pending packet.  As soon as one
+ * keyset succeeds, no more keysets are tried for that packet, though trials
+ * already in progress are allowed to finish.
+ * Without workers, all the trials are done by the thread calling
+ * decrypt_verify */
+#define DV_MAX_WORKERS	16
+
+struct dv_packet {
+  struct decrypt_verify_request * request;
+  char * encrypted;        /* from the request */
+  int csize;               /* size of ciphertext to decrypt */
+  char * sig;              /* only used if ssize != 0 */
+  int ssize;
+  keyset * keys;           /* the candidates, from keysets_to_try */
+  int nkeys;
+  int next;                /* index of the next keyset to try */
+  int active;              /* number of trials in progress */
+  int found;               /* index of the successful keyset, or -1 */
+  int res;                 /* result of decrypt_verify_keyset for found */
+  char * text;             /* plaintext from the successful keyset */
+  char * contact;          /* name of the contact for the successful keyset */
+  int count;               /* number of verifications */
+  int decrypt_count;       /* number of decryptions */
+  struct dv_packet * next_pending;
+};
+
+static pthread_mutex_t dv_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t dv_work = PTHREAD_COND_INITIALIZER;  /* more pending */
+static pthread_cond_t dv_done = PTHREAD_COND_INITIALIZER;  /* a trial ended */
+static struct dv_packet * dv_pending = NULL;
+static int dv_num_workers = 0;
+
+/* 1 if no more keysets need to be tried for this packet */
+static int dv_exhausted (struct dv_packet * p)
+{
+  return ((p->found >= 0) || (p->next >= p->nkeys));
+}
+
+/* called with dv_mutex held */
+static void dv_unlink (struct dv_packet * p)
+{
+  struct dv_packet ** ptr = &dv_pending;
+  while (*ptr != NULL) {
+    if (*ptr == p) {
+      *ptr = p->next_pending;
+      return;
+    }
+    ptr = &((*ptr)->next_pending);
+  }
+}
+
+/* try the next keyset of p.  Called with dv_mutex held, which is
+ * released during the trial itself */
+static void dv_trial (struct dv_packet * p)
+{
+  int index = p->next++;
+  p->active++;
+  if (dv_exhausted (p))
+    dv_unlink (p);    /* nothing left for anyone else to start */
+  pthread_mutex_unlock (&dv_mutex);
+  struct decrypt_verify_request * r = p->request;
+  char * text = NULL;
+  int count = 0;
+  int decrypt_count = 0;
+  int res = decrypt_verify_keyset (p->keys [index], r->sig_algo,
+                                   p->encrypted, p->csize, p->sig, p->ssize,
+                                   &text, r->sender, r->sbits,
+                                   r->dest, r->dbits, &count, &decrypt_count);
+  char * contact = NULL;
+  if (res) {
+    contact = get_contact_name (p->keys [index]);
+    if (contact == NULL) {   /* should never happen, try the next keyset */
+      free (text);
+      res = 0;
+    }
+  }
+  pthread_mutex_lock (&dv_mutex);
+  p->active--;
+  p->count += count;
+  p->decrypt_count += decrypt_count;
+  if (res) {   /* if several succeed, keep the first in keyset order */
+    if ((p->found < 0) || (index < p->found)) {
+      if (p->text != NULL)
+        free (p->text);
+      if (p->contact != NULL)
+        free (p->contact);
+      p->found = index;
+      p->res = res;
+      p->text = text;
+      p->contact = contact;
+    } else {
+      free (text);
+      free (contact);
+    }
+    dv_unlink (p);    /* cancel the trials not yet started */
+  }
+  if (dv_exhausted (p) && (p->active == 0))
+    pthread_cond_broadcast (&dv_done);
+}
+
+static void * dv_worker (void * arg)
+{
+  pthread_mutex_lock (&dv_mutex);
+  while (1) {
+    while (dv_pending == NULL)
+      pthread_cond_wait (&dv_work, &dv_mutex);
+    dv_trial (dv_pending);
+  }
+  pthread_mutex_unlock (&dv_mutex);  /* never reached */
+  return NULL;
+}
+
+/* by default, one worker for each core other than the caller's */
+void decrypt_verify_start_workers (int n)
+{
+  static int started = 0;
+  pthread_mutex_lock (&dv_mutex);
+  if (started) {
+    pthread_mutex_unlock (&dv_mutex);
+    return;
+  }
+  started = 1;
+  char * env = getenv ("ALLNET_DV_WORKERS");
+  if (env != NULL)
+    n = atoi (env);
+  else if (n < 0)
+    n = (int) sysconf (_SC_NPROCESSORS_ONLN) - 1;
+  if (n < 0)
+    n = 0;
+  if (n > DV_MAX_WORKERS)
+    n = DV_MAX_WORKERS;
+  while (dv_num_workers < n) {
+    pthread_t thread;
+    if (pthread_create (&thread, NULL, dv_worker, NULL) != 0) {
+      perror ("decrypt_verify pthread_create");
+      break;  /* fewer workers, or the callers do all the work */
+    }
+    pthread_detach (thread);
+    dv_num_workers++;
+  }
+  pthread_mutex_unlock (&dv_mutex);
+}
+
+/* one more than the index of a packet that still has keysets to try,
+ * or 0 if all are done or being tried by other threads.
+ * Called with dv_mutex held */
+static int dv_untried (struct dv_packet * packets, int count)
+{
+  int i;
+  for (i = 0; i < count; i++)
+    if (! dv_exhausted (packets + i))
+      return i + 1;
+  return 0;
+}
+
+/* 1 if every packet has finished, 0 if some trials are still running */
+static int dv_all_done (struct dv_packet * packets, int count)
+{
+  int i;
+  for (i = 0; i < count; i++)
+    if ((! dv_exhausted (packets + i)) || (packets [i].active > 0))
+      return 0;
+  return 1;
+}
+
+/* fill in the results of the request from the packet */
+static void dv_finish (struct dv_packet * p)
+{
+  struct decrypt_verify_request * r = p->request;
+  if (p->found >= 0) {
+    r->contact = p->contact;
+    r->kset = p->keys [p->found];
+    r->text = p->text;
+    r->result = ((r->sig_algo != ALLNET_SIGTYPE_NONE) ? p->res : (- p->res));
+  }
+  if (p->keys != NULL)
+    free (p->keys);
+}
+
+/* decrypt and verify count packets at once, trying their keysets
+ * in parallel.  The results are as for decrypt_verify */
+void decrypt_verify_batch (struct decrypt_verify_request * requests,
+                           int count)
+{
 #ifdef DEBUG_PRINT
-      unsigned long long int time_ver = allnet_time_us () - start;
-#endif /* DEBUG_PRINT */
-      if (do_decrypt) {
-#ifdef DEBUG_PRINT
-        printf ("signature match for contact %s, key %d\n", contacts [i], j);
-#endif /* DEBUG_PRINT */
-        allnet_rsa_prvkey prv_key;
-        int priv_ksize = get_my_privkey (keys [j], &prv_key);
-        int res = 0;
-        if (priv_ksize > 0) {
-          res = allnet_decrypt (encrypted, csize, prv_key, text);
-          decrypt_count++;
-        }
-        if (res) {
-          *contact = strcpy_malloc (contacts [i], "verify contact");
-          *kset = keys [j];
-#ifdef DEBUG_PRINT
-          unsigned long long int time_delta = allnet_time_us () - start;
-          printf ("%ssuccess: %d ver (%lld.%06lld s) + %d dec ",
-                  (sig_algo != ALLNET_SIGTYPE_NONE) ? "" : "unsigned ", count,
-                  time_ver / 1000000, time_ver % 1000000, decrypt_count);
-          printf ("%lld.%06lld seconds\n",
-                  time_delta / 1000000, time_delta % 1000000);
+  unsigned long long int start = allnet_time_us ();
 #endif /* DEBUG_PRINT */
-          free (keys);
-          if (contacts != NULL) free (contacts);
-          if (sig_algo != ALLNET_SIGTYPE_NONE)
-            return res;
-          else
-            return -res;
-        } else if (sig_algo != ALLNET_SIGTYPE_NONE) {
-          printf ("signed msg from %s key %d verifies but does not decrypt\n",
-                  contacts [i], j);
-        }
+  if (count <= 0)
+    return;
+  struct dv_packet * packets =
+    malloc_or_fail (count * sizeof (struct dv_packet), "decrypt_verify_batch");
+  int total = 0;   /* total number of keysets to try */
+  int i;
+  for (i = 0; i < count; i++) {
+    struct decrypt_verify_request * r = requests + i;
+    struct dv_packet * p = packets + i;
+    r->result = 0;
+    r->contact = NULL;
+    r->kset = -1;
+    r->text = NULL;
+    memset (p, 0, sizeof (struct dv_packet));
+    p->request = r;
+    p->found = -1;
+    p->encrypted = r->encrypted;
+    if (r->sig_algo != ALLNET_SIGTYPE_NONE)  /* has signature */
+      p->ssize = readb16 (r->encrypted + r->esize - 2) + 2;
+    if (p->ssize > r->esize)
+      continue;   /* nkeys is 0, nothing to try */
+    p->csize = r->esize - p->ssize;
+    p->sig = r->encrypted + p->csize;
+    p->nkeys = keysets_to_try (r->sender, r->sbits, r->dest, r->dbits,
+                               r->maxcontacts, &(p->keys));
+    total += p->nkeys;
+  }
+  pthread_mutex_lock (&dv_mutex);
+  if ((total > 1) && (dv_num_workers > 0)) {  /* worth sharing */
+    for (i = count - 1; i >= 0; i--) {
+      if (packets [i].nkeys > 0) {
+        packets [i].next_pending = dv_pending;
+        dv_pending = packets + i;
       }
     }
-    if ((nkeys > 0) && (keys != NULL))
-      free (keys);
+    pthread_cond_broadcast (&dv_work);
   }
-  if (contacts != NULL) free (contacts);
+  /* do our own share of the trials, then wait for the workers to finish */
+  while (! dv_all_done (packets, count)) {
+    int index_plus_one = dv_untried (packets, count);
+    if (index_plus_one > 0)
+      dv_trial (packets + (index_plus_one - 1));
+    else
+      pthread_cond_wait (&dv_done, &dv_mutex);
+  }
+  for (i = 0; i < count; i++)
+    dv_unlink (packets + i);
+  pthread_mutex_unlock (&dv_mutex);
+  for (i = 0; i < count; i++)
+    dv_finish (packets + i);
 #ifdef DEBUG_PRINT
-  printf ("unable to decrypt packet, dropping\n");
   unsigned long long int time_delta = allnet_time_us () - start;
-  if (count + decrypt_count > 0)
-    printf ("%d verifications+%d decryptions took %lld.%06lld seconds\n",
-            count, decrypt_count, time_delta / 1000000, time_delta % 1000000);
+  for (i = 0; i < count; i++)
+    printf ("%s%s: %d ver + %d dec ",
+            (requests [i].sig_algo != ALLNET_SIGTYPE_NONE) ? "" : "unsigned ",
+            (requests [i].result != 0) ? "success" : "failure",
+            packets [i].count, packets [i].decrypt_count);
+  printf ("%lld.%06lld seconds\n", time_delta / 1000000, time_delta % 1000000);
 #endif /* DEBUG_PRINT */
-  return 0;
+  free (packets);
+}
+
+/* returns the data size > 0, and malloc's and fills in the contact, if able
+ * to decrypt and verify the packet.
+ * If there is no signature but it is able to decrypt, returns the
+ * negative of the data size < 0, and fills in the contact matching
+ * the public key used to decrypt.
+ * With either of these, malloc's and fills in *text.
+ * The contact and keyset always identify an individual contact, never a group
+ * if decryption does not work, returns 0 and sets *contact and *text to NULL
+ *
+ * if maxcontacts > 0 and neither sender nor dest are given, only tries
+ * to match up to maxcontacts
+ */
+int decrypt_verify (int sig_algo, char * encrypted, int esize,
+                    char ** contact, keyset * kset, char ** text,
+                    char * sender, int sbits, char * dest, int dbits,
+                    int maxcontacts)
+{
+  struct decrypt_verify_request r;
+  r.sig_algo = sig_algo;
+  r.encrypted = encrypted;
+  r.esize = esize;
+  r.sender = sender;
+  r.sbits = sbits;
+  r.dest = dest;
+  r.dbits = dbits;
+  r.maxcontacts = maxcontacts;
+  decrypt_verify_batch (&r, 1);
+  *contact = r.contact;
+  *kset = r.kset;
+  *text = r.text;
+  return r.result;
 }
@@ -41,12 +41,42 @@ extern int allnet_sign (const char * text, int tsize, allnet_rsa_prvkey key,
  * The contact and keyset always identify an individual contact, never a group
  * if decryption does not work, returns 0 and sets *contact and *text to NULL
  *
- *
- * if maxcontacts > 0, only tries to match up to maxcontacts
+ * if the sender or dest have a nonzero number of bits, only tries keysets
+ * whose addresses match.  Otherwise, if maxcontacts > 0, only tries
+ * to match up to maxcontacts randomly selected contacts
  */
 extern int decrypt_verify (int sig_algo, char * encrypted, int esize,
                            char ** contact, keyset * key, char ** text,
                            char * sender, int sbits, char * dest, int dbits,
                            int maxcontacts);
 
+/* the same for several packets at once, sharing the worker threads that
+ * decrypt_verify uses to try keysets in parallel.  The caller fills in
+ * the arguments of each request, decrypt_verify_batch fills in the results */
+struct decrypt_verify_request {
+  /* arguments, as for decrypt_verify */
+  int sig_algo;
+  char * encrypted;
+  int esize;
+  char * sender;
+  int sbits;
+  char * dest;
+  int dbits;
+  int maxcontacts;
+  /* results, as for decrypt_verify.  contact and text are malloc'd */
+  int result;
+  char * contact;
+  keyset kset;
+  char * text;
+};
+extern void decrypt_verify_batch (struct decrypt_verify_request * requests,
+                                  int count);
+
+/* start n threads to try keysets in parallel for decrypt_verify, or if
+ * n < 0, one for each core other than the caller's.  The environment
+ * variable ALLNET_DV_WORKERS, if set, overrides n.  Programs that do not
+ * call this do all the trials in the thread calling decrypt_verify.
+ * Only the first call has any effect */
+extern void decrypt_verify_start_workers (int n);
+
 #endif /* ALLNET_APP_CIPHER_H */
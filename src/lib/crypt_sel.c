@@ -23,6 +23,7 @@ allnet_rsa_pubkey allnet_rsa_private_to_public (allnet_rsa_prvkey key)
   result.nbits = key.nbits;
   wp_copy (key.nbits, result.n, key.n);
   result.e = key.e;
+  result.mont = key.mont;
   return result;
 #endif /* HAVE_OPENSSL */
 }
@@ -76,6 +77,7 @@ int allnet_get_pubkey (const char * key, int ksize, allnet_rsa_pubkey * rsa)
   rsa->nbits = ksize * 8;
   wp_from_bytes (rsa->nbits, rsa->n, ksize, key);
   rsa->e = 65537;
+  wp_rsa_key_prepare (rsa);
   return ksize;
 #endif /* HAVE_OPENSSL */
 }
@@ -150,6 +152,7 @@ int allnet_pubkey_from_raw (allnet_rsa_pubkey * rsa,
   rsa->nbits = (ksize - 1) * 8;
   wp_from_bytes (rsa->nbits, rsa->n, ksize - 1, key + 1);
   rsa->e = 65537;
+  wp_rsa_key_prepare (rsa);
 #endif /* HAVE_OPENSSL */
   return ksize;
 }
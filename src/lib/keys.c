@@ -89,36 +89,228 @@ static void print_contacts (char * desc, int individual_only)
 }
 #endif /* DEBUG_PRINT */
 
+static int valid_keyset (keyset k)
+{
+  return ((k >= 0) && (k < num_key_infos) && (! kip [k].is_deleted));
+}
+
+/* index of the keysets by contact name.  name_index is an open-addressing
+ * hash table (name_index_size is a power of two) holding, for each distinct
+ * name, the first keyset in kip with that name, and name_index_next [k]
+ * is the next keyset with the same name as k (-1 at the end).
+ * Deleted keysets are included, so a walk along a name's list finds the
+ * same keysets, in the same order, as a search through all of kip.
+ * Like the address index, rebuilt lazily after a change.  The index is
+ * only read, built, or invalidated with name_index_mutex held */
+static keyset * name_index = NULL;
+static int name_index_size = 0;
+static keyset * name_index_next = NULL;
+static int name_index_valid = 0;
+static pthread_mutex_t name_index_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/* called with name_index_mutex held */
+static void invalidate_name_index ()
+{
+  name_index_valid = 0;
+}
+
+static unsigned int name_hash (const char * name)
+{
+  unsigned int result = 2166136261U;   /* 32-bit FNV-1a */
+  while (*name != '\0')
+    result = (result ^ ((unsigned char) (*(name++)))) * 16777619U;
+  return result;
+}
+
+/* returns the slot holding the first keyset with this name, or if none,
+ * the empty slot where it belongs.  called with name_index_mutex held */
+static int name_slot (const char * name)
+{
+  unsigned int mask = name_index_size - 1;
+  unsigned int slot = name_hash (name) & mask;
+  while ((name_index [slot] >= 0) &&
+         ((kip [name_index [slot]].contact_name == NULL) ||
+          (strcmp (kip [name_index [slot]].contact_name, name) != 0)))
+    slot = (slot + 1) & mask;
+  return (int)slot;
+}
+
+/* called with name_index_mutex held */
+static void build_name_index ()
+{
+  if (name_index_valid)
+    return;
+  int size = 16;      /* keep the table at most half full */
+  while (size < 2 * num_key_infos)
+    size *= 2;
+  if (size != name_index_size) {
+    if (name_index != NULL)
+      free (name_index);
+    name_index = malloc_or_fail (size * sizeof (keyset), "build_name_index");
+    name_index_size = size;
+  }
+  int i;
+  for (i = 0; i < name_index_size; i++)
+    name_index [i] = -1;
+  if (name_index_next != NULL)
+    free (name_index_next);
+  name_index_next = NULL;
+  if (num_key_infos > 0)
+    name_index_next = malloc_or_fail (num_key_infos * sizeof (keyset),
+                                      "build_name_index next");
+  /* insert from last to first, so each list ends up in kip order */
+  keyset k;
+  for (k = num_key_infos - 1; k >= 0; k--) {
+    name_index_next [k] = -1;
+    if (kip [k].contact_name == NULL)
+      continue;
+    int slot = name_slot (kip [k].contact_name);
+    name_index_next [k] = name_index [slot];
+    name_index [slot] = k;
+  }
+  name_index_valid = 1;
+}
+
+/* returns the first keyset with this name, or -1 if there is none
+ * called with name_index_mutex held */
+static keyset first_keyset (const char * contact)
+{
+  build_name_index ();
+  if (contact == NULL)
+    return -1;
+  return name_index [name_slot (contact)];
+}
+
 /* return 0 if the contact does not exist, otherwise one more than the
- * contact's index in cp */
+ * index in kip of the contact's first keyset */
 static int contact_exists (const char * contact)
 {
+  pthread_mutex_lock (&name_index_mutex);
+  keyset k = first_keyset (contact);
+  pthread_mutex_unlock (&name_index_mutex);
+  return k + 1;
+}
+
+/* which contacts are listed by all_contacts_implementation and next_listed */
+#define LIST_VISIBLE		0   /* with a visible keyset */
+#define LIST_INDIVIDUAL		1   /* with a keyset that is not a group */
+#define LIST_INVISIBLE		2   /* with keysets, none of them visible */
+
+/* deleted keysets are ignored.  called with name_index_mutex held */
+static int contact_listed (keyset first, int which)
+{
+  int live = 0;
+  int visible = 0;
+  int individual = 0;
+  keyset k;
+  for (k = first; k >= 0; k = name_index_next [k]) {
+    if (kip [k].is_deleted)
+      continue;
+    live = 1;
+    if (kip [k].is_visible)
+      visible = 1;
+    if (! kip [k].is_group)
+      individual = 1;
+  }
+  if (which == LIST_INDIVIDUAL)
+    return individual;
+  if (which == LIST_INVISIBLE)
+    return (live && (! visible));
+  return visible;
+}
+
+/* index of the keysets of individual contacts by remote address.
+ * There is one list per value of the first byte of the remote address,
+ * and one more for keysets whose remote address has fewer than 8 bits.
+ * address_index [i] is the first keyset in list i, and
+ * address_index_next [k] the keyset after k in the same list (-1 at the end).
+ * The index is rebuilt (lazily, by build_address_index) after any change */
+#define ADDRESS_INDEX_SHORT	256
+#define ADDRESS_INDEX_LISTS	(ADDRESS_INDEX_SHORT + 1)
+static keyset address_index [ADDRESS_INDEX_LISTS];
+static keyset * address_index_next = NULL;
+static int address_index_valid = 0;
+static pthread_mutex_t address_index_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/* incremented each time contact keys or addresses change */
+static volatile int key_changes = 0;
+
+/* takes address_index_mutex, so a build_address_index running at the
+ * same time cannot mark the index valid after this change.
+ * May be called with name_index_mutex held, never the other way around */
+static void invalidate_address_index ()
+{
+  pthread_mutex_lock (&address_index_mutex);
+  address_index_valid = 0;
+  key_changes++;
+  pthread_mutex_unlock (&address_index_mutex);
+}
+
+/* called with address_index_mutex held */
+static void build_address_index ()
+{
+  if (address_index_valid)
+    return;
+  if (address_index_next != NULL)
+    free (address_index_next);
+  address_index_next = NULL;
+  if (num_key_infos > 0)
+    address_index_next = malloc_or_fail (num_key_infos * sizeof (keyset),
+                                         "build_address_index");
+  keyset tails [ADDRESS_INDEX_LISTS];
   int i;
-  for (i = 0; i < cp_used; i++) {
-    if (strcmp (cpx [i], contact) == 0)
-      return i + 1;
-    /* else
-      printf ("%d: %s does not match %s\n", i, contact, cp [i]); */
+  for (i = 0; i < ADDRESS_INDEX_LISTS; i++) {
+    address_index [i] = -1;
+    tails [i] = -1;
+  }
+  keyset k;
+  for (k = 0; k < num_key_infos; k++) {
+    address_index_next [k] = -1;
+    if ((! valid_keyset (k)) || (kip [k].is_group) ||
+        (kip [k].contact_name == NULL))
+      continue;
+    int list = ((kip [k].remote.nbits < 8) ? ADDRESS_INDEX_SHORT :
+                ((unsigned char) (kip [k].remote.address [0])));
+    if (tails [list] < 0)
+      address_index [list] = k;
+    else
+      address_index_next [tails [list]] = k;
+    tails [list] = k;
   }
-  return 0;
+  address_index_valid = 1;
 }
 
-static int valid_keyset (keyset k)
+/* an address with 0 bits matches any other address */
+static int address_matches (const unsigned char * address, int nbits,
+                            const struct key_address * ka)
 {
-  return ((k >= 0) && (k < num_key_infos) && (! kip [k].is_deleted));
+  if ((address == NULL) || (nbits <= 0) || (ka->nbits <= 0))
+    return 1;
+  return (matches (address, nbits,
+                   (const unsigned char *) (ka->address), ka->nbits) > 0);
 }
 
-static void generate_contacts ()
+/* called with name_index_mutex held */
+static void generate_contacts_locked ()
 {
+  invalidate_name_index ();
+  build_name_index ();
   int ki = 0;
   cp_used = 0;
   for (ki = 0; ki < num_key_infos; ki++) {
     if ((kip [ki].contact_name != NULL) &&
-        (! contact_exists (kip [ki].contact_name)))
+        (first_keyset (kip [ki].contact_name) == ki))
       cpx [cp_used++] = kip [ki].contact_name;
   }
 }
 
+static void generate_contacts ()
+{
+  pthread_mutex_lock (&name_index_mutex);
+  generate_contacts_locked ();
+  pthread_mutex_unlock (&name_index_mutex);
+}
+
 static void set_kip_size (int size)
 {
   struct key_info * new_kip = NULL;
@@ -156,6 +348,7 @@ static void set_kip_size (int size)
   for (i = 0; i < size; i++)
     new_cp [i] = NULL;
   /* set kip, cp, cpx to point to the new arrays */
+  pthread_mutex_lock (&name_index_mutex);
   if (kip != NULL)
     free (kip);
   if (cpx != NULL)
@@ -164,7 +357,9 @@ static void set_kip_size (int size)
   kip = new_kip;
   cpx = new_cp;
   cp_used = 0;
-  generate_contacts ();
+  generate_contacts_locked ();
+  pthread_mutex_unlock (&name_index_mutex);
+  invalidate_address_index ();
 }
 
 #define DATE_TIME_LEN           14      /* strlen("20130101120102") */
@@ -619,6 +814,11 @@ int num_contacts ()
   return cp_used;
 }
 
+int contact_key_changes ()
+{
+  return key_changes;
+}
+
 static char ** malloc_copy_array_of_strings (char ** array, int count)
 {
   if ((array == NULL) || (count <= 0))
@@ -638,31 +838,27 @@ static char ** malloc_copy_array_of_strings (char ** array, int count)
   return result;
 }
 
-static int all_contacts_implementation (char *** contacts, int individual_only)
+static int all_contacts_implementation (char *** contacts, int which)
 {
   init_from_file ("all_contacts_implementation");
 #ifdef DEBUG_PRINT
-  print_contacts ("entering all_contacts_implementation (%d)", individual_only);
+  print_contacts ("entering all_contacts_implementation",
+                  (which == LIST_INDIVIDUAL));
 #endif /* DEBUG_PRINT */
   int i;
   int delta = 0;
   char ** p = NULL;
 /* allocate enough room for all the contacts, then only return the ones
- * we actually want to return: the ones that are not deleted,
- * and if individual_only, that are not groups
- * otherwise, that are visible
+ * we actually want to return, as selected by contact_listed
  * we do waste of some space, but the amount of wasted space should
  * be small, and simplifying the code is worth it */
+  pthread_mutex_lock (&name_index_mutex);
   if (contacts != NULL) {
     p = malloc_copy_array_of_strings (cpx, cp_used);
     *contacts = p;
   }
   for (i = 0; i < cp_used; i++) {
-    int include = (! kip [i].is_deleted);
-    if (individual_only)  /* only include if it is not a group */
-      include = include && (! kip [i].is_group);
-    else                  /* only include if it is visible */
-      include = include && (kip [i].is_visible);
+    int include = contact_listed (first_keyset (cpx [i]), which);
     if (include) {
       if ((delta > 0) && (p != NULL))
         /* delta > 0, so at least some with index < i have been ignored */
@@ -673,7 +869,9 @@ static int all_contacts_implementation (char *** contacts, int individual_only)
       delta++;
     }
   }
-  return cp_used - delta;
+  int result = cp_used - delta;
+  pthread_mutex_unlock (&name_index_mutex);
+  return result;
 }
 
 /* returns the number of contacts, and (if not NULL) has contacts point
@@ -681,13 +879,51 @@ static int all_contacts_implementation (char *** contacts, int individual_only)
  * contact names (to free, call free (*contacts)). */
 int all_contacts (char *** contacts)
 {
-  return all_contacts_implementation (contacts, 0);
+  return all_contacts_implementation (contacts, LIST_VISIBLE);
 }
 
 /* same, but only individual contacts, not groups */
 int all_individual_contacts (char *** contacts)
 {
-  return all_contacts_implementation (contacts, 1);
+  return all_contacts_implementation (contacts, LIST_INDIVIDUAL);
+}
+
+static int next_listed (int * iter, char ** name, int * nsize, int which)
+{
+  init_from_file ("next_contact");
+  int result = 0;
+  pthread_mutex_lock (&name_index_mutex);
+  while ((! result) && (*iter >= 0) && (*iter < cp_used)) {
+    const char * contact = cpx [*iter];
+    (*iter)++;
+    if (contact_listed (first_keyset (contact), which)) {
+      /* copy while holding the lock, the contact may be renamed or deleted
+       * as soon as we release it */
+      int needed = (int)strlen (contact) + 1;
+      if ((*name == NULL) || (*nsize < needed)) {
+        if (*name != NULL)
+          free (*name);
+        *nsize = needed;
+        *name = malloc_or_fail (needed, "next_contact");
+      }
+      memcpy (*name, contact, needed);
+      result = 1;
+    }
+  }
+  pthread_mutex_unlock (&name_index_mutex);
+  return result;
+}
+
+/* iterate over the same contacts as all_contacts */
+int next_contact (int * iter, char ** name, int * nsize)
+{
+  return next_listed (iter, name, nsize, LIST_VISIBLE);
+}
+
+/* iterate over the same contacts as all_individual_contacts */
+int next_individual_contact (int * iter, char ** name, int * nsize)
+{
+  return next_listed (iter, name, nsize, LIST_INDIVIDUAL);
 }
 
 #if 0
@@ -769,6 +1005,7 @@ static void write_member_file (const char * fname, char ** members,
 
 static void save_contact (struct key_info * k)
 {
+  invalidate_address_index ();
   if (k->is_deleted) {
     printf ("not saving deleted contact %s\n", k->contact_name);
     return;
@@ -1017,6 +1254,7 @@ keyset create_contact (const char * contact, int keybits, int feedback,
     } else {                 /* contact has been deleted, continue */
       preselected_index = k;
       /* free the memory used to store the previous contact */
+      pthread_mutex_lock (&name_index_mutex);
       if (ki->contact_name != NULL)
         free (ki->contact_name);
       ki->contact_name = NULL;
@@ -1026,6 +1264,8 @@ keyset create_contact (const char * contact, int keybits, int feedback,
       if (ki->members != NULL)
         free (ki->members);
       ki->members = NULL;
+      invalidate_name_index ();
+      pthread_mutex_unlock (&name_index_mutex);
     }
   }
 
@@ -1071,8 +1311,7 @@ keyset create_contact (const char * contact, int keybits, int feedback,
   else
     set_kip_size (new_contact + 1);   /* make room for the new entry */
   kip [new_contact] = new;
-  if (preselected_index < 0)          /* re-initialize the list */
-    generate_contacts ();
+  generate_contacts ();               /* re-initialize the list and index */
 
 #ifdef DEBUG_PRINT
 #ifdef HAVE_OPENSSL
@@ -1100,17 +1339,18 @@ keyset create_contact (const char * contact, int keybits, int feedback,
 int rename_contact (const char * old, const char * new)
 {
   init_from_file ("rename_contact");
-  int key;
-  for (key = 0; key < cp_used; key++) {
-    if ((! kip [key].is_deleted) && (kip [key].is_visible) &&
-        (strcmp (cpx [key], new) == 0)) {
+  pthread_mutex_lock (&name_index_mutex);
+  keyset key;
+  for (key = first_keyset (new); key >= 0; key = name_index_next [key]) {
+    if ((! kip [key].is_deleted) && (kip [key].is_visible)) {
+      pthread_mutex_unlock (&name_index_mutex);
       printf ("cannot rename %s to existing contact %s\n", old, new);
       return 0;
     }
   }
   int renamed = 0;
-  for (key = 0; key < cp_used; key++) {
-    if ((! kip [key].is_deleted) && (strcmp (cpx [key], old) == 0)) {
+  for (key = first_keyset (old); key >= 0; key = name_index_next [key]) {
+    if (! kip [key].is_deleted) {
       char * name_file_name = strcat_malloc (kip [key].dir_name, "/name",
                                              "rename_contact");
       size_t newlen = strlen (new);
@@ -1119,7 +1359,6 @@ int rename_contact (const char * old, const char * new)
         if (p != NULL) {
           strcpy (p, new);
           kip [key].contact_name = p;
-          cpx [key] = p;
           renamed = 1;
         } else {
           printf ("unable to realloc %s for %s\n", old, new);
@@ -1130,6 +1369,9 @@ int rename_contact (const char * old, const char * new)
       free (name_file_name);
     }
   }
+  if (renamed)   /* the names in cpx may have been realloc'd */
+    generate_contacts_locked ();
+  pthread_mutex_unlock (&name_index_mutex);
   return renamed;
 }
 
@@ -1141,39 +1383,18 @@ int rename_contact (const char * old, const char * new)
  * should be free'd. */
 int invisible_contacts (char *** contacts)
 {
-  init_from_file ("hidden_contacts");
-#ifdef DEBUG_PRINT
-  print_contacts ("entering hidden_contacts", 0);
-#endif /* DEBUG_PRINT */
-  int i;
-  int delta = 0;
-  char ** p = NULL;
-  if (contacts != NULL) {
-    p = malloc_copy_array_of_strings (cpx, cp_used);
-    *contacts = p;
-  }
-  for (i = 0; i < cp_used; i++) {
-    if ((kip [i].is_deleted) || (kip [i].is_visible)) {  /* skip */
-      delta++;
-    } else {
-      if ((delta > 0) && (p != NULL))  /* make p[i-delta] valid */
-        p [i - delta] = p [i];
-         /* note: delta increases at most once per loop,
-            so i >= delta >= 0 and i >= i - delta >= 0 */
-    }
-  }
-  return cp_used - delta;
+  return all_contacts_implementation (contacts, LIST_INVISIBLE);
 }
 
 /* make_in/visible return 1 for success, 0 if not successful */
 int make_invisible (const char * contact)
 {
   init_from_file ("make_invisible");
-  int key;
+  keyset key;
   int hidden = 0;
-  for (key = 0; key < cp_used; key++) {
-    if ((! kip [key].is_deleted) && (kip [key].is_visible) &&
-        (strcmp (cpx [key], contact) == 0)) {
+  pthread_mutex_lock (&name_index_mutex);
+  for (key = first_keyset (contact); key >= 0; key = name_index_next [key]) {
+    if ((! kip [key].is_deleted) && (kip [key].is_visible)) {
       char * file_name =
         strcat_malloc (kip [key].dir_name, "/hidden", "make_invisible");
       write_file (file_name, "", 0, 0);  /* create the file */
@@ -1184,16 +1405,20 @@ int make_invisible (const char * contact)
       hidden = 1;
     }
   }
+  pthread_mutex_unlock (&name_index_mutex);
   return hidden;
 }
 
 int make_visible (const char * contact)
 {
   init_from_file ("make_visible");
-  int key;
-  for (key = 0; key < cp_used; key++) {
-    if ((! kip [key].is_deleted) && (kip [key].is_visible) &&
-        (strcmp (cpx [key], contact) == 0)) {
+  keyset first;
+  keyset key;
+  pthread_mutex_lock (&name_index_mutex);
+  first = first_keyset (contact);
+  for (key = first; key >= 0; key = name_index_next [key]) {
+    if ((! kip [key].is_deleted) && (kip [key].is_visible)) {
+      pthread_mutex_unlock (&name_index_mutex);
 #ifdef DEBUG_PRINT
       printf ("unable to unhide contact %s, already visible\n", contact);
 #endif /* DEBUG_PRINT */
@@ -1201,9 +1426,8 @@ int make_visible (const char * contact)
     }
   }
   int success = 0;
-  for (key = 0; key < cp_used; key++) {
-    if ((! kip [key].is_visible) && (! kip [key].is_deleted) &&
-        (strcmp (cpx [key], contact) == 0)) {
+  for (key = first; key >= 0; key = name_index_next [key]) {
+    if ((! kip [key].is_visible) && (! kip [key].is_deleted)) {
       char * file_name =
         strcat_malloc (kip [key].dir_name, "/hidden", "make_visible");
  /* remove .allnet/contacts/x/hidden, if any */
@@ -1217,6 +1441,7 @@ int make_visible (const char * contact)
       free (file_name);
     }
   }
+  pthread_mutex_unlock (&name_index_mutex);
   return success;
 }
 
@@ -1224,28 +1449,28 @@ int make_visible (const char * contact)
 int is_visible (const char * contact)
 {
   init_from_file ("is_visible");
-  int key;
-  for (key = 0; key < cp_used; key++) {
-    if ((! kip [key].is_deleted) && (kip [key].is_visible) &&
-        (strcmp (cpx [key], contact) == 0)) {
-      return 1;
-    }
-  }
-  return 0;  /* is invisible, or deleted, or does not exist */
+  int result = 0;  /* is invisible, or deleted, or does not exist */
+  keyset key;
+  pthread_mutex_lock (&name_index_mutex);
+  for (key = first_keyset (contact); key >= 0; key = name_index_next [key])
+    if ((! kip [key].is_deleted) && (kip [key].is_visible))
+      result = 1;
+  pthread_mutex_unlock (&name_index_mutex);
+  return result;
 }
 
 /* returns 1 if the contact exists and is not visible */
 int is_invisible (const char * contact)
 {
   init_from_file ("is_invisible");
-  int key;
-  for (key = 0; key < cp_used; key++) {
-    if ((! kip [key].is_deleted) && (! kip [key].is_visible) &&
-        (strcmp (cpx [key], contact) == 0)) {
-      return 1;
-    }
-  }
-  return 0;  /* is visible, or deleted, or does not exist */
+  int result = 0;  /* is visible, or deleted, or does not exist */
+  keyset key;
+  pthread_mutex_lock (&name_index_mutex);
+  for (key = first_keyset (contact); key >= 0; key = name_index_next [key])
+    if ((! kip [key].is_deleted) && (! kip [key].is_visible))
+      result = 1;
+  pthread_mutex_unlock (&name_index_mutex);
+  return result;
 }
 
 /* notice -- moving keys around causes existing keysets to be invalidated
@@ -1259,19 +1484,37 @@ int delete_contact (const char * contact)
 {
   init_from_file ("delete_contact");
   int result = 0;
-  int key;
-  for (key = 0; key < cp_used; key++) {
-    if ((! kip [key].is_deleted) && (strcmp (cpx [key], contact) == 0)) {
+  keyset key;
+  pthread_mutex_lock (&name_index_mutex);
+  for (key = first_keyset (contact); key >= 0; key = name_index_next [key]) {
+    if (! kip [key].is_deleted) {
       /* for now, only actually delete contacts that are hidden */
       if (! kip [key].is_visible) {
         rmdir_and_all_files (kip [key].dir_name);
         kip [key].is_deleted = 1;
+        invalidate_address_index ();
         result = 1;
       } else {
-        return 0;
+        result = 0;
+        break;
       }
     }
   }
+  pthread_mutex_unlock (&name_index_mutex);
+  return result;
+}
+
+/* returns the first keyset of the contact that is not deleted, or -1 */
+static keyset live_keyset (const char * contact)
+{
+  keyset result = -1;
+  keyset key;
+  pthread_mutex_lock (&name_index_mutex);
+  for (key = first_keyset (contact); (key >= 0) && (result < 0);
+       key = name_index_next [key])
+    if (! kip [key].is_deleted)
+      result = key;
+  pthread_mutex_unlock (&name_index_mutex);
   return result;
 }
 
@@ -1281,15 +1524,13 @@ int delete_contact (const char * contact)
 int contact_file_get (const char * contact, const char * fname, char ** content)
 {
   init_from_file ("contact_file_get");
-  int key;
-  for (key = 0; key < cp_used; key++) {
-    if ((! kip [key].is_deleted) && (strcmp (cpx [key], contact) == 0)) {
-      char * path = strcat3_malloc (kip [key].dir_name, "/", fname,
-                                    "contact_file_get");
-      int result = read_file_malloc (path, content, 0);
-      free (path);
-      return result;
-    }
+  keyset key = live_keyset (contact);
+  if (key >= 0) {
+    char * path = strcat3_malloc (kip [key].dir_name, "/", fname,
+                                  "contact_file_get");
+    int result = read_file_malloc (path, content, 0);
+    free (path);
+    return result;
   }
   if (content != NULL)
     *content = NULL;
@@ -1301,15 +1542,13 @@ int contact_file_write (const char * contact, const char * fname,
                         const char * content, int clength)
 {
   init_from_file ("contact_file_write");
-  int key;
-  for (key = 0; key < cp_used; key++) {
-    if ((! kip [key].is_deleted) && (strcmp (cpx [key], contact) == 0)) {
-      char * path = strcat3_malloc (kip [key].dir_name, "/", fname,
-                                    "contact_file_write");
-      int result = write_file (path, content, clength, 0);
-      free (path);
-      return result;
-    }
+  keyset key = live_keyset (contact);
+  if (key >= 0) {
+    char * path = strcat3_malloc (kip [key].dir_name, "/", fname,
+                                  "contact_file_write");
+    int result = write_file (path, content, clength, 0);
+    free (path);
+    return result;
   }
   return 0;  /* contact not found */
 }
@@ -1318,17 +1557,15 @@ int contact_file_write (const char * contact, const char * fname,
 int contact_file_delete (const char * contact, const char * fname)
 {
   init_from_file ("contact_file_delete");
-  int key;
-  for (key = 0; key < cp_used; key++) {
-    if ((! kip [key].is_deleted) && (strcmp (cpx [key], contact) == 0)) {
-      char * path = strcat3_malloc (kip [key].dir_name, "/", fname,
-                                    "contact_file_delete");
-      int result = unlink (path);
-      free (path);
-      if (result < 0)
-        return 0;
-      return 1;  /* success */
-    }
+  keyset key = live_keyset (contact);
+  if (key >= 0) {
+    char * path = strcat3_malloc (kip [key].dir_name, "/", fname,
+                                  "contact_file_delete");
+    int result = unlink (path);
+    free (path);
+    if (result < 0)
+      return 0;
+    return 1;  /* success */
   }
   return 0;  /* contact not found */
 }
@@ -1362,14 +1599,14 @@ int create_spare_key (int keybits, char * random, int rsize)
 /* deleting a group does not delete the members of the group. */
 int is_group (const char * contact)   
 {
-  int ki;
-  for (ki = 0; ki < num_key_infos; ki++) {
-    if ((! kip [ki].is_deleted) &&
-        (kip [ki].is_group) &&
-        (strcmp (kip [ki].contact_name, contact) == 0))
-      return 1;
-  }
-  return 0;
+  int result = 0;
+  keyset ki;
+  pthread_mutex_lock (&name_index_mutex);
+  for (ki = first_keyset (contact); ki >= 0; ki = name_index_next [ki])
+    if ((! kip [ki].is_deleted) && (kip [ki].is_group))
+      result = 1;
+  pthread_mutex_unlock (&name_index_mutex);
+  return result;
 }
 
 /* group creation succeeds iff there is no prior contact or group
@@ -1450,14 +1687,19 @@ static int reload_members_from_file (int ki)
     mlen = 0;
   free (fname);
   if (result) {
-    if ((kip [ki].num_group_members > 0) && (kip [ki].members != NULL))
-      free (kip [ki].members); /* throw away the in-memory info */
     char ** members_list = NULL;
     int mcount = 0;
     if (mlen > 0)
       mcount = get_members (members_content, mlen, &members_list);
+    /* all_keys and the like may be walking the old members */
+    pthread_mutex_lock (&name_index_mutex);
+    char ** old_members = kip [ki].members;
+    int old_count = kip [ki].num_group_members;
     kip [ki].num_group_members = mcount;
     kip [ki].members = members_list;
+    pthread_mutex_unlock (&name_index_mutex);
+    if ((old_count > 0) && (old_members != NULL))
+      free (old_members); /* throw away the in-memory info */
   }
   if (members_content != NULL)
     free (members_content);
@@ -1843,31 +2085,30 @@ int group_contacts (const char * group, char *** members)
 /* recursively (up to max depth) count keysets for groups */
 /* return -1 if a recursive loop is detected, as indicated by max_depth <= 0 */
 /* if keysets is not null, assign up to the first num_keysets */
+/* called with name_index_mutex held */
 static int recursive_num_keysets (const char * contact, int max_depth,
                                   keyset * keysets, int num_keysets)
 {
   if (max_depth <= 0)
     return -1;
-  int i;
+  keyset i;
   int count = 0;
-  for (i = 0; i < num_key_infos; i++) {
-    if ((kip [i].contact_name != NULL) &&
-        (strcmp (kip [i].contact_name, contact) == 0)) {
-      if ((! kip [i].is_group) || (kip [i].num_group_members < 0)) {
-        /* not a group */
-        if ((keysets != NULL) && (num_keysets > count))
-          keysets [count] = i;
-        count++;
-      } else {  /* recursively count each member's keys */
-        int m;
-        for (m = 0; m < kip [i].num_group_members; m++) {
-          int result =
-            recursive_num_keysets (kip [i].members [m], max_depth - 1,
-                                   keysets + count, num_keysets - count);
-          if (result < 0)
-            return result;
-          count += result;
-        }
+  for (i = first_keyset (contact); i >= 0; i = name_index_next [i]) {
+    if ((! kip [i].is_group) || (kip [i].num_group_members < 0)) {
+      /* not a group */
+      if ((keysets != NULL) && (num_keysets > count))
+        keysets [count] = i;
+      count++;
+    } else {  /* recursively count each member's keys */
+      int m;
+      for (m = 0; m < kip [i].num_group_members; m++) {
+        int result =
+          recursive_num_keysets (kip [i].members [m], max_depth - 1,
+                                 ((keysets == NULL) ? NULL :
+                                  (keysets + count)), num_keysets - count);
+        if (result < 0)
+          return result;
+        count += result;
       }
     }
   }
@@ -1882,15 +2123,14 @@ static int recursive_num_keysets (const char * contact, int max_depth,
 
 /* count keysets -- same as above, but returns 0 for groups */
 /* if keysets is not null, assign up to the first num_keysets */
+/* called with name_index_mutex held */
 static int plain_num_keysets (const char * contact,
                               keyset * keysets, int num_keysets)
 {
-  int i;
+  keyset i;
   int count = 0;
-  for (i = 0; i < num_key_infos; i++) {
-    if ((kip [i].contact_name != NULL) &&
-        (strcmp (kip [i].contact_name, contact) == 0) &&
-        (! kip [i].is_group)) {
+  for (i = first_keyset (contact); i >= 0; i = name_index_next [i]) {
+    if (! kip [i].is_group) {
       if ((keysets != NULL) && (num_keysets > count))
         keysets [count] = i;
       count++;
@@ -1900,23 +2140,34 @@ static int plain_num_keysets (const char * contact,
 }
 #endif /* RECURSIVELY_INCLUDE_GROUP_KEYS */
 
-/* returns -1 if the contact does not exist, and 0 or more otherwise */
-int num_keysets (const char * contact)
+/* returns -1 if the contact does not exist, otherwise the number of
+ * keysets, of which up to the first num_keysets are assigned to keysets
+ * called with name_index_mutex held */
+static int indexed_keysets (const char * contact,
+                            keyset * keysets, int num_keysets)
 {
-  init_from_file ("num_keysets");
-  keyset k_plus_one = contact_exists (contact);
-  if (k_plus_one <= 0)
-    return -1;
-  keyset k = k_plus_one - 1;
-  if (! valid_keyset (k))
+  if (first_keyset (contact) < 0)
     return -1;
 #ifdef RECURSIVELY_INCLUDE_GROUP_KEYS
-  return recursive_num_keysets (contact, num_key_infos + 1, NULL, 0);
+  return recursive_num_keysets (contact, num_key_infos + 1,
+                                keysets, num_keysets);
 #else /* ! RECURSIVELY_INCLUDE_GROUP_KEYS */
-  return plain_num_keysets (contact, NULL, 0);
+  return plain_num_keysets (contact, keysets, num_keysets);
 #endif /* RECURSIVELY_INCLUDE_GROUP_KEYS */
 }
 
+/* returns -1 if the contact does not exist, and 0 or more otherwise */
+int num_keysets (const char * contact)
+{
+  init_from_file ("num_keysets");
+  int result = -1;
+  pthread_mutex_lock (&name_index_mutex);
+  if (valid_keyset (first_keyset (contact)))
+    result = indexed_keysets (contact, NULL, 0);
+  pthread_mutex_unlock (&name_index_mutex);
+  return result;
+}
+
 /* returns the number of keysets.
  * malloc's a new keysets (must be free'd) and fills it with the keysets. */
 /* returns -1 if the contact does not exist */
@@ -1927,27 +2178,27 @@ int all_keys (const char * contact, keyset ** keysets)
   print_contacts ("entering all_keys", 0);
 #endif /* DEBUG_PRINT */
 
-  if (! contact_exists (contact))
-    return -1;
-#ifdef RECURSIVELY_INCLUDE_GROUP_KEYS
-  int count = recursive_num_keysets (contact, num_key_infos + 1, NULL, 0);
-#else /* ! RECURSIVELY_INCLUDE_GROUP_KEYS */
-  int count = plain_num_keysets (contact, NULL, 0);
-#endif /* RECURSIVELY_INCLUDE_GROUP_KEYS */
-
-  if ((keysets == NULL) || (count <= 0)) {
+  if (keysets != NULL)
     *keysets = NULL;
-    return count;
+  pthread_mutex_lock (&name_index_mutex);
+  int count = indexed_keysets (contact, NULL, 0);
+  if ((keysets != NULL) && (count > 0)) {
+    *keysets = malloc_or_fail (count * sizeof (keyset), "all_keys");
+    int copied = indexed_keysets (contact, *keysets, count);
+    assert (copied == count);
   }
+  pthread_mutex_unlock (&name_index_mutex);
+  return count;
+}
 
-  *keysets = malloc_or_fail (count * sizeof (keyset), "all_keys");
-#ifdef RECURSIVELY_INCLUDE_GROUP_KEYS
-  int copied = recursive_num_keysets (contact, num_key_infos + 1,
-                                      *keysets, count);
-#else /* ! RECURSIVELY_INCLUDE_GROUP_KEYS */
-  int copied = plain_num_keysets (contact, *keysets, count);
-#endif /* RECURSIVELY_INCLUDE_GROUP_KEYS */
-  assert (copied == count);
+/* same as all_keys, but fills in up to the first max keysets of the
+ * caller's array instead of allocating one */
+int contact_keysets (const char * contact, keyset * keysets, int max)
+{
+  init_from_file ("contact_keysets");
+  pthread_mutex_lock (&name_index_mutex);
+  int count = indexed_keysets (contact, keysets, ((keysets == NULL) ? 0 : max));
+  pthread_mutex_unlock (&name_index_mutex);
   return count;
 }
 
@@ -2035,6 +2286,54 @@ unsigned int get_remote (keyset k, unsigned char * address)
   return kip [k].remote.nbits;
 }
 
+/* the keysets in list that match the source and destination */
+static int add_matching_keysets (int list,
+                                 const unsigned char * source, int sbits,
+                                 const unsigned char * dest, int dbits,
+                                 keyset * result, int count)
+{
+  keyset k;
+  for (k = address_index [list]; k >= 0; k = address_index_next [k])
+    if ((address_matches (source, sbits, &(kip [k].remote))) &&
+        (address_matches (dest, dbits, &(kip [k].local))))
+      result [count++] = k;
+  return count;
+}
+
+int keysets_matching_addresses (const unsigned char * source, int sbits,
+                                const unsigned char * dest, int dbits,
+                                keyset ** keysets)
+{
+  init_from_file ("keysets_matching_addresses");
+  *keysets = NULL;
+  if (source == NULL)
+    sbits = 0;
+  pthread_mutex_lock (&address_index_mutex);
+  build_address_index ();
+  keyset * result = NULL;
+  if (num_key_infos > 0)
+    result = malloc_or_fail (num_key_infos * sizeof (keyset),
+                             "keysets_matching_addresses");
+  int count = 0;
+  if (sbits >= 8) {
+    count = add_matching_keysets (source [0], source, sbits, dest, dbits,
+                                  result, count);
+    count = add_matching_keysets (ADDRESS_INDEX_SHORT, source, sbits,
+                                  dest, dbits, result, count);
+  } else {  /* any list might match */
+    int list;
+    for (list = 0; list < ADDRESS_INDEX_LISTS; list++)
+      count = add_matching_keysets (list, source, sbits, dest, dbits,
+                                    result, count);
+  }
+  pthread_mutex_unlock (&address_index_mutex);
+  if (count > 0)
+    *keysets = result;
+  else if (result != NULL)
+    free (result);
+  return count;
+}
+
 /* returnes a malloc'd copy of the contact name, or NULL for errors */
 char * get_contact_name (keyset k)
 {
@@ -21,6 +21,10 @@ typedef int keyset;  /* opaque type, do not access directly */
 /* returns 0 or more */
 extern int num_contacts (void);
 
+/* returns a number that changes whenever a contact is created or deleted,
+ * or a contact's keys or addresses change */
+extern int contact_key_changes (void);
+
 /* returns the number of contacts, and (if not NULL) has contacts point
  * to a dynamically allocated array of pointers to null-terminated
  * contact names (to free, call free (*contacts)). */
@@ -28,6 +32,14 @@ extern int all_contacts (char *** contacts);
 /* same, but only individual contacts, not groups */
 extern int all_individual_contacts (char *** contacts);
 
+/* iterate over the contacts without allocating an array: set *iter to 0,
+ * *name to NULL and *nsize to 0, then call until the result is 0.
+ * Each call copies the next contact name (the same names all_contacts
+ * or all_individual_contacts would return) into *name, which is
+ * reallocated as needed and *nsize updated.  When done, free (*name). */
+extern int next_contact (int * iter, char ** name, int * nsize);
+extern int next_individual_contact (int * iter, char ** name, int * nsize);
+
 /* returns the keyset if successful, -1 if the contact already existed
  * creates a new private/public key pair, and if not NULL, also 
  * the contact public key, local and remote addresses
@@ -122,6 +134,9 @@ extern int num_keysets (const char * contact);
  * malloc's a new keysets (must be free'd) and fills it with the keysets. */
 /* returns -1 if the contact does not exist */
 extern int all_keys (const char * contact, keyset ** keysets);
+/* same, but fills in up to the first max keysets of the caller's array.
+ * The result may be more than max, in which case only max are assigned */
+extern int contact_keysets (const char * contact, keyset * keysets, int max);
 
 /* returns a pointer to a dynamically allocated (must be free'd).
  * name for the directory corresponding to this key. */
@@ -147,6 +162,14 @@ extern unsigned int get_my_privkey     (keyset k, allnet_rsa_prvkey * key);
 /* address must have length at least ADDRESS_SIZE */
 extern unsigned int get_local (keyset k, unsigned char * address);
 extern unsigned int get_remote (keyset k, unsigned char * address);
+/* returns the number of keysets of individual contacts whose remote address
+ * matches the source and whose local address matches the destination,
+ * where an address with 0 bits matches any address.  Uses an index by
+ * remote address, so is faster than calling get_remote for every keyset.
+ * if the result is > 0, malloc's *keysets (must be free'd) */
+extern int keysets_matching_addresses (const unsigned char * source, int sbits,
+                                       const unsigned char * dest, int dbits,
+                                       keyset ** keysets);
 /* returnes a malloc'd copy of the contact name, or NULL for errors */
 extern char * get_contact_name (keyset k);
 
@@ -0,0 +1,401 @@
+/* metrics.c: counters and latency histograms that are cheap to update */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdarg.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "metrics.h"
+#include "util.h"
+#include "ai.h"
+
+/* histogram buckets are log-linear, as in HDR histograms: values below
+ * 16 each have their own bucket, and every larger power of two is
+ * divided into 8 buckets, so a value is known to within 12.5% */
+#define METRICS_SUB_BITS	3
+#define METRICS_SUB_BUCKETS	(1 << METRICS_SUB_BITS)
+#define METRICS_EXACT		(2 * METRICS_SUB_BUCKETS)   /* 16 */
+#define METRICS_BUCKETS		\
+  (METRICS_EXACT + (64 - (METRICS_SUB_BITS + 1)) * METRICS_SUB_BUCKETS)
+
+struct metrics_hist {
+  uint64_t count;
+  uint64_t sum;
+  uint64_t max;
+  uint64_t buckets [METRICS_BUCKETS];
+};
+
+/* the metrics updated by one thread */
+struct metrics_thread {
+  uint64_t counters [METRICS_MAX_COUNTERS];
+  struct metrics_hist hists [METRICS_MAX_HISTOGRAMS];
+  struct metrics_thread * next;
+};
+
+#define METRICS_MAX_REPORTERS	8
+
+/* the mutex protects the names, the list of threads, retired, and the
+ * reporters.  It is not needed to update the metrics of a thread */
+static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+static char * counter_names [METRICS_MAX_COUNTERS];
+static int num_counters = 0;
+static char * histogram_names [METRICS_MAX_HISTOGRAMS];
+static int num_histograms = 0;
+static struct metrics_thread * threads = NULL;
+/* the sum of the metrics of threads that have exited */
+static struct metrics_thread retired;
+static metrics_reporter reporters [METRICS_MAX_REPORTERS];
+static void * reporter_refs [METRICS_MAX_REPORTERS];
+static int num_reporters = 0;
+
+static pthread_once_t key_once = PTHREAD_ONCE_INIT;
+static pthread_key_t thread_key;
+static __thread struct metrics_thread * mine = NULL;
+
+static void add_thread_metrics (struct metrics_thread * to,
+                                const struct metrics_thread * from)
+{
+  int i;
+  for (i = 0; i < METRICS_MAX_COUNTERS; i++)
+    to->counters [i] += from->counters [i];
+  for (i = 0; i < METRICS_MAX_HISTOGRAMS; i++) {
+    const struct metrics_hist * f = from->hists + i;
+    struct metrics_hist * t = to->hists + i;
+    if (f->count == 0)
+      continue;
+    t->count += f->count;
+    t->sum += f->sum;
+    if (f->max > t->max)
+      t->max = f->max;
+    int b;
+    for (b = 0; b < METRICS_BUCKETS; b++)
+      t->buckets [b] += f->buckets [b];
+  }
+}
+
+/* called when a thread that has updated metrics exits */
+static void retire_thread (void * arg)
+{
+  struct metrics_thread * mt = (struct metrics_thread *) arg;
+  pthread_mutex_lock (&mutex);
+  add_thread_metrics (&retired, mt);
+  struct metrics_thread ** p = &threads;
+  while ((*p != NULL) && (*p != mt))
+    p = &((*p)->next);
+  if (*p == mt)
+    *p = mt->next;
+  pthread_mutex_unlock (&mutex);
+  free (mt);
+}
+
+static void create_key ()
+{
+  pthread_key_create (&thread_key, retire_thread);
+}
+
+static struct metrics_thread * thread_metrics ()
+{
+  if (mine != NULL)
+    return mine;
+  pthread_once (&key_once, create_key);
+  /* calloc, so pages of histograms that are never used are not touched */
+  struct metrics_thread * mt = calloc (1, sizeof (struct metrics_thread));
+  if (mt == NULL)
+    return NULL;
+  pthread_mutex_lock (&mutex);
+  mt->next = threads;
+  threads = mt;
+  pthread_mutex_unlock (&mutex);
+  pthread_setspecific (thread_key, mt);
+  mine = mt;
+  return mt;
+}
+
+static int register_name (char ** names, int * count, int max,
+                          const char * name)
+{
+  pthread_mutex_lock (&mutex);
+  int i;
+  for (i = 0; i < *count; i++) {
+    if (strcmp (names [i], name) == 0) {
+      pthread_mutex_unlock (&mutex);
+      return i;
+    }
+  }
+  int result = -1;
+  if (*count < max) {
+    result = *count;
+    names [result] = strcpy_malloc (name, "metrics name");
+    *count = result + 1;
+  } else {
+    printf ("too many metrics, unable to register %s\n", name);
+  }
+  pthread_mutex_unlock (&mutex);
+  return result;
+}
+
+int metrics_counter (const char * name)
+{
+  return register_name (counter_names, &num_counters, METRICS_MAX_COUNTERS,
+                        name);
+}
+
+int metrics_histogram (const char * name)
+{
+  return register_name (histogram_names, &num_histograms,
+                        METRICS_MAX_HISTOGRAMS, name);
+}
+
+void metrics_add (int counter, unsigned long long int n)
+{
+  if ((counter < 0) || (counter >= METRICS_MAX_COUNTERS))
+    return;
+  struct metrics_thread * mt = thread_metrics ();
+  if (mt != NULL)
+    mt->counters [counter] += n;
+}
+
+static int highest_bit (uint64_t value)   /* value must be nonzero */
+{
+#if defined(__GNUC__)
+  return 63 - __builtin_clzll (value);
+#else /* ! __GNUC__ */
+  int result = 0;
+  while (value >>= 1)
+    result++;
+  return result;
+#endif /* __GNUC__ */
+}
+
+static int bucket_index (uint64_t value)
+{
+  if (value < METRICS_EXACT)
+    return (int) value;
+  int e = highest_bit (value);      /* at least METRICS_SUB_BITS + 1 */
+  int sub = (int) ((value >> (e - METRICS_SUB_BITS)) &
+                   (METRICS_SUB_BUCKETS - 1));
+  return METRICS_EXACT + (e - (METRICS_SUB_BITS + 1)) * METRICS_SUB_BUCKETS +
+         sub;
+}
+
+/* the middle of the range of values counted in this bucket */
+static uint64_t bucket_value (int index)
+{
+  if (index < METRICS_EXACT)
+    return index;
+  int e = (index - METRICS_EXACT) / METRICS_SUB_BUCKETS +
+          (METRICS_SUB_BITS + 1);
+  int sub = (index - METRICS_EXACT) % METRICS_SUB_BUCKETS;
+  uint64_t low = ((uint64_t) (METRICS_SUB_BUCKETS + sub)) <<
+                 (e - METRICS_SUB_BITS);
+  uint64_t width = ((uint64_t) 1) << (e - METRICS_SUB_BITS);
+  return low + width / 2;
+}
+
+void metrics_record (int histogram, unsigned long long int value)
+{
+  if ((histogram < 0) || (histogram >= METRICS_MAX_HISTOGRAMS))
+    return;
+  struct metrics_thread * mt = thread_metrics ();
+  if (mt == NULL)
+    return;
+  struct metrics_hist * h = mt->hists + histogram;
+  h->count++;
+  h->sum += value;
+  if (value > h->max)
+    h->max = value;
+  h->buckets [bucket_index (value)]++;
+}
+
+unsigned long long int metrics_now_ns ()
+{
+  struct timespec ts;
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return ((unsigned long long int) ts.tv_sec) * 1000000000ULL + ts.tv_nsec;
+}
+
+void metrics_add_reporter (metrics_reporter f, void * ref)
+{
+  pthread_mutex_lock (&mutex);
+  if (num_reporters < METRICS_MAX_REPORTERS) {
+    reporters [num_reporters] = f;
+    reporter_refs [num_reporters] = ref;
+    num_reporters++;
+  }
+  pthread_mutex_unlock (&mutex);
+}
+
+/* the value below which the given fraction of the values fall */
+static uint64_t percentile (const struct metrics_hist * h, double fraction)
+{
+  uint64_t goal = (uint64_t) (h->count * fraction);
+  if (goal >= h->count)
+    goal = h->count - 1;
+  uint64_t seen = 0;
+  int b;
+  for (b = 0; b < METRICS_BUCKETS; b++) {
+    seen += h->buckets [b];
+    if (seen > goal) {
+      uint64_t value = bucket_value (b);
+      return ((value > h->max) ? h->max : value);
+    }
+  }
+  return h->max;
+}
+
+/* adds one line to buffer, if it fits */
+static void add_line (char * buffer, int bsize, int * off,
+                      const char * format, ...)
+{
+  char line [1000];
+  va_list ap;
+  va_start (ap, format);
+  int n = vsnprintf (line, sizeof (line), format, ap);
+  va_end (ap);
+  if ((n > 0) && (n < (int) sizeof (line)) && (*off + n < bsize)) {
+    memcpy (buffer + *off, line, n + 1);
+    *off += n;
+  }
+}
+
+int metrics_to_string (char * buffer, int bsize)
+{
+  if (bsize <= 0)
+    return 0;
+  buffer [0] = '\0';
+  struct metrics_thread * sum =
+    malloc_or_fail (sizeof (struct metrics_thread), "metrics_to_string");
+  pthread_mutex_lock (&mutex);
+  /* the threads keep updating their metrics while we add them up, so
+   * the totals may include some, but not all, of the concurrent updates */
+  memcpy (sum, &retired, sizeof (struct metrics_thread));
+  struct metrics_thread * mt;
+  for (mt = threads; mt != NULL; mt = mt->next)
+    add_thread_metrics (sum, mt);
+  int nc = num_counters;
+  int nh = num_histograms;
+  int nr = num_reporters;
+  metrics_reporter rfuns [METRICS_MAX_REPORTERS];
+  void * rrefs [METRICS_MAX_REPORTERS];
+  memcpy (rfuns, reporters, sizeof (rfuns));
+  memcpy (rrefs, reporter_refs, sizeof (rrefs));
+  int off = 0;
+  int i;
+  for (i = 0; i < nc; i++)
+    add_line (buffer, bsize, &off, "counter %s %llu\n", counter_names [i],
+              (unsigned long long int) sum->counters [i]);
+  for (i = 0; i < nh; i++) {
+    const struct metrics_hist * h = sum->hists + i;
+    if (h->count == 0) {
+      add_line (buffer, bsize, &off, "histogram %s count 0\n",
+                histogram_names [i]);
+      continue;
+    }
+    add_line (buffer, bsize, &off,
+              "histogram %s count %llu mean %llu p50 %llu p90 %llu "
+              "p99 %llu p99.9 %llu max %llu\n", histogram_names [i],
+              (unsigned long long int) h->count,
+              (unsigned long long int) (h->sum / h->count),
+              (unsigned long long int) percentile (h, 0.5),
+              (unsigned long long int) percentile (h, 0.9),
+              (unsigned long long int) percentile (h, 0.99),
+              (unsigned long long int) percentile (h, 0.999),
+              (unsigned long long int) h->max);
+  }
+  pthread_mutex_unlock (&mutex);
+  free (sum);
+  /* the reporters are called without the lock, so they may use metrics */
+  for (i = 0; i < nr; i++) {
+    int n = rfuns [i] (buffer + off, bsize - off, rrefs [i]);
+    if ((n > 0) && (off + n < bsize))
+      off += n;
+    buffer [off] = '\0';
+  }
+  return off;
+}
+
+#define METRICS_DATAGRAM	8192
+#define METRICS_BUFFER		(1024 * 1024)
+
+/* send the metrics in datagrams that each end with a complete line */
+static void send_metrics (int sock, const char * text, int tsize,
+                          struct sockaddr_storage * sas, socklen_t alen)
+{
+  int off = 0;
+  while (off < tsize) {
+    int n = tsize - off;
+    if (n > METRICS_DATAGRAM) {
+      n = METRICS_DATAGRAM;
+      while ((n > 0) && (text [off + n - 1] != '\n'))
+        n--;
+      if (n == 0)   /* a line longer than a datagram, send it anyway */
+        n = METRICS_DATAGRAM;
+    }
+    sendto (sock, text + off, n, 0, (struct sockaddr *) sas, alen);
+    off += n;
+  }
+  sendto (sock, text, 0, 0, (struct sockaddr *) sas, alen);  /* the end */
+}
+
+static void * metrics_server_thread (void * arg)
+{
+  int sock = * ((int *) arg);
+  free (arg);
+  char * text = malloc_or_fail (METRICS_BUFFER, "metrics server");
+  while (1) {
+    char request [100];
+    struct sockaddr_storage sas;
+    socklen_t alen = sizeof (sas);
+    ssize_t n = recvfrom (sock, request, sizeof (request), 0,
+                          (struct sockaddr *) (&sas), &alen);
+    if (n < 0) {
+      perror ("metrics recvfrom");
+      break;
+    }
+    /* the socket is bound to the loopback address, but check anyway */
+    if (! is_loopback_ip ((struct sockaddr *) (&sas), alen))
+      continue;
+    int tsize = metrics_to_string (text, METRICS_BUFFER);
+    send_metrics (sock, text, tsize, &sas, alen);
+  }
+  free (text);
+  close (sock);
+  return NULL;
+}
+
+int metrics_start_server (int port)
+{
+  int sock = socket (AF_INET, SOCK_DGRAM, 0);
+  if (sock < 0) {
+    perror ("metrics socket");
+    return 0;
+  }
+  struct sockaddr_in sin;
+  memset (&sin, 0, sizeof (sin));
+  sin.sin_family = AF_INET;
+  sin.sin_addr.s_addr = htonl (INADDR_LOOPBACK);
+  sin.sin_port = htons (port);
+  if (bind (sock, (struct sockaddr *) (&sin), sizeof (sin)) != 0) {
+    perror ("metrics bind");
+    close (sock);
+    return 0;
+  }
+  int * arg = malloc_or_fail (sizeof (int), "metrics_start_server");
+  *arg = sock;
+  pthread_t thread;
+  if (pthread_create (&thread, NULL, metrics_server_thread, arg) != 0) {
+    perror ("pthread_create metrics");
+    free (arg);
+    close (sock);
+    return 0;
+  }
+  pthread_detach (thread);
+  return 1;
+}
@@ -0,0 +1,66 @@
+/* metrics.h: counters and latency histograms that are cheap to update */
+
+#ifndef ALLNET_METRICS_H
+#define ALLNET_METRICS_H
+
+/* allnetd answers metrics requests sent to this port on the loopback
+ * address (see metrics_start_server) */
+#define ALLNET_METRICS_PORT	0xa11d  /* ALLnet Daemon metrics, 41245 */
+
+#define METRICS_MAX_COUNTERS	256
+#define METRICS_MAX_HISTOGRAMS	32
+
+/* counters and histograms are registered by name, and registering a
+ * name again returns the same id.  Returns -1 if there are already
+ * METRICS_MAX_COUNTERS (or METRICS_MAX_HISTOGRAMS) names.
+ * Names should not have spaces, and histogram names should end with
+ * the unit of the values recorded, e.g. "pcache.gc_ns" */
+extern int metrics_counter (const char * name);
+extern int metrics_histogram (const char * name);
+
+/* each thread updates its own copy of the counters and histograms, so
+ * updates take no locks.  The copies are added together when printed.
+ * Updates with an id of -1 are ignored */
+extern void metrics_add (int counter, unsigned long long int n);
+extern void metrics_record (int histogram, unsigned long long int value);
+
+/* the same, for a fixed name -- the id is looked up on the first call */
+#define METRICS_COUNT(name, n)	\
+  do {	\
+    static int metrics_id_ = -1;	\
+    if (metrics_id_ < 0)	\
+      metrics_id_ = metrics_counter (name);	\
+    metrics_add (metrics_id_, (n));	\
+  } while (0)
+#define METRICS_RECORD(name, value)	\
+  do {	\
+    static int metrics_id_ = -1;	\
+    if (metrics_id_ < 0)	\
+      metrics_id_ = metrics_histogram (name);	\
+    metrics_record (metrics_id_, (value));	\
+  } while (0)
+
+/* monotonic time in nanoseconds, for timing with histograms */
+extern unsigned long long int metrics_now_ns (void);
+
+/* a reporter adds lines to the printed metrics for things that are not
+ * counters or histograms, such as the state of each peer.  It should
+ * print into buffer, at most bsize bytes, and return the number of
+ * bytes printed */
+typedef int (* metrics_reporter) (char * buffer, int bsize, void * ref);
+extern void metrics_add_reporter (metrics_reporter f, void * ref);
+
+/* prints all the metrics into buffer, one per line:
+ *   counter name value
+ *   histogram name count n mean m p50 a p90 b p99 c p99.9 d max e
+ * followed by the lines from the reporters, and returns the number of
+ * bytes printed.  Stops at the last complete line that fits */
+extern int metrics_to_string (char * buffer, int bsize);
+
+/* starts a thread that answers any datagram it receives on port of the
+ * IPv4 loopback address with the metrics, as a series of datagrams of
+ * complete lines, and then an empty datagram.
+ * Returns 1 if the thread was started, 0 otherwise */
+extern int metrics_start_server (int port);
+
+#endif /* ALLNET_METRICS_H */
@@ -173,8 +173,12 @@ struct allnet_mgmt_trace_reply {
  * spoofed IP address), or
  * a sender authenticator and a receiver authenticator
  * if we previously sent a sender authenticator to this peer, the receiver
- * authenticator should now have a copy of that earlier sender authenticator */
+ * authenticator should now have a copy of that earlier sender authenticator
+ * The first KEEPALIVE_STAMP_SIZE bytes of a sender authenticator are a
+ * stamp chosen by the sender, and the rest depend on the stamp.  Since the
+ * receiver echoes it, the sender can match replies to its keepalives */
 #define KEEPALIVE_AUTHENTICATION_SIZE	8
+#define KEEPALIVE_STAMP_SIZE		2
 struct allnet_keepalive_optional {
   char sender [KEEPALIVE_AUTHENTICATION_SIZE];
   char receiver [KEEPALIVE_AUTHENTICATION_SIZE];
@@ -7,22 +7,27 @@
    There are two main data structures, one for most messages, and one for acks.
    An auxiliary data structure tracks the tokens we have seen, and maps
    them to small integers.  All three of these data structures are
-   saved to disk.
+   saved to disk.  The messages and acks files are normally mapped into
+   memory, and only the pages that have changed are synced to disk.
    The messages data structure is a hash table indexed by message ID.
    The acks data structure is a hash table indexed by ack.
+   An in-memory secondary index over the messages table lets data
+   requests skip entries that cannot hold any matching message.
 
    When a message hash table entry is full, we do a gc to remove the
-   lowest-priority messages from each entry, until at least half of
-   that entry's storage is available.  After each g.c, we change our token.
+   lowest-priority messages from that entry, until at least half of
+   that entry's storage is available.  Each gc also collects a few more
+   entries and ack slots, so that over time every entry and slot is
+   collected.  After each complete pass over the tables, we change our token.
    In contrast, throwing away acks does not change the token.
    */
 
 /* command to compile it as a stand-alone program that prints the contents
    of the caches:
-   gcc -Wall -g -o bin/allnet-print-caches -DPRINT_CACHE_FILES src/lib/pcache.c src/lib/configfiles.c src/lib/util.c src/lib/allnet_log.c src/lib/sha.c src/lib/ai.c src/lib/pipemsg.c src/lib/allnet_queue.c src/lib/pid_bloom.c -lpthread
+   gcc -Wall -g -o bin/allnet-print-caches -DPRINT_CACHE_FILES src/lib/pcache.c src/lib/configfiles.c src/lib/util.c src/lib/allnet_log.c src/lib/sha.c src/lib/ai.c src/lib/pipemsg.c src/lib/allnet_queue.c src/lib/pid_bloom.c src/lib/metrics.c -lpthread
 
    command to compile it as a stand-alone program to test pcache_request:
-   gcc -Wall -g -o bin/allnet-test-caches -DTEST_CACHE_FILES src/lib/pcache.c src/lib/configfiles.c src/lib/util.c src/lib/allnet_log.c src/lib/sha.c src/lib/ai.c src/lib/pipemsg.c src/lib/allnet_queue.c src/lib/pid_bloom.c -lpthread
+   gcc -Wall -g -o bin/allnet-test-caches -DTEST_CACHE_FILES src/lib/pcache.c src/lib/configfiles.c src/lib/util.c src/lib/allnet_log.c src/lib/sha.c src/lib/ai.c src/lib/pipemsg.c src/lib/allnet_queue.c src/lib/pid_bloom.c src/lib/metrics.c -lpthread
 */
 
 #include <stdio.h>
@@ -33,6 +38,11 @@
 #include <inttypes.h>
 #include <pthread.h>  /* to be able to write files asynchronously */
 #include <sys/mman.h>
+#include <sys/stat.h>
+#if defined(__SSE2__) && defined(__GNUC__)
+#define PCACHE_SSE2	/* compare 16 ack tags at a time */
+#include <emmintrin.h>
+#endif /* __SSE2__ && __GNUC__ */
 
 #include "pcache.h"
 #include "pid_bloom.h"
@@ -42,6 +52,7 @@
 #include "configfiles.h"
 #include "allnet_log.h"
 #include "priority.h"
+#include "metrics.h"
 
 #ifdef COMPARE_SHA_TO_OPENSSL
 #include <openssl/sha.h>  /* for debugging */
@@ -124,6 +135,20 @@ struct tokens_file {  /* format saved on file */
 
 static struct allnet_log * alog = NULL;
 
+/* each public function holds the lock while calling the corresponding
+ * _locked function, so the cache may be used from multiple threads */
+static pthread_mutex_t pcache_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static void lock_pcache ()
+{
+  pthread_mutex_lock (&pcache_mutex);
+}
+
+static void unlock_pcache ()
+{
+  pthread_mutex_unlock (&pcache_mutex);
+}
+
 static void debug_crash (const char * message)
 {
   if ((message != NULL) && (strlen (message) > 0))
@@ -225,6 +250,138 @@ static void reinit_local_token ()
   random_bytes (local_token, ALLNET_TOKEN_SIZE);
 }
 
+#if ! defined(PRINT_CACHE_FILES) && ! defined(TEST_CACHE_FILES)
+/* the stand-alone programs only read the files, and should not map them
+ * while allnetd may be using them */
+#define PCACHE_MAP_FILES
+#endif /* ! PRINT_CACHE_FILES && ! TEST_CACHE_FILES */
+
+/* normally the message and ack tables are mapped (MAP_SHARED) from
+ * ~/.allnet/acache/messages and ~/.allnet/acache/acks, so the files
+ * are the tables, and we never read or write the whole file.
+ * Each change to a message table entry or an ack slot sets the
+ * corresponding bit in the dirty bitmap, and saving the table only
+ * msyncs the pages holding dirty entries or slots.
+ * If a file cannot be mapped, the table is malloc'd and saved by
+ * writing the whole file. */
+struct mapped_table {
+  char * base;          /* NULL if the table is not mapped */
+  size_t size;          /* in bytes */
+  size_t unit;          /* number of bytes for each bit of the dirty bitmap */
+  int num_units;
+  uint64_t * dirty;
+};
+
+static struct mapped_table mapped_messages =
+  { .base = NULL, .size = 0, .unit = 0, .num_units = 0, .dirty = NULL };
+static struct mapped_table mapped_acks =
+  { .base = NULL, .size = 0, .unit = 0, .num_units = 0, .dirty = NULL };
+
+static void unmap_table (struct mapped_table * mt)
+{
+  if (mt->base != NULL)
+    munmap (mt->base, mt->size);
+  if (mt->dirty != NULL)
+    free (mt->dirty);
+  mt->base = NULL;
+  mt->size = 0;
+  mt->num_units = 0;
+  mt->dirty = NULL;
+}
+
+/* map the given file from ~/.allnet/acache as a table of the given size.
+ * If reset is nonzero or the file has a different size, the file
+ * is cleared first.  Returns a pointer to the table, or NULL */
+static char * map_table (struct mapped_table * mt, const char * name,
+                         size_t size, size_t unit, int reset)
+{
+  unmap_table (mt);
+#ifdef PCACHE_MAP_FILES
+  int fd = open_rw_config ("acache", name, 1);
+  if (fd < 0)
+    return NULL;
+  struct stat st;
+  if ((fstat (fd, &st) != 0) || (st.st_size != (off_t) size))
+    reset = 1;
+  /* truncating, then extending, clears the file without writing each page */
+  if ((reset) && ((ftruncate (fd, 0) != 0) ||
+                  (ftruncate (fd, (off_t) size) != 0))) {
+    perror ("pcache map_table ftruncate");
+    close (fd);
+    return NULL;
+  }
+  void * p = mmap (NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close (fd);    /* the mapping remains valid */
+  if (p == MAP_FAILED) {
+    perror ("pcache map_table mmap");
+    return NULL;
+  }
+  mt->base = p;
+  mt->size = size;
+  mt->unit = unit;
+  mt->num_units = (int) ((size + unit - 1) / unit);
+  size_t dsize = ((mt->num_units + 63) / 64) * sizeof (uint64_t);
+  mt->dirty = malloc_or_fail (dsize, "pcache dirty bitmap");
+  memset (mt->dirty, 0, dsize);
+  return mt->base;
+#else /* ! PCACHE_MAP_FILES */
+  return NULL;
+#endif /* PCACHE_MAP_FILES */
+}
+
+static void mark_dirty (struct mapped_table * mt, int unit_index)
+{
+  if ((mt->dirty != NULL) && (unit_index >= 0) &&
+      (unit_index < mt->num_units))
+    mt->dirty [unit_index / 64] |= (one64 << (unit_index % 64));
+}
+
+static void entry_dirty (int eindex)
+{
+  mark_dirty (&mapped_messages, eindex);
+}
+
+static void slot_dirty (int aindex)
+{
+  mark_dirty (&mapped_acks, aindex / ACKS_PER_SLOT);
+}
+
+/* msync the pages that hold dirty units, and clear the dirty bitmap.
+ * Consecutive dirty units are synced with a single call.
+ * flags should be MS_ASYNC or MS_SYNC.  Returns the number of bytes synced */
+static size_t sync_table (struct mapped_table * mt, int flags)
+{
+  if ((mt->base == NULL) || (mt->dirty == NULL))
+    return 0;
+  size_t page = (size_t) sysconf (_SC_PAGESIZE);
+  size_t synced = 0;
+  int u = 0;
+  while (u < mt->num_units) {
+    if (mt->dirty [u / 64] == 0) {   /* skip 64 clean units at a time */
+      u = (u / 64 + 1) * 64;
+      continue;
+    }
+    if (((mt->dirty [u / 64] >> (u % 64)) & 1) == 0) {
+      u++;
+      continue;
+    }
+    int first = u;
+    while ((u < mt->num_units) && ((mt->dirty [u / 64] >> (u % 64)) & 1)) {
+      mt->dirty [u / 64] &= ~(one64 << (u % 64));
+      u++;
+    }
+    size_t start = first * mt->unit;
+    start -= (start % page);             /* msync requires page alignment */
+    size_t end = u * mt->unit;
+    if (end > mt->size)
+      end = mt->size;
+    if (msync (mt->base + start, end - start, flags) != 0)
+      perror ("pcache msync");
+    synced += end - start;
+  }
+  return synced;
+}
+
 /* either read or create ~/.allnet/acache/sizes */
 static void init_sizes ()
 {
@@ -286,6 +443,24 @@ static void init_sizes ()
 #endif /* DEBUG_PRINT */
 }
 
+static void release_message_table ()
+{
+  if (mapped_messages.base != NULL)
+    unmap_table (&mapped_messages);
+  else if (message_table != NULL)
+    free (message_table);
+  message_table = NULL;
+}
+
+static void release_ack_table ()
+{
+  if (mapped_acks.base != NULL)
+    unmap_table (&mapped_acks);
+  else if (ack_table != NULL)
+    free (ack_table);
+  ack_table = NULL;
+}
+
 static void initialize_acks_from_scratch ()
 {
   if (num_acks < 100)
@@ -294,8 +469,14 @@ static void initialize_acks_from_scratch ()
     num_acks -= (num_acks % ACKS_PER_SLOT);
   size_t asize = num_acks * sizeof (struct hash_ack_entry);
   assert (((asize / sizeof (struct hash_ack_entry)) % ACKS_PER_SLOT) == 0);
-  ack_table = malloc_or_fail (asize, "pcache default ack");
-  memset (ack_table, 0, asize);
+  release_ack_table ();
+  ack_table = (struct hash_ack_entry *)
+    map_table (&mapped_acks, "acks", asize,
+               ACKS_PER_SLOT * sizeof (struct hash_ack_entry), 1);
+  if (ack_table == NULL) {
+    ack_table = malloc_or_fail (asize, "pcache default ack");
+    memset (ack_table, 0, asize);
+  }
 }
 
 /* called at the beginning, and in case of any initialization error */
@@ -307,9 +488,16 @@ static void initialize_from_scratch ()
   message_table_size = DEFAULT_MESSAGE_TABLE_SIZE;
   num_message_table_entries =
     message_table_size / sizeof (struct hash_table_entry);
-  if (message_table != NULL) free (message_table);
-  message_table = malloc_or_fail (message_table_size, "pcache default message");
-  memset (message_table, 0, message_table_size);
+  release_message_table ();
+  size_t msize = num_message_table_entries * sizeof (struct hash_table_entry);
+  message_table = (struct hash_table_entry *)
+    map_table (&mapped_messages, "messages", msize,
+               sizeof (struct hash_table_entry), 1);
+  if (message_table == NULL) {
+    message_table = malloc_or_fail (message_table_size,
+                                    "pcache default message");
+    memset (message_table, 0, message_table_size);
+  }
   initialize_acks_from_scratch ();
 }
 
@@ -360,6 +548,13 @@ static int initialize_messages_from_file ()
   char * fname = NULL;
   size_t msize = num_message_table_entries * sizeof (struct hash_table_entry);
   int found_error = 0;
+  /* a mapped file was written by this code, so there is no need to read
+   * or check it.  The pages are read on demand as entries are used */
+  message_table = (struct hash_table_entry *)
+    map_table (&mapped_messages, "messages", msize,
+               sizeof (struct hash_table_entry), 0);
+  if (message_table != NULL)
+    return 1;
   if (config_file_name ("acache", "messages", &fname)) {
     long long int fsize = file_size (fname);
     if (fsize == msize) {  /* read the file */
@@ -388,7 +583,7 @@ static int initialize_messages_from_file ()
         if (found_error) {
           if (p != NULL) free (p);
         } else {
-          if (message_table != NULL) free (message_table);
+          release_message_table ();
           message_table = mp;
           result = 1;
         }
@@ -414,12 +609,18 @@ static int initialize_acks_from_file ()
   int result = 0;
   char * fname = NULL;
   size_t asize = num_acks * sizeof (struct hash_ack_entry);
+  ack_table = (struct hash_ack_entry *)
+    map_table (&mapped_acks, "acks", asize,
+               ACKS_PER_SLOT * sizeof (struct hash_ack_entry), 0);
+  if (ack_table != NULL)
+    return 1;
   if (config_file_name ("acache", "acks", &fname)) {
     char * p = NULL;
     int fsize = ((file_size (fname) == asize) ? read_file_malloc (fname, &p, 1)
                                               : 0);
     if (fsize == asize) {    /* all is well */
       assert (((asize / sizeof (struct hash_ack_entry)) % ACKS_PER_SLOT) == 0);
+      release_ack_table ();
       ack_table = (struct hash_ack_entry *)p;   /* point to memory */
       result = 1;
       int i;
@@ -461,7 +662,8 @@ printf ("ack table size %d, expecting %d for %d acks\n",
 /* load the three tables from files */
 static void initialize_from_file ()
 {
-  initialize_from_scratch ();
+  /* the tables are only set up from scratch if something goes wrong,
+   * since doing so first would clear the mapped files */
   int tokens_ok = 0;
   int messages_ok = 0;
   int acks_ok = 0;
@@ -481,6 +683,224 @@ static void initialize_from_file ()
   initialize_from_scratch ();   /* some error, re-initialize */
 }
 
+/* details of a data request, with pointers to the bitmaps */
+struct req_details {
+  struct allnet_data_request req;
+  int dst_bits;
+  const unsigned char * dst_bitmap;
+  int src_bits;
+  const unsigned char * src_bitmap;
+  int mid_bits;
+  const unsigned char * mid_bitmap;
+};
+
+/* secondary indexes over the message table, so that pcache_request only
+ * needs to look at message table entries that may hold matching messages.
+ * For each of destination, source, and message ID, the index records,
+ * for each value of the first INDEX_PREFIX_BITS bits, a bitmap of the
+ * message table entries that contain at least one message with that prefix.
+ * Messages whose address has fewer than INDEX_PREFIX_BITS bits (and
+ * messages without a message ID) are recorded under INDEX_WILDCARD, and
+ * are candidates for every request.
+ * We also record for each entry the time the newest message was added,
+ * so requests with a "since" time can skip entries with only older messages.
+ * The index is only kept in memory, and is rebuilt from the message table
+ * at startup.  Since it only selects candidates, each candidate message
+ * must still be checked with matches_data_request. */
+#define INDEX_PREFIX_BITS	8
+#define INDEX_WILDCARD		(1 << INDEX_PREFIX_BITS)
+#define INDEX_KEYS		(INDEX_WILDCARD + 1)
+#define INDEX_KEY_WORDS		((INDEX_KEYS + 63) / 64)
+#define INDEX_DST		0
+#define INDEX_SRC		1
+#define INDEX_MID		2
+#define INDEX_DIMENSIONS	3
+
+static int index_entry_words = 0;     /* 64-bit words in an entry bitmap */
+/* for each dimension and key, a bitmap of index_entry_words words */
+static uint64_t * index_by_key = NULL;
+/* for each entry and dimension, a bitmap of INDEX_KEY_WORDS words */
+static uint64_t * index_entry_keys = NULL;
+/* for each entry, the allnet time the newest message was added */
+static unsigned long long int * index_entry_newest = NULL;
+static uint64_t * index_candidates = NULL;    /* result of index_select */
+
+#define INDEX_BIT(bitmap, n)	(((bitmap) [(n) / 64] >> ((n) % 64)) & 1)
+#define INDEX_SET(bitmap, n)	((bitmap) [(n) / 64] |= (one64 << ((n) % 64)))
+#define INDEX_CLEAR(bitmap, n)	((bitmap) [(n) / 64] &= ~(one64 << ((n) % 64)))
+
+static uint64_t * index_key_bitmap (int dimension, int key)
+{
+  return index_by_key +
+         ((dimension * INDEX_KEYS + key) * index_entry_words);
+}
+
+static uint64_t * index_entry_bitmap (int eindex, int dimension)
+{
+  return index_entry_keys +
+         ((eindex * INDEX_DIMENSIONS + dimension) * INDEX_KEY_WORDS);
+}
+
+/* the index key for an address of nbits bits */
+static int index_key (const char * address, int nbits)
+{
+  if ((address == NULL) || (nbits < INDEX_PREFIX_BITS))
+    return INDEX_WILDCARD;
+  return ((readb16 (address) >> (16 - INDEX_PREFIX_BITS)) &
+          (INDEX_WILDCARD - 1));
+}
+
+/* recompute the keys for the messages in the given entry, and update
+ * the index accordingly.  If arrival is not zero, it is the time the
+ * most recent message was added to the entry */
+static void index_entry (int eindex, unsigned long long int arrival)
+{
+  if ((index_by_key == NULL) ||
+      (eindex < 0) || (eindex >= num_message_table_entries))
+    return;
+  uint64_t keys [INDEX_DIMENSIONS] [INDEX_KEY_WORDS];
+  memset (keys, 0, sizeof (keys));
+  struct hash_table_entry * hp = message_table + eindex;
+  int offset = 0;
+  int i;
+  for (i = 0; i < hp->num_messages; i++) {
+    struct message_header mh;
+    memcpy (&mh, hp->storage + offset, MESSAGE_HEADER_SIZE);
+    const char * msg = hp->storage + offset + MESSAGE_HEADER_SIZE;
+    const struct allnet_header * ahp = (const struct allnet_header *) msg;
+    if (mh.length >= ALLNET_HEADER_SIZE) {
+      INDEX_SET (keys [INDEX_DST],
+                 index_key ((char *) ahp->destination, ahp->dst_nbits));
+      INDEX_SET (keys [INDEX_SRC],
+                 index_key ((char *) ahp->source, ahp->src_nbits));
+      INDEX_SET (keys [INDEX_MID],
+                 index_key (ALLNET_MESSAGE_ID (ahp, ahp->transport,
+                                               mh.length), 16));
+    }
+    offset += MESSAGE_HEADER_SIZE + mh.length;
+  }
+  int d;
+  for (d = 0; d < INDEX_DIMENSIONS; d++) {
+    uint64_t * old = index_entry_bitmap (eindex, d);
+    int k;
+    for (k = 0; k < INDEX_KEYS; k++) {
+      int was = INDEX_BIT (old, k);
+      int is = INDEX_BIT (keys [d], k);
+      if (was && ! is)
+        INDEX_CLEAR (index_key_bitmap (d, k), eindex);
+      else if (is && ! was)
+        INDEX_SET (index_key_bitmap (d, k), eindex);
+    }
+    memcpy (old, keys [d], sizeof (keys [d]));
+  }
+  if (hp->num_messages <= 0)
+    index_entry_newest [eindex] = 0;
+  else if (arrival > index_entry_newest [eindex])
+    index_entry_newest [eindex] = arrival;
+}
+
+/* (re)build the index from the contents of the message table */
+static void index_rebuild ()
+{
+  if (index_by_key != NULL) free (index_by_key);
+  if (index_entry_keys != NULL) free (index_entry_keys);
+  if (index_entry_newest != NULL) free (index_entry_newest);
+  if (index_candidates != NULL) free (index_candidates);
+  index_entry_words = (num_message_table_entries + 63) / 64;
+  size_t key_size = INDEX_DIMENSIONS * INDEX_KEYS * index_entry_words *
+                    sizeof (uint64_t);
+  size_t entry_size = num_message_table_entries * INDEX_DIMENSIONS *
+                      INDEX_KEY_WORDS * sizeof (uint64_t);
+  size_t newest_size =
+    num_message_table_entries * sizeof (unsigned long long int);
+  size_t candidates_size = index_entry_words * sizeof (uint64_t);
+  index_by_key = malloc_or_fail (key_size, "pcache index by key");
+  index_entry_keys = malloc_or_fail (entry_size, "pcache index entry keys");
+  index_entry_newest = malloc_or_fail (newest_size, "pcache index newest");
+  index_candidates = malloc_or_fail (candidates_size, "pcache candidates");
+  memset (index_by_key, 0, key_size);
+  memset (index_entry_keys, 0, entry_size);
+  memset (index_entry_newest, 0, newest_size);
+  /* arrival times are not saved, so assume messages read from file are new */
+  unsigned long long int now = allnet_time ();
+  int i;
+  for (i = 0; i < num_message_table_entries; i++)
+    index_entry (i, now);
+}
+
+/* set wanted [k] for each key k that may match a set bit in the bitmap */
+static void index_wanted_keys (int power_two, int bitmap_bits,
+                               const unsigned char * bitmap, char * wanted)
+{
+  memset (wanted, 0, INDEX_KEYS);
+  wanted [INDEX_WILDCARD] = 1;
+  if ((power_two <= 0) || (power_two > 16) || (bitmap == NULL))
+    return;
+  int b;
+  for (b = 0; b < bitmap_bits; b++) {
+    if ((b % 8 == 0) && (bitmap [b / 8] == 0)) {
+      b += 7;               /* skip the entire byte */
+      continue;
+    }
+    if ((bitmap [b / 8] & (1 << (7 - (b % 8)))) == 0)
+      continue;
+    if (power_two >= INDEX_PREFIX_BITS) {
+      wanted [b >> (power_two - INDEX_PREFIX_BITS)] = 1;
+    } else {                /* every key with these first bits */
+      int shift = INDEX_PREFIX_BITS - power_two;
+      memset (wanted + (b << shift), 1, (1 << shift));
+    }
+  }
+}
+
+/* or together the entry bitmaps for all the wanted keys, and
+ * and the result into index_candidates */
+static void index_and_dimension (int dimension, const char * wanted)
+{
+  int w;
+  for (w = 0; w < index_entry_words; w++) {
+    uint64_t any = 0;
+    int k;
+    for (k = 0; k < INDEX_KEYS; k++)
+      if (wanted [k])
+        any |= index_key_bitmap (dimension, k) [w];
+    index_candidates [w] &= any;
+  }
+}
+
+/* returns a bitmap of the entries that may hold messages matching rd,
+ * or NULL if every entry should be searched */
+static uint64_t * index_select (const struct req_details * rd)
+{
+  if (index_by_key == NULL)
+    return NULL;
+  memset (index_candidates, 0xff, index_entry_words * sizeof (uint64_t));
+  char wanted [INDEX_KEYS];
+  if (rd->dst_bitmap != NULL) {
+    index_wanted_keys (rd->req.dst_bits_power_two, rd->dst_bits,
+                       rd->dst_bitmap, wanted);
+    index_and_dimension (INDEX_DST, wanted);
+  }
+  if (rd->src_bitmap != NULL) {
+    index_wanted_keys (rd->req.src_bits_power_two, rd->src_bits,
+                       rd->src_bitmap, wanted);
+    index_and_dimension (INDEX_SRC, wanted);
+  }
+  if (rd->mid_bitmap != NULL) {
+    index_wanted_keys (rd->req.mid_bits_power_two, rd->mid_bits,
+                       rd->mid_bitmap, wanted);
+    index_and_dimension (INDEX_MID, wanted);
+  }
+  unsigned long long int since = readb64u (rd->req.since);
+  if (since != 0) {
+    int i;
+    for (i = 0; i < num_message_table_entries; i++)
+      if (index_entry_newest [i] < since)
+        INDEX_CLEAR (index_candidates, i);
+  }
+  return index_candidates;
+}
+
 /* return 1 if too soon, else update *time_var and state and return 0 */
 /* if override is true, always update *time_var (not state) and return 0 */
 static int too_soon (unsigned long long int * time_var, int * state,
@@ -574,6 +994,247 @@ static void write_file_async (char * fname, const char * contents, int csize,
   }
 }
 
+/* histogram of the time taken by pcache_save_packet: save_latency [i]
+ * counts the calls that took less than 2^i microseconds (and at least
+ * 2^(i-1)), and the last bucket counts all the slower calls */
+#define SAVE_LATENCY_BUCKETS	24
+static uint64_t save_latency [SAVE_LATENCY_BUCKETS];
+
+static void record_save_latency (unsigned long long int us)
+{
+  int bucket = 0;
+  while ((bucket + 1 < SAVE_LATENCY_BUCKETS) && ((1ULL << bucket) <= us))
+    bucket++;
+  save_latency [bucket]++;
+}
+
+/* print the non-empty buckets of the latency histogram */
+static int save_latency_to_string (char * buffer, int bsize)
+{
+  int off = snprintf (buffer, bsize, "pcache_save_packet latency:");
+  int i;
+  for (i = 0; i < SAVE_LATENCY_BUCKETS; i++)
+    if (save_latency [i] > 0)
+      off += snprintf (buffer + off, minz (bsize, off), " <%lluus: %" PRIu64,
+                       1ULL << i, save_latency [i]);
+  off += snprintf (buffer + off, minz (bsize, off), "\n");
+  return off;
+}
+
+static struct pcache_stats stats;   /* only changed with the lock held */
+
+static void shift_token (char * tokenp, int token_shift, const char * debug)
+{
+#ifdef DEBUG_PRINT
+  printf ("shift_token (%p, %d, %s): %p..%p and %p..%p\n",
+          tokenp, token_shift, debug, message_table,
+          ((char *) message_table) + message_table_size, ack_table,
+          ((char *) ack_table) + (num_acks * sizeof (struct hash_ack_entry)));
+#endif /* DEBUG_PRINT */
+  if (token_shift <= 0)
+    return;
+  if (token_shift > 32)
+    printf ("error 1: %s token shift %d\n", debug, token_shift);
+  /* now shift the tokens */
+  uint64_t mask = ~(((uint64_t) -1) << (64 - token_shift));
+#ifdef DEBUG_FOR_DEVELOPER_OFF
+static uint64_t tokens_shifted = 0;
+if (! (tokens_shifted & (1 << token_shift))) {
+printf ("%s, shift %d, mask %016" PRIx64 "\n", debug, token_shift, mask);
+tokens_shifted = tokens_shifted | (1 << token_shift);
+}
+#endif /* DEBUG_FOR_DEVELOPER_OFF */
+  uint64_t tokens = readb64 (tokenp);
+  tokens = ((tokens >> token_shift) & mask);
+  writeb64 (tokenp, tokens);
+}
+
+/* the ack table is indexed in memory by ack_tags, one per ack slot.
+ * Bit i of used is set iff ack_table [base + i] is in use, and tags [i]
+ * is a one-byte fingerprint of its id (the first 8 bytes select the slot,
+ * so the fingerprint is the next byte).  A lookup only compares the ids
+ * of the used entries whose tag matches -- on average, fewer than one
+ * per lookup -- and finding a free entry is a bit scan.
+ * ack_tags is rebuilt from the table when it is loaded. */
+#if (ACKS_PER_SLOT != 64)
+#error "the ack slot used bitmap requires ACKS_PER_SLOT to be 64"
+#endif /* ACKS_PER_SLOT != 64 */
+#define ACK_TAG(id)	((uint8_t) ((id) [8]))
+
+struct ack_slot_tags {
+  uint8_t tags [ACKS_PER_SLOT];
+  uint64_t used;
+};
+static struct ack_slot_tags * ack_tags = NULL;
+
+static void ack_tags_rebuild ()
+{
+  if (ack_tags != NULL)
+    free (ack_tags);
+  int num_slots = num_acks / ACKS_PER_SLOT;
+  size_t size = num_slots * sizeof (struct ack_slot_tags);
+  ack_tags = malloc_or_fail (size, "pcache ack tags");
+  memset (ack_tags, 0, size);
+  int i;
+  for (i = 0; i < num_acks; i++) {
+    if (ack_table [i].used) {
+      struct ack_slot_tags * st = ack_tags + (i / ACKS_PER_SLOT);
+      st->tags [i % ACKS_PER_SLOT] = ACK_TAG (ack_table [i].id);
+      st->used |= (one64 << (i % ACKS_PER_SLOT));
+    }
+  }
+}
+
+/* mark the entry used or unused, in both the table and the tags */
+static void ack_entry_set_used (int aindex, int used)
+{
+  struct ack_slot_tags * st = ack_tags + (aindex / ACKS_PER_SLOT);
+  uint64_t bit = one64 << (aindex % ACKS_PER_SLOT);
+  ack_table [aindex].used = used;
+  if (used) {
+    st->tags [aindex % ACKS_PER_SLOT] = ACK_TAG (ack_table [aindex].id);
+    st->used |= bit;
+  } else {
+    st->used &= ~bit;
+  }
+}
+
+/* returns a bitmap with bit i set iff tags [i] == tag */
+static uint64_t ack_tags_matching (const uint8_t * tags, uint8_t tag)
+{
+  uint64_t result = 0;
+  int i;
+#ifdef PCACHE_SSE2
+  __m128i t = _mm_set1_epi8 ((char) tag);
+  for (i = 0; i < ACKS_PER_SLOT; i += 16) {
+    __m128i v = _mm_loadu_si128 ((const __m128i *) (tags + i));
+    uint64_t m = (uint16_t) _mm_movemask_epi8 (_mm_cmpeq_epi8 (v, t));
+    result |= (m << i);
+  }
+#else /* ! PCACHE_SSE2 */
+  for (i = 0; i < ACKS_PER_SLOT; i++)
+    if (tags [i] == tag)
+      result |= (one64 << i);
+#endif /* PCACHE_SSE2 */
+  return result;
+}
+
+/* index of the lowest set bit, bits must not be 0 */
+static int lowest_bit (uint64_t bits)
+{
+#ifdef __GNUC__
+  return __builtin_ctzll (bits);
+#else /* ! __GNUC__ */
+  int result = 0;
+  while ((bits & 1) == 0) {
+    bits >>= 1;
+    result++;
+  }
+  return result;
+#endif /* __GNUC__ */
+}
+
+static int count_bits (uint64_t bits)
+{
+#ifdef __GNUC__
+  return __builtin_popcountll (bits);
+#else /* ! __GNUC__ */
+  int result = 0;
+  for ( ; bits != 0; bits &= (bits - 1))
+    result++;
+  return result;
+#endif /* __GNUC__ */
+}
+
+/* when the list of external tokens is full, gc_tokens discards the
+ * oldest tokens, and the sent_to_tokens bitmaps in every message and ack
+ * must be shifted by the same amount.  Rather than shifting every bitmap
+ * at once, we add the shift to token_shift_total, and each message table
+ * entry or ack slot is brought up to date (caught up) before its bitmaps
+ * are next used, or when it is garbage collected or saved to file. */
+static unsigned int token_shift_total = 0;
+static unsigned int * entry_token_shift = NULL;  /* per message table entry */
+static unsigned int * slot_token_shift = NULL;   /* per ack slot */
+
+/* the incremental gc collects the entries and slots beginning here */
+static int gc_entry_cursor = 0;
+static int gc_slot_cursor = 0;
+/* number of additional message table entries to collect on each gc */
+#define GC_ENTRIES_PER_STEP	8
+
+static void init_gc_state ()
+{
+  if (entry_token_shift != NULL) free (entry_token_shift);
+  if (slot_token_shift != NULL) free (slot_token_shift);
+  size_t esize = num_message_table_entries * sizeof (unsigned int);
+  size_t ssize = (num_acks / ACKS_PER_SLOT) * sizeof (unsigned int);
+  entry_token_shift = malloc_or_fail (esize, "pcache entry token shift");
+  slot_token_shift = malloc_or_fail (ssize, "pcache slot token shift");
+  token_shift_total = 0;
+  memset (entry_token_shift, 0, esize);
+  memset (slot_token_shift, 0, ssize);
+  gc_entry_cursor = 0;
+  gc_slot_cursor = 0;
+}
+
+/* shift_token only handles shifts up to 32, and shifts may accumulate */
+static void shift_token_by (char * tokenp, unsigned int shift,
+                            const char * debug)
+{
+  while (shift > 0) {
+    int step = ((shift > 32) ? 32 : (int) shift);
+    shift_token (tokenp, step, debug);
+    shift -= step;
+  }
+}
+
+/* apply any pending token shifts to the messages in this entry */
+static void entry_catch_up (int eindex)
+{
+  if ((entry_token_shift == NULL) ||
+      (entry_token_shift [eindex] == token_shift_total))
+    return;
+  unsigned int shift = token_shift_total - entry_token_shift [eindex];
+  entry_token_shift [eindex] = token_shift_total;
+  struct hash_table_entry * hp = message_table + eindex;
+  int offset = 0;
+  int i;
+  for (i = 0; i < hp->num_messages; i++) {
+    struct message_header mh;
+    memcpy (&mh, hp->storage + offset, MESSAGE_HEADER_SIZE);
+    shift_token_by ((char *) (&(mh.sent_to_tokens)), shift, "entry_catch_up");
+    memcpy (hp->storage + offset, &mh, MESSAGE_HEADER_SIZE);
+    offset += MESSAGE_HEADER_SIZE + mh.length;
+  }
+  entry_dirty (eindex);
+}
+
+/* apply any pending token shifts to the acks in the slot for this index */
+static void slot_catch_up (int aindex)
+{
+  int slot = aindex / ACKS_PER_SLOT;
+  if ((slot_token_shift == NULL) ||
+      (slot_token_shift [slot] == token_shift_total))
+    return;
+  unsigned int shift = token_shift_total - slot_token_shift [slot];
+  slot_token_shift [slot] = token_shift_total;
+  int base = slot * ACKS_PER_SLOT;
+  int i;
+  for (i = 0; i < ACKS_PER_SLOT; i++)
+    shift_token_by ((char *) (&(ack_table [base + i].sent_to_tokens)), shift,
+                    "slot_catch_up");
+  slot_dirty (aindex);
+}
+
+static void token_shift_catch_up_all ()
+{
+  int i;
+  for (i = 0; i < num_message_table_entries; i++)
+    entry_catch_up (i);
+  for (i = 0; i < num_acks; i += ACKS_PER_SLOT)
+    slot_catch_up (i);
+}
+
 /* if in_background is non-zero, starts a thread to write the file.
  * otherwise, writes the file before returning.
  * same for the other write_*_file functions */
@@ -583,6 +1244,11 @@ static void write_messages_file (int override, int in_background)
   static int state = 0;
   if (too_soon (&last_saved, &state, override))
     return;
+  token_shift_catch_up_all ();  /* the saved tokens must match the table */
+  if (mapped_messages.base != NULL) {
+    sync_table (&mapped_messages, (in_background ? MS_ASYNC : MS_SYNC));
+    return;
+  }
   char * fname;
   if (config_file_name ("acache", "messages", &fname)) {
     size_t msize = num_message_table_entries * sizeof (struct hash_table_entry);
@@ -600,6 +1266,11 @@ static void write_acks_file (int override, int in_background)
   static int state = 0;
   if (too_soon (&last_saved, &state, override))
     return;
+  token_shift_catch_up_all ();
+  if (mapped_acks.base != NULL) {
+    sync_table (&mapped_acks, (in_background ? MS_ASYNC : MS_SYNC));
+    return;
+  }
   char * fname;
   if (config_file_name ("acache", "acks", &fname)) {
     size_t asize = num_acks * sizeof (struct hash_ack_entry);
@@ -647,11 +1318,14 @@ static void init_pcache ()
     num_external_tokens = 0;
     init_sizes ();
     initialize_from_file ();   /* load the three tables from files */
+    index_rebuild ();
+    ack_tags_rebuild ();
+    init_gc_state ();
   }
 }
 
 /* save cached information to disk */
-void pcache_write ()
+static void pcache_write_locked ()
 {
   if ((alog == NULL) || (num_message_table_entries <= 0))
     return;
@@ -659,19 +1333,44 @@ void pcache_write ()
   write_acks_file (1, WRITE_FILE_WAIT);
   write_tokens_file (1, WRITE_FILE_WAIT);
   pid_save_bloom ();
+  char latency [1000];
+  save_latency_to_string (latency, sizeof (latency));
+  printf ("%s", latency);
 printf ("pcache_write completed\n");
 }
 
+void pcache_write ()
+{
+  lock_pcache ();
+  pcache_write_locked ();
+  unlock_pcache ();
+}
+
+void pcache_get_stats (struct pcache_stats * result)
+{
+  lock_pcache ();
+  *result = stats;
+  unlock_pcache ();
+}
+
 /* fills in the first ALLNET_TOKEN_SIZE bytes of token with the current token */
-void pcache_current_token (char * result_token)
+static void pcache_current_token_locked (char * result_token)
 {
   init_pcache ();
   memcpy (result_token, local_token, ALLNET_TOKEN_SIZE);
 }
 
+void pcache_current_token (char * result_token)
+{
+  lock_pcache ();
+  pcache_current_token_locked (result_token);
+  unlock_pcache ();
+}
+
 /* return 1 for success, 0 for failure.
  * look inside a message and fill in its ID (MESSAGE_ID_SIZE bytes). */
-int pcache_message_id (const char * message, int msize, char * result_id)
+static int pcache_message_id_locked (const char * message, int msize,
+                                     char * result_id)
 {
   init_pcache ();
   if (msize < ALLNET_HEADER_SIZE)
@@ -705,30 +1404,12 @@ int pcache_message_id (const char * message, int msize, char * result_id)
   return 1;
 }
 
-static void shift_token (char * tokenp, int token_shift, const char * debug)
+int pcache_message_id (const char * message, int msize, char * result_id)
 {
-#ifdef DEBUG_PRINT
-  printf ("shift_token (%p, %d, %s): %p..%p and %p..%p\n",
-          tokenp, token_shift, debug, message_table,
-          ((char *) message_table) + message_table_size, ack_table,
-          ((char *) ack_table) + (num_acks * sizeof (struct hash_ack_entry)));
-#endif /* DEBUG_PRINT */
-  if (token_shift <= 0)
-    return;
-  if (token_shift > 32)
-    printf ("error 1: %s token shift %d\n", debug, token_shift);
-  /* now shift the tokens */
-  uint64_t mask = ~(((uint64_t) -1) << (64 - token_shift));
-#ifdef DEBUG_FOR_DEVELOPER_OFF
-static uint64_t tokens_shifted = 0;
-if (! (tokens_shifted & (1 << token_shift))) {
-printf ("%s, shift %d, mask %016" PRIx64 "\n", debug, token_shift, mask);
-tokens_shifted = tokens_shifted | (1 << token_shift);
-}
-#endif /* DEBUG_FOR_DEVELOPER_OFF */
-  uint64_t tokens = readb64 (tokenp);
-  tokens = ((tokens >> token_shift) & mask);
-  writeb64 (tokenp, tokens);
+  lock_pcache ();
+  int result = pcache_message_id_locked (message, msize, result_id);
+  unlock_pcache ();
+  return result;
 }
 
 #define DEBUG_GC(test, err, crash) \
@@ -751,14 +1432,16 @@ tokens_shifted = tokens_shifted | (1 << token_shift);
 /* free up messages by priority (for same priority, free up earlier messages)
  * until at least half of the space + msize is available.
  * if msize >= half the space, removes all existing messages in the entry. */
-static int gc_messages_entry (int eindex, int msize, int token_shift)
+static int gc_messages_entry (int eindex, int msize)
 {
 #ifdef DEBUG_PRINT
   printf ("gc_messages_entry (%d, %d)\n", eindex, msize);
 #endif /* DEBUG_PRINT */
+  entry_catch_up (eindex);
   struct hash_table_entry * hp = message_table + eindex;
   if (hp->num_messages <= 0)                   /* no messages, we are done */
     return 0;
+  entry_dirty (eindex);
   int wanted_space = MESSAGE_STORAGE_SIZE / 2 + msize + MESSAGE_HEADER_SIZE;
   if (wanted_space >= MESSAGE_STORAGE_SIZE) {  /* easy, free everything */
     hp->num_messages = 0;                      /* delete all messages */
@@ -830,8 +1513,6 @@ int total_size = -33;  /* for debugging */
   int check_num = 0;
   for (i = 0; i < hp->num_messages; i++) {
     if (msgs [i].keep) {
-      shift_token ((char *) (&(msgs [i].mh.sent_to_tokens)), token_shift,
-                   "gc_messages_entry"); 
       memcpy (hp->storage + current_message_offset,
               &(msgs [i].mh), MESSAGE_HEADER_SIZE);
       memmove (hp->storage + current_message_offset + MESSAGE_HEADER_SIZE,
@@ -854,36 +1535,60 @@ printf ("size %d =? %d, num = %d =? %d\n", check_size, total_size, check_num, nu
   return total_size;
 }
 
+/* gc_messages_entry, also counting the messages it removes */
+static int gc_counted_entry (int eindex, int msize)
+{
+  int before = message_table [eindex].num_messages;
+  int result = gc_messages_entry (eindex, msize);
+  if (before > message_table [eindex].num_messages)
+    stats.gc_messages += before - message_table [eindex].num_messages;
+  return result;
+}
+
+/* the gc normally picks acks at random.  After pcache_random_seed,
+ * it picks them from this fixed sequence (xorshift64*) instead */
+static uint64_t gc_random_state = 0;
+
+void pcache_random_seed (uint64_t seed)
+{
+  gc_random_state = seed;
+}
+
+/* a random int between 0 and max (inclusive) */
+static int gc_random (int max)
+{
+  if (gc_random_state == 0)
+    return (int) random_int (0, max);
+  gc_random_state ^= gc_random_state >> 12;
+  gc_random_state ^= gc_random_state << 25;
+  gc_random_state ^= gc_random_state >> 27;
+  return (int) (((gc_random_state * 2685821657736338717ULL) >> 32) %
+                (max + 1));
+}
+
 /* free up acks at random, until at least half of the acks in
  * the slot are free */
-static void gc_ack_slot (int aindex, int token_shift)
+static void gc_ack_slot (int aindex)
 {
 #ifdef DEBUG_PRINT
   printf ("gc_ack_slot (%d)\n", aindex);
 #endif /* DEBUG_PRINT */
+  slot_catch_up (aindex);
   int base = aindex - (aindex % ACKS_PER_SLOT);
-  int i = 0;
-  int used_count = 0;
-  for (i = 0; i < ACKS_PER_SLOT; i++) {
-    if (ack_table [base + i].used)
-      used_count++;
-  }
+  int used_count = count_bits (ack_tags [aindex / ACKS_PER_SLOT].used);
   while (used_count > ACKS_PER_SLOT / 2) {
-    int sel = (int)random_int (0, ACKS_PER_SLOT - 1);  /* delete this entry */
+    int sel = gc_random (ACKS_PER_SLOT - 1);      /* delete this entry */
     if (ack_table [base + sel].used) {            /* if it's in use */
       if (! pid_is_in_bloom (ack_table [base + sel].ack, PID_ACK_FILTER))
         pid_add_to_bloom (ack_table [base + sel].ack, PID_ACK_FILTER);
       if (! pid_is_in_bloom (ack_table [base + sel].id , PID_MESSAGE_FILTER))
         pid_add_to_bloom (ack_table [base + sel].id , PID_MESSAGE_FILTER);
-      ack_table [base + sel].used = 0;
+      ack_entry_set_used (base + sel, 0);
+      slot_dirty (base);
       used_count--;
+      stats.gc_acks++;
     }
   }
-  if (token_shift > 0) {
-    for (i = 0; i < ACKS_PER_SLOT; i++)
-      shift_token ((char *)&(ack_table [base + i].sent_to_tokens), token_shift,
-                   "gc_acks_entry"); 
-  }
 }
 
 /* does FIFO replacement -- just shifts tokens to the front of the
@@ -924,75 +1629,88 @@ printf ("num_external_tokens is now %d\n", num_external_tokens);
 #define PRINT_GC
 #endif /* DEBUG_FOR_DEVELOPERS */
 
-/* Garbage collects both the messages and ack tables, guaranteeing
- * that at least half the bytes in each message table entry
- * and half the entries in each ack table slot are free. 
- * If eindex is in the range 0..num_message_table_entries,
- * also guarantees that the message table entry at that slot has
- * at least msize free bytes, and returns the offset for that entry.
- * otherwise returns 0.
- * Also updates the token. */
-static int do_gc (int eindex, int msize,
-                  int write_tok, int write_msg, int write_ack)
+/* called when the incremental gc has gone over all the entries and slots.
+ * Only here do we change our token and advance the bloom filter, so these
+ * happen about as often as when each gc collected all the tables. */
+static void gc_finish_cycle ()
 {
-  zero_returned_for_token = 0;  /* force a search on the next pcache_request */
-#ifdef PRINT_GC
-  long long int start = allnet_time_us ();
-#endif /* PRINT_GC */
 #ifdef VERBOSE_GC
   static int gc_counter = 1;
   char desc [1000];
-  snprintf (desc, sizeof (desc),
-            "before gc (%d, %d, %d)", gc_counter, eindex, msize);
+  snprintf (desc, sizeof (desc), "gc cycle %d", gc_counter++);
   print_stats (desc);
 #endif /* VERBOSE_GC */
+  stats.gc_cycles++;
+  reinit_local_token ();
+  write_tokens_file (1, WRITE_FILE_ASYNC);
+  pid_advance_bloom ();
+  pid_save_bloom ();
+  save_latency_to_string (alog->b, alog->s);
+  log_print (alog);
+}
+
+/* Incremental garbage collection.  Guarantees that at least half the
+ * bytes in message table entry eindex are free, and that it has at
+ * least msize free bytes, and returns the offset for that entry.
+ * If eindex is not in the range 0..num_message_table_entries, returns 0.
+ * Also collects the next GC_ENTRIES_PER_STEP message table entries and
+ * a proportional number of ack slots, so the amount of work per call is
+ * bounded, but over many calls the entire tables are collected. */
+static int gc_step (int eindex, int msize)
+{
+  zero_returned_for_token = 0;  /* force a search on the next pcache_request */
+  stats.gc_steps++;
+  unsigned long long int start_ns = metrics_now_ns ();
+#ifdef PRINT_GC
+  long long int start = allnet_time_us ();
+#endif /* PRINT_GC */
   int result = 0;
-  int delta_tokens = gc_tokens ();
-#ifdef VERBOSE_GC
-  printf ("tokens shifted by %d\n", delta_tokens);
-#endif /* VERBOSE_GC */
-  int i;
-  for (i = 0; i < num_acks; i += ACKS_PER_SLOT)
-    gc_ack_slot (i, delta_tokens);
-#ifdef VERBOSE_GC
-  print_stats ("acks done, messages next");
-#endif /* VERBOSE_GC */
-  for (i = 0; i < num_message_table_entries; i++) {
-    if (i == eindex)  /* use msize and set result */
-      result = gc_messages_entry (i, msize, delta_tokens);
-    else
-      gc_messages_entry (i, 0, delta_tokens);
+  if ((eindex >= 0) && (eindex < num_message_table_entries)) {
+    result = gc_counted_entry (eindex, msize);
+    index_entry (eindex, 0);
   }
-  reinit_local_token ();
-#ifdef VERBOSE_GC
-  snprintf (desc, sizeof (desc),
-            "gc (%d, %d, %d) => %d", gc_counter++, eindex, msize, result);
-  print_stats (desc);
-#endif /* VERBOSE_GC */
+  int i;
+  for (i = 0; ((i < GC_ENTRIES_PER_STEP) &&
+               (gc_entry_cursor < num_message_table_entries)); i++) {
+    if (gc_entry_cursor != eindex) {  /* eindex was collected above */
+      gc_counted_entry (gc_entry_cursor, 0);
+      index_entry (gc_entry_cursor, 0);
+    }
+    gc_entry_cursor++;
+  }
+  /* keep the slot cursor proportional to the entry cursor, so both
+   * reach the end of their table at the same time */
+  int num_slots = num_acks / ACKS_PER_SLOT;
+  int slot_goal = (int) (((long long int) gc_entry_cursor) * num_slots /
+                         num_message_table_entries);
+  while (gc_slot_cursor < slot_goal)
+    gc_ack_slot ((gc_slot_cursor++) * ACKS_PER_SLOT);
+  if (gc_entry_cursor >= num_message_table_entries) {
+    gc_entry_cursor = 0;
+    gc_slot_cursor = 0;
+    gc_finish_cycle ();
+  }
+  METRICS_COUNT ("pcache.gc_steps", 1);
+  METRICS_RECORD ("pcache.gc_ns", metrics_now_ns () - start_ns);
 #ifdef PRINT_GC
   long long int us = allnet_time_us () - start;
-  printf ("gc %d/%d/%d took %lld.%06llds, shifted %d tokens\n",
-          write_tok, write_msg, write_ack,
-          us / 1000000, us % 1000000, delta_tokens);
+  printf ("gc step %d took %lld.%06llds\n", eindex,
+          us / 1000000, us % 1000000);
 #endif /* PRINT_GC */
-  if (write_tok) write_tokens_file (1, WRITE_FILE_ASYNC);
-  if (write_msg) write_messages_file (1, WRITE_FILE_ASYNC);
-  if (write_ack) write_acks_file (1, WRITE_FILE_ASYNC);
-  pid_advance_bloom ();
-  pid_save_bloom ();
   return result;
 }
 
+static int pcache_id_found_locked (const char * id);
+
 /* save this (received) packet */
-void pcache_save_packet (const char * message, int msize, int priority)
+static void save_packet (const char * message, int msize, int priority)
 {
-  init_pcache ();
   char id [MESSAGE_ID_SIZE];
-  if (! pcache_message_id (message, msize, id)) {
+  if (! pcache_message_id_locked (message, msize, id)) {
     print_buffer (message, msize, "no message ID for packet: ", msize, 1);
     return;
   }
-  if (pcache_id_found (id))   /* already here, nothing to do */
+  if (pcache_id_found_locked (id))   /* already here, nothing to do */
     return;
   zero_returned_for_token = 0;  /* force a search on the next pcache_request */
   int eindex = (readb64 (id) % num_message_table_entries);
@@ -1004,11 +1722,8 @@ void pcache_save_packet (const char * message, int msize, int priority)
     memcpy (&mh, hp->storage + offset, MESSAGE_HEADER_SIZE);
     offset += MESSAGE_HEADER_SIZE + mh.length;
   }
-  int did_gc = 0;
-  if (offset + MESSAGE_HEADER_SIZE + msize > MESSAGE_STORAGE_SIZE) {
-    offset = do_gc (eindex, msize, 1, 0, 1);
-    did_gc = 1;
-  }
+  if (offset + MESSAGE_HEADER_SIZE + msize > MESSAGE_STORAGE_SIZE)
+    offset = gc_step (eindex, msize);
   if (offset + MESSAGE_HEADER_SIZE + msize <= MESSAGE_STORAGE_SIZE) {
     struct message_header mh;
     memcpy (mh.id, id, MESSAGE_ID_SIZE);
@@ -1018,20 +1733,41 @@ void pcache_save_packet (const char * message, int msize, int priority)
     memcpy (hp->storage + offset, &mh, MESSAGE_HEADER_SIZE);
     memcpy (hp->storage + offset + MESSAGE_HEADER_SIZE, message, msize);
     hp->num_messages = hp->num_messages + 1; 
+    stats.saved++;
+    entry_dirty (eindex);
+    index_entry (eindex, allnet_time ());
   } else {
     printf ("gc error, @ %d offset %d + %d + %d > %d\n", eindex, offset,
             (int) MESSAGE_HEADER_SIZE, msize, (int) MESSAGE_STORAGE_SIZE);
     exit (1);
   }
-  write_messages_file (did_gc, WRITE_FILE_ASYNC);
+  write_messages_file (0, WRITE_FILE_ASYNC);
+}
+
+/* save this (received) packet */
+static void pcache_save_packet_locked (const char * message, int msize,
+                                       int priority)
+{
+  init_pcache ();
+  unsigned long long int start = allnet_time_us ();
+  save_packet (message, msize, priority);
+  record_save_latency (allnet_time_us () - start);
+  METRICS_COUNT ("pcache.saves", 1);
+}
+
+void pcache_save_packet (const char * message, int msize, int priority)
+{
+  lock_pcache ();
+  pcache_save_packet_locked (message, msize, priority);
+  unlock_pcache ();
 }
 
 /* record this packet ID, without actually saving it */
-void pcache_record_packet (const char * message, int msize)
+static void pcache_record_packet_locked (const char * message, int msize)
 {
   init_pcache ();
   char id [MESSAGE_ID_SIZE];
-  if (! pcache_message_id (message, msize, id)) {
+  if (! pcache_message_id_locked (message, msize, id)) {
     print_buffer (message, msize, "no message ID for packet: ", msize, 1);
     return;
   }
@@ -1040,6 +1776,13 @@ void pcache_record_packet (const char * message, int msize)
     pid_add_to_bloom (id, PID_MESSAGE_FILTER);
 }
 
+void pcache_record_packet (const char * message, int msize)
+{
+  lock_pcache ();
+  pcache_record_packet_locked (message, msize);
+  unlock_pcache ();
+}
+
 static void delete_message_entry (struct hash_table_entry * hp,
                                   struct message_header * mh, int offset)
 {
@@ -1047,6 +1790,8 @@ static void delete_message_entry (struct hash_table_entry * hp,
   int remaining = MESSAGE_STORAGE_SIZE - (offset + length);
   memmove (hp->storage + offset, hp->storage + offset + length, remaining);
   hp->num_messages--;
+  entry_dirty ((int) (hp - message_table));
+  index_entry ((int) (hp - message_table), 0);
 }
 
 /* return 1 if the ID is in the cache, 0 otherwise
@@ -1077,7 +1822,7 @@ static int pcache_id_found_delete (const char * id, int delete,
 
 /* return 1 if the ID is in the cache, 0 otherwise
  * ID is MESSAGE_ID_SIZE bytes. */
-int pcache_id_found (const char * id)
+static int pcache_id_found_locked (const char * id)
 {
   init_pcache ();
   if (pid_is_in_bloom (id, PID_MESSAGE_FILTER))
@@ -1085,25 +1830,42 @@ int pcache_id_found (const char * id)
   return pcache_id_found_delete (id, 0, NULL);  /* do not delete */
 }
 
+int pcache_id_found (const char * id)
+{
+  lock_pcache ();
+  int result = pcache_id_found_locked (id);
+  stats.id_lookups++;
+  if (result)
+    stats.id_hits++;
+  unlock_pcache ();
+  if (result)
+    METRICS_COUNT ("pcache.id_hits", 1);
+  else
+    METRICS_COUNT ("pcache.id_misses", 1);
+  return result;
+}
+
 /* return the index of the ack in the ack hash table, or -1 if not found */
 static int find_one_ack (const char * id)
 {
   int aindex = (readb64 (id) % num_acks);
   int base = aindex - (aindex % ACKS_PER_SLOT);
-  int i;
-  for (i = 0; i < ACKS_PER_SLOT; i++) {
-    if ((ack_table [base + i].used) &&
-        (memcmp (ack_table [base + i].id, id, MESSAGE_ID_SIZE) == 0)) {
+  struct ack_slot_tags * st = ack_tags + (aindex / ACKS_PER_SLOT);
+  uint64_t candidates = ack_tags_matching (st->tags, ACK_TAG (id)) & st->used;
+  while (candidates != 0) {
+    int i = lowest_bit (candidates);
+    if (memcmp (ack_table [base + i].id, id, MESSAGE_ID_SIZE) == 0)
       return base + i;
-    }
+    candidates &= (candidates - 1);   /* clear the lowest bit */
   }
   return -1;
 }
 
 /* return 1 if we have the ack for this ID, 0 if we do not
  * if we return 1, fill in the ack */
-int pcache_id_acked (const char * id, char * ack)
+static int pcache_id_acked_locked (const char * id, char * ack)
 {
+  init_pcache ();
   int aindex = find_one_ack (id);
   if (aindex >= 0) {
     memcpy (ack, ack_table [aindex].ack, MESSAGE_ID_SIZE);
@@ -1112,19 +1874,34 @@ int pcache_id_acked (const char * id, char * ack)
   return 0;
 }
 
+int pcache_id_acked (const char * id, char * ack)
+{
+  lock_pcache ();
+  int result = pcache_id_acked_locked (id, ack);
+  stats.ack_lookups++;
+  if (result)
+    stats.ack_hits++;
+  unlock_pcache ();
+  if (result)
+    METRICS_COUNT ("pcache.ack_hits", 1);
+  else
+    METRICS_COUNT ("pcache.ack_misses", 1);
+  return result;
+}
+
 /* returns an index if there is one available, otherwise -1 */
 static int find_free_ack_in_slot (int aindex)
 {
   int base = aindex - (aindex % ACKS_PER_SLOT);
-  int i;
-  for (i = 0; i < ACKS_PER_SLOT; i++)
-    if (! ack_table [base + i].used)    /* found a free entry */
-      return base + i;                  /* use this as the index */
-  return -1;
+  uint64_t free_entries = ~(ack_tags [aindex / ACKS_PER_SLOT].used);
+  if (free_entries == 0)
+    return -1;
+  return base + lowest_bit (free_entries);   /* use the first free entry */
 }
 
-/* return the index of the ack in the ack hash table */
-static int save_one_ack (const char * ack, int max_hops)
+/* return the index of the ack in the ack hash table
+ * id is the hash of the ack, computed by the caller */
+static int save_one_ack (const char * ack, const char * id, int max_hops)
 {
 #ifdef DEBUG_PRINT
   static int received_count = 0;
@@ -1134,12 +1911,12 @@ static int save_one_ack (const char * ack, int max_hops)
   /* if it is in the bloom filter, no need to save */
   if (pid_is_in_bloom (ack, PID_ACK_FILTER))
     return 0;
-  char id [MESSAGE_ID_SIZE];
-  sha512_bytes (ack, MESSAGE_ID_SIZE, id, MESSAGE_ID_SIZE);
   int aindex = find_one_ack (id);
   if (aindex >= 0) {  /* found */
-    if (ack_table [aindex].max_hops < max_hops)
+    if (ack_table [aindex].max_hops < max_hops) {
       ack_table [aindex].max_hops = max_hops;
+      slot_dirty (aindex);
+    }
 #ifdef DEBUG_PRINT
     duplicate_count++;
 #endif /* DEBUG_PRINT */
@@ -1151,7 +1928,8 @@ static int save_one_ack (const char * ack, int max_hops)
   if (ack_table [aindex].used) {      /* find another position in slot */
     int found = find_free_ack_in_slot (aindex);
     if (found < 0) {                  /* no free slot, must gc */
-      do_gc (-1, 0, 1, 1, 0);
+      gc_ack_slot (aindex);
+      gc_step (-1, 0);
       did_gc = 1;
       if (ack_table [aindex].used) {   /* find another position in slot */
         found = find_free_ack_in_slot (aindex);  /* should always have space */
@@ -1188,9 +1966,10 @@ static int save_one_ack (const char * ack, int max_hops)
 #endif /* DEBUG_PRINT */
   memcpy (ack_table [aindex].ack, ack, MESSAGE_ID_SIZE);
   memcpy (ack_table [aindex].id , id , MESSAGE_ID_SIZE);
-  ack_table [aindex].used = 1;
+  ack_entry_set_used (aindex, 1);
   ack_table [aindex].max_hops = max_hops;
   ack_table [aindex].sent_to_tokens = 0;
+  slot_dirty (aindex);
   /* finally, delete the corresponding message if any */
   pcache_id_found_delete (id, 1, NULL);  /* delete if found */
   return aindex;
@@ -1198,15 +1977,36 @@ static int save_one_ack (const char * ack, int max_hops)
 
 /* each ack has size MESSAGE_ID_SIZE */
 /* record all these acks and delete (stop caching) corresponding messages */
-void pcache_save_acks (const char * acks, int num, int max_hops)
+static void pcache_save_acks_locked (const char * acks, int num,
+                                     int max_hops)
 {
   init_pcache ();
-  int i;
-  for (i = 0; i < num; i++)
-    save_one_ack (acks + i * MESSAGE_ID_SIZE, max_hops);
+  /* hash the acks a batch at a time, which is faster than one by one */
+#define SAVE_ACKS_BATCH	64
+  char ids [SAVE_ACKS_BATCH * MESSAGE_ID_SIZE];
+  int first;
+  for (first = 0; first < num; first += SAVE_ACKS_BATCH) {
+    int count = minz (num, first);
+    if (count > SAVE_ACKS_BATCH)
+      count = SAVE_ACKS_BATCH;
+    const char * batch = acks + first * MESSAGE_ID_SIZE;
+    sha512_bytes_batch (batch, MESSAGE_ID_SIZE, count, ids, MESSAGE_ID_SIZE);
+    int i;
+    for (i = 0; i < count; i++)
+      save_one_ack (batch + i * MESSAGE_ID_SIZE, ids + i * MESSAGE_ID_SIZE,
+                    max_hops);
+  }
+#undef SAVE_ACKS_BATCH
   write_acks_file (0, WRITE_FILE_ASYNC);
 }
 
+void pcache_save_acks (const char * acks, int num, int max_hops)
+{
+  lock_pcache ();
+  pcache_save_acks_locked (acks, num, max_hops);
+  unlock_pcache ();
+}
+
 /* returns -1 if the token is not found, or the token index (0..63) otherwise */
 static int token_find_index (const char * token)
 {
@@ -1253,7 +2053,8 @@ printf ("%d: ", i);
 print_buffer (token_list [i], MESSAGE_ID_SIZE, NULL, 8, 1);
 }
 #endif /* DEBUG_FOR_DEVELOPER_OFF */
-    do_gc (-1, 0, 0, 1, 1);
+    token_shift_total += gc_tokens ();
+    gc_step (-1, 0);
     did_gc = 1;
     last_gc = allnet_time ();
 #ifdef DEBUG_FOR_DEVELOPER_OFF
@@ -1280,7 +2081,8 @@ print_buffer (token_list [i], MESSAGE_ID_SIZE, NULL, 8, 1);
 /* return 1 if the ack has not yet been sent to this token, 
  * and mark it as sent to this token. 
  * otherwise, return 0 */
-int pcache_ack_for_token (const char * token, const char * ack)
+static int pcache_ack_for_token_locked (const char * token,
+                                        const char * ack)
 {
   init_pcache ();
   /* assume that acks in the bloom filter have been sent to all tokens */
@@ -1290,18 +2092,35 @@ int pcache_ack_for_token (const char * token, const char * ack)
   char id [MESSAGE_ID_SIZE];
   sha512_bytes (ack, MESSAGE_ID_SIZE, id, MESSAGE_ID_SIZE);
   int aindex = find_one_ack (id);
-  int itoken = token_to_send_to (token, ack_table [aindex].sent_to_tokens, "1");
+  uint64_t sent_to_tokens = 0;
+  if (aindex >= 0) {  /* found */
+    slot_catch_up (aindex);
+    sent_to_tokens = ack_table [aindex].sent_to_tokens;
+  }
+  int itoken = token_to_send_to (token, sent_to_tokens, "1");
   if (itoken == -1)  /* already sent */
     return 0;
-  if (aindex >= 0)    /* found */
+  if (aindex >= 0) {  /* found */
+    slot_catch_up (aindex);   /* token_to_send_to may have shifted tokens */
     ack_table [aindex].sent_to_tokens |= (one64 << itoken);
+    slot_dirty (aindex);
+  }
   return 1;
 }
 
+int pcache_ack_for_token (const char * token, const char * ack)
+{
+  lock_pcache ();
+  int result = pcache_ack_for_token_locked (token, ack);
+  unlock_pcache ();
+  return result;
+}
+
 /* call pcache_ack_for_token repeatedly for all these acks,
  * moving the new ones to the front of the array and returning the
  * number that are new (0 for none, -1 for errors) */
-int pcache_acks_for_token (const char * token, char * acks, int num)
+static int pcache_acks_for_token_locked (const char * token,
+                                         char * acks, int num)
 {
   init_pcache ();
   const char * ack = acks;
@@ -1309,7 +2128,7 @@ int pcache_acks_for_token (const char * token, char * acks, int num)
   int result = 0;
   int i;
   for (i = 0; i < num; i++) {
-    if (pcache_ack_for_token (token, ack)) {  /* good one, keep it */
+    if (pcache_ack_for_token_locked (token, ack)) {  /* good one, keep it */
       if (offset != ack)
         memcpy (offset, ack, MESSAGE_ID_SIZE);
       offset += MESSAGE_ID_SIZE; /* increment offset only for new acks */
@@ -1320,6 +2139,14 @@ int pcache_acks_for_token (const char * token, char * acks, int num)
   return result;
 }
 
+int pcache_acks_for_token (const char * token, char * acks, int num)
+{
+  lock_pcache ();
+  int result = pcache_acks_for_token_locked (token, acks, num);
+  unlock_pcache ();
+  return result;
+}
+
 /* returns 0 if bits_power_two is 0, and 2^bits_power_two otherwise */
 static int power_two (int bits_power_two)
 {
@@ -1359,16 +2186,6 @@ static char * add_to_result (struct pcache_result * r, const char * message,
   return new_message;
 }
 
-struct req_details {
-  struct allnet_data_request req;
-  int dst_bits;
-  const unsigned char * dst_bitmap;
-  int src_bits;
-  const unsigned char * src_bitmap;
-  int mid_bits;
-  const unsigned char * mid_bitmap;
-};
-
 #ifdef TEST_CACHE_FILES
 static void print_rd (const struct req_details *rd)
 {
@@ -1550,8 +2367,9 @@ static int matches_data_request (const struct req_details *rd,
    messages are in order of descending priority.
    If max > 0, at most max messages will be returned.
    The memory used by pcache_result is allocated in the given buffer */
-struct pcache_result pcache_request (const struct allnet_data_request *req,
-                                     int max, char * buffer, int bsize)
+static struct pcache_result
+  pcache_request_locked (const struct allnet_data_request *req,
+                         int max, char * buffer, int bsize)
 {
 #ifdef DEBUG_PRINT
   long long int start_time = allnet_time_us ();
@@ -1583,9 +2401,20 @@ int exp_count = 0;
 int token_count = 0;
 int max_count = 0;
   if (message_table != NULL) {
+    /* unless we want everything, only look at entries selected by the index */
+    uint64_t * candidates = ((match_all) ? NULL : index_select (&rd));
     int ie;
     for (ie = 0; (last_message != NULL) &&
                  (ie < num_message_table_entries); ie++) {
+      if (candidates != NULL) {
+        if ((ie % 64 == 0) && (candidates [ie / 64] == 0)) {
+          ie += 63;      /* no candidates in the next 64 entries */
+          continue;
+        }
+        if (! INDEX_BIT (candidates, ie))
+          continue;
+      }
+      entry_catch_up (ie);   /* so sent_to_tokens matches the token list */
       int offset = 0;
       int im;
       for (im = 0; (last_message != NULL) &&
@@ -1626,10 +2455,20 @@ result.n, exp_count, token_count, max_count, delta / 1000000, delta % 1000000);
   return result;
 }
 
+struct pcache_result pcache_request (const struct allnet_data_request *req,
+                                     int max, char * buffer, int bsize)
+{
+  lock_pcache ();
+  struct pcache_result result =
+    pcache_request_locked (req, max, buffer, bsize);
+  unlock_pcache ();
+  return result;
+}
+
 /* return 1 if the trace request/reply has been seen before, or otherwise
  * return 0 and save the ID.  Trace ID should be MESSAGE_ID_SIZE bytes
  * implementation: add directly to the appropriate bloom filter */
-int pcache_trace_request (const unsigned char * id)
+static int pcache_trace_request_locked (const unsigned char * id)
 {
   init_pcache ();
   if (pid_is_in_bloom ((const char *) id, PID_TRACE_REQ_FILTER))
@@ -1638,8 +2477,16 @@ int pcache_trace_request (const unsigned char * id)
   return 0;
 }
 
+int pcache_trace_request (const unsigned char * id)
+{
+  lock_pcache ();
+  int result = pcache_trace_request_locked (id);
+  unlock_pcache ();
+  return result;
+}
+
 /* for replies, we look at the entire packet, without the header */
-int pcache_trace_reply (const char * msg, int msize)
+static int pcache_trace_reply_locked (const char * msg, int msize)
 {
   init_pcache ();
   char id [MESSAGE_ID_SIZE];
@@ -1650,6 +2497,14 @@ int pcache_trace_reply (const char * msg, int msize)
   return 0;
 }
 
+int pcache_trace_reply (const char * msg, int msize)
+{
+  lock_pcache ();
+  int result = pcache_trace_reply_locked (msg, msize);
+  unlock_pcache ();
+  return result;
+}
+
 #ifdef IMPLEMENT_MGMT_ID_REQUEST  /* not used, so, not implemented */
 /* similar to pcache_request.
    Modifies req to reflect any IDs (may be 0) that are not found */
@@ -1663,29 +2518,39 @@ struct pcache_result pcache_id_request (struct allnet_mgmt_id_request * req)
 #endif /* IMPLEMENT_MGMT_ID_REQUEST */
 
 /* mark that this message need never again be sent to this token */
-void pcache_mark_token_sent (const char * token,  /* ALLNET_TOKEN_SIZE bytes */
-                             const char * message, int msize)
+static void pcache_mark_token_sent_locked (const char * token,
+                                           const char * message, int msize)
 {
   init_pcache ();
   if ((token == NULL) || (message == NULL) || (msize < ALLNET_HEADER_SIZE))
     return;
   char id [MESSAGE_ID_SIZE];
-  if (! pcache_message_id (message, msize, id)) {
+  if (! pcache_message_id_locked (message, msize, id)) {
     print_buffer (message, msize, "no message ID for packet: ", msize, 1);
     return;
   }
   int token_index = token_to_send_to (token, 0, "3");
   if (token_index >= 0) {
+    entry_catch_up (readb64 (id) % num_message_table_entries);
     char * hp = NULL;              /* 0: do not delete! -- hp points to mh */
     if ((pcache_id_found_delete (id, 0, &hp)) && (hp != NULL)) {
       struct message_header mh;
       memcpy (&mh, hp, sizeof (mh));
       mh.sent_to_tokens |= (one64 << token_index);
       memcpy (hp, &mh, sizeof (mh));
+      entry_dirty (readb64 (id) % num_message_table_entries);
     }
   }
 }
 
+void pcache_mark_token_sent (const char * token,  /* ALLNET_TOKEN_SIZE bytes */
+                             const char * message, int msize)
+{
+  lock_pcache ();
+  pcache_mark_token_sent_locked (token, message, msize);
+  unlock_pcache ();
+}
+
 #if 0  /* not (yet) implemented */
 
 /* return 1 if we have the ack, 0 if we do not */
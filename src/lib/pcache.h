@@ -102,4 +102,22 @@ extern int pcache_trace_reply (const char * msg, int msize);
 /* save cached information to disk */
 extern void pcache_write (void);
 
+/* with a nonzero seed, the choices the cache makes at random depend only
+ * on the seed, so a benchmark or test can be repeated exactly */
+extern void pcache_random_seed (uint64_t seed);
+
+/* counts kept since the cache was initialized in this process */
+struct pcache_stats {
+  unsigned long long int id_lookups;    /* calls to pcache_id_found */
+  unsigned long long int id_hits;       /* ... that found the ID */
+  unsigned long long int ack_lookups;   /* calls to pcache_id_acked */
+  unsigned long long int ack_hits;      /* ... that found an ack */
+  unsigned long long int saved;         /* packets added to the cache */
+  unsigned long long int gc_steps;      /* incremental gcs */
+  unsigned long long int gc_cycles;     /* gcs of the entire cache */
+  unsigned long long int gc_messages;   /* messages removed by gc */
+  unsigned long long int gc_acks;       /* acks removed by gc */
+};
+extern void pcache_get_stats (struct pcache_stats * stats);
+
 #endif /* PACKET_CACHE_H */
@@ -3,7 +3,11 @@
 
 /* command to compile it as a stand-alone program for testing
    of the caches:
-   gcc -Wall -g -o pid_bloom_test -DTEST_PID_BLOOM src/lib/pid_bloom.c src/lib/util.c src/lib/pipemsg.c src/lib/sha.c  src/lib/allnet_queue.c src/lib/allnet_log.c src/lib/ai.c src/lib/configfiles.c -lpthread
+   gcc -Wall -g -o pid_bloom_test -DTEST_PID_BLOOM src/lib/pid_bloom.c src/lib/util.c src/lib/pipemsg.c src/lib/sha.c  src/lib/allnet_queue.c src/lib/allnet_log.c src/lib/ai.c src/lib/configfiles.c src/lib/metrics.c -lpthread
+
+   command to compile a benchmark comparing this layout to the earlier
+   layout (one 64Kbit array for each 16 bits of the ID) at the same size:
+   gcc -Wall -O2 -o pid_bloom_bench -DBENCHMARK_PID_BLOOM src/lib/pid_bloom.c src/lib/util.c src/lib/configfiles.c src/lib/sha.c src/lib/allnet_log.c src/lib/ai.c src/lib/metrics.c -lpthread
 */
 
 #include <stdio.h>
@@ -15,22 +19,87 @@
 #include "pid_bloom.h"
 #include "util.h"
 #include "configfiles.h"
+#include "metrics.h"
+
+#define NUM_FILTERS	16      /* generations, filter 0 is the newest */
+#define FILTER_DEPTH	12      /* 12 bits set for each ID */
 
-#define NUM_FILTERS	16
-#define FILTER_DEPTH	8       /* 8 levels of filtering */
-#define FILTER_WIDTH	65536   /* 16 bits at a time */
-#define FILTER_BITS	16      /* 16 bits at a time */
+/* each filter is divided into blocks of 64 bytes (one cache line), and
+ * all FILTER_DEPTH bits for an ID are in the same block.  The blocks
+ * with the same index in each of the NUM_FILTERS filters are stored
+ * next to each other, so checking an ID in all the filters reads at
+ * most NUM_FILTERS adjacent cache lines, rather than (as in the earlier
+ * layout) up to 8 scattered cache lines in each filter. */
+#define BLOCK_WORDS	8       /* 64-bit words in each block */
+#define BLOCK_BITS	(BLOCK_WORDS * 64)
+#define BIT_INDEX_BITS	9       /* log2 (BLOCK_BITS) */
+#define NUM_BLOCKS	1024    /* blocks in each filter */
+#define BLOCK_INDEX_BITS	10      /* log2 (NUM_BLOCKS) */
 
-/* bloom filter size should be 4MB = 4 * 16 * 8 * 65536 / 8 */
+/* bloom filter size should be 4MB = 4 * 1024 * 16 * 8 * 8, the same
+ * as the earlier (unblocked) layout of 4 * 16 * 8 * 65536 / 8 */
 
-static char bloom_filter [PID_FILTER_SELECTORS] [NUM_FILTERS]
-                         [FILTER_DEPTH] [FILTER_WIDTH / 8];
+static uint64_t bloom_filter [PID_FILTER_SELECTORS] [NUM_BLOCKS]
+                             [NUM_FILTERS] [BLOCK_WORDS];
 #define BLOOM_SIZE	(sizeof (bloom_filter))
 
-/* internal data structure to keep track of the number of bits in
+/* the bloom file begins with this, so files in the earlier layout
+ * (which had the same size) are discarded rather than misread */
+static const char bloom_file_magic [8] = "pidblk1";
+#define BLOOM_FILE_SIZE	(sizeof (bloom_file_magic) + BLOOM_SIZE)
+
+/* internal data structure to keep track of the number of IDs in
  * each filter, and advance the filter if the load factor gets too high */
 static int filter_load [PID_FILTER_SELECTORS];
-#define MAX_FILTER_LOAD	(FILTER_WIDTH / 4)
+/* 32 bits for each ID.  With 12 bits per ID, about 0.3 of the bits are set.
+ * Using 12 rather than 8 bits per ID makes up for the uneven load of
+ * the blocks, so the false positive rate is about the same as with the
+ * earlier layout */
+#define MAX_FILTER_LOAD	(NUM_BLOCKS * BLOCK_BITS / 32)
+
+/* compute the mask of the bits for this id, and return the block index */
+static int block_mask (const char * id, uint64_t * mask)
+{
+  uint64_t high = readb64 (id);
+  uint64_t low = readb64 (id + 8);
+  memset (mask, 0, BLOCK_WORDS * sizeof (uint64_t));
+  /* the block index is the top BLOCK_INDEX_BITS bits of the ID, and
+   * the bit indices are the low-order bits, BIT_INDEX_BITS at a time */
+  int depth;
+  for (depth = 0; depth < FILTER_DEPTH; depth++) {
+    int first = depth * BIT_INDEX_BITS;
+    uint64_t source;
+    if (first + BIT_INDEX_BITS <= 64)
+      source = low >> first;
+    else if (first >= 64)
+      source = high >> (first - 64);
+    else     /* some bits from each */
+      source = (low >> first) | (high << (64 - first));
+    int bit = (int) (source & (BLOCK_BITS - 1));
+    mask [bit / 64] |= (((uint64_t) 1) << (bit % 64));
+  }
+  return (int) (high >> (64 - BLOCK_INDEX_BITS));
+}
+
+/* return 1 if all the bits in mask are set in the block */
+static int block_has_mask (const uint64_t * block, const uint64_t * mask)
+{
+  uint64_t missing = 0;
+  int w;
+  for (w = 0; w < BLOCK_WORDS; w++)
+    missing |= (mask [w] & ~(block [w]));
+  return (missing == 0);
+}
+
+static int bits_set (uint64_t word)
+{
+  int result = 0;
+  while (word != 0) {
+    word &= (word - 1);   /* clear the lowest bit that is set */
+    result++;
+  }
+  return result;
+}
 
 /* if the filter load is reasonable, initialize filter_load.
  * Otherwise, the bloom filter and filter_load are re-initialized to 0. */
@@ -39,27 +108,19 @@ static void init_filter_load ()
   int excessive = 0;
   int sel; 
   for (sel = 0; sel < PID_FILTER_SELECTORS; sel++) {
-    int total = 0;  /* max bits set at any depth on filter 0 for this sel */
-    int dep;
-    for (dep = 0; dep < FILTER_DEPTH; dep++) {
-      int depth_total = 0;  /* max bits set at this depth */
-      int pos;
-      for (pos = 0; pos < FILTER_WIDTH / 8; pos++) {
-        int byte = bloom_filter [sel] [0] [dep] [pos];
-        int bits_set = ((byte >> 7) & 1) + ((byte >> 6) & 1) +
-                       ((byte >> 5) & 1) + ((byte >> 4) & 1) +
-                       ((byte >> 3) & 1) + ((byte >> 2) & 1) +
-                       ((byte >> 1) & 1) + ((byte     ) & 1);
-        depth_total += bits_set;
-      }
-      if (depth_total > total)
-        total = depth_total;
+    int total = 0;  /* bits set in filter 0 for this sel */
+    int block;
+    for (block = 0; block < NUM_BLOCKS; block++) {
+      int w;
+      for (w = 0; w < BLOCK_WORDS; w++)
+        total += bits_set (bloom_filter [sel] [block] [0] [w]);
     }
-    filter_load [sel] = total;  /* total bits set for this selector */
-    if (total >= MAX_FILTER_LOAD) {   /* record and print */
+    /* an underestimate if some IDs share bits, as did the earlier count */
+    filter_load [sel] = total / FILTER_DEPTH;
+    if (filter_load [sel] >= MAX_FILTER_LOAD) {   /* record and print */
        excessive = 1;
        printf ("bloom filter %d has a load of %d, max %d\n",
-               sel, total, MAX_FILTER_LOAD);
+               sel, filter_load [sel], MAX_FILTER_LOAD);
     }
   }
   if (excessive) {  /* reset bloom_filter and filter_load */
@@ -81,12 +142,15 @@ static int bloom_init (int do_init)
     if (config_file_name ("acache", "bloom", &fname) >= 0) {
       char * from_file = NULL;
       int size = read_file_malloc (fname, &from_file, 0);
-      if ((from_file != NULL) && (size == BLOOM_SIZE)) {
-        memcpy (bloom_filter, from_file, BLOOM_SIZE);
+      if ((from_file != NULL) && (size == BLOOM_FILE_SIZE) &&
+          (memcmp (from_file, bloom_file_magic,
+                   sizeof (bloom_file_magic)) == 0)) {
+        memcpy (bloom_filter, from_file + sizeof (bloom_file_magic),
+                BLOOM_SIZE);
         init_filter_load ();
-      } else if (from_file != NULL) {   /* size is wrong */
+      } else if (from_file != NULL) {   /* size or format is wrong */
         printf ("error: expected %d bytes, got %d, deleting %s\n",
-                (int) BLOOM_SIZE, size, fname);
+                (int) BLOOM_FILE_SIZE, size, fname);
         unlink (fname);
       } else {   /* from_file is NULL, the file does not exist */
         printf ("error reading %s: no such file\n", fname);
@@ -101,78 +165,34 @@ static int bloom_init (int do_init)
   return 1;
 }
 
-/* id should refer to at least 16 bytes, and PID_SIZE should be 16 or more
- * filter_selector should be one of the PID_*_FILTER values
- * return 1 if the id (of size FILTER_BITS/8 * FILTER_DEPTH) is found
- * in one of the filters. */
-int pid_is_in_bloom (const char * id, int filter_selector)
+static void check_sizes (int filter_selector)
 {
-  assert(FILTER_WIDTH == 65536);
-  assert(FILTER_BITS == 16);
-  assert(FILTER_BITS * FILTER_DEPTH == 16 * 8);
-  assert(FILTER_BITS == MESSAGE_ID_SIZE);
+  assert(BLOCK_BITS == (1 << BIT_INDEX_BITS));
+  assert(NUM_BLOCKS == (1 << BLOCK_INDEX_BITS));
+  assert(FILTER_DEPTH * BIT_INDEX_BITS + BLOCK_INDEX_BITS <= 128);
   assert(PID_SIZE >= 16);
   assert(filter_selector < PID_FILTER_SELECTORS);
   assert(filter_selector >= 0);
   assert(BLOOM_SIZE == (PID_FILTER_SELECTORS *
-                        NUM_FILTERS * FILTER_DEPTH * FILTER_WIDTH / 8));
-  bloom_init (1);
-  int filter_num;
-  for (filter_num = 0; filter_num < NUM_FILTERS; filter_num++) {
-    int is_in_all = 1;
-    int filter_depth;
-    for (filter_depth = 0; filter_depth < FILTER_DEPTH; filter_depth++) {
-      uint16_t pos = readb16 ((char *) id + filter_depth * 2);
-      uint16_t index = pos / 8;
-      uint16_t offset = pos % 8;
-      int byte =
-        bloom_filter [filter_selector] [filter_num] [filter_depth] [index];
-      int bit = byte & (1 << offset);
-      if (bit == 0) {  /* the ID is not in this filter */
-        is_in_all = 0;
-        break;         /* break out of the inner loop within one filter */
-      }
-    }
-    if (is_in_all && (filter_num > 0))  /* also add into the top-level filter */
-      pid_add_to_bloom (id, filter_selector);
-    if (is_in_all)
-      return 1;
-  }
-  return 0;
+                        NUM_BLOCKS * NUM_FILTERS * BLOCK_WORDS * 8));
 }
 
-/* add this id to filter 0 */
-void pid_add_to_bloom (const char * id, int filter_selector)
+/* set the bits of mask in the given block of filter 0 */
+static void add_mask (int filter_selector, int block, const uint64_t * mask)
 {
-  assert(FILTER_WIDTH == 65536);
-  assert(FILTER_BITS == 16);
-  assert(FILTER_BITS * FILTER_DEPTH == 16 * 8);
-  assert(FILTER_BITS == MESSAGE_ID_SIZE);
-  assert(PID_SIZE >= 16);
-  assert(filter_selector < PID_FILTER_SELECTORS);
-  assert(filter_selector >= 0);
-  assert(BLOOM_SIZE == (PID_FILTER_SELECTORS *
-                        NUM_FILTERS * FILTER_DEPTH * FILTER_WIDTH / 8));
-  bloom_init (1);
-  int increment_filter_load = 0;
-  int filter_depth;
-  for (filter_depth = 0; filter_depth < FILTER_DEPTH; filter_depth++) {
-    uint16_t pos = readb16 ((char *) id + filter_depth * 2);
-    uint16_t index = pos / 8;
-    uint16_t offset = pos % 8;
-    int old_value = bloom_filter [filter_selector] [0] [filter_depth] [index];
-    int new_value = old_value | (1 << offset);
-    bloom_filter [filter_selector] [0] [filter_depth] [index] = new_value;
-    if (old_value != new_value)
-      increment_filter_load = 1;
+  uint64_t * newest = bloom_filter [filter_selector] [block] [0];
+  uint64_t changed = 0;
+  int w;
+  for (w = 0; w < BLOCK_WORDS; w++) {
+    changed |= (mask [w] & ~(newest [w]));
+    newest [w] |= mask [w];
   }
 /* we increment the filter load if any bit has been set.
- * this is not accurate -- we might not have set a bit at
- * the depth that has the maximum filter load.
- * although inaccurate, it is a safe thing to do since
+ * this is not accurate -- some of the bits may have already been set
+ * by other IDs.  Although inaccurate, it is a safe thing to do since
  * it means the filter load is an overestimate, and we may
  * save too soon but not too late. */
-  if (increment_filter_load) {
+  if (changed != 0) {
     filter_load [filter_selector] += 1;
     if (filter_load [filter_selector] > MAX_FILTER_LOAD) {
 printf ("advancing and saving bloom filter %d with load %d, life is good\n",
@@ -183,14 +203,58 @@ printf ("advancing and saving bloom filter %d with load %d, life is good\n",
   }
 }
 
+/* return 1 if the id is found in one of the filters.  If refresh
+ * is nonzero, an id found in an older filter is also added to filter 0 */
+static int bloom_lookup (const char * id, int filter_selector, int refresh)
+{
+  uint64_t mask [BLOCK_WORDS];
+  int block = block_mask (id, mask);
+  int filter_num;
+  for (filter_num = 0; filter_num < NUM_FILTERS; filter_num++) {
+    if (block_has_mask (bloom_filter [filter_selector] [block] [filter_num],
+                        mask)) {
+      if (refresh && (filter_num > 0))  /* also add into top-level filter */
+        add_mask (filter_selector, block, mask);
+      return 1;
+    }
+  }
+  return 0;
+}
+
+/* id should refer to at least 16 bytes, and PID_SIZE should be 16 or more
+ * filter_selector should be one of the PID_*_FILTER values
+ * return 1 if the id is found in one of the filters. */
+int pid_is_in_bloom (const char * id, int filter_selector)
+{
+  check_sizes (filter_selector);
+  bloom_init (1);
+  int result = bloom_lookup (id, filter_selector, 1);
+  METRICS_COUNT ("bloom.lookups", 1);
+  if (result)
+    METRICS_COUNT ("bloom.hits", 1);
+  return result;
+}
+
+/* add this id to filter 0 */
+void pid_add_to_bloom (const char * id, int filter_selector)
+{
+  check_sizes (filter_selector);
+  bloom_init (1);
+  uint64_t mask [BLOCK_WORDS];
+  int block = block_mask (id, mask);
+  add_mask (filter_selector, block, mask);
+}
+
 void pid_save_bloom ()
 {
   if (! bloom_init (0))   /* nothing to save */
     return;
   int fd = open_write_config ("acache", "bloom", 1);
   if (fd >= 0) {
-    ssize_t write_size = BLOOM_SIZE;
-    ssize_t written = write (fd, bloom_filter, BLOOM_SIZE);
+    ssize_t write_size = BLOOM_FILE_SIZE;
+    ssize_t written = write (fd, bloom_file_magic, sizeof (bloom_file_magic));
+    if (written == sizeof (bloom_file_magic))
+      written += write (fd, bloom_filter, BLOOM_SIZE);
     if (written < 0)
       perror ("write ~/.allnet/acache/bloom\n");
     else if (written != write_size)
@@ -208,15 +272,13 @@ void pid_advance_bloom ()
     return;
   int sel;
   for (sel = 0; sel < PID_FILTER_SELECTORS; sel++) {
-    int index;
-/* for (index = NUM_FILTERS - 1; index >= 0; index--)
-printf ("memcpy (%p, %p, %zd) (%p...%p)\n", &(bloom_filter [sel] [index + 1]),
-&(bloom_filter [sel] [index]), sizeof (bloom_filter [sel] [index]),
-bloom_filter, ((char *) bloom_filter) + sizeof (bloom_filter)); */
-    for (index = NUM_FILTERS - 2; index >= 0; index--)
-      memcpy (&(bloom_filter [sel] [index + 1]), &(bloom_filter [sel] [index]),
-              sizeof (bloom_filter [sel] [index]));
-    memset (&(bloom_filter [sel] [0]), 0, sizeof (bloom_filter [sel] [0]));
+    int block;
+    for (block = 0; block < NUM_BLOCKS; block++) {
+      uint64_t (* filters) [BLOCK_WORDS] = bloom_filter [sel] [block];
+      memmove (filters + 1, filters,
+               (NUM_FILTERS - 1) * sizeof (filters [0]));
+      memset (filters [0], 0, sizeof (filters [0]));
+    }
     filter_load [sel] = 0;
   }
 }
@@ -237,7 +299,6 @@ int main ()
 {
   char id1 [MESSAGE_ID_SIZE];
   assert (sizeof (id1) == 16);
-  assert (sizeof (id1) == FILTER_BITS/8 * FILTER_DEPTH);
   random_bytes (id1, sizeof (id1));
   print_buffer (id1, 16, "random id1    ", 16, 1);
   if (pid_is_in_bloom (id1, 0))
@@ -274,3 +335,115 @@ int main ()
 }
 
 #endif /* TEST_PID_BLOOM */
+
+#ifdef BENCHMARK_PID_BLOOM
+
+/* the earlier layout, with a separate array of 65536 bits for each
+ * of the 8 16-bit pieces of the ID, and the same total size */
+#define OLD_FILTER_DEPTH	8
+#define OLD_FILTER_WIDTH	65536
+static char old_filter [PID_FILTER_SELECTORS] [NUM_FILTERS]
+                       [OLD_FILTER_DEPTH] [OLD_FILTER_WIDTH / 8];
+
+static void old_add (const char * id, int sel)
+{
+  int depth;
+  for (depth = 0; depth < OLD_FILTER_DEPTH; depth++) {
+    uint16_t pos = readb16 (id + depth * 2);
+    old_filter [sel] [0] [depth] [pos / 8] |= (1 << (pos % 8));
+  }
+}
+
+/* like bloom_lookup with refresh 0 */
+static int old_is_in (const char * id, int sel)
+{
+  int filter_num;
+  for (filter_num = 0; filter_num < NUM_FILTERS; filter_num++) {
+    int depth;
+    for (depth = 0; depth < OLD_FILTER_DEPTH; depth++) {
+      uint16_t pos = readb16 (id + depth * 2);
+      if ((old_filter [sel] [filter_num] [depth] [pos / 8] &
+           (1 << (pos % 8))) == 0)
+        break;
+    }
+    if (depth >= OLD_FILTER_DEPTH)
+      return 1;
+  }
+  return 0;
+}
+
+static void old_advance ()
+{
+  int sel;
+  for (sel = 0; sel < PID_FILTER_SELECTORS; sel++) {
+    memmove (old_filter [sel] [1], old_filter [sel] [0],
+             (NUM_FILTERS - 1) * sizeof (old_filter [sel] [0]));
+    memset (old_filter [sel] [0], 0, sizeof (old_filter [sel] [0]));
+  }
+}
+
+#define BENCH_LOOKUPS	2000000
+
+/* fill every generation of both layouts with about MAX_FILTER_LOAD IDs
+ * (the most each generation holds), then time lookups of IDs that
+ * are in the filter, and of random IDs.  The lookups do not refresh,
+ * so the filters do not change while being measured. */
+int main ()
+{
+  assert (sizeof (old_filter) == BLOOM_SIZE);
+  printf ("filter size %d bytes for each layout\n", (int) BLOOM_SIZE);
+  bloom_init (1);
+  int gen;
+  for (gen = 0; gen < NUM_FILTERS; gen++) {  /* clear any file contents */
+    pid_advance_bloom ();
+    old_advance ();
+  }
+  int per_filter = MAX_FILTER_LOAD - 1;  /* so pid_add_to_bloom won't advance */
+  int num_ids = NUM_FILTERS * per_filter;
+  char * ids = malloc_or_fail (num_ids * PID_SIZE, "pid_bloom benchmark");
+  random_bytes (ids, num_ids * PID_SIZE);
+  int i;
+  for (i = 0; i < num_ids; i++) {
+    if ((i > 0) && ((i % per_filter) == 0)) {
+      pid_advance_bloom ();
+      old_advance ();
+    }
+    pid_add_to_bloom (ids + i * PID_SIZE, 0);
+    old_add (ids + i * PID_SIZE, 0);
+  }
+  char * random_ids = malloc_or_fail (BENCH_LOOKUPS * PID_SIZE,
+                                      "pid_bloom benchmark random");
+  random_bytes (random_ids, BENCH_LOOKUPS * PID_SIZE);
+  int layout;
+  for (layout = 0; layout < 2; layout++) {
+    const char * name = ((layout == 0) ? "earlier" : "blocked");
+    int found = 0;
+    unsigned long long int start = allnet_time_us ();
+    for (i = 0; i < BENCH_LOOKUPS; i++) {
+      /* spread the lookups over all the generations */
+      const char * id = ids + ((i * 7919LL) % num_ids) * PID_SIZE;
+      found += ((layout == 0) ? old_is_in (id, 0) : bloom_lookup (id, 0, 0));
+    }
+    unsigned long long int present_us = allnet_time_us () - start;
+    /* almost all the random IDs are not in the filter, so each lookup
+     * checks every generation, and each one found is a false positive */
+    int false_positives = 0;
+    start = allnet_time_us ();
+    for (i = 0; i < BENCH_LOOKUPS; i++) {
+      const char * id = random_ids + i * PID_SIZE;
+      false_positives +=
+        ((layout == 0) ? old_is_in (id, 0) : bloom_lookup (id, 0, 0));
+    }
+    unsigned long long int absent_us = allnet_time_us () - start;
+    printf ("%s: %d/%d found, %.0f lookups/s present, %.0f lookups/s absent\n",
+            name, found, BENCH_LOOKUPS,
+            BENCH_LOOKUPS * 1000000.0 / (present_us + 1),
+            BENCH_LOOKUPS * 1000000.0 / (absent_us + 1));
+    printf ("%s: false positive rate %g (%d/%d, %d generations)\n",
+            name, false_positives / (double) BENCH_LOOKUPS,
+            false_positives, BENCH_LOOKUPS, NUM_FILTERS);
+  }
+  return 0;
+}
+
+#endif /* BENCHMARK_PID_BLOOM */
@@ -17,8 +17,8 @@
 
 /* id should refer to at least 16 bytes, and PID_SIZE should be 16 or more
  * filter_selector should be one of the PID_*_FILTER values
- * return 1 if the id (of size FILTER_BITS/8 * FILTER_DEPTH) is found
- * in one of the filters. */
+ * return 1 if the id is found in one of the filters (in which case
+ * it is also added to the newest filter). */
 extern int pid_is_in_bloom (const char * id, int filter_selector);
 
 /* id should refer to at least 16 bytes, and PID_SIZE should be 16 or more
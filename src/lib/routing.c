@@ -30,8 +30,25 @@ static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
 struct peer_info {
   struct addr_info ai;
   int refreshed;
+  /* for DHT peers, measured from the keepalives we send them.  Each
+   * keepalive has a stamp that the peer echoes, so only its answers
+   * (and not the peer's own periodic keepalives) are timed */
+  unsigned int keepalive_stamp;           /* 0 if none unanswered */
+  unsigned long long int keepalive_sent;  /* us, when it was sent */
+  unsigned long long int rtt;   /* smoothed round-trip time in us, 0 if none */
+  int loss;                     /* smoothed fraction of keepalives lost, /1000 */
+  int send_failures;            /* number of consecutive failed sends */
 };
 
+/* among equally close peers, routing_top_dht_matches prefers the peers
+ * with the lowest round-trip time, scaled up by their loss rate.
+ * Peers that have not been measured are assumed to have this rtt */
+#define UNMEASURED_RTT		(500 * 1000)   /* 500ms, in us */
+/* peers that lose more keepalives than this are only used last */
+#define MAX_LOSS		750            /* 75% */
+/* a peer is moved to the ping list after this many failed sends */
+#define MAX_SEND_FAILURES	3
+
 struct peer_info peers [MAX_PEERS];
 
 /* for now use a fixed-size array of addr_infos to store the ping list. */
@@ -599,6 +616,44 @@ static int addr_in_list (const unsigned char * addr,
   return 0;
 }
 
+/* lower is better: the expected time to reach the peer, given its
+ * round-trip time and its loss rate */
+static unsigned long long int peer_cost (const struct peer_info * p)
+{
+  if ((p->send_failures > 0) || (p->loss > MAX_LOSS))
+    return ~0ULL;
+  unsigned long long int rtt = ((p->rtt > 0) ? p->rtt : UNMEASURED_RTT);
+  return (rtt * 1000) / (1000 - p->loss);
+}
+
+/* sets order to the columns of the row, with the peers closest to dest
+ * first, and among equally close peers, the ones with the lowest cost.
+ * Otherwise the order of the row (most recently added first) is kept */
+static void sort_row (int row, const unsigned char * dest, int nbits,
+                      int * order)
+{
+  int bits [PEERS_PER_BIT];
+  unsigned long long int cost [PEERS_PER_BIT];
+  int i;
+  for (i = 0; i < PEERS_PER_BIT; i++) {
+    struct peer_info * p = peers + (row * PEERS_PER_BIT + i);
+    bits [i] = ((p->ai.nbits > 0) ?
+                matching_bits (dest, nbits, p->ai.destination, ADDRESS_BITS) :
+                -1);
+    cost [i] = peer_cost (p);
+    /* insertion sort, only moving entries that are strictly worse */
+    int j = i;
+    while ((j > 0) &&
+           ((bits [order [j - 1]] < bits [i]) ||
+            ((bits [order [j - 1]] == bits [i]) &&
+             (cost [order [j - 1]] > cost [i])))) {
+      order [j] = order [j - 1];
+      j--;
+    }
+    order [j] = i;
+  }
+}
+
 /* fills in an array of sockaddr_storage to the top internet addresses
  * (up to max_matches) for the given AllNet address.
  * returns the number of matches
@@ -628,8 +683,10 @@ print_dht (0); */
   init_peers (0, 0);
   int row, col;
   for (row = ADDRESS_BITS - 1; ((peer < max_matches) && (row >= 0)); row--) {
+    int order [PEERS_PER_BIT];
+    sort_row (row, dest, nbits, order);
     for (col = 0; ((peer < max_matches) && (col < PEERS_PER_BIT)); col++) {
-      struct addr_info * ai = &(peers [row * PEERS_PER_BIT + col].ai);
+      struct addr_info * ai = &(peers [row * PEERS_PER_BIT + order [col]].ai);
 /* the DHT forwarding is to include up to max_matches neighbors from
  * the routing table, each of them closer than I am to the destination */
       if ((ai->nbits > 0) &&
@@ -800,9 +857,12 @@ int routing_add_dht (struct addr_info addr)
       peers [ip_index].ai.nbits = 0;
     int limit = PEERS_PER_BIT - 1;
     result = 1;   /* new, unless found >= 0 */
+    struct peer_info entry;   /* a new peer has not been measured */
+    memset (&entry, 0, sizeof (entry));
     if (found >= 0) {
       result = 0; /* not new */
       limit = found;   /* move this address to the front of this bit */
+      entry = peers [index + found];   /* keep its measurements */
     }
 #ifdef DEBUG_PRINT
     if (result != 0)
@@ -814,8 +874,9 @@ int routing_add_dht (struct addr_info addr)
      * if found < 0, limit is PEERS_PER_BIT - 1, drop the last address */
     for (i = limit; i > 0; i--)
       peers [index + i] = peers [index + i - 1]; 
-    peers [index].ai = addr;   /* put this one in front */
-    peers [index].refreshed = 1;
+    entry.ai = addr;
+    entry.refreshed = 1;
+    peers [index] = entry;   /* put this one in front */
     if (found < 0)   /* if it is in the ping list, delete it from there */
       delete_ping (&addr);
   }
@@ -972,6 +1033,110 @@ void routing_expire_dht (struct socket_set * s)
 #endif /* DEBUG_PRINT */
 }
 
+/* returns the index of the peer with this internet address, or -1 */
+static int find_peer_sockaddr (const struct sockaddr_storage * addr,
+                               socklen_t alen)
+{
+  int i;
+  for (i = 0; i < MAX_PEERS; i++) {
+    if (peers [i].ai.nbits > 0) {
+      struct sockaddr_storage sas;
+      memset (&sas, 0, sizeof (sas));
+      socklen_t slen;
+      if ((ai_to_sockaddr (&(peers [i].ai), &sas, &slen)) &&
+          (same_sockaddr (&sas, slen, addr, alen)))
+        return i;
+    }
+  }
+  return -1;
+}
+
+unsigned int routing_keepalive_sent (const struct sockaddr_storage * addr,
+                                     socklen_t alen)
+{
+  unsigned int stamp = 0;
+  pthread_mutex_lock (&mutex);
+  init_peers (0, 0);
+  int i = find_peer_sockaddr (addr, alen);
+  if (i >= 0) {
+    struct peer_info * p = peers + i;
+    /* the previous one was not answered.  Peers that never answer
+     * (e.g. older versions) are not penalized, only left unmeasured */
+    if ((p->keepalive_stamp != 0) && (p->rtt > 0))
+      p->loss += (1000 - p->loss) / 8;
+    unsigned long long int now = allnet_time_us ();
+    /* any nonzero value that differs from the last stamp will do */
+    stamp = ((now / 1000) & 0xffff);
+    if ((stamp == 0) || (stamp == p->keepalive_stamp))
+      stamp = (p->keepalive_stamp % 0xffff) + 1;
+    p->keepalive_stamp = stamp;
+    p->keepalive_sent = now;
+  }
+  pthread_mutex_unlock (&mutex);
+  return stamp;
+}
+
+void routing_keepalive_answered (const struct sockaddr_storage * addr,
+                                 socklen_t alen, unsigned int stamp)
+{
+  if (stamp == 0)   /* not an answer to one of our timed keepalives */
+    return;
+  pthread_mutex_lock (&mutex);
+  init_peers (0, 0);
+  int i = find_peer_sockaddr (addr, alen);
+  if ((i >= 0) && (peers [i].keepalive_stamp == stamp)) {
+    struct peer_info * p = peers + i;
+    unsigned long long int now = allnet_time_us ();
+    unsigned long long int sample =
+      ((now > p->keepalive_sent) ? (now - p->keepalive_sent) : 1);
+    /* smoothed as in TCP, with 1/8 weight for the new sample */
+    p->rtt = ((p->rtt == 0) ? sample : ((7 * p->rtt + sample) / 8));
+    p->loss -= p->loss / 8;
+    p->keepalive_stamp = 0;   /* later echoes of this stamp are not timed */
+  }
+  pthread_mutex_unlock (&mutex);
+}
+
+void routing_send_result (const struct sockaddr_storage * addr,
+                          socklen_t alen, int sent)
+{
+  if (sent < 0)   /* a local error, says nothing about the peer */
+    return;
+  /* called for every send, so only look for the peer if it may need
+   * updating, i.e. after a failure */
+  static int any_failures = 0;
+  pthread_mutex_lock (&mutex);
+  if ((sent) && (! any_failures)) {
+    pthread_mutex_unlock (&mutex);
+    return;
+  }
+  init_peers (0, 0);
+  int i = find_peer_sockaddr (addr, alen);
+  if (i >= 0) {
+    if (sent) {
+      peers [i].send_failures = 0;
+      any_failures = 0;
+      int j;
+      for (j = 0; j < MAX_PEERS; j++)
+        if ((peers [j].ai.nbits > 0) && (peers [j].send_failures > 0))
+          any_failures = 1;
+    } else if (++(peers [i].send_failures) < MAX_SEND_FAILURES) {
+      any_failures = 1;
+    } else {
+      /* do not wait for routing_expire_dht, move it to the ping list now */
+      struct addr_info copy = peers [i].ai;
+      peers [i].ai.nbits = 0;
+      int n = snprintf (alog->b, alog->s, "%d sends failed, removing peer ",
+                        peers [i].send_failures);
+      addr_info_to_string (&copy, alog->b + n, alog->s - n);
+      log_print (alog);
+      routing_add_ping_locked (&copy);
+      save_peers ();
+    }
+  }
+  pthread_mutex_unlock (&mutex);
+}
+
 static struct addr_info * get_nth_peer (int n)
 {
   int i;
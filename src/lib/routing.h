@@ -27,6 +27,24 @@ extern int routing_top_dht_matches (const unsigned char * dest, int nbits,
                                     struct sockaddr_storage * result,
                                     socklen_t * alen, int max_matches);
 
+/* keep track of the round-trip time and loss rate of each DHT peer:
+ * call routing_keepalive_sent before sending a keepalive to the address,
+ * and send the keepalive with the stamp it returns (0 if the address is
+ * not a DHT peer).  Call routing_keepalive_answered with the stamp echoed
+ * in each authenticated keepalive received from the address.  Only the
+ * first echo of the latest stamp is timed */
+extern unsigned int routing_keepalive_sent (const struct sockaddr_storage * addr,
+                                            socklen_t alen);
+extern void routing_keepalive_answered (const struct sockaddr_storage * addr,
+                                        socklen_t alen, unsigned int stamp);
+
+/* call with the result of each send to a DHT peer: sent is 1 if the send
+ * succeeded, 0 if it failed because of the peer, and -1 (ignored) if it
+ * failed for local reasons.  A peer whose sends keep failing is moved to
+ * the ping list without waiting for routing_expire_dht */
+extern void routing_send_result (const struct sockaddr_storage * addr,
+                                 socklen_t alen, int sent);
+
 /* either adds or refreshes a DHT entry.
  * returns 1 for a new entry, 0 for an existing entry, -1 for errors */
 extern int routing_add_dht (struct addr_info addr);
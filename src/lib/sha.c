@@ -18,11 +18,6 @@ static int debugging = 0;
 #define DEBUG_PRINT
 #endif /* SHA_UNIT_TEST */
 
-typedef union uint512 {
-  unsigned char c [512 / 8];
-  uint64_t i [512 / (8 * sizeof (uint64_t))];
-} uint512;
-
 typedef union uint160 {
   unsigned char c [160 / 8];   			/* 20 bytes */
   uint32_t i [160 / (8 * sizeof (uint32_t))];  	/* 5 words */
@@ -186,12 +181,12 @@ static inline void init_w (uint64_t * W, const uint64_t * block)
 }
 
 /* do the basic hash of one block. */
-/* block is the 512-bit/64-byte/16-word input block.
- * hash is the 160-bit/20-byte/5-word input and output hash
+/* block is the 1024-bit/128-byte/16-word input block.
+ * hash is the 512-bit/64-byte/8-word input and output hash
  * native_in is 1 if we don't have to revert the bytes of the block on
  * a little-endian machine */
 static void compute_sha512 (const uint64_t * block,
-                            uint512 * hash, int native_in) 
+                            uint64_t * hash, int native_in)
 {
   uint64_t W [80];
   int t;
@@ -207,14 +202,14 @@ static void compute_sha512 (const uint64_t * block,
 #endif /* __BYTE_ORDER == __LITTLE_ENDIAN */
 
   /* step 2 */
-  uint64_t a = hash->i [0];
-  uint64_t b = hash->i [1];
-  uint64_t c = hash->i [2];
-  uint64_t d = hash->i [3];
-  uint64_t e = hash->i [4];
-  uint64_t f = hash->i [5];
-  uint64_t g = hash->i [6];
-  uint64_t h = hash->i [7];
+  uint64_t a = hash [0];
+  uint64_t b = hash [1];
+  uint64_t c = hash [2];
+  uint64_t d = hash [3];
+  uint64_t e = hash [4];
+  uint64_t f = hash [5];
+  uint64_t g = hash [6];
+  uint64_t h = hash [7];
 #ifdef DEBUG_PRINT
   if (debugging)
     printf ("in: %016" PRIx64 " %016" PRIx64 " %016" PRIx64 " %016" PRIx64 " %016" PRIx64 " %016" PRIx64 " %016" PRIx64 " %016" PRIx64 "\n",
@@ -244,85 +239,96 @@ static void compute_sha512 (const uint64_t * block,
   }
 
   /* step 4 */
-  hash->i [0] += a;
-  hash->i [1] += b;
-  hash->i [2] += c;
-  hash->i [3] += d;
-  hash->i [4] += e;
-  hash->i [5] += f;
-  hash->i [6] += g;
-  hash->i [7] += h;
+  hash [0] += a;
+  hash [1] += b;
+  hash [2] += c;
+  hash [3] += d;
+  hash [4] += e;
+  hash [5] += f;
+  hash [6] += g;
+  hash [7] += h;
   if (debugging)
     printf ("hash = %16" PRIx64 " %16" PRIx64 " %16" PRIx64 " %16" PRIx64 " %16" PRIx64 " %16" PRIx64 " %16" PRIx64 " %16" PRIx64 "\n",
-            hash->i [0], hash->i [1], hash->i [2], hash->i [3],
-            hash->i [4], hash->i [5], hash->i [6], hash->i [7]);
+            hash [0], hash [1], hash [2], hash [3],
+            hash [4], hash [5], hash [6], hash [7]);
 }
 
-/* the result array must have size SHA512_SIZE */
-/* #define SHA512_SIZE	64 */
-void sha512 (const char * input, int bytes, char * result)
+void sha512_init (struct sha512_state * state)
 {
-  int i;
-  if (bytes < 0) {
+  memcpy (state->hash, init_H512, sizeof (init_H512));
+  state->length = 0;
+}
+
+void sha512_update (struct sha512_state * state, const char * data, int dsize)
+{
+  if (dsize < 0) {
     printf ("error in sha computation; %d (%x) bytes requested\n",
-            bytes, bytes);
+            dsize, dsize);
     exit (1);
   }
-  /* padding */
-  unsigned int bits = bytes * 8;
-  int input_blocks = bytes / SHA512_BLOCK_SIZE;
-  char last1 [SHA512_BLOCK_SIZE];  /* next-to-last block, has data from input */
-  char last2 [SHA512_BLOCK_SIZE];  /* last block, may not be needed */
-  memset (last1, 0, SHA512_BLOCK_SIZE);
-  memset (last2, 0, SHA512_BLOCK_SIZE);
-  int last_bytes = bytes % SHA512_BLOCK_SIZE;
-  int padding = SHA512_BLOCK_SIZE - last_bytes;
-  if (last_bytes > 0)
-    memcpy (last1, input + (bytes - last_bytes), last_bytes);
-  if (padding > 0)
-    last1 [last_bytes] = 0x80;
-  else
-    last2 [0] = 0x80;
-  /* sha512 has 16B for 2^128 bytes, my ints are 64 bits/8B long */
-  if (padding < 17)  /* so we extend if padding < 17, but only write 8 bytes */
-    write_int (last2 + (SHA512_BLOCK_SIZE - 8), bits);
-  else
-    write_int (last1 + (SHA512_BLOCK_SIZE - 8), bits);
-  uint512 hash;
-  memcpy (hash.c, init_H512, sizeof (init_H512));
-  for (i = 0; i < input_blocks; i++) {
-    compute_sha512 (((uint64_t *) (input + 128 * i)), &hash, 0);
-#ifdef DEBUG_PRINT
-    printf ("hash is %016" PRIx64 " %016" PRIx64 " %016" PRIx64 " %016" PRIx64 " %016" PRIx64 " %016" PRIx64 " %016" PRIx64 " %016" PRIx64 "\n",
-            hash.i [0], hash.i [1], hash.i [2], hash.i [3],
-            hash.i [4], hash.i [5], hash.i [6], hash.i [7]);
-    print_data (hash.c, 64);
-#endif /* DEBUG_PRINT */
+  int used = (int) (state->length % SHA512_BLOCK_SIZE);
+  state->length += dsize;
+  if (used > 0) {  /* first fill the partial block from an earlier call */
+    int fill = SHA512_BLOCK_SIZE - used;
+    if (fill > dsize)
+      fill = dsize;
+    memcpy (state->buffer + used, data, fill);
+    if (used + fill < SHA512_BLOCK_SIZE)
+      return;
+    compute_sha512 ((uint64_t *) (state->buffer), state->hash, 0);
+    data += fill;
+    dsize -= fill;
+  }
+  /* compute_sha512 reads the input a byte at a time unless native_in,
+   * so data need not be aligned */
+  while (dsize >= SHA512_BLOCK_SIZE) {
+    compute_sha512 ((const uint64_t *) data, state->hash, 0);
+    data += SHA512_BLOCK_SIZE;
+    dsize -= SHA512_BLOCK_SIZE;
   }
-  compute_sha512 (((uint64_t *) last1), &hash, 0);
-  if (padding < 17)
-    compute_sha512 (((uint64_t *) last2), &hash, 0);
+  if (dsize > 0)
+    memcpy (state->buffer, data, dsize);
+}
+
+static void write_hash (const uint64_t * hash, char * result)
+{
+  int i;
+  for (i = 0; i < SHA512_SIZE / 8; i++)
+    write_int (result + 8 * i, hash [i]);
+}
+
+void sha512_final (struct sha512_state * state, char * result)
+{
+  int used = (int) (state->length % SHA512_BLOCK_SIZE);
+  state->buffer [used++] = (char) 0x80;
+  /* sha512 has 16B for 2^128 bits, my lengths are 64 bits/8B long */
+  if (used > SHA512_BLOCK_SIZE - 16) {  /* no room for the length */
+    memset (state->buffer + used, 0, SHA512_BLOCK_SIZE - used);
+    compute_sha512 ((uint64_t *) (state->buffer), state->hash, 0);
+    used = 0;
+  }
+  memset (state->buffer + used, 0, SHA512_BLOCK_SIZE - 8 - used);
+  write_int (state->buffer + (SHA512_BLOCK_SIZE - 8), state->length * 8);
+  compute_sha512 ((uint64_t *) (state->buffer), state->hash, 0);
 #ifdef DEBUG_PRINT
   if (debugging) {
     printf ("final hash is %016" PRIx64 " %016" PRIx64 " %016" PRIx64 " %016" PRIx64 " %016" PRIx64 " %016" PRIx64 " %016" PRIx64 " %016" PRIx64 "\n",
-            hash.i [0], hash.i [1], hash.i [2], hash.i [3],
-            hash.i [4], hash.i [5], hash.i [6], hash.i [7]);
-    print_data (hash.c, 64);
+            state->hash [0], state->hash [1], state->hash [2],
+            state->hash [3], state->hash [4], state->hash [5],
+            state->hash [6], state->hash [7]);
   }
 #endif /* DEBUG_PRINT */
+  write_hash (state->hash, result);
+}
 
-#if __BYTE_ORDER == __LITTLE_ENDIAN
-  write_int (result     , hash.i [0]);
-  write_int (result +  8, hash.i [1]);
-  write_int (result + 16, hash.i [2]);
-  write_int (result + 24, hash.i [3]);
-  write_int (result + 32, hash.i [4]);
-  write_int (result + 40, hash.i [5]);
-  write_int (result + 48, hash.i [6]);
-  write_int (result + 56, hash.i [7]);
-#else /* __BYTE_ORDER != __LITTLE_ENDIAN */
-  memcpy (result, hash.c, SHA512_SIZE);
-#endif /* __BYTE_ORDER == __LITTLE_ENDIAN */
+/* the result array must have size SHA512_SIZE */
+/* #define SHA512_SIZE	64 */
+void sha512 (const char * input, int bytes, char * result)
+{
+  struct sha512_state state;
+  sha512_init (&state);
+  sha512_update (&state, input, bytes);
+  sha512_final (&state, result);
 }
 
 /* the result array must have size rsize, only the first rsize bytes
@@ -526,31 +532,8 @@ void sha1_bytes (const char * data, int dsize, char * result, int rsize)
   }
 }
 
-/* returns the new buffer, setting allocated to true if we've
- * done a malloc and caller should free the result.  The hope is
- * that, in most cases, no allocation will be needed */
-static char * malloc_concat (const char * s1, int s1len,
-                             const char * s2, int s2len,
-                             char * buffer, int bsize, int * allocated)
-{
-  int size = s1len + s2len;
-  int allocate = (size > bsize);
-  if (allocate)
-    buffer = malloc (s1len + s2len);
-  if (allocate && (buffer == NULL)) {
-    printf ("malloc_concat: unable to allocate %d + %d = %d bytes\n",
-            s1len, s2len, s1len + s2len);
-    exit (1);
-  }
-  memcpy (buffer, s1, s1len);
-  memcpy (buffer + s1len, s2, s2len);
-  *allocated = allocate;
-  return buffer;
-}
-
-/* the result array must have size SHA512_SIZE */
-void sha512hmac (const char * data, int dsize, const char * key, int ksize,
-                 char * result)
+void sha512hmac_init (struct sha512hmac_key * hk,
+                      const char * key, int ksize)
 {
   char key_copy [SHA512_BLOCK_SIZE];
   memset (key_copy, 0, sizeof (key_copy));
@@ -568,19 +551,154 @@ void sha512hmac (const char * data, int dsize, const char * key, int ksize,
     ipad [i] = 0x36 ^ key_copy [i];
     opad [i] = 0x5c ^ key_copy [i];
   }
+  /* each pad is exactly one block, so these only keep the hash state */
+  sha512_init (&(hk->inner));
+  sha512_update (&(hk->inner), ipad, SHA512_BLOCK_SIZE);
+  sha512_init (&(hk->outer));
+  sha512_update (&(hk->outer), opad, SHA512_BLOCK_SIZE);
+  memset (key_copy, 0, sizeof (key_copy));
+  memset (ipad, 0, sizeof (ipad));
+  memset (opad, 0, sizeof (opad));
+}
 
+void sha512hmac_keyed (const struct sha512hmac_key * hk,
+                       const char * data, int dsize, char * result)
+{
+  struct sha512_state state = hk->inner;
   char hash1 [SHA512_SIZE];
-  char buffer [20000];  /* for things smaller than this, no need to allocate */
-  int allocated = 0;
-  char * data1 = malloc_concat (ipad, SHA512_BLOCK_SIZE, data, dsize,
-                                buffer, sizeof (buffer), &allocated);
-  sha512 (data1, SHA512_BLOCK_SIZE + dsize, hash1);
-  if (allocated)
-    free (data1);
-  assert (sizeof (buffer) >= SHA512_BLOCK_SIZE + SHA512_SIZE);
-  memcpy (buffer, opad, SHA512_BLOCK_SIZE);
-  memcpy (buffer + SHA512_BLOCK_SIZE, hash1, SHA512_SIZE);
-  sha512 (buffer, SHA512_BLOCK_SIZE + SHA512_SIZE, result);
+  sha512_update (&state, data, dsize);
+  sha512_final (&state, hash1);
+  state = hk->outer;
+  sha512_update (&state, hash1, SHA512_SIZE);
+  sha512_final (&state, result);
+}
+
+/* the result array must have size SHA512_SIZE */
+void sha512hmac (const char * data, int dsize, const char * key, int ksize,
+                 char * result)
+{
+  struct sha512hmac_key hk;
+  sha512hmac_init (&hk, key, ksize);
+  sha512hmac_keyed (&hk, data, dsize, result);
+}
+
+/* the batch hash works on SHA512_LANES inputs at a time, each in its
+ * own lane of a vector.  The compiler uses vector instructions where
+ * it can, and plain 64-bit operations otherwise */
+#define SHA512_LANES	4
+typedef uint64_t lanes __attribute__ ((vector_size (8 * SHA512_LANES)));
+
+#define lanes_rotr(n, x) (((x) >> (n)) | ((x) << (64 - (n))))
+
+static inline __attribute__ ((always_inline))
+  void compute_sha512_lanes (lanes * W, lanes * hash)
+{
+  int t;
+  for (t = 16; t < 80; t++) {
+    lanes s0 = lanes_rotr (1, W [t - 15]) ^ lanes_rotr (8, W [t - 15]) ^
+               (W [t - 15] >> 7);
+    lanes s1 = lanes_rotr (19, W [t - 2]) ^ lanes_rotr (61, W [t - 2]) ^
+               (W [t - 2] >> 6);
+    W [t] = s1 + W [t - 7] + s0 + W [t - 16];
+  }
+  lanes a = hash [0];
+  lanes b = hash [1];
+  lanes c = hash [2];
+  lanes d = hash [3];
+  lanes e = hash [4];
+  lanes f = hash [5];
+  lanes g = hash [6];
+  lanes h = hash [7];
+  for (t = 0; t < 80; t++) {
+    lanes S1 = lanes_rotr (14, e) ^ lanes_rotr (18, e) ^ lanes_rotr (41, e);
+    lanes S0 = lanes_rotr (28, a) ^ lanes_rotr (34, a) ^ lanes_rotr (39, a);
+    lanes t1 = h + S1 + ((e & f) ^ ((~e) & g)) + K512 [t] + W [t];
+    lanes t2 = S0 + ((a & b) ^ (a & c) ^ (b & c));
+    h = g;
+    g = f;
+    f = e;
+    e = d + t1;
+    d = c;
+    c = b;
+    b = a;
+    a = t1 + t2;
+  }
+  hash [0] += a;
+  hash [1] += b;
+  hash [2] += c;
+  hash [3] += d;
+  hash [4] += e;
+  hash [5] += f;
+  hash [6] += g;
+  hash [7] += h;
+}
+
+static void compute_sha512_lanes_default (lanes * W, lanes * hash)
+{
+  compute_sha512_lanes (W, hash);
+}
+
+#if defined(__x86_64__) && defined(__GNUC__) && ! defined(__clang__)
+/* with 256-bit vectors, all four lanes are computed together */
+#define SHA512_AVX2
+__attribute__ ((target ("avx2")))
+static void compute_sha512_lanes_avx2 (lanes * W, lanes * hash)
+{
+  compute_sha512_lanes (W, hash);
+}
+#endif /* __x86_64__ && __GNUC__ && ! __clang__ */
+
+/* hashes count inputs of dsize bytes each, stored one after the other
+ * in data, saving rsize bytes of each hash into results, as
+ * sha512_bytes would.  dsize must be at most SHA512_MAX_BATCH_INPUT */
+void sha512_bytes_batch (const char * data, int dsize, int count,
+                         char * results, int rsize)
+{
+  if ((dsize < 0) || (dsize > SHA512_MAX_BATCH_INPUT)) {
+    printf ("error in sha512_bytes_batch: %d bytes, at most %d allowed\n",
+            dsize, SHA512_MAX_BATCH_INPUT);
+    exit (1);
+  }
+  int copy = ((rsize < SHA512_SIZE) ? rsize : SHA512_SIZE);
+#ifdef SHA512_AVX2
+  static int use_avx2 = -1;
+  if (use_avx2 < 0)
+    use_avx2 = __builtin_cpu_supports ("avx2");
+#endif /* SHA512_AVX2 */
+  int first;
+  for (first = 0; first < count; first += SHA512_LANES) {
+    lanes W [80];
+    lanes hash [8];
+    int t, l;
+    for (l = 0; l < SHA512_LANES; l++) {
+      /* unused lanes hash the first input again, and are not saved */
+      int index = ((first + l < count) ? (first + l) : first);
+      char block [SHA512_BLOCK_SIZE];
+      memset (block, 0, sizeof (block));
+      memcpy (block, data + index * dsize, dsize);
+      block [dsize] = (char) 0x80;
+      write_int (block + (SHA512_BLOCK_SIZE - 8), ((uint64_t) dsize) * 8);
+      for (t = 0; t < 16; t++)
+        W [t] [l] = read_int (block + 8 * t);
+      for (t = 0; t < 8; t++)
+        hash [t] [l] = init_H512 [t];
+    }
+#ifdef SHA512_AVX2
+    if (use_avx2)
+      compute_sha512_lanes_avx2 (W, hash);
+    else
+#endif /* SHA512_AVX2 */
+      compute_sha512_lanes_default (W, hash);
+    for (l = 0; (l < SHA512_LANES) && (first + l < count); l++) {
+      char sha [SHA512_SIZE];
+      for (t = 0; t < 8; t++)
+        write_int (sha + 8 * t, hash [t] [l]);
+      char * r = results + (first + l) * rsize;
+      memcpy (r, sha, copy);
+      if (rsize > copy)
+        memset (r + copy, 0, rsize - copy);
+    }
+  }
 }
 
 #ifdef SHA_UNIT_TEST
@@ -686,6 +804,66 @@ static void compare_to_openssl ()
 #undef DATA_SIZE
 }
 
+/* the incremental and batch computations must match sha512 */
+static void compare_incremental_and_batch ()
+{
+#define DATA_SIZE	2000
+  char data [DATA_SIZE];
+  int i;
+  for (i = 0; i < DATA_SIZE; i++)
+    data [i] = i * 37 + 11;
+  char expected [SHA512_SIZE];
+  char result [SHA512_SIZE];
+  for (i = 0; i <= DATA_SIZE; i += 7) {
+    sha512 (data, i, expected);
+    struct sha512_state state;
+    sha512_init (&state);
+    int off = 0;
+    int step = 1;
+    while (off < i) {   /* pieces of different sizes */
+      int n = ((off + step <= i) ? step : (i - off));
+      sha512_update (&state, data + off, n);
+      off += n;
+      step = (step * 3 + 1) % 300;
+    }
+    sha512_final (&state, result);
+    if (memcmp (expected, result, SHA512_SIZE) != 0) {
+      printf ("error: incremental sha512 differs for length %d\n", i);
+      exit (1);
+    }
+  }
+  char key [] = "foo bar";
+  struct sha512hmac_key hk;
+  sha512hmac_init (&hk, key, strlen (key));
+  for (i = 0; i <= DATA_SIZE; i += 13) {
+    sha512hmac (data, i, key, strlen (key), expected);
+    sha512hmac_keyed (&hk, data, i, result);
+    if (memcmp (expected, result, SHA512_SIZE) != 0) {
+      printf ("error: keyed hmac differs for length %d\n", i);
+      exit (1);
+    }
+  }
+  int dsize;
+  for (dsize = 0; dsize <= SHA512_MAX_BATCH_INPUT; dsize++) {
+    int count = DATA_SIZE / (dsize + 1);
+    if (count > 11)
+      count = 11;    /* not a multiple of the number of lanes */
+    char batch [11 * 20];
+    sha512_bytes_batch (data, dsize, count, batch, 20);
+    for (i = 0; i < count; i++) {
+      char one [20];
+      sha512_bytes (data + i * dsize, dsize, one, 20);
+      if (memcmp (one, batch + i * 20, 20) != 0) {
+        printf ("error: batch sha512 differs for size %d, index %d\n",
+                dsize, i);
+        exit (1);
+      }
+    }
+  }
+  printf ("incremental, keyed hmac, and batch sha512 give the same results\n");
+#undef DATA_SIZE
+}
+
 int main (int argc, char ** argv)
 {
   if (argc > 1) {
@@ -865,6 +1043,7 @@ int main (int argc, char ** argv)
   run_test_sha1 (sha1_t6, 495, sha1_r6);
 
   compare_to_openssl ();
+  compare_incremental_and_batch ();
 
   return 0;
 }
@@ -3,6 +3,8 @@
 #ifndef ALLNET_SHA_H
 #define ALLNET_SHA_H
 
+#include <stdint.h>
+
 #define SHA1_SIZE	20
 #define SHA512_SIZE	64
 
@@ -24,4 +26,40 @@ extern void sha1_bytes (const char * data, int dsize,
 extern void sha512hmac (const char * data, int dsize,
                         const char * key, int ksize, char * result);
 
+/* incremental computation of sha512, for data that is not contiguous.
+ * sha512_init, then sha512_update any number of times, then sha512_final,
+ * which puts SHA512_SIZE bytes into result.  A state may be copied
+ * (struct assignment) to continue two different computations */
+struct sha512_state {
+  uint64_t hash [8];
+  uint64_t length;     /* number of bytes given to sha512_update so far */
+  char buffer [128];   /* the partial block, if length % 128 != 0 */
+};
+extern void sha512_init (struct sha512_state * state);
+extern void sha512_update (struct sha512_state * state,
+                           const char * data, int dsize);
+extern void sha512_final (struct sha512_state * state, char * result);
+
+/* an hmac key, with the padded key already hashed, so that computing
+ * the hmac of short data only hashes the data and the inner hash.
+ * sha512hmac_keyed gives the same result as sha512hmac with the key
+ * given to sha512hmac_init. */
+struct sha512hmac_key {
+  struct sha512_state inner;
+  struct sha512_state outer;
+};
+extern void sha512hmac_init (struct sha512hmac_key * hk,
+                             const char * key, int ksize);
+extern void sha512hmac_keyed (const struct sha512hmac_key * hk,
+                              const char * data, int dsize, char * result);
+
+/* hashes count inputs of dsize bytes each, stored one after the other
+ * in data, saving rsize bytes of each hash (as for sha512_bytes) one
+ * after the other in results, which must have count * rsize bytes.
+ * Several inputs are hashed at once, so this is faster than calling
+ * sha512_bytes count times.  dsize must be <= SHA512_MAX_BATCH_INPUT */
+#define SHA512_MAX_BATCH_INPUT	111   /* inputs that fit in one block */
+extern void sha512_bytes_batch (const char * data, int dsize, int count,
+                                char * results, int rsize);
+
 #endif /* ALLNET_SHA_H */
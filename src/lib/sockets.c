@@ -1,5 +1,9 @@
 /* manage sockets, mostly for use by ad and app_util */
 
+#ifdef __linux__
+#define _GNU_SOURCE   /* recvmmsg */
+#endif /* __linux__ */
+
 #include <stdio.h>
 #include <unistd.h>
 #include <string.h>
@@ -15,11 +19,20 @@
 #include "util.h"
 #include "priority.h"
 #include "ai.h"   /* same_sockaddr */
+#include "metrics.h"
 
 #ifdef ALLNET_NETPACKET_SUPPORT
 #include <linux/if_packet.h>
 #endif /* ALLNET_NETPACKET_SUPPORT */
 
+#ifdef __linux__
+/* on linux, wait with epoll and receive multiple packets per system call */
+#define USE_EPOLL_RECVMMSG
+#include <sys/epoll.h>
+/* also send to multiple peers per system call */
+#define USE_SENDMMSG
+#endif /* __linux__ */
+
 static pthread_mutex_t global_mutex = PTHREAD_MUTEX_INITIALIZER;
 
 static void lock (const char * caller)
@@ -133,6 +146,140 @@ static void add_priority (const char * message, int msize, unsigned int p,
   writeb16 (buffer + msize, p);
 }
 
+/* each socket_address_set has an open-addressing hash table of indices
+ * into its send_addrs.  The hash only uses the parts of the address
+ * that same_sockaddr compares, with IPv4 addresses and IPv4-in-IPv6
+ * addresses hashing the same, so equal addresses have equal hashes. */
+static uint32_t sockaddr_hash (const struct sockaddr_storage * sas,
+                               socklen_t alen)
+{
+  const unsigned char * key = (const unsigned char *) sas;
+  int ksize = alen;
+  unsigned char buffer [2 + 16];
+  if (alen == sizeof (struct sockaddr_in)) {
+    const struct sockaddr_in * sin = (const struct sockaddr_in *) sas;
+    memcpy (buffer, &(sin->sin_port), 2);
+    memcpy (buffer + 2, &(sin->sin_addr), 4);
+    key = buffer;
+    ksize = 6;
+  } else if (alen == sizeof (struct sockaddr_in6)) {
+    const struct sockaddr_in6 * sin6 = (const struct sockaddr_in6 *) sas;
+    const char * a6 = (const char *) (&(sin6->sin6_addr));
+    memcpy (buffer, &(sin6->sin6_port), 2);
+    if ((readb64 (a6) == 0) && (readb16 (a6 + 8) == 0) &&
+        (readb16 (a6 + 10) == 0xffff)) {  /* IPv4 in IPv6 */
+      memcpy (buffer + 2, a6 + 12, 4);
+      ksize = 6;
+    } else {
+      memcpy (buffer + 2, a6, 16);
+      ksize = 18;
+    }
+    key = buffer;
+  }
+  uint32_t hash = 2166136261u;   /* FNV-1a */
+  int i;
+  for (i = 0; i < ksize; i++)
+    hash = (hash ^ key [i]) * 16777619u;
+  return hash;
+}
+
+static void addr_index_insert (struct socket_address_set * sock, int ai)
+{
+  struct socket_address_validity * sav = sock->send_addrs + ai;
+  uint32_t mask = sock->addr_index_size - 1;
+  uint32_t h = sockaddr_hash (&(sav->addr), sav->alen) & mask;
+  while (sock->addr_index [h] >= 0)
+    h = (h + 1) & mask;
+  sock->addr_index [h] = ai;
+}
+
+/* build the index with room for at least twice as many addresses */
+static void addr_index_rebuild (struct socket_address_set * sock)
+{
+  int size = 16;
+  while (size < 2 * sock->num_addrs)
+    size *= 2;
+  if (size != sock->addr_index_size) {
+    if (sock->addr_index != NULL)
+      free (sock->addr_index);
+    sock->addr_index = malloc_or_fail (size * sizeof (int),
+                                       "sockets.c addr_index");
+    sock->addr_index_size = size;
+  }
+  int i;
+  for (i = 0; i < size; i++)
+    sock->addr_index [i] = -1;
+  for (i = 0; i < sock->num_addrs; i++)
+    addr_index_insert (sock, i);
+}
+
+/* returns the index in send_addrs of the given address, or -1 */
+static int addr_index_find (struct socket_address_set * sock,
+                            const struct sockaddr_storage * sas,
+                            socklen_t alen)
+{
+  if (sock->num_addrs <= 0)
+    return -1;
+  if (sock->addr_index == NULL)
+    addr_index_rebuild (sock);
+  uint32_t mask = sock->addr_index_size - 1;
+  uint32_t h = sockaddr_hash (sas, alen) & mask;
+  while (sock->addr_index [h] >= 0) {
+    struct socket_address_validity * sav =
+      sock->send_addrs + sock->addr_index [h];
+    if (same_sockaddr (sas, alen, &(sav->addr), sav->alen))
+      return sock->addr_index [h];
+    h = (h + 1) & mask;
+  }
+  return -1;
+}
+
+/* packets are received into a ring of slots, and later returned
+ * one (or a few) at a time by socket_read (or socket_read_batch) */
+#define SOCKET_RING_SIZE	64
+struct socket_ring_slot {
+  int sockfd;
+  struct sockaddr_storage from;
+  socklen_t alen;
+  int rcvd;
+  char buffer [SOCKET_READ_MIN_BUFFER];
+};
+
+struct socket_read_ring {
+  int first;          /* index of the first slot holding a packet */
+  int count;          /* number of slots holding packets */
+  int changed;        /* sockets were added or deleted since the last read */
+#ifdef USE_EPOLL_RECVMMSG
+  int epoll_fd;
+#endif /* USE_EPOLL_RECVMMSG */
+  struct socket_ring_slot slots [SOCKET_RING_SIZE];
+};
+
+/* called with the lock held */
+static struct socket_read_ring * get_ring (struct socket_set * s)
+{
+  if (s->ring == NULL) {
+    s->ring = malloc_or_fail (sizeof (struct socket_read_ring),
+                              "socket read ring");
+    s->ring->first = 0;
+    s->ring->count = 0;
+    s->ring->changed = 1;
+#ifdef USE_EPOLL_RECVMMSG
+    s->ring->epoll_fd = epoll_create1 (0);
+    if (s->ring->epoll_fd < 0)
+      perror ("epoll_create1");
+#endif /* USE_EPOLL_RECVMMSG */
+  }
+  return s->ring;
+}
+
+/* called with the lock held, whenever a socket is added or deleted */
+static void sockets_changed (struct socket_set * s)
+{
+  if (s->ring != NULL)
+    s->ring->changed = 1;
+}
+
 static int socket_sock_loop_locked (struct socket_set * s,
                                     socket_sock_loop_fun f, void * ref)
 {
@@ -142,6 +289,9 @@ static int socket_sock_loop_locked (struct socket_set * s,
     struct socket_address_set * sas = &(s->sockets [si]);
     if (! f (sas, ref)) {  /* delete this element */
       close (sas->sockfd);
+      sockets_changed (s);
+      if (sas->addr_index != NULL)
+        free (sas->addr_index);
       count++;
       /* compress the array to replace the deleted element */
       int sim;
@@ -168,12 +318,14 @@ static int socket_addr_loop_locked (struct socket_set * s,
   int si;
   for (si = 0; si < s->num_sockets; si++) {
     struct socket_address_set * sas = s->sockets + si;
+    int deleted = 0;
     int ai;
     for (ai = 0; ai < sas->num_addrs; ai++) {
       struct socket_address_validity * sav = sas->send_addrs + ai;
 check_sav (sav, "socket_addr_loop");
       if (! f (sas, sav, ref)) {  /* delete this element */
         count++;
+        deleted = 1;
         /* compress the array to replace the deleted element */
         int aim;
         for (aim = ai; aim + 1 < sas->num_addrs; aim++)
@@ -182,6 +334,8 @@ check_sav (sav, "socket_addr_loop");
         ai--;   /* so the loop does the next element, which now is at ai */
       }
     }
+    if (deleted)   /* indices have changed */
+      addr_index_rebuild (sas);
   }
   return count;
 }
@@ -212,6 +366,9 @@ static int socket_add_locked (struct socket_set * s, int sockfd, int is_local,
   s->sockets [index].is_broadcast = is_bc;
   s->sockets [index].num_addrs = 0;
   s->sockets [index].send_addrs = NULL;
+  s->sockets [index].addr_index = NULL;
+  s->sockets [index].addr_index_size = 0;
+  sockets_changed (s);
   return 1;
 }
 /* returns a pointer to the new sav, or NULL in case of errors (e.g.
@@ -233,18 +390,22 @@ static struct socket_address_validity *
     print_socket_set (s);
     return NULL;
   }
-  int ai;
-  for (ai = 0; ai < sock->num_addrs; ai++) {
-    struct socket_address_validity * sav = &(sock->send_addrs [ai]);
-    check_sav (sav, "socket_address_add_locked");
-    if (same_sockaddr (&(addr.addr), addr.alen, &(sav->addr), sav->alen))
-      return NULL;  /* already there, no need to add */
-  }
+  if (addr_index_find (sock, &(addr.addr), addr.alen) >= 0)
+    return NULL;  /* already there, no need to add */
   int index = sock->num_addrs;
   sock->num_addrs++;
   int size = sock->num_addrs * sizeof (struct socket_address_validity);
   sock->send_addrs = realloc (sock->send_addrs, size);
   sock->send_addrs [index] = addr;
+  sock->send_addrs [index].pace_tokens = SOCKET_PACE_BURST;
+  sock->send_addrs [index].pace_time = allnet_time_us ();
+  sock->send_addrs [index].packets_sent = 0;
+  sock->send_addrs [index].packets_rcvd = 0;
+  if ((sock->addr_index == NULL) ||
+      (2 * sock->num_addrs > sock->addr_index_size))
+    addr_index_rebuild (sock);
+  else
+    addr_index_insert (sock, index);
   check_sav (sock->send_addrs + index, "return value from saal");
   return sock->send_addrs + index;
 }
@@ -273,23 +434,14 @@ check_sav (&addr, "socket_address_add return value");
   return result;
 }
 
-struct recv_limit_data {
-  int updated;
-  int new_recv_limit;
-  struct sockaddr_storage addr;
-  socklen_t alen;
-};
-
-static int update_recv_limit_fun (struct socket_address_set * sock,
-                                  struct socket_address_validity * sav,
-                                  void * ref)
+static struct socket_address_set * find_sock (struct socket_set * s,
+                                              int sockfd)
 {
-  struct recv_limit_data * rld = (struct recv_limit_data *) ref;
-  if (same_sockaddr (&(rld->addr), rld->alen, &(sav->addr), sav->alen)) {
-    rld->updated = 1; /* found! */
-    sav->recv_limit = rld->new_recv_limit;
-  }
-  return 1;   /* keep the record */
+  int i;
+  for (i = 0; i < s->num_sockets; i++)
+    if (s->sockets [i].sockfd == sockfd)
+      return s->sockets + i;
+  return NULL;
 }
 
 /* returns 1 if the receive limit was updated, 0 otherwise */
@@ -299,15 +451,19 @@ int socket_update_recv_limit (int new_recv_limit, struct socket_set * s,
 #ifdef DEBUG_SOCKETS
 struct socket_set * debug_copy = debug_copy_socket_set (s);
 #endif /* DEBUG_SOCKETS */
-  struct recv_limit_data rld =
-    { .updated = 0, .new_recv_limit = new_recv_limit, .alen = alen };
-  memcpy (&(rld.addr), &addr, sizeof (addr));
-  int del = socket_addr_loop (s, update_recv_limit_fun, &rld);
-  if (del != 0) {
-    printf ("error: update_recv_limit deleted %d addrs\n", del);
-    exit (1);
+  int updated = 0;
+  lock ("socket_update_recv_limit");
+  int si;
+  for (si = 0; si < s->num_sockets; si++) {
+    struct socket_address_set * sock = s->sockets + si;
+    int ai = addr_index_find (sock, &addr, alen);
+    if (ai >= 0) {
+      updated = 1; /* found! */
+      sock->send_addrs [ai].recv_limit = new_recv_limit;
+    }
   }
-  if (! rld.updated) {   /* likely error -- report for now */
+  unlock ("socket_update_recv_limit");
+  if (! updated) {   /* likely error -- report for now */
     char st [1000];
     print_sockaddr_str ((struct sockaddr *) &addr, alen, st, sizeof (st));
     printf ("warning: update_recv_limit %s did not update any addresses\n", st);
@@ -320,7 +476,26 @@ struct socket_set * debug_copy = debug_copy_socket_set (s);
 #ifdef DEBUG_SOCKETS
   if (debug_copy != NULL) free (debug_copy);
 #endif /* DEBUG_SOCKETS */
-  return rld.updated;
+  return updated;
+}
+
+/* returns 1 if the address was found, 0 otherwise.  Addresses without
+ * a time limit are left without a time limit */
+int socket_update_time_limit (long long int new_time_limit,
+                              struct socket_set * s, int sockfd,
+                              struct sockaddr_storage addr, socklen_t alen)
+{
+  int found = 0;
+  lock ("socket_update_time_limit");
+  struct socket_address_set * sock = find_sock (s, sockfd);
+  int ai = ((sock == NULL) ? -1 : addr_index_find (sock, &addr, alen));
+  if (ai >= 0) {
+    found = 1;
+    if (sock->send_addrs [ai].time_limit != 0)
+      sock->send_addrs [ai].time_limit = new_time_limit;
+  }
+  unlock ("socket_update_time_limit");
+  return found;
 }
 
 static int update_time_fun (struct socket_address_set * sock,
@@ -346,23 +521,6 @@ int socket_update_time (struct socket_set * s, long long int new_time)
   return socket_addr_loop (s, update_time_fun, &new_time);
 }
 
-static void add_fd_to_bitset (fd_set * set, int fd, int * max)
-{
-  FD_SET (fd, set);
-  if (fd >= *max)
-    *max = fd + 1;
-}
-/* returns the max parameter to pass to select */
-static int make_fdset (struct socket_set * s, fd_set * set)
-{
-  int i;
-  int max_pipe = 0;
-  FD_ZERO (set);
-  for (i = 0; i < s->num_sockets; i++)
-    add_fd_to_bitset (set, s->sockets [i].sockfd, &max_pipe);
-  return max_pipe;
-}
-
 static void update_read (struct sockaddr_storage sas, socklen_t alen,
                          struct socket_address_set * sock,
                          long long int rcvd_time, int auth,
@@ -372,26 +530,24 @@ static void update_read (struct sockaddr_storage sas, socklen_t alen,
   *savp = NULL;     /* in case we don't find it */
   *is_new = 1;      /* in case we don't find it */
   *recv_limit_reached = 0; /* in case we don't find it (and good default) */
-  int i;
-  for (i = 0; i < sock->num_addrs; i++) {
+  int i = addr_index_find (sock, &sas, alen);
+  if (i >= 0) {  /* found! */
     struct socket_address_validity * sav = sock->send_addrs + i;
 check_sav (sav, "update_read");
-    if (same_sockaddr (&sas, alen, &(sav->addr), sav->alen)) {  /* found! */
 /* printf ("update_read %d found: ", sock->sockfd); print_sav(sav); */
-      *savp = sav;
-      *is_new = 0;
-      sav->alive_rcvd = rcvd_time;
-      if (sav->recv_limit >= 1)
-        sav->recv_limit--;
-      *recv_limit_reached = (sav->recv_limit == 0);
-      if ((sav->send_limit_on_recv != 0) && auth)
-        sav->send_limit = sav->send_limit_on_recv;
-      break;
-    }
+    *savp = sav;
+    *is_new = 0;
+    sav->alive_rcvd = rcvd_time;
+    sav->packets_rcvd++;
+    if (sav->recv_limit >= 1)
+      sav->recv_limit--;
+    *recv_limit_reached = (sav->recv_limit == 0);
+    if ((sav->send_limit_on_recv != 0) && auth)
+      sav->send_limit = sav->send_limit_on_recv;
   }
 }
 
-/* called with the mutex locked, unlocks it before returning */
+/* called with the mutex locked */
 static struct socket_read_result
   record_message (struct socket_set * s, long long int rcvd_time,
                   struct socket_address_set * sock,
@@ -426,87 +582,271 @@ if (! is_new) check_sav (sav, "update_read result");
   memset (&(r.from), 0, sizeof (r.from));
   memcpy (&(r.from), &sas, alen);
 if (! is_new) check_sav (r.sav, "record_message result");
-  unlock ("record_message");
   return r;
 }
 
+/* called with the mutex locked.
+ * returns up to max results from the packets in the ring */
+static int ring_results (struct socket_set * s, struct socket_read_ring * ring,
+                         struct socket_read_result * results, int max,
+                         long long int rcvd_time)
+{
+  int n = 0;
+  while ((n < max) && (ring->count > 0)) {
+    struct socket_ring_slot * slot = ring->slots + ring->first;
+    ring->first = (ring->first + 1) % SOCKET_RING_SIZE;
+    ring->count--;
+    struct socket_address_set * sock = find_sock (s, slot->sockfd);
+    if (sock == NULL)    /* socket was deleted since we received */
+      continue;
+    /* all packets must have a min header, local packets also have priority */
+    int min = ALLNET_HEADER_SIZE + ((sock->is_local) ? 2 : 0);
+    if ((slot->rcvd < min) || (slot->rcvd > SOCKET_READ_MIN_BUFFER))
+      continue;
+    int auth = ((sock->is_global_v4 || sock->is_global_v6) ?
+                is_auth_keepalive (slot->from, s->random_secret,
+                                   sizeof (s->random_secret), s->counter,
+                                   slot->buffer, slot->rcvd) : 1);
+    results [n++] = record_message (s, rcvd_time, sock, slot->from,
+                                    slot->alen, slot->buffer, slot->rcvd,
+                                    auth);
+  }
+  return n;
+}
+
+/* the index of the next free slot in the ring, and in *contiguous,
+ * the number of free slots starting at that index, without wrapping around */
+static int ring_free_slots (struct socket_read_ring * ring, int * contiguous)
+{
+  int start = (ring->first + ring->count) % SOCKET_RING_SIZE;
+  int free_slots = SOCKET_RING_SIZE - ring->count;
+  if (start + free_slots > SOCKET_RING_SIZE)
+    free_slots = SOCKET_RING_SIZE - start;
+  *contiguous = free_slots;
+  return start;
+}
+
+#ifdef USE_EPOLL_RECVMMSG
+/* called with the mutex locked.
+ * receive as many packets as are available on this socket, or as fit
+ * in the ring.  Returns the number received, or -1 for errors */
+static int ring_drain_socket (struct socket_read_ring * ring, int sockfd)
+{
+  int received = 0;
+  while (ring->count < SOCKET_RING_SIZE) {
+    int n;
+    int start = ring_free_slots (ring, &n);
+    struct mmsghdr msgs [SOCKET_RING_SIZE];
+    struct iovec iovs [SOCKET_RING_SIZE];
+    memset (msgs, 0, n * sizeof (struct mmsghdr));
+    int i;
+    for (i = 0; i < n; i++) {
+      struct socket_ring_slot * slot = ring->slots + start + i;
+      iovs [i].iov_base = slot->buffer;
+      iovs [i].iov_len = SOCKET_READ_MIN_BUFFER;
+      msgs [i].msg_hdr.msg_name = &(slot->from);
+      msgs [i].msg_hdr.msg_namelen = sizeof (slot->from);
+      msgs [i].msg_hdr.msg_iov = iovs + i;
+      msgs [i].msg_hdr.msg_iovlen = 1;
+    }
+    int rcvd = recvmmsg (sockfd, msgs, n, MSG_DONTWAIT, NULL);
+    if (rcvd <= 0) {
+      if ((received > 0) || (errno == EAGAIN) || (errno == EWOULDBLOCK))
+        return received;
+      return -1;
+    }
+    for (i = 0; i < rcvd; i++) {
+      struct socket_ring_slot * slot = ring->slots + start + i;
+      slot->sockfd = sockfd;
+      slot->alen = msgs [i].msg_hdr.msg_namelen;
+      slot->rcvd = msgs [i].msg_len;
+    }
+    ring->count += rcvd;
+    received += rcvd;
+    if (rcvd < n)   /* nothing more to receive on this socket */
+      break;
+  }
+  return received;
+}
+
+/* called with the mutex locked, returns with the mutex locked, but
+ * releases it while waiting up to 10ms for packets to arrive, then
+ * receives all the available packets into the ring.
+ * returns -1 for errors (in which case error->sock may be set), else 0 */
+static int ring_wait_fill (struct socket_set * s,
+                           struct socket_read_ring * ring,
+                           struct socket_read_result * error)
+{
+  int epoll_fd = ring->epoll_fd;
+  if (ring->changed) {   /* (re-)register all the sockets */
+    int i;
+    for (i = 0; i < s->num_sockets; i++) {
+      struct epoll_event event = { .events = EPOLLIN,
+                                   .data.fd = s->sockets [i].sockfd };
+      if ((epoll_ctl (epoll_fd, EPOLL_CTL_ADD, s->sockets [i].sockfd,
+                      &event) != 0) && (errno != EEXIST))
+        perror ("epoll_ctl");
+    }
+    ring->changed = 0;
+  }
+  unlock ("ring_wait_fill");
+  struct epoll_event events [SOCKET_RING_SIZE];
+  int ready = epoll_wait (epoll_fd, events, SOCKET_RING_SIZE, 10);
+  lock ("ring_wait_fill");
+  if (ready < 0) {
+    if (errno != EINTR)   /* it is normal to be killed during epoll_wait */
+      perror ("epoll_wait");
+    return -1;
+  }
+  int i;
+  for (i = 0; (i < ready) && (ring->count < SOCKET_RING_SIZE); i++) {
+    struct socket_address_set * sock = find_sock (s, events [i].data.fd);
+    if (sock == NULL)    /* socket was deleted while we were waiting */
+      continue;
+    if (ring_drain_socket (ring, sock->sockfd) < 0) {
+      if ((errno == ECONNREFUSED) && (ring->count == 0)) {
+        error->sock = sock;  /* connected socket was closed by peer */
+        return -1;
+      }
+      if (errno != ECONNREFUSED)
+        perror ("ring_wait_fill recvmmsg");
+    }
+  }
+  return 0;
+}
+
+#else /* ! USE_EPOLL_RECVMMSG */
+
+static void add_fd_to_bitset (fd_set * set, int fd, int * max)
+{
+  FD_SET (fd, set);
+  if (fd >= *max)
+    *max = fd + 1;
+}
 /* returns the max parameter to pass to select */
-/* called with the mutex locked, unlocks it before returning */
-static struct socket_read_result
-  get_message (struct socket_set * s, char * buffer, fd_set * set,
-               long long int rcvd_time,
-               struct socket_read_result result)  /* result init'd by caller */
+static int make_fdset (struct socket_set * s, fd_set * set)
 {
   int i;
-  for (i = 0; i < s->num_sockets; i++) {
+  int max_pipe = 0;
+  FD_ZERO (set);
+  for (i = 0; i < s->num_sockets; i++)
+    add_fd_to_bitset (set, s->sockets [i].sockfd, &max_pipe);
+  return max_pipe;
+}
+
+/* called with the mutex locked, returns with the mutex locked.
+ * waits up to 10ms for packets to arrive, then receives one
+ * packet from each socket that has one into the ring.
+ * returns -1 for errors (in which case error->sock may be set), else 0 */
+static int ring_wait_fill (struct socket_set * s,
+                           struct socket_read_ring * ring,
+                           struct socket_read_result * error)
+{
+  fd_set receiving;
+  int max_pipe = make_fdset (s, &receiving);
+  /* always select for 10ms, since we are holding the lock */
+  struct timeval tv = { .tv_sec = 0, .tv_usec = 10000 };
+  int result = select (max_pipe, &receiving, NULL, NULL, &tv);
+  if (result < 0) {    /* some error */
+    if (errno != EINTR)   /* it is normal to be killed during select */
+      perror ("select");
+    return -1;
+  }
+  int i;
+  for (i = 0; (i < s->num_sockets) && (ring->count < SOCKET_RING_SIZE); i++) {
     struct socket_address_set * sock = s->sockets + i;
-    if (FD_ISSET (sock->sockfd, set)) { 
-      struct sockaddr_storage sas;
-      struct sockaddr * sap = (struct sockaddr *) (&sas);
-      socklen_t alen = sizeof (sas);
-      ssize_t rcvd = recvfrom (sock->sockfd, buffer, SOCKET_READ_MIN_BUFFER,
-                               MSG_DONTWAIT, sap, &alen);
-      /* all packets must have a min header, local packets also have priority */
-      int min = ALLNET_HEADER_SIZE + ((sock->is_local) ? 2 : 0);
-      if ((rcvd >= (ssize_t) min) && (rcvd <= SOCKET_READ_MIN_BUFFER)) {
-        int auth = ((sock->is_global_v4 || sock->is_global_v6) ?
-                    is_auth_keepalive (sas, s->random_secret, 
-                                       sizeof (s->random_secret), s->counter,
-                                       buffer, (int)rcvd) : 1);
-        return record_message (s, rcvd_time, sock, sas, alen,
-                               buffer, (int)rcvd, auth);
-      }
-      if (errno == ECONNREFUSED) {  /* connected socket was closed by peer */
-        result.success = -1;    /* error on this socket */
-        result.sock = sock;
+    if (FD_ISSET (sock->sockfd, &receiving)) { 
+      int n;
+      struct socket_ring_slot * slot =
+        ring->slots + ring_free_slots (ring, &n);
+      socklen_t alen = sizeof (slot->from);
+      ssize_t rcvd = recvfrom (sock->sockfd, slot->buffer,
+                               SOCKET_READ_MIN_BUFFER, MSG_DONTWAIT,
+                               (struct sockaddr *) (&(slot->from)), &alen);
+      if (rcvd >= 0) {
+        slot->sockfd = sock->sockfd;
+        slot->alen = alen;
+        slot->rcvd = (int) rcvd;
+        ring->count++;
+      } else if ((errno == ECONNREFUSED) && (ring->count == 0)) {
+        error->sock = sock;  /* connected socket was closed by peer */
+        return -1;
       } else {
-        perror ("get_message recvfrom");
+        perror ("ring_wait_fill recvfrom");
         /* TODO: should we close the socket? */
       }
-      break;
     }
   }
-  unlock ("get_message");
-  return result;
+  return 0;
 }
+#endif /* USE_EPOLL_RECVMMSG */
 
-/* the buffer must have length at least SOCKET_READ_MIN_BUFFER = ALLNET_MTU+2 */
-struct socket_read_result socket_read (struct socket_set * s,
-                                       char * buffer, int timeout,
-                                       long long int rcvd_time)
+/* if copy_to is not NULL, max should be 1, and the message is copied
+ * to copy_to before the mutex is released */
+static int read_results (struct socket_set * s,
+                         struct socket_read_result * results, int max,
+                         int timeout, long long int rcvd_time, char * copy_to)
 {
   struct socket_read_result r = { .success = 0, .message = NULL, .msize = 0,
                                   .priority = 0, .sock = NULL, .alen = 0,
                                   .socket_address_is_new = 0,
                                   .sav = NULL, .recv_limit_reached = 0 };
   memset (&(r.from), 0, sizeof (r.from));
+  results [0] = r;
   int remaining_time = timeout;
-  while ((timeout == SOCKETS_TIMEOUT_FOREVER) || (remaining_time > 0)) {
+  int first = 1;   /* always check the ring at least once */
+  while (first || (timeout == SOCKETS_TIMEOUT_FOREVER) ||
+         (remaining_time > 0)) {
     lock ("socket_read");
-    fd_set receiving;
-    int max_pipe = make_fdset (s, &receiving);
-    /* always select for 1ms, since we are holding the lock */
-    struct timeval tv = { .tv_sec = 0, .tv_usec = 10000 };
-    int result = select (max_pipe, &receiving, NULL, NULL, &tv);
-    if (result > 0)      /* found something, get_message unlocks global_mutex */
-      return get_message (s, buffer, &receiving, rcvd_time, r);
+    struct socket_read_ring * ring = get_ring (s);
+    int n = ring_results (s, ring, results, max, rcvd_time);
+    if ((n == 0) && ((! first) || (timeout != 0))) {
+      if (ring_wait_fill (s, ring, &r) < 0) {
+        unlock ("socket_read");
+        r.success = -1;    /* error */
+        results [0] = r;
+        return -1;
+      }
+      n = ring_results (s, ring, results, max, rcvd_time);
+    }
+    if ((n > 0) && (copy_to != NULL)) {
+      int delta = ((results [0].sock->is_local) ? 2 : 0);
+      memcpy (copy_to, results [0].message, results [0].msize + delta);
+      results [0].message = copy_to;
+    }
     unlock ("socket_read");
+    if (n > 0)
+      return n;
     /* sleep a little while so others have a chance to acquire the lock.
      * otherwise, linux will not grant the lock to others until it
      * can see if we immediately re-acquire the lock (I am guessing this
      * is to avoid a context switch) which however leads to starvation */
     usleep (1);
-    if (result < 0) {    /* some error */
-      if (errno != EINTR)   /* it is normal to be killed during select */
-        perror ("select");
-      r.success = -1;    /* error */
-      return r;
-    } /* else: timed out */
     if (remaining_time > 0) remaining_time--;
+    first = 0;
   }
+  return 0;
+}
+
+/* the buffer must have length at least SOCKET_READ_MIN_BUFFER = ALLNET_MTU+2 */
+struct socket_read_result socket_read (struct socket_set * s,
+                                       char * buffer, int timeout,
+                                       long long int rcvd_time)
+{
+  struct socket_read_result r;
+  read_results (s, &r, 1, timeout, rcvd_time, buffer);
   return r;
 }
 
+int socket_read_batch (struct socket_set * s,
+                       struct socket_read_result * results, int max,
+                       int timeout, long long int rcvd_time)
+{
+  if (max <= 0)
+    return 0;
+  return read_results (s, results, max, timeout, rcvd_time, NULL);
+}
+
 /* any of these may be null, si and ai set to -1 if they are not known. */
 static void send_error (const char * message, int msize, int flags, int res,
                         const struct sockaddr_storage sas, socklen_t alen,
@@ -542,6 +882,13 @@ static void send_error (const char * message, int msize, int flags, int res,
   }
 }
 
+/* errors that can happen in normal operation, so need not be reported */
+static int expected_send_error (int e)
+{
+  return ((e == EADDRNOTAVAIL) || (e == ENETUNREACH) ||
+          (e == EHOSTUNREACH) || (e == EHOSTDOWN));
+}
+
 /* returns 1 for success, 0 for error */
 static int send_on_socket (const char * message, int msize,
                            unsigned long long int sent_time,
@@ -560,10 +907,10 @@ check_sav (sav, "send_on_socket");
                            (struct sockaddr *) (&(sav->addr)), sav->alen);
   if (result == msize) {
     sav->alive_sent = sent_time;
+    sav->packets_sent++;
     return 1;
   }
-  if ((errno != EADDRNOTAVAIL) && (errno != ENETUNREACH) &&
-      (errno != EHOSTUNREACH) && (errno != EHOSTDOWN)) {
+  if (! expected_send_error (errno)) {
     char desc2 [1000];
     snprintf (desc2, sizeof (desc2), "%s send_on_socket", desc);
     /* some error, so the rest of this function is for debugging */
@@ -573,28 +920,162 @@ check_sav (sav, "send_on_socket");
   return 0;
 }
 
+/* the same message is sent to many addresses.  Addresses are collected
+ * into a batch, then sent (with sendmmsg if available) when the batch
+ * is full or when there are no more addresses.  Consecutive entries
+ * with the same sockfd are sent with a single system call */
+#define SEND_BATCH_SIZE	64
+#define SEND_RESULT_ERROR	0
+#define SEND_RESULT_SENT	1
+#define SEND_RESULT_NOT_SENT	2
+#define SEND_RESULT_LOCAL_ERROR	3  /* error on our side, not the peer's */
+struct send_batch {
+  const char * message;
+  int msize;
+  int count;
+  int sockfds [SEND_BATCH_SIZE];
+  const struct sockaddr_storage * addrs [SEND_BATCH_SIZE];
+  socklen_t alens [SEND_BATCH_SIZE];
+  struct socket_address_validity * savs [SEND_BATCH_SIZE]; /* may be NULL */
+  char * results [SEND_BATCH_SIZE];  /* set to a SEND_RESULT_ value */
+};
+
+static int send_flags ()
+{
+#ifdef MSG_NOSIGNAL
+  return MSG_NOSIGNAL;
+#else /* MSG_NOSIGNAL */
+  return 0;
+#endif /* MSG_NOSIGNAL */
+}
+
+/* errors that say nothing about the peer we were sending to */
+static int local_send_error (int e)
+{
+  return ((e == ENETUNREACH) || (e == ENETDOWN) || (e == EADDRNOTAVAIL) ||
+          (e == ENOBUFS) || (e == ENOMEM) || (e == EAGAIN) ||
+          (e == EWOULDBLOCK) || (e == EINTR));
+}
+
+/* report the error (if unexpected) for entry i, with errno still set */
+static void send_batch_error (struct send_batch * b, int i, int res)
+{
+  *(b->results [i]) =
+    ((local_send_error (errno)) ? SEND_RESULT_LOCAL_ERROR : SEND_RESULT_ERROR);
+  if (b->savs [i] != NULL) {
+    if (! expected_send_error (errno))
+      send_error (b->message, b->msize, send_flags (), res,
+                  b->savs [i]->addr, b->savs [i]->alen,
+                  "socket_send_fun send_on_socket", NULL,
+                  b->sockfds [i], b->savs [i], -1, -1);
+  } else if (errno != ENETUNREACH) {
+    send_error (b->message, b->msize, send_flags (), res,
+                *(b->addrs [i]), b->alens [i], "socket_send_out_extra",
+                NULL, b->sockfds [i], NULL, -1, -1);
+  }
+}
+
+/* send the entries from first (inclusive) to last (exclusive),
+ * all of which have the same sockfd */
+static void send_batch_run (struct send_batch * b, int first, int last)
+{
+  int sockfd = b->sockfds [first];
+#ifdef USE_SENDMMSG
+  struct mmsghdr msgs [SEND_BATCH_SIZE];
+  struct iovec iov = { .iov_base = (void *) b->message, .iov_len = b->msize };
+  memset (msgs, 0, sizeof (msgs));
+  int i;
+  for (i = first; i < last; i++) {
+    struct msghdr * mh = &(msgs [i - first].msg_hdr);
+    mh->msg_name = (void *) (b->addrs [i]);
+    mh->msg_namelen = b->alens [i];
+    mh->msg_iov = &iov;
+    mh->msg_iovlen = 1;
+  }
+  int done = first;
+  while (done < last) {
+    int n = sendmmsg (sockfd, msgs + (done - first), last - done,
+                      send_flags ());
+    if (n <= 0) {  /* the first message had an error, skip it */
+      send_batch_error (b, done, n);
+      done++;
+    } else {
+      for (i = done; i < done + n; i++)
+        *(b->results [i]) = ((msgs [i - first].msg_len == b->msize) ?
+                             SEND_RESULT_SENT : SEND_RESULT_ERROR);
+      done += n;
+    }
+  }
+#else /* ! USE_SENDMMSG */
+  int i;
+  for (i = first; i < last; i++) {
+    ssize_t res = sendto (sockfd, b->message, b->msize, send_flags (),
+                          (struct sockaddr *) (b->addrs [i]), b->alens [i]);
+    if (res == b->msize)
+      *(b->results [i]) = SEND_RESULT_SENT;
+    else
+      send_batch_error (b, i, (int) res);
+  }
+#endif /* USE_SENDMMSG */
+}
+
+static void send_batch_flush (struct send_batch * b)
+{
+  int first = 0;
+  while (first < b->count) {
+    int last = first + 1;
+    while ((last < b->count) && (b->sockfds [last] == b->sockfds [first]))
+      last++;
+    send_batch_run (b, first, last);
+    first = last;
+  }
+  b->count = 0;
+}
+
+static void send_batch_add (struct send_batch * b, int sockfd,
+                            const struct sockaddr_storage * addr,
+                            socklen_t alen,
+                            struct socket_address_validity * sav,
+                            char * result)
+{
+  if (b->count >= SEND_BATCH_SIZE)
+    send_batch_flush (b);
+  b->sockfds [b->count] = sockfd;
+  b->addrs [b->count] = addr;
+  b->alens [b->count] = alen;
+  b->savs [b->count] = sav;
+  b->results [b->count] = result;
+  b->count++;
+}
+
 struct socket_send_data {
   int local_not_remote;
   const char * message;
   int msize;
+  unsigned int priority;       /* only used for pacing */
+  unsigned long long int now;  /* in microseconds, 0 to disable pacing */
   unsigned long long int sent_time;
   struct sockaddr_storage except_to;
   socklen_t alen;
   int error;
+  /* send results, one per address, in the order of socket_addr_loop.
+   * only accessed with the lock held */
+  char * results;
+  int next_result;
 };
 
+/* called after all the sends have completed, to record the results */
 static int socket_send_fun (struct socket_address_set * sock,
                             struct socket_address_validity * sav,
                             void * ref)
 {
   struct socket_send_data * ssd = (struct socket_send_data *) ref;
 check_sav (sav, "socket_send_fun");
-  if ((sock->is_local == ssd->local_not_remote) &&
-      (! same_sockaddr (&(ssd->except_to), ssd->alen,
-                        &(sav->addr), sav->alen))) {
-    if (send_on_socket (ssd->message, ssd->msize, ssd->sent_time,
-                        sock->sockfd, sav, "socket_send_fun", NULL, -1, -1)) {
+  int result = ssd->results [ssd->next_result++];
+  if (result != SEND_RESULT_NOT_SENT) {
+    if (result == SEND_RESULT_SENT) {
       sav->alive_sent = ssd->sent_time;
+      sav->packets_sent++;
       if (sav->send_limit > 0) {
         sav->send_limit--;
 #ifdef DEBUG_SOCKETS
@@ -618,6 +1099,95 @@ check_sav (sav, "socket_send_fun");
   return 1;         /* do not delete */
 }
 
+/* returns 1 if the message may be sent to sav now, 0 if the address
+ * has exceeded its rate and the message should not be sent */
+static int pace_send (struct socket_address_validity * sav,
+                      struct socket_send_data * ssd)
+{
+  if (ssd->now > sav->pace_time) {  /* refill */
+    unsigned long long int delta = ssd->now - sav->pace_time;
+    sav->pace_tokens += (delta * SOCKET_PACE_RATE) / 1000000LL;
+    if (sav->pace_tokens > SOCKET_PACE_BURST)
+      sav->pace_tokens = SOCKET_PACE_BURST;
+    sav->pace_time = ssd->now;
+  }
+  if ((sav->pace_tokens < ssd->msize) &&
+      (ssd->priority < SOCKET_PACE_PRIORITY))
+    return 0;
+  sav->pace_tokens -= ssd->msize;
+  if (sav->pace_tokens < 0)
+    sav->pace_tokens = 0;
+  return 1;
+}
+
+/* send to all the matching addresses in the socket set, and to the extra
+ * addresses if any.  Returns the number of extra addresses that failed,
+ * and if extra_sent is not NULL, sets it to 1 for each extra address that
+ * succeeded, 0 for those that failed because of the peer, and -1 for
+ * those that failed for local reasons or were not sent */
+static int send_all (struct socket_set * s, struct socket_send_data * ssd,
+                     int num_extra, const int * extra_fds,
+                     const struct sockaddr_storage * extra,
+                     const socklen_t * extra_alens, int * extra_sent)
+{
+  static char * results = NULL;  /* only used with the lock held */
+  static int results_size = 0;
+  lock ("send_all");
+  int needed = (num_extra > 0) ? num_extra : 0;
+  int si;
+  int ai;
+  for (si = 0; si < s->num_sockets; si++)
+    needed += s->sockets [si].num_addrs;
+  if (needed > results_size) {
+    if (results != NULL)
+      free (results);
+    results_size = needed + 64;
+    results = malloc_or_fail (results_size, "sockets.c send_all");
+  }
+  struct send_batch b = { .message = ssd->message, .msize = ssd->msize,
+                          .count = 0 };
+  int nr = 0;
+  int i;
+  for (i = 0; i < num_extra; i++)
+    send_batch_add (&b, extra_fds [i], extra + i, extra_alens [i], NULL,
+                    results + nr++);
+  for (si = 0; si < s->num_sockets; si++) {
+    struct socket_address_set * sock = s->sockets + si;
+    int except = -1;
+    if (ssd->alen > 0)
+      except = addr_index_find (sock, &(ssd->except_to), ssd->alen);
+    for (ai = 0; ai < sock->num_addrs; ai++) {
+      struct socket_address_validity * sav = sock->send_addrs + ai;
+      if ((sock->is_local != ssd->local_not_remote) || (ai == except)) {
+        results [nr] = SEND_RESULT_NOT_SENT;
+      } else if ((ssd->now != 0) && (! sock->is_local) &&
+                 (! pace_send (sav, ssd))) {
+        results [nr] = SEND_RESULT_NOT_SENT;
+        s->paced_drops++;
+        METRICS_COUNT ("sockets.paced", 1);
+      } else {
+        send_batch_add (&b, sock->sockfd, &(sav->addr), sav->alen, sav,
+                        results + nr);
+      }
+      nr++;
+    }
+  }
+  send_batch_flush (&b);
+  int extra_errors = 0;
+  for (i = 0; i < num_extra; i++) {
+    if (results [i] != SEND_RESULT_SENT)
+      extra_errors++;
+    if (extra_sent != NULL)
+      extra_sent [i] = ((results [i] == SEND_RESULT_SENT) ? 1 :
+                        ((results [i] == SEND_RESULT_ERROR) ? 0 : -1));
+  }
+  ssd->results = results + ((num_extra > 0) ? num_extra : 0);
+  ssd->next_result = 0;
+  socket_addr_loop_locked (s, socket_send_fun, ssd);
+  unlock ("send_all");
+  return extra_errors;
+}
+
 /* socket_send_{local,remote} remove any address that has become invalid 
  * due to send limit.
  * return 1 for success, 0 for at least some error */
@@ -633,7 +1203,33 @@ int socket_send_local (struct socket_set * s, const char * message, int msize,
   memset (&(ssd.except_to), 0, sizeof (ssd.except_to));
   if ((alen > 0) && (alen < sizeof (except_to)))
     memcpy (&(ssd.except_to), &(except_to), alen);
-  socket_addr_loop (s, socket_send_fun, &ssd);
+  send_all (s, &ssd, 0, NULL, NULL, NULL, NULL);
+  if (ssd.error)
+    return 0;
+  return 1;
+}
+
+int socket_send_out_extra (struct socket_set * s, const char * message,
+                           int msize, unsigned int priority,
+                           unsigned long long int sent_time,
+                           struct sockaddr_storage except_to,
+                           socklen_t alen, int num_extra,
+                           const int * extra_fds,
+                           const struct sockaddr_storage * extra,
+                           const socklen_t * extra_alens,
+                           int * extra_sent, int * extra_errors)
+{
+  struct socket_send_data ssd =
+    { .message = message, .msize = msize, .priority = priority,
+      .now = allnet_time_us (),
+      .sent_time = sent_time, .alen = alen, .local_not_remote = 0, .error = 0 };
+  memset (&(ssd.except_to), 0, sizeof (ssd.except_to));
+  if ((alen > 0) && (alen < sizeof (except_to)))
+    memcpy (&(ssd.except_to), &(except_to), alen);
+  int errors = send_all (s, &ssd, num_extra, extra_fds, extra, extra_alens,
+                         extra_sent);
+  if (extra_errors != NULL)
+    *extra_errors = errors;
   if (ssd.error)
     return 0;
   return 1;
@@ -644,12 +1240,12 @@ int socket_send_out (struct socket_set * s, const char * message, int msize,
                      struct sockaddr_storage except_to, socklen_t alen)
 {
   struct socket_send_data ssd =
-    { .message = message, .msize = msize,
+    { .message = message, .msize = msize, .priority = 0, .now = 0,
       .sent_time = sent_time, .alen = alen, .local_not_remote = 0, .error = 0 };
   memset (&(ssd.except_to), 0, sizeof (ssd.except_to));
   if ((alen > 0) && (alen < sizeof (except_to)))
     memcpy (&(ssd.except_to), &(except_to), alen);
-  socket_addr_loop (s, socket_send_fun, &ssd);
+  send_all (s, &ssd, 0, NULL, NULL, NULL, NULL);
   if (ssd.error)
     return 0;
   return 1;
@@ -760,7 +1356,7 @@ check_sav (sav, "socket_send_keepalives");
       if (sas->is_global_v4 || sas->is_global_v6) {
         size = keepalive_auth (auth_msg, sizeof (auth_msg),
                                sav->addr, s->random_secret,
-                               sizeof (s->random_secret), s->counter,
+                               sizeof (s->random_secret), s->counter, 0,
                                sav->keepalive_auth);
         msg = auth_msg;
       }
@@ -772,6 +1368,45 @@ check_sav (sav, "socket_send_keepalives");
   return count;
 }
 
+/* send a keepalive to the given address on the given socket, with
+ * authentication if the socket is global, as socket_send_keepalives does.
+ * returns 1 if sent, 0 if the address is not in the socket set or
+ * the send failed */
+int socket_send_keepalive (struct socket_set * s, int sockfd,
+                           struct sockaddr_storage addr, socklen_t alen,
+                           long long int sent_time)
+{
+  int result = 0;
+  lock ("socket_send_keepalive");
+  struct socket_address_set * sock = find_sock (s, sockfd);
+  int ai = ((sock == NULL) ? -1 : addr_index_find (sock, &addr, alen));
+  if (ai >= 0) {
+    struct socket_address_validity * sav = sock->send_addrs + ai;
+    unsigned int msize;
+    const char * message = keepalive_packet (&msize); /* small, w/o auth */
+    char buffer [ALLNET_MTU + 2];
+    int size = msize;
+    if (sock->is_local) {
+      add_priority (message, msize, ALLNET_PRIORITY_EPSILON,
+                    buffer, sizeof (buffer));
+      size = msize + 2;
+      message = buffer;
+    } else if (sock->is_global_v4 || sock->is_global_v6) {
+      size = keepalive_auth (buffer, sizeof (buffer), sav->addr,
+                             s->random_secret, sizeof (s->random_secret),
+                             s->counter, 0, sav->keepalive_auth);
+      message = buffer;
+    }
+    result = send_on_socket (message, size, sent_time, sockfd, sav,
+                             "socket_send_keepalive", s, -1, ai);
+    struct dec_send_limit_data dsld = { .alen = alen };
+    memcpy (&(dsld.addr), &addr, sizeof (addr));
+    socket_addr_loop_locked (s, socket_dec_send_limit, &dsld);
+  }
+  unlock ("socket_send_keepalive");
+  return result;
+}
+
 /* create a socket and bind it as appropriate for the given address
  * and add it to the given socket set
  * return the sockfd for success, -1 otherwise */
@@ -14,6 +14,7 @@
 #include <sys/socket.h>
 
 #include "mgmt.h"
+#include "priority.h"
 
 /* since UDP doesn't tell us when peers have gone away, we send each peer
  * a message and require each active peer to send us a message every n
@@ -33,6 +34,14 @@ struct socket_address_validity {
   int send_limit;                /* num packets can send, 0 if no send limit */
   int send_limit_on_recv;        /* new send limit on recv, 0 to disable */
   char keepalive_auth [KEEPALIVE_AUTHENTICATION_SIZE];  /* send with keepalives */
+  /* token bucket for pacing sends to remote addresses, in bytes.
+   * initialized by socket_address_add */
+  long long int pace_tokens;
+  unsigned long long int pace_time;  /* in microseconds, last refill */
+  /* packets sent to and received from this address, set to 0 by
+   * socket_address_add */
+  unsigned long long int packets_sent;
+  unsigned long long int packets_rcvd;
 };
 
 struct socket_address_set {
@@ -43,14 +52,24 @@ struct socket_address_set {
   int is_broadcast;              /* true if added to support broadcasts */; 
   int num_addrs;
   struct socket_address_validity * send_addrs;
+  /* hash index of send_addrs, maintained by sockets.c.  Each entry is an
+   * index into send_addrs, or -1.  addr_index is NULL until first used */
+  int * addr_index;
+  int addr_index_size;           /* a power of two, or 0 */
 };
 
+struct socket_read_ring;   /* internal to sockets.c */
+
 struct socket_set {
   int num_sockets;
   struct socket_address_set * sockets;
   /* needed to send authentication in keepalives */
   char random_secret [KEEPALIVE_AUTHENTICATION_SIZE];
   uint64_t counter;
+  /* packets received but not yet returned by socket_read, initially NULL */
+  struct socket_read_ring * ring;
+  /* number of sends skipped because the peer had used up its rate */
+  unsigned long long int paced_drops;
 };
 
 /* return 1 if was able to add, and 0 otherwise (e.g. if already in the set) */
@@ -110,10 +129,31 @@ struct socket_read_result {
 extern struct socket_read_result socket_read (struct socket_set * s,
                                               char * buffer, int timeout,
                                               long long int rcvd_time);
+/* same as socket_read, but returns up to max results, and the number of
+ * results (0 if the call timed out, -1 for errors, in which case
+ * results [0] has success -1).
+ * All the packets available on each socket are received at once, and kept
+ * in the socket set until they are returned by socket_read or
+ * socket_read_batch, so most calls to either do not need system calls.
+ * Each message points into the socket set, and is only valid until
+ * the next call to socket_read or socket_read_batch.  The sav pointers
+ * are only valid until the next change to the addresses in the socket set,
+ * so if other threads send, use the calls that take an address instead */
+#define SOCKET_READ_BATCH	32
+extern int socket_read_batch (struct socket_set * s,
+                              struct socket_read_result * results, int max,
+                              int timeout, long long int rcvd_time);
 /* returns 1 if the receive limit was updated, 0 otherwise */
 extern int socket_update_recv_limit (int new_recv_limit, struct socket_set * s,
                                      struct sockaddr_storage addr,
                                      socklen_t alen);
+/* sets the time limit of the given address, unless it has no time limit.
+ * Returns 1 if the address was found, 0 otherwise.  Unlike writing to
+ * a sav, this is safe while other threads send or change the socket set */
+extern int socket_update_time_limit (long long int new_time_limit,
+                                     struct socket_set * s, int sockfd,
+                                     struct sockaddr_storage addr,
+                                     socklen_t alen);
 /* remove all socket addresses whose time is less than new_time.
  * return the number of records deleted */
 extern int socket_update_time (struct socket_set * s, long long int new_time);
@@ -129,6 +169,32 @@ extern int socket_send_local (struct socket_set * s, const char * message,
 extern int socket_send_out (struct socket_set * s, const char * message,
                             int msize, unsigned long long int sent_time,
                             struct sockaddr_storage except_to, socklen_t alen);
+/* sends to remote addresses are paced: each address may receive
+ * SOCKET_PACE_RATE bytes per second, with bursts of up to SOCKET_PACE_BURST
+ * bytes.  Messages with priority at least SOCKET_PACE_PRIORITY are always
+ * sent (and use up the rate), lower priority messages are not sent to
+ * addresses that have exceeded their rate.  socket_send_out does not pace */
+#define SOCKET_PACE_RATE	(128 * 1024)
+#define SOCKET_PACE_BURST	(64 * 1024)
+#define SOCKET_PACE_PRIORITY	ALLNET_PRIORITY_FRIENDS_LOW
+/* same as socket_send_out, but also sends to num_extra addresses that
+ * need not be in the socket set (e.g. DHT peers), extra [i] being sent
+ * on extra_fds [i].  All the sends are batched, so a single system call
+ * may send to many peers.  if extra_sent is not NULL, extra_sent [i] is
+ * set to 1 if the send to extra [i] succeeded, to 0 if it failed with an
+ * error that points to the peer (e.g. ECONNREFUSED, EHOSTUNREACH), and to
+ * -1 if it failed for local reasons (e.g. ENETUNREACH, ENOBUFS).
+ * if extra_errors is not NULL, it is set to the number of extra addresses
+ * to which the send failed */
+extern int socket_send_out_extra (struct socket_set * s, const char * message,
+                                  int msize, unsigned int priority,
+                                  unsigned long long int sent_time,
+                                  struct sockaddr_storage except_to,
+                                  socklen_t alen, int num_extra,
+                                  const int * extra_fds,
+                                  const struct sockaddr_storage * extra,
+                                  const socklen_t * extra_alens,
+                                  int * extra_sent, int * extra_errors);
 /* send only to the given socket and address */
 extern int socket_send_to (const char * message, int msize,
                            unsigned int priority,
@@ -149,6 +215,13 @@ extern int socket_send_to_ip (int sockfd, const char * message, int msize,
 extern int socket_send_keepalives (struct socket_set * s,
                                    long long int current_time,
                                    long long int local, long long int remote);
+/* send a keepalive only to the given address, which must be in the
+ * socket set on the given socket.  The address is looked up while the
+ * socket set is locked, so this is safe while other threads send or
+ * change the socket set.  returns 1 if sent, 0 otherwise */
+extern int socket_send_keepalive (struct socket_set * s, int sockfd,
+                                  struct sockaddr_storage addr,
+                                  socklen_t alen, long long int sent_time);
 
 /* create a socket and bind it as appropriate for the given address
  * and add it to the given socket set
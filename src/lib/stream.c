@@ -42,6 +42,25 @@ void allnet_stream_init (struct allnet_stream_encryption_state * state,
   state->hash_size = hash_size;
   state->counter = 1;  /* start with counter value of 1 */
   state->block_offset = 0;
+  wp_aes_init (&(state->aes), state->key);
+  memcpy (state->aes_key, state->key, ALLNET_STREAM_KEY_SIZE);
+  state->aes_valid = 1;
+  sha512hmac_init (&(state->hmac), state->secret, ALLNET_STREAM_SECRET_SIZE);
+  memcpy (state->hmac_secret, state->secret, ALLNET_STREAM_SECRET_SIZE);
+  state->hmac_valid = 1;
+}
+
+/* computes the hmac with the precomputed key, recomputing it if needed */
+static void stream_hmac (struct allnet_stream_encryption_state * sp,
+                         const char * data, int dsize, char * result)
+{
+  if ((! sp->hmac_valid) ||
+      (memcmp (sp->hmac_secret, sp->secret, ALLNET_STREAM_SECRET_SIZE) != 0)) {
+    sha512hmac_init (&(sp->hmac), sp->secret, ALLNET_STREAM_SECRET_SIZE);
+    memcpy (sp->hmac_secret, sp->secret, ALLNET_STREAM_SECRET_SIZE);
+    sp->hmac_valid = 1;
+  }
+  sha512hmac_keyed (&(sp->hmac), data, dsize, result);
 }
 
 static void update_counter (char * bytes, uint64_t value)
@@ -51,27 +70,69 @@ static void update_counter (char * bytes, uint64_t value)
   writeb64 (bytes + write_offset, value);
 }
 
-/* serves two purposes: initializing the block, or getting the next aes char */
-static int aes_next_byte (struct allnet_stream_encryption_state * sp,
-                          char * block, int init)
+/* the last byte of each encrypted counter block is never used, so each
+ * counter value only gives 15 bytes of key stream.  This is part of the
+ * format, and must not change */
+#define STREAM_BLOCK_BYTES	(WP_AES_BLOCK_SIZE - 1)
+/* how many blocks of key stream to compute at once */
+#define STREAM_CHUNK_BLOCKS	16
+
+/* computes n bytes of key stream, advancing the counter and block offset */
+static void aes_key_stream (struct allnet_stream_encryption_state * sp,
+                            char * out, int n)
 {
-  if ((init) || (((sp->block_offset + 1) % WP_AES_BLOCK_SIZE) == 0)) {
-    if (! init) {
+  if ((! sp->aes_valid) ||
+      (memcmp (sp->aes_key, sp->key, ALLNET_STREAM_KEY_SIZE) != 0)) {
+    wp_aes_init (&(sp->aes), sp->key);
+    memcpy (sp->aes_key, sp->key, ALLNET_STREAM_KEY_SIZE);
+    sp->aes_valid = 1;
+  }
+  char blocks [STREAM_CHUNK_BLOCKS * WP_AES_BLOCK_SIZE];
+  while (n > 0) {
+    if (sp->block_offset >= STREAM_BLOCK_BYTES) {  /* used up this block */
       (sp->counter)++;
       sp->block_offset = 0;
     }
+    int first = STREAM_BLOCK_BYTES - sp->block_offset;
+    int nblocks = 1;
+    if (n > first)
+      nblocks += (n - first + STREAM_BLOCK_BYTES - 1) / STREAM_BLOCK_BYTES;
+    if (nblocks > STREAM_CHUNK_BLOCKS)
+      nblocks = STREAM_CHUNK_BLOCKS;
     char counter [WP_AES_BLOCK_SIZE];
     update_counter (counter, sp->counter);
-    if (! allnet_aes_encrypt_block (sp->key, counter, block)) {
-      printf ("aes unknown error, unable to encrypt\n");
-      return -1;
+    wp_aes_ctr_stream (&(sp->aes), counter, blocks, nblocks);
+    int b;
+    for (b = 0; (b < nblocks) && (n > 0); b++) {
+      if (b > 0) {
+        (sp->counter)++;
+        sp->block_offset = 0;
+      }
+      int count = STREAM_BLOCK_BYTES - sp->block_offset;
+      if (count > n)
+        count = n;
+      memcpy (out, blocks + b * WP_AES_BLOCK_SIZE + sp->block_offset, count);
+      out += count;
+      n -= count;
+      sp->block_offset += count;
     }
-    if (init)
-      return 0;
   }
-  int index = sp->block_offset;
-  (sp->block_offset)++;
-  return block [index];
+}
+
+static void aes_xor_stream (struct allnet_stream_encryption_state * sp,
+                            const char * in, char * out, int n)
+{
+  char stream [STREAM_CHUNK_BLOCKS * STREAM_BLOCK_BYTES];
+  while (n > 0) {
+    int count = ((n < (int) sizeof (stream)) ? n : (int) sizeof (stream));
+    aes_key_stream (sp, stream, count);
+    int i;
+    for (i = 0; i < count; i++)
+      out [i] = in [i] ^ stream [i];
+    in += count;
+    out += count;
+    n -= count;
+  }
 }
 
 /* allnet_stream_encrypt_buffer encrypts a buffer given an encryption state
@@ -96,11 +157,7 @@ int allnet_stream_encrypt_buffer (struct allnet_stream_encryption_state * sp,
   /* compute the initial counter value, measured in bytes */
   uint64_t send_counter = sp->counter * WP_AES_BLOCK_SIZE + sp->block_offset;
   /* encrypt the data */
-  char crypt_block [WP_AES_BLOCK_SIZE];
-  aes_next_byte (sp, crypt_block, 1);   /* init crypt_block */
-  int i;
-  for (i = 0; i < tsize; i++)
-    result [i] = text [i] ^ aes_next_byte (sp, crypt_block, 0);
+  aes_xor_stream (sp, text, result, tsize);
   int written = tsize;
   /* write the least significant sp->counter_size bytes of the send
    * counter to the result */
@@ -122,7 +179,7 @@ int allnet_stream_encrypt_buffer (struct allnet_stream_encryption_state * sp,
   if (sp->hash_size > 0) {
     char hmac [SHA512_SIZE];
     /* the hmac covers the ciphertext and the counter bytes */
-    sha512hmac (result, written, sp->secret, ALLNET_STREAM_SECRET_SIZE, hmac);
+    stream_hmac (sp, result, written, hmac);
     int num_bytes = sp->hash_size;
     if (sp->hash_size > SHA512_SIZE) {
       memset (result + written, 0, sp->hash_size - SHA512_SIZE);
@@ -172,8 +229,7 @@ int allnet_stream_decrypt_buffer (struct allnet_stream_encryption_state * sp,
   if (sp->hash_size > 0) {
     char hmac [SHA512_SIZE];
     /* the hmac covers the ciphertext and the counter bytes */
-    sha512hmac (packet, psize - sp->hash_size,
-                sp->secret, ALLNET_STREAM_SECRET_SIZE, hmac);
+    stream_hmac (sp, packet, psize - sp->hash_size, hmac);
     int num_bytes = sp->hash_size;
     if (sp->hash_size > SHA512_SIZE)
       num_bytes = SHA512_SIZE;
@@ -203,11 +259,7 @@ int allnet_stream_decrypt_buffer (struct allnet_stream_encryption_state * sp,
   sp->counter = counter / WP_AES_BLOCK_SIZE;
   /* decrypt and return */
   int rsize = psize - (sp->counter_size + sp->hash_size);
-  char crypt_block [WP_AES_BLOCK_SIZE];
-  aes_next_byte (sp, crypt_block, 1);   /* init crypt_block */
-  int i;
-  for (i = 0; i < rsize; i++)
-    text [i] = packet [i] ^ aes_next_byte (sp, crypt_block, 0);
+  aes_xor_stream (sp, packet, text, rsize);
   return 1;
 }
 
@@ -5,6 +5,8 @@
 
 #include <inttypes.h>    /* uint64_t */
 #include "crypt_sel.h"   /* AES256_SIZE */
+#include "wp_aes.h"      /* struct wp_aes_context */
+#include "sha.h"         /* struct sha512hmac_key */
 
 #define ALLNET_STREAM_KEY_SIZE		AES256_SIZE  /* 32 bytes, 256 bits */
 #define ALLNET_STREAM_SECRET_SIZE	64	/* 64 bytes, 512 bits */
@@ -16,6 +18,16 @@ struct allnet_stream_encryption_state {
   int hash_size;
   uint64_t counter;
   int block_offset;   /* how many bytes we are into the block */
+  /* the expanded key, computed when needed.  Callers that copy the state
+   * or change the key need not update these, since aes_key records
+   * which key was expanded.  aes_valid is 0 if the state was zeroed */
+  struct wp_aes_context aes;
+  char aes_key [ALLNET_STREAM_KEY_SIZE];
+  int aes_valid;
+  /* likewise for the hmac key computed from the secret */
+  struct sha512hmac_key hmac;
+  char hmac_secret [ALLNET_STREAM_SECRET_SIZE];
+  int hmac_valid;
 };
 
 /* allnet_stream_init allocates and initializes state for encrypting and
@@ -90,37 +90,128 @@ static int write_string_to (const char * string, int null_term, int fd)
   return result;
 }
 
+/* a set of at most capacity message IDs.  When the set is full, adding
+ * an ID evicts the oldest ID.  The IDs are kept in a ring in the order
+ * they were added, and found through an open-addressing hash table with
+ * at least twice as many slots as IDs, so that a flood of packets costs a
+ * few comparisons per packet rather than one for every ID in the set */
+struct id_set {
+  int capacity;
+  int count;               /* number of IDs in the set */
+  int oldest;              /* position in the ring of the oldest ID */
+  unsigned int mask;       /* number of slots - 1 */
+  unsigned long long int seed;  /* so senders cannot choose the slots */
+  char * ids;              /* the ring, capacity * MESSAGE_ID_SIZE bytes */
+  int * slots;             /* position in the ring of an ID, or -1 */
+};
+
+static void id_set_init (struct id_set * set, int capacity)
+{
+  unsigned int nslots = 16;
+  while (nslots < 2 * (unsigned int) capacity)
+    nslots = nslots * 2;
+  set->capacity = capacity;
+  set->count = 0;
+  set->oldest = 0;
+  set->mask = nslots - 1;
+  random_bytes ((char *) (&(set->seed)), sizeof (set->seed));
+  set->ids = malloc_or_fail (capacity * MESSAGE_ID_SIZE, "id_set_init ids");
+  set->slots = malloc_or_fail (nslots * sizeof (int), "id_set_init slots");
+  unsigned int i;
+  for (i = 0; i < nslots; i++)
+    set->slots [i] = -1;
+}
+
+static void id_set_free (struct id_set * set)
+{
+  free (set->ids);
+  free (set->slots);
+  set->ids = NULL;
+  set->slots = NULL;
+}
+
+/* IDs are random or hashes, so 8 of their bytes are a good hash */
+static unsigned int id_set_home (struct id_set * set, const char * id)
+{
+  unsigned long long int h = (readb64 (id) ^ set->seed) * 0x9e3779b97f4a7c15ULL;
+  return ((unsigned int) (h >> 32)) & set->mask;
+}
+
+static char * id_set_id (struct id_set * set, int position)
+{
+  return set->ids + (position * MESSAGE_ID_SIZE);
+}
+
+/* returns the slot with the ID, or -1 if the ID is not in the set */
+static int id_set_find (struct id_set * set, const char * id)
+{
+  unsigned int i = id_set_home (set, id);
+  while (set->slots [i] >= 0) {
+    if (memcmp (id_set_id (set, set->slots [i]), id, MESSAGE_ID_SIZE) == 0)
+      return (int) i;
+    i = (i + 1) & set->mask;
+  }
+  return -1;
+}
+
+/* empties the slot, and moves back any IDs that were placed further
+ * along because the slot was in use, so no lookup stops too early */
+static void id_set_remove_slot (struct id_set * set, unsigned int hole)
+{
+  unsigned int i = hole;
+  while (1) {
+    i = (i + 1) & set->mask;
+    if (set->slots [i] < 0)
+      break;
+    unsigned int home = id_set_home (set, id_set_id (set, set->slots [i]));
+    /* the ID can move to the hole if the hole is between home and i */
+    if (((i - home) & set->mask) >= ((i - hole) & set->mask)) {
+      set->slots [hole] = set->slots [i];
+      hole = i;
+    }
+  }
+  set->slots [hole] = -1;
+}
+
+/* returns 1 if the ID is in the set.
+ * Otherwise, returns 0 and adds the ID, evicting the oldest if needed */
+static int id_set_check_add (struct id_set * set, const char * id)
+{
+  if (id_set_find (set, id) >= 0)
+    return 1;
+  int position;
+  if (set->count < set->capacity) {
+    position = (set->oldest + set->count) % set->capacity;
+    set->count++;
+  } else {   /* full, replace the oldest ID */
+    position = set->oldest;
+    int slot = id_set_find (set, id_set_id (set, position));
+    if (slot >= 0)
+      id_set_remove_slot (set, slot);
+    set->oldest = (set->oldest + 1) % set->capacity;
+  }
+  memcpy (id_set_id (set, position), id, MESSAGE_ID_SIZE);
+  unsigned int i = id_set_home (set, id);
+  while (set->slots [i] >= 0)
+    i = (i + 1) & set->mask;
+  set->slots [i] = position;
+  return 0;
+}
+
 #define CHECK_FOR_DUPLICATES
 
 #ifdef CHECK_FOR_DUPLICATES
-/* returns 1 if the packet was seen within the last NUM_REMEMBERED packets.
+/* returns 1 if the packet was seen within the last packets remembered.
  * Otherwise, returns 0 and remembers this packet */
-int packet_received_before (char * message, int msize,
-                            char * remembered_hashes, int nh, int * position)
+static int packet_received_before (char * message, int msize,
+                                   struct id_set * remembered)
 {
-  if (*position < 0) {
-    memset (remembered_hashes, 0, nh * MESSAGE_ID_SIZE);
-    *position = 0;
-  }
   if (msize <= 4)
     return 1;  /* should be caught before calling packet_received_before */
   char hash [MESSAGE_ID_SIZE];
   /* when hashing, skip the hop counts */
   sha512_bytes (message + 4, msize - 4, hash, MESSAGE_ID_SIZE);
-  int i;
-  for (i = 0; i < nh; i++) {
-    if (memcmp (remembered_hashes + (i * MESSAGE_ID_SIZE),
-                hash, MESSAGE_ID_SIZE) == 0)
-      return 1;  /* found */
-  }
-  /* not found, add */
-  if ((*position < 0) || (*position >= nh))
-    *position = 0;
-  memcpy (remembered_hashes + ((*position) * MESSAGE_ID_SIZE), hash,
-          MESSAGE_ID_SIZE);
-  *position = *position + 1;
-  return 0;   /* not found */
-#undef NUM_REMEMBERED_HASHES
+  return id_set_check_add (remembered, hash);
 }
 #endif /* CHECK_FOR_DUPLICATES */
 
@@ -131,6 +222,7 @@ int packet_received_before (char * message, int msize,
  * if this trace was received before, return 1 to say the trace should not
  * be forwarded or replied to.
  * trace_id must have MESSAGE_ID_SIZE bytes
+ * only called by allnetd while holding its mgmt_mutex, so needs no lock
  */
 static int is_in_trace_cache (const unsigned char * trace_id)
 {
@@ -149,17 +241,15 @@ static int is_in_trace_cache (const unsigned char * trace_id)
     sent_this_interval = 0;
   }
 #endif /* LIMIT_RATE_OF_TRACES */
-  static char cache [TRACE_CACHE_SIZE] [MESSAGE_ID_SIZE];
-  /* look through all of the cache to find any matching traces */
-  int i;
-  for (i = 0; i < TRACE_CACHE_SIZE; i++) {
-    if (memcmp (cache [i], trace_id, MESSAGE_ID_SIZE) == 0)
-      return 1;   /* already seen, ignore */
+  static struct id_set cache;
+  static int initialized = 0;
+  if (! initialized) {
+    id_set_init (&cache, TRACE_CACHE_SIZE);
+    initialized = 1;
   }
-  /* trace not found, add the trace_id to the cache at the next position */
-  static int next = 0;       /* next place to save messages */
-  memcpy (cache [next], trace_id, MESSAGE_ID_SIZE);
-  next = (next + 1) % TRACE_CACHE_SIZE;
+  /* if not found, adds the trace_id in place of the oldest trace_id */
+  if (id_set_check_add (&cache, (const char *) trace_id))
+    return 1;   /* already seen, ignore */
 #undef TRACE_CACHE_SIZE
 
 #ifdef LIMIT_RATE_OF_TRACES
@@ -743,7 +833,7 @@ static void handle_packet (char * message, int msize, char * seeking,
                            struct timeval start, int seq,
                            int match_only, int no_intermediates,
                            int null_term, int fd_out,
-                           char * rememberedh, int nh, int * positionh,
+                           struct id_set * remembered,
                            struct allnet_log * alog)
 {
 /* print_packet (message, msize, "handle_packet got", 1); */
@@ -783,7 +873,7 @@ static void handle_packet (char * message, int msize, char * seeking,
     return;
   }
 #ifdef CHECK_FOR_DUPLICATES
-  if (packet_received_before (message, msize, rememberedh, nh, positionh)) {
+  if (packet_received_before (message, msize, remembered)) {
 #ifdef DEBUG_PRINT
     print_packet (message, msize, "received duplicate trace packet", 1);
 #endif /* DEBUG_PRINT */
@@ -806,7 +896,7 @@ static void wait_for_responses (int sock, char * trace_id, int sec,
                                 int seq, int match_only, int no_intermediates,
                                 int null_term,
                                 int fd_out,
-                                char * rememberedh, int nh, int * positionh,
+                                struct id_set * remembered,
                                 struct timeval tv_start,
                                 struct allnet_log * alog)
 {
@@ -824,7 +914,7 @@ static void wait_for_responses (int sock, char * trace_id, int sec,
     if (found > 0) {
       handle_packet (message, found, trace_id, tv_start, seq, match_only,
                      no_intermediates, null_term, fd_out,
-                     rememberedh, nh, positionh, alog);
+                     remembered, alog);
       free (message);
     }
     local_send_keepalive (0);
@@ -850,8 +940,9 @@ void do_trace_loop (int sock,
     sum_rtt = 0;
   }
 #define NUM_REMEMBERED_HASHES	1000
-  char remembered_hashes [NUM_REMEMBERED_HASHES * MESSAGE_ID_SIZE];
-  int remembered_position = 0;
+  struct id_set remembered;
+  id_set_init (&remembered, NUM_REMEMBERED_HASHES);
+#undef NUM_REMEMBERED_HASHES
   
   print_details = wide;
 #ifdef DEBUG_PRINT
@@ -888,10 +979,9 @@ void do_trace_loop (int sock,
     }
     wait_for_responses (sock, trace_id, sleep, count,
                         match_only, no_intermediates, null_term,
-                        fd_out, remembered_hashes,
-                        NUM_REMEMBERED_HASHES, &remembered_position,
-                        tv_start, alog);
+                        fd_out, &remembered, tv_start, alog);
   }
+  id_set_free (&remembered);
   print_summary_file (0, null_term, fd_out);
   print_details = 1;
 }
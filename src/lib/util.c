@@ -681,7 +681,7 @@ const char * keepalive_packet (unsigned int * size)
 int keepalive_auth (char * buffer, int bsize,
                     struct sockaddr_storage addr,
                     const char * secret, int slen,
-                    long long int counter,
+                    long long int counter, unsigned int stamp,
                     const char * receiver_auth)
 {
   unsigned int hsize = 0;
@@ -699,7 +699,7 @@ rsize, bsize, hsize, larger);
     return 0;
   }
   memcpy (buffer, header, hsize);
-  compute_sender_auth (addr, secret, slen, counter,
+  compute_sender_auth (addr, secret, slen, counter, stamp,
                        buffer + hsize, KEEPALIVE_AUTHENTICATION_SIZE);
   if (larger)
     memcpy (buffer + hsize + KEEPALIVE_AUTHENTICATION_SIZE,
@@ -1928,15 +1928,17 @@ rp->mid_bits_power_two);
 /* computes the sender authentication into the given buffer */
 void compute_sender_auth (struct sockaddr_storage addr,
                           const char * secret, int slen,
-                          long long int counter,
+                          long long int counter, unsigned int stamp,
                           char * to, int tsize)
 {
-  if (tsize <= 0)
+  if (tsize <= KEEPALIVE_STAMP_SIZE)
     return;
   memset (to, 0, tsize);
-  char buffer [sizeof (counter) + sizeof (struct sockaddr_storage)];
+  writeb16 (to, stamp);
+  char buffer [sizeof (counter) + 2 + sizeof (struct sockaddr_storage)];
   writeb64 (buffer, counter);
-  int off = sizeof (counter);
+  writeb16 (buffer + sizeof (counter), stamp);
+  int off = sizeof (counter) + 2;
   struct sockaddr * sap = (struct sockaddr *) (&addr);
   if (sap->sa_family == AF_INET) {
     struct sockaddr_in * sin = (struct sockaddr_in *) (&addr);
@@ -1960,10 +1962,10 @@ void compute_sender_auth (struct sockaddr_storage addr,
     return;   /* not an IP address */
   char result [SHA512_SIZE];
   sha512hmac (buffer, off, secret, KEEPALIVE_AUTHENTICATION_SIZE, result);
-  int csize = tsize;   /* copy size, for memcpy */
+  int csize = tsize - KEEPALIVE_STAMP_SIZE;   /* copy size, for memcpy */
   if (csize > sizeof (result))
     csize = sizeof (result);
-  memcpy (to, result, csize);
+  memcpy (to + KEEPALIVE_STAMP_SIZE, result, csize);
 }
 
 /* returns whether this keepalive has the right authentication */
@@ -1980,11 +1982,11 @@ int is_auth_keepalive (struct sockaddr_storage addr,
   int hsize = ALLNET_MGMT_HEADER_SIZE (hp->transport);
   if (msize != (hsize + 2 * KEEPALIVE_AUTHENTICATION_SIZE))
     return 0;   /* not a valid authentication packet */
+  const char * echo = message + hsize + KEEPALIVE_AUTHENTICATION_SIZE;
   char verification [KEEPALIVE_AUTHENTICATION_SIZE];
-  compute_sender_auth (addr, secret, slen, counter,
+  compute_sender_auth (addr, secret, slen, counter, readb16 (echo),
                        verification, sizeof (verification));
-  return (memcmp (message + hsize + KEEPALIVE_AUTHENTICATION_SIZE,
-                  verification, KEEPALIVE_AUTHENTICATION_SIZE) == 0);
+  return (memcmp (echo, verification, KEEPALIVE_AUTHENTICATION_SIZE) == 0);
 }
 
 void print_gethostbyname_error (const char * hostname, struct allnet_log * log)
@@ -72,11 +72,13 @@ extern const char * keepalive_packet (unsigned int * size);
  * sender authentication and filling in the receiver authentication
  * (must be of size KEEPALIVE_AUTHENTICATION_SIZE), or
  * if receiver_auth is NULL or all zeros, the packet is shorter
+ * the low 16 bits of stamp are sent in the sender authentication, and
+ * are echoed back by the receiver.  Use 0 unless replies are to be timed.
  * returns the size to send, always <= bsize (0 for errors) */
 extern int keepalive_auth (char * buffer, int bsize,
                            struct sockaddr_storage addr,
                            const char * secret, int slen,
-                           long long int counter,
+                           long long int counter, unsigned int stamp,
                            const char * receiver_auth);
 
 /* malloc, initialize, and return an ack message for a received packet.
@@ -306,10 +308,11 @@ extern int is_valid_message (const char * packet, unsigned int size,
  * the message never expires). */
 extern int is_expired_message (const char * packet, unsigned int size);
 
-/* computes the sender authentication into the given buffer */
+/* computes the sender authentication into the given buffer, starting
+ * with the stamp (see keepalive_auth) */
 extern void compute_sender_auth (struct sockaddr_storage addr,
                                  const char * secret, int slen,
-                                 long long int counter,
+                                 long long int counter, unsigned int stamp,
                                  char * result, int rlen);
 /* returns whether this keepalive has the right authentication */
 extern int is_auth_keepalive (struct sockaddr_storage addr,
@@ -11,6 +11,12 @@
 
 #include "wp_aes.h"
 
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+#define WP_AES_NI	/* use the AES instructions if the CPU has them */
+#include <cpuid.h>
+#include <wmmintrin.h>
+#endif /* (__x86_64__ || __i386__) && __GNUC__ */
+
 /* Things common to enciphering and deciphering */
 
 /* GF(256) logarithm      */
@@ -83,41 +89,6 @@ static const int F[256] = {
 	0x39, 0x4b, 0xdd, 0x7c, 0x84, 0x97, 0xa2, 0xfd, 
     0x1c, 0x24, 0x6c, 0xb4, 0xc7, 0x52, 0xf6, 0x01};
 
-/* S-Box                  */
-static const int SB[256] = {
-	0x63, 0x7c, 0x77, 0x7b, 0xf2, 0x6b, 0x6f, 0xc5, 
-	0x30, 0x01, 0x67, 0x2b, 0xfe, 0xd7, 0xab, 0x76, 
-	0xca, 0x82, 0xc9, 0x7d, 0xfa, 0x59, 0x47, 0xf0, 
-	0xad, 0xd4, 0xa2, 0xaf, 0x9c, 0xa4, 0x72, 0xc0, 
-	0xb7, 0xfd, 0x93, 0x26, 0x36, 0x3f, 0xf7, 0xcc, 
-	0x34, 0xa5, 0xe5, 0xf1, 0x71, 0xd8, 0x31, 0x15, 
-	0x04, 0xc7, 0x23, 0xc3, 0x18, 0x96, 0x05, 0x9a, 
-	0x07, 0x12, 0x80, 0xe2, 0xeb, 0x27, 0xb2, 0x75, 
-	0x09, 0x83, 0x2c, 0x1a, 0x1b, 0x6e, 0x5a, 0xa0, 
-	0x52, 0x3b, 0xd6, 0xb3, 0x29, 0xe3, 0x2f, 0x84, 
-	0x53, 0xd1, 0x00, 0xed, 0x20, 0xfc, 0xb1, 0x5b, 
-	0x6a, 0xcb, 0xbe, 0x39, 0x4a, 0x4c, 0x58, 0xcf, 
-	0xd0, 0xef, 0xaa, 0xfb, 0x43, 0x4d, 0x33, 0x85, 
-	0x45, 0xf9, 0x02, 0x7f, 0x50, 0x3c, 0x9f, 0xa8, 
-	0x51, 0xa3, 0x40, 0x8f, 0x92, 0x9d, 0x38, 0xf5, 
-	0xbc, 0xb6, 0xda, 0x21, 0x10, 0xff, 0xf3, 0xd2, 
-	0xcd, 0x0c, 0x13, 0xec, 0x5f, 0x97, 0x44, 0x17, 
-	0xc4, 0xa7, 0x7e, 0x3d, 0x64, 0x5d, 0x19, 0x73, 
-	0x60, 0x81, 0x4f, 0xdc, 0x22, 0x2a, 0x90, 0x88, 
-	0x46, 0xee, 0xb8, 0x14, 0xde, 0x5e, 0x0b, 0xdb, 
-	0xe0, 0x32, 0x3a, 0x0a, 0x49, 0x06, 0x24, 0x5c, 
-	0xc2, 0xd3, 0xac, 0x62, 0x91, 0x95, 0xe4, 0x79, 
-	0xe7, 0xc8, 0x37, 0x6d, 0x8d, 0xd5, 0x4e, 0xa9, 
-	0x6c, 0x56, 0xf4, 0xea, 0x65, 0x7a, 0xae, 0x08, 
-	0xba, 0x78, 0x25, 0x2e, 0x1c, 0xa6, 0xb4, 0xc6, 
-	0xe8, 0xdd, 0x74, 0x1f, 0x4b, 0xbd, 0x8b, 0x8a, 
-	0x70, 0x3e, 0xb5, 0x66, 0x48, 0x03, 0xf6, 0x0e, 
-	0x61, 0x35, 0x57, 0xb9, 0x86, 0xc1, 0x1d, 0x9e, 
-	0xe1, 0xf8, 0x98, 0x11, 0x69, 0xd9, 0x8e, 0x94, 
-	0x9b, 0x1e, 0x87, 0xe9, 0xce, 0x55, 0x28, 0xdf, 
-	0x8c, 0xa1, 0x89, 0x0d, 0xbf, 0xe6, 0x42, 0x68, 
-    0x41, 0x99, 0x2d, 0x0f, 0xb0, 0x54, 0xbb, 0x16};
-
 #ifdef AES_DECRYPT
 /* S-Box Inverse          */
 static const int SBI[256] = {
@@ -167,6 +138,7 @@ static const int SBI[256] = {
 
 /* uint32_t state[4]; */
 
+#ifdef AES_DECRYPT
 static void AddRoundKey(uint32_t *state, int round, uint32_t *w)
 {
   state[0] ^= w[Nb*round];;
@@ -174,12 +146,15 @@ static void AddRoundKey(uint32_t *state, int round, uint32_t *w)
   state[2] ^= w[Nb*round+2];
   state[3] ^= w[Nb*round+3];
 }
+#endif /* AES_DECRYPT */
 
+#ifdef AES_DECRYPT
 static int times(int x, int y)
 {
   if(x==0 || y==0) return 0;
   return F[(L[x]+L[y])%255];
 }
+#endif /* AES_DECRYPT */
 
 #ifdef DEBUG_PRINT
 static void PrintState(uint32_t *s)
@@ -195,6 +170,126 @@ static void PrintState(uint32_t *s)
 
 /* end of Wes's common.c */
 
+/* constant-time S-box.  Table lookups take time that depends on which
+ * cache lines hold the entries, and so may leak the key.  Instead,
+ * the S-box is computed using the 113-gate circuit of Boyar and Peralta
+ * on 64 bytes at a time, one bit of each byte in each of 8 64-bit words
+ * (bit-slicing), so the time does not depend on the data. */
+
+/* transpose the 8x8 bit matrix with rows in the bytes of x */
+static uint64_t transpose_bits (uint64_t x)
+{
+  uint64_t t;
+  t = (x ^ (x >> 7)) & 0x00aa00aa00aa00aaULL;
+  x = x ^ t ^ (t << 7);
+  t = (x ^ (x >> 14)) & 0x0000cccc0000ccccULL;
+  x = x ^ t ^ (t << 14);
+  t = (x ^ (x >> 28)) & 0x00000000f0f0f0f0ULL;
+  x = x ^ t ^ (t << 28);
+  return x;
+}
+
+/* convert 64 bytes to bit-sliced form, in which bit j of byte n
+ * is bit n of q [j] */
+static void bitslice (const unsigned char * in, uint64_t * q)
+{
+  int i, j;
+  for (j = 0; j < 8; j++)
+    q [j] = 0;
+  for (i = 0; i < 8; i++) {
+    uint64_t x = 0;
+    for (j = 0; j < 8; j++)
+      x |= ((uint64_t) in [8 * i + j]) << (8 * j);
+    x = transpose_bits (x);   /* now byte j of x has bit j of each byte */
+    for (j = 0; j < 8; j++)
+      q [j] |= ((x >> (8 * j)) & 0xff) << (8 * i);
+  }
+}
+
+/* the inverse of bitslice */
+static void unbitslice (const uint64_t * q, unsigned char * out)
+{
+  int i, j;
+  for (i = 0; i < 8; i++) {
+    uint64_t x = 0;
+    for (j = 0; j < 8; j++)
+      x |= ((q [j] >> (8 * i)) & 0xff) << (8 * j);
+    x = transpose_bits (x);
+    for (j = 0; j < 8; j++)
+      out [8 * i + j] = (unsigned char) (x >> (8 * j));
+  }
+}
+
+/* the Boyar-Peralta S-box circuit, q [7] is the high bit of each byte */
+static void bitsliced_sbox (uint64_t * q)
+{
+  uint64_t x0, x1, x2, x3, x4, x5, x6, x7;
+  uint64_t y1, y2, y3, y4, y5, y6, y7, y8, y9;
+  uint64_t y10, y11, y12, y13, y14, y15, y16, y17, y18, y19;
+  uint64_t y20, y21;
+  uint64_t z0, z1, z2, z3, z4, z5, z6, z7, z8, z9;
+  uint64_t z10, z11, z12, z13, z14, z15, z16, z17;
+  uint64_t t0, t1, t2, t3, t4, t5, t6, t7, t8, t9;
+  uint64_t t10, t11, t12, t13, t14, t15, t16, t17, t18, t19;
+  uint64_t t20, t21, t22, t23, t24, t25, t26, t27, t28, t29;
+  uint64_t t30, t31, t32, t33, t34, t35, t36, t37, t38, t39;
+  uint64_t t40, t41, t42, t43, t44, t45, t46, t47, t48, t49;
+  uint64_t t50, t51, t52, t53, t54, t55, t56, t57, t58, t59;
+  uint64_t t60, t61, t62, t63, t64, t65, t66, t67;
+  uint64_t s0, s1, s2, s3, s4, s5, s6, s7;
+
+  x0 = q [7]; x1 = q [6]; x2 = q [5]; x3 = q [4];
+  x4 = q [3]; x5 = q [2]; x6 = q [1]; x7 = q [0];
+
+  /* top linear transformation */
+  y14 = x3 ^ x5;  y13 = x0 ^ x6;  y9 = x0 ^ x3;    y8 = x0 ^ x5;
+  t0 = x1 ^ x2;   y1 = t0 ^ x7;   y4 = y1 ^ x3;    y12 = y13 ^ y14;
+  y2 = y1 ^ x0;   y5 = y1 ^ x6;   y3 = y5 ^ y8;    t1 = x4 ^ y12;
+  y15 = t1 ^ x5;  y20 = t1 ^ x1;  y6 = y15 ^ x7;   y10 = y15 ^ t0;
+  y11 = y20 ^ y9; y7 = x7 ^ y11;  y17 = y10 ^ y11; y19 = y10 ^ y8;
+  y16 = t0 ^ y11; y21 = y13 ^ y16; y18 = x0 ^ y16;
+
+  /* non-linear section */
+  t2 = y12 & y15;  t3 = y3 & y6;    t4 = t3 ^ t2;    t5 = y4 & x7;
+  t6 = t5 ^ t2;    t7 = y13 & y16;  t8 = y5 & y1;    t9 = t8 ^ t7;
+  t10 = y2 & y7;   t11 = t10 ^ t7;  t12 = y9 & y11;  t13 = y14 & y17;
+  t14 = t13 ^ t12; t15 = y8 & y10;  t16 = t15 ^ t12; t17 = t4 ^ t14;
+  t18 = t6 ^ t16;  t19 = t9 ^ t14;  t20 = t11 ^ t16; t21 = t17 ^ y20;
+  t22 = t18 ^ y19; t23 = t19 ^ y21; t24 = t20 ^ y18; t25 = t21 ^ t22;
+  t26 = t21 & t23; t27 = t24 ^ t26; t28 = t25 & t27; t29 = t28 ^ t22;
+  t30 = t23 ^ t24; t31 = t22 ^ t26; t32 = t31 & t30; t33 = t32 ^ t24;
+  t34 = t23 ^ t33; t35 = t27 ^ t33; t36 = t24 & t35; t37 = t36 ^ t34;
+  t38 = t27 ^ t36; t39 = t29 & t38; t40 = t25 ^ t39; t41 = t40 ^ t37;
+  t42 = t29 ^ t33; t43 = t29 ^ t40; t44 = t33 ^ t37; t45 = t42 ^ t41;
+  z0 = t44 & y15;  z1 = t37 & y6;   z2 = t33 & x7;   z3 = t43 & y16;
+  z4 = t40 & y1;   z5 = t29 & y7;   z6 = t42 & y11;  z7 = t45 & y17;
+  z8 = t41 & y10;  z9 = t44 & y12;  z10 = t37 & y3;  z11 = t33 & y4;
+  z12 = t43 & y13; z13 = t40 & y5;  z14 = t29 & y2;  z15 = t42 & y9;
+  z16 = t45 & y14; z17 = t41 & y8;
+
+  /* bottom linear transformation */
+  t46 = z15 ^ z16; t47 = z10 ^ z11; t48 = z5 ^ z13;  t49 = z9 ^ z10;
+  t50 = z2 ^ z12;  t51 = z2 ^ z5;   t52 = z7 ^ z8;   t53 = z0 ^ z3;
+  t54 = z6 ^ z7;   t55 = z16 ^ z17; t56 = z12 ^ t48; t57 = t50 ^ t53;
+  t58 = z4 ^ t46;  t59 = z3 ^ t54;  t60 = t46 ^ t57; t61 = z14 ^ t57;
+  t62 = t52 ^ t58; t63 = t49 ^ t58; t64 = z4 ^ t59;  t65 = t61 ^ t62;
+  t66 = z1 ^ t63;  s0 = t59 ^ t63;  s6 = t56 ^ ~t62; s7 = t48 ^ ~t60;
+  t67 = t64 ^ t65; s3 = t53 ^ t66;  s4 = t51 ^ t66;  s5 = t47 ^ t65;
+  s1 = t64 ^ ~s3;  s2 = t55 ^ ~t67;
+
+  q [7] = s0; q [6] = s1; q [5] = s2; q [4] = s3;
+  q [3] = s4; q [2] = s5; q [1] = s6; q [0] = s7;
+}
+
+/* apply the S-box to each of 64 bytes, in constant time */
+static void ct_sub_bytes (unsigned char * bytes)
+{
+  uint64_t q [8];
+  bitslice (bytes, q);
+  bitsliced_sbox (q);
+  unbitslice (q, bytes);
+}
+
 /* start of Wes's KeyExpansion.c */
 
 static uint32_t makeword(const unsigned char *p)
@@ -210,11 +305,11 @@ static uint32_t makeword(const unsigned char *p)
 
 static void SubWord(uint32_t *p)
 {
-  unsigned char *q = (unsigned char *) p;
-  *q = SB[*q];
-  *(q+1) = SB[*(q+1)];
-  *(q+2) = SB[*(q+2)];
-  *(q+3) = SB[*(q+3)];
+  unsigned char bytes [64];
+  memset (bytes, 0, sizeof (bytes));
+  memcpy (bytes, p, sizeof (uint32_t));
+  ct_sub_bytes (bytes);
+  memcpy (p, bytes, sizeof (uint32_t));
 }
 
 static void RotWord(uint32_t *p)
@@ -332,92 +427,221 @@ static void AESD(unsigned char *C, unsigned char *M,
 
 /* end of Wes's AESD.c */
 
-/* start of Wes's AES.c */
+/* encryption using the expanded key as bytes, in the order they are
+ * used, which is also the order needed by the AES instructions.
+ * The state is the 16 bytes of the block, in order, so state [r + 4 * c]
+ * is row r, column c.  Up to WP_AES_PARALLEL blocks are encrypted
+ * at once, since the S-box works on 64 bytes at a time */
+#define WP_AES_PARALLEL	4
 
-static void SubBytes(uint32_t *p)
+static void ct_shift_rows (unsigned char * s)
 {
-  int i;
-  unsigned char *q = (unsigned char *) p;
-  for(i = 0; i<16; i++) *(q+i) = SB[*(q+i)];
+  unsigned char t [WP_AES_BLOCK_SIZE];
+  int r, c;
+  for (c = 0; c < 4; c++)
+    for (r = 0; r < 4; r++)
+      t [r + 4 * c] = s [r + 4 * ((c + r) % 4)];
+  memcpy (s, t, sizeof (t));
 }
-	
-static void ShiftRows(uint32_t *s)
+
+/* multiply by 2 in GF(2^8), without branching on the value */
+static unsigned char xtime (unsigned char x)
 {
-  uint32_t a, b, c, d;
-  a = s[0]; b = s[1]; c = s[2]; d = s[3];
-  s[0] = (a&0xff000000) | (b&0xff0000) | (c&0xff00) | (d&0xff);
-  s[1] = (b&0xff000000) | (c&0xff0000) | (d&0xff00) | (a&0xff);
-  s[2] = (c&0xff000000) | (d&0xff0000) | (a&0xff00) | (b&0xff);
-  s[3] = (d&0xff000000) | (a&0xff0000) | (b&0xff00) | (c&0xff);
+  return (unsigned char) ((x << 1) ^ (((x >> 7) & 1) * 0x1b));
 }
 
-static uint32_t mcc(uint32_t x)
+static void ct_mix_columns (unsigned char * s)
 {
-  int a, b, c, d, e, f, g, h;
-  a = x>>24;
-  b = (x>>16)&0xff;
-  c = (x>>8)&0xff;
-  d = x&0xff;
+  int c;
+  for (c = 0; c < 4; c++) {
+    unsigned char * col = s + 4 * c;
+    unsigned char a0 = col [0], a1 = col [1], a2 = col [2], a3 = col [3];
+    unsigned char all = a0 ^ a1 ^ a2 ^ a3;
+    col [0] = a0 ^ all ^ xtime (a0 ^ a1);
+    col [1] = a1 ^ all ^ xtime (a1 ^ a2);
+    col [2] = a2 ^ all ^ xtime (a2 ^ a3);
+    col [3] = a3 ^ all ^ xtime (a3 ^ a0);
+  }
+}
 
-  e = times(0x02,a)^times(0x03,b)^c^d;
-  f = a^times(0x02,b)^times(0x03,c)^d;
-  g = a^b^times(0x02,c)^times(0x03,d);
-  h = times(0x03,a)^b^c^times(0x02,d);
+static void add_round_key (unsigned char * s, const unsigned char * rk)
+{
+  int i;
+  for (i = 0; i < WP_AES_BLOCK_SIZE; i++)
+    s [i] ^= rk [i];
+}
 
-  return e<<24 | f<<16 | g<<8 | h;
+/* in and out may be the same */
+static void ct_encrypt_blocks (const unsigned char * rk,
+                               const unsigned char * in, unsigned char * out,
+                               int nblocks)
+{
+  unsigned char state [WP_AES_PARALLEL * WP_AES_BLOCK_SIZE];
+  while (nblocks > 0) {
+    int n = ((nblocks < WP_AES_PARALLEL) ? nblocks : WP_AES_PARALLEL);
+    memset (state, 0, sizeof (state));
+    memcpy (state, in, n * WP_AES_BLOCK_SIZE);
+    int b, round;
+    for (b = 0; b < n; b++)
+      add_round_key (state + b * WP_AES_BLOCK_SIZE, rk);
+    for (round = 1; round <= Nr; round++) {
+      ct_sub_bytes (state);
+      for (b = 0; b < n; b++) {
+        unsigned char * sp = state + b * WP_AES_BLOCK_SIZE;
+        ct_shift_rows (sp);
+        if (round < Nr)
+          ct_mix_columns (sp);
+        add_round_key (sp, rk + round * WP_AES_BLOCK_SIZE);
+      }
+    }
+    memcpy (out, state, n * WP_AES_BLOCK_SIZE);
+    in += n * WP_AES_BLOCK_SIZE;
+    out += n * WP_AES_BLOCK_SIZE;
+    nblocks -= n;
+  }
 }
-	
-static void MixColumns(uint32_t *s)
+
+#ifdef WP_AES_NI
+static int has_aes_instructions ()
 {
-  s[0] = mcc(s[0]);
-  s[1] = mcc(s[1]);
-  s[2] = mcc(s[2]);
-  s[3] = mcc(s[3]);
+  unsigned int a, b, c, d;
+  if (! __get_cpuid (1, &a, &b, &c, &d))
+    return 0;
+  return ((c & bit_AES) != 0);
 }
 
-static void AES(const unsigned char *M, unsigned char *C, uint32_t *w)
+__attribute__ ((target ("aes,sse2")))
+static void aesni_encrypt_blocks (const unsigned char * rk,
+                                  const unsigned char * in,
+                                  unsigned char * out, int nblocks)
 {
-  int round, i;
-  static uint32_t state[4];
+  __m128i k [Nr + 1];
+  int r;
+  for (r = 0; r <= Nr; r++)
+    k [r] = _mm_loadu_si128 ((const __m128i *) (rk + r * WP_AES_BLOCK_SIZE));
+  /* four blocks at a time, so the instructions can overlap */
+  while (nblocks >= 4) {
+    __m128i b0 = _mm_loadu_si128 ((const __m128i *) (in));
+    __m128i b1 = _mm_loadu_si128 ((const __m128i *) (in + 16));
+    __m128i b2 = _mm_loadu_si128 ((const __m128i *) (in + 32));
+    __m128i b3 = _mm_loadu_si128 ((const __m128i *) (in + 48));
+    b0 = _mm_xor_si128 (b0, k [0]);
+    b1 = _mm_xor_si128 (b1, k [0]);
+    b2 = _mm_xor_si128 (b2, k [0]);
+    b3 = _mm_xor_si128 (b3, k [0]);
+    for (r = 1; r < Nr; r++) {
+      b0 = _mm_aesenc_si128 (b0, k [r]);
+      b1 = _mm_aesenc_si128 (b1, k [r]);
+      b2 = _mm_aesenc_si128 (b2, k [r]);
+      b3 = _mm_aesenc_si128 (b3, k [r]);
+    }
+    _mm_storeu_si128 ((__m128i *) (out), _mm_aesenclast_si128 (b0, k [Nr]));
+    _mm_storeu_si128 ((__m128i *) (out + 16), _mm_aesenclast_si128 (b1, k [Nr]));
+    _mm_storeu_si128 ((__m128i *) (out + 32), _mm_aesenclast_si128 (b2, k [Nr]));
+    _mm_storeu_si128 ((__m128i *) (out + 48), _mm_aesenclast_si128 (b3, k [Nr]));
+    in += 64;
+    out += 64;
+    nblocks -= 4;
+  }
+  while (nblocks > 0) {
+    __m128i b0 = _mm_loadu_si128 ((const __m128i *) in);
+    b0 = _mm_xor_si128 (b0, k [0]);
+    for (r = 1; r < Nr; r++)
+      b0 = _mm_aesenc_si128 (b0, k [r]);
+    _mm_storeu_si128 ((__m128i *) out, _mm_aesenclast_si128 (b0, k [Nr]));
+    in += 16;
+    out += 16;
+    nblocks--;
+  }
+}
+#endif /* WP_AES_NI */
 
-  state[0] = makeword(M);
-  state[1] = makeword(M+4);
-  state[2] = makeword(M+8);
-  state[3] = makeword(M+12);
-  AddRoundKey(state, 0, w);
+/* expand the 32-byte key into ctx */
+void wp_aes_init (struct wp_aes_context * ctx, const char * key)
+{
+  uint32_t w [Nb * (Nr + 1)];
+  KeyExpansion ((const unsigned char *) key, w);
+  int i;
+  for (i = 0; i < Nb * (Nr + 1); i++) {
+    ctx->round_keys [4 * i    ] = (unsigned char) (w [i] >> 24);
+    ctx->round_keys [4 * i + 1] = (unsigned char) (w [i] >> 16);
+    ctx->round_keys [4 * i + 2] = (unsigned char) (w [i] >>  8);
+    ctx->round_keys [4 * i + 3] = (unsigned char) (w [i]      );
+  }
+  memset (w, 0, sizeof (w));
+#ifdef WP_AES_NI
+  ctx->use_aes_instructions = has_aes_instructions ();
+#else /* WP_AES_NI */
+  ctx->use_aes_instructions = 0;
+#endif /* WP_AES_NI */
+}
 
-  for(round = 1; round<Nr; round++) {
-#ifdef DEBUG_PRINT
-    printf("Round %d  ", round);
-    PrintState(state);
-#endif /* DEBUG_PRINT */
-    SubBytes(state);
-    ShiftRows(state);
-    MixColumns(state);
-    AddRoundKey(state, round, w);
+/* encrypts nblocks blocks.  in and out may be the same */
+static void encrypt_blocks (const struct wp_aes_context * ctx,
+                            const char * in, char * out, int nblocks)
+{
+#ifdef WP_AES_NI
+  if (ctx->use_aes_instructions) {
+    aesni_encrypt_blocks (ctx->round_keys, (const unsigned char *) in,
+                          (unsigned char *) out, nblocks);
+    return;
   }
-#ifdef DEBUG_PRINT
-  printf("Round %d  ", round);
-  PrintState(state);
-#endif /* DEBUG_PRINT */
-  SubBytes(state);
-  ShiftRows(state);
-  AddRoundKey(state, round, w);
-#ifdef DEBUG_PRINT
-  printf("Output  ");
-  PrintState(state);
-#endif /* DEBUG_PRINT */
-	
-  for(i = 0; i<4; i++) {
-    C[4*i] = state[i]>>24;
-    C[4*i+1] = (state[i]>>16)&0xff;
-    C[4*i+2] = (state[i]>>8)&0xff;
-    C[4*i+3] = state[i]&0xff;
+#endif /* WP_AES_NI */
+  ct_encrypt_blocks (ctx->round_keys, (const unsigned char *) in,
+                     (unsigned char *) out, nblocks);
+}
+
+void wp_aes_encrypt (const struct wp_aes_context * ctx,
+                     const char * in, char * out)
+{
+  encrypt_blocks (ctx, in, out, 1);
+}
+
+/* add 1 to the big-endian counter */
+static void increment_counter (char * ctr)
+{
+  int i;
+  for (i = WP_AES_BLOCK_SIZE - 1; i >= 0; i--) {
+    ctr [i] = (char) ((ctr [i] & 0xff) + 1);
+    if (ctr [i] != 0)   /* no carry */
+      break;
   }
 }
 
-/* end of Wes's AES.c */
+void wp_aes_ctr_stream (const struct wp_aes_context * ctx, char * ctr,
+                        char * out, int nblocks)
+{
+  int i;
+  for (i = 0; i < nblocks; i++) {
+    memcpy (out + i * WP_AES_BLOCK_SIZE, ctr, WP_AES_BLOCK_SIZE);
+    increment_counter (ctr);
+  }
+  encrypt_blocks (ctx, out, out, nblocks);
+}
+
+/* the key stream is computed this many blocks at a time */
+#define CTR_CHUNK_BLOCKS	32
 
+void wp_aes_ctr_crypt (const struct wp_aes_context * ctx, char * ctr,
+                       const char * in, char * out, int size)
+{
+  char stream [CTR_CHUNK_BLOCKS * WP_AES_BLOCK_SIZE];
+  while (size > 0) {
+    int nblocks = (size + WP_AES_BLOCK_SIZE - 1) / WP_AES_BLOCK_SIZE;
+    if (nblocks > CTR_CHUNK_BLOCKS)
+      nblocks = CTR_CHUNK_BLOCKS;
+    wp_aes_ctr_stream (ctx, ctr, stream, nblocks);
+    int n = nblocks * WP_AES_BLOCK_SIZE;
+    if (n > size)
+      n = size;
+    int i;
+    for (i = 0; i < n; i++)
+      out [i] = in [i] ^ stream [i];
+    in += n;
+    out += n;
+    size -= n;
+  }
+}
 
 /* for AES in counter mode, only encryption is used
  * in, out may be the same or different buffer, both should
@@ -431,15 +655,43 @@ void wp_aes_encrypt_block (int ksize, const char * key,
     printf ("       %d-byte key specified\n", ksize);
     exit (1);   /* this is a serious error in the caller */
   }
-  uint32_t w[60];  /* 60 = Nb*(Nr+1)  */
-  /* uint32_t state[4]; */
-  KeyExpansion((const unsigned char *) key, w);
-  AES ((const unsigned char *) in, (unsigned char *) out, w);
+  struct wp_aes_context ctx;
+  wp_aes_init (&ctx, key);
+  wp_aes_encrypt (&ctx, in, out);
 }
 
 #ifdef AES_UNIT_TEST
+/* the S-box from its definition: the multiplicative inverse followed
+ * by the affine transformation */
+static int reference_sbox (int x)
+{
+  int inv = ((x == 0) ? 0 : F [(255 - (L [x] % 255)) % 255]);
+  int result = 0x63;
+  int i;
+  for (i = 0; i < 5; i++)  /* inv xor its rotations by 1, 2, 3, 4 bits */
+    result ^= ((inv << i) | (inv >> (8 - i))) & 0xff;
+  return result;
+}
+
 int main (int argc, char ** argv)
 {
+  /* check the bitsliced S-box against every possible input */
+  int x;
+  for (x = 0; x < 256; x += 64) {
+    unsigned char bytes [64];
+    int i;
+    for (i = 0; i < 64; i++)
+      bytes [i] = x + i;
+    ct_sub_bytes (bytes);
+    for (i = 0; i < 64; i++) {
+      if (bytes [i] != reference_sbox (x + i)) {
+        printf ("error: S-box (%02x) is %02x, should be %02x\n",
+                x + i, bytes [i], reference_sbox (x + i));
+        return 1;
+      }
+    }
+  }
+
   char key [] =   /* not random */
    {  1,  2,  3,  4,  5,  6,  7,  8,  9, 10, 11, 12, 13, 14, 15, 16,
      17, 18, 19, 20, 21, 22, 23, 24, 25, 26, 27, 28, 29, 30, 31, 32};
@@ -458,6 +710,29 @@ int main (int argc, char ** argv)
     printf ("error: AES did not give the right result\n");
     return 1;
   }
+#ifdef WP_AES_NI
+  /* the AES instructions and the portable code must agree */
+  struct wp_aes_context ctx;
+  int i;
+  for (i = 0; i < (int) sizeof (key); i++)
+    key [i] = i * 37 + 5;
+  wp_aes_init (&ctx, key);
+  if (ctx.use_aes_instructions) {
+    char in [7 * WP_AES_BLOCK_SIZE];
+    char hw [sizeof (in)];
+    char sw [sizeof (in)];
+    for (i = 0; i < (int) sizeof (in); i++)
+      in [i] = i * 11 + 3;
+    aesni_encrypt_blocks (ctx.round_keys, (unsigned char *) in,
+                          (unsigned char *) hw, 7);
+    ct_encrypt_blocks (ctx.round_keys, (unsigned char *) in,
+                       (unsigned char *) sw, 7);
+    if (memcmp (hw, sw, sizeof (hw)) != 0) {
+      printf ("error: AES instructions and portable code differ\n");
+      return 1;
+    }
+  }
+#endif /* WP_AES_NI */
   printf ("AES test was successful\n");
   return 0;
 }
@@ -22,4 +22,31 @@
 extern void wp_aes_encrypt_block (int ksize, const char * key,
                                   const char * in, char * out);
 
+/* an expanded 256-bit key, so repeated encryptions with the same key
+ * only compute the key schedule once.  A context may be shared among
+ * threads once wp_aes_init has returned */
+struct wp_aes_context {
+  unsigned char round_keys [240];  /* 15 round keys of 16 bytes each */
+  int use_aes_instructions;        /* set if the CPU supports AES-NI */
+};
+
+/* key must have AES_KEY_256_BYTES */
+extern void wp_aes_init (struct wp_aes_context * ctx, const char * key);
+
+/* in and out have WP_AES_BLOCK_SIZE bytes, and may be the same buffer */
+extern void wp_aes_encrypt (const struct wp_aes_context * ctx,
+                            const char * in, char * out);
+
+/* encrypts nblocks successive values of the 128-bit big-endian counter
+ * ctr into out (nblocks * WP_AES_BLOCK_SIZE bytes).  On return ctr
+ * has been incremented nblocks times */
+extern void wp_aes_ctr_stream (const struct wp_aes_context * ctx, char * ctr,
+                               char * out, int nblocks);
+
+/* counter-mode encryption (or decryption) of size bytes from in to out,
+ * which may be the same buffer.  Updates ctr as wp_aes_ctr_stream does,
+ * once for each started block */
+extern void wp_aes_ctr_crypt (const struct wp_aes_context * ctx, char * ctr,
+                              const char * in, char * out, int size);
+
 #endif /* WP_AES_H */
@@ -1172,6 +1172,12 @@ void wp_exp_mod_montgomery (int nbits, uint64_t * res, const uint64_t * base,
     printf ("wp_exp_mod_montgomery warning: even modulo %s\n",
             wp_itox (nbits, mod));
     wp_exp_mod (nbits, res, base, exp, mod, temp);
+    return;
+  }
+  struct wp_montgomery ctx;
+  if (wp_montgomery_init (&ctx, nbits, mod)) {
+    wp_montgomery_exp (&ctx, res, base, exp, temp);
+    return;
   }
 #ifdef DEBUG_PRINT_MONT
   printf ("wp_exp_mod_montgomery (%d, %s ^ ", nbits, wp_itox (nbits, base));
@@ -1236,6 +1242,266 @@ void wp_exp_mod_montgomery (int nbits, uint64_t * res, const uint64_t * base,
 #endif /* DEBUG_PRINT_MONT */
 }
 
+/* montgomery multiplication and exponentiation using a context that is
+ * computed once for each modulus, so the setup cost is not paid on every
+ * exponentiation.  The multiplication reduces a word at a time (CIOS,
+ * "coarsely integrated operand scanning", Koc, Acar, and Kaliski 1996).
+ * Inside the context and in these functions, numbers are stored least
+ * significant word first, the opposite of the rest of this file, so the
+ * loops run forward. */
+
+/* returns the low word of a * b + c + d, and sets *high to the high word.
+ * the result always fits in 128 bits */
+static inline uint64_t mul_add (uint64_t * high, uint64_t a, uint64_t b,
+                                uint64_t c, uint64_t d)
+{
+#ifdef __SIZEOF_INT128__
+  unsigned __int128 product = ((unsigned __int128) a) * b + c + d;
+  *high = (uint64_t) (product >> 64);
+  return (uint64_t) product;
+#else /* __SIZEOF_INT128__ */
+  uint64_t hi, low;
+  multiply128 (&hi, &low, a, b);
+  low += c;
+  hi += (low < c);
+  low += d;
+  hi += (low < d);
+  *high = hi;
+  return low;
+#endif /* __SIZEOF_INT128__ */
+}
+
+/* converts between this file's order and least-significant-first order */
+static void reverse_words (int nwords, uint64_t * dst, const uint64_t * src)
+{
+  int i;
+  for (i = 0; i < nwords; i++)
+    dst [i] = src [nwords - 1 - i];
+}
+
+/* r = a * b / 2^(64 * nwords) modulo n, for a, b < n.
+ * r may be the same as a or b.  t must have nwords + 2 words.
+ * the sequence of operations does not depend on the values */
+static void mont_mul (int nwords, uint64_t * r,
+                      const uint64_t * a, const uint64_t * b,
+                      const uint64_t * n, uint64_t n0, uint64_t * t)
+{
+  memset (t, 0, (nwords + 2) * sizeof (uint64_t));
+  int i, j;
+  for (i = 0; i < nwords; i++) {
+    uint64_t carry = 0;
+    for (j = 0; j < nwords; j++)
+      t [j] = mul_add (&carry, a [j], b [i], t [j], carry);
+    uint64_t sum = t [nwords] + carry;
+    t [nwords + 1] = (sum < carry);
+    t [nwords] = sum;
+    /* add m * n to make the low word zero, then shift right one word */
+    uint64_t m = t [0] * n0;
+    mul_add (&carry, m, n [0], t [0], 0);
+    for (j = 1; j < nwords; j++)
+      t [j - 1] = mul_add (&carry, m, n [j], t [j], carry);
+    sum = t [nwords] + carry;
+    t [nwords - 1] = sum;
+    t [nwords] = t [nwords + 1] + (sum < carry);
+  }
+  /* now t < 2n.  Put t - n in r, then keep it only if t >= n,
+   * which is if the high word is set or the subtraction did not borrow */
+  uint64_t borrow = 0;
+  for (j = 0; j < nwords; j++) {
+    uint64_t d1 = t [j] - n [j];
+    uint64_t b1 = (t [j] < n [j]);
+    r [j] = d1 - borrow;
+    borrow = b1 | (d1 < borrow);
+  }
+  uint64_t keep = ((uint64_t) 0) - (t [nwords] | (borrow ^ 1));
+  for (j = 0; j < nwords; j++)
+    r [j] = (r [j] & keep) | (t [j] & ~keep);
+}
+
+/* returns 1 if a < b, both least significant word first */
+static int less_than_reversed (int nwords, const uint64_t * a,
+                               const uint64_t * b)
+{
+  int i;
+  for (i = nwords - 1; i >= 0; i--)
+    if (a [i] != b [i])
+      return (a [i] < b [i]);
+  return 0;
+}
+
+/* returns 1 if the context was initialized, 0 if the modulus is even
+ * or too large */
+int wp_montgomery_init (struct wp_montgomery * ctx, int nbits,
+                        const uint64_t * mod)
+{
+  ctx->nbits = 0;
+  if ((nbits <= 0) || (nbits > WP_MONTGOMERY_MAX_BITS) ||
+      (nbits % 64 != 0) || (wp_is_even (nbits, mod)))
+    return 0;
+  int nwords = NUM_WORDS (nbits);
+  reverse_words (nwords, ctx->mod, mod);
+  /* n0 = -1/mod modulo 2^64, by newton's method.  Since mod is odd,
+   * mod * mod = 1 modulo 8, and each step doubles the correct bits */
+  uint64_t inverse = ctx->mod [0];
+  int i;
+  for (i = 0; i < 5; i++)
+    inverse *= 2 - ctx->mod [0] * inverse;
+  ctx->n0 = ((uint64_t) 0) - inverse;
+  /* r^2 modulo mod, by doubling 1 modulo mod 2 * nbits times.  The
+   * modulus is not secret, so branching on the comparison is fine */
+  uint64_t * r2 = ctx->r_squared;
+  memset (r2, 0, nwords * sizeof (uint64_t));
+  r2 [0] = 1;
+  for (i = 0; i < 2 * nbits; i++) {
+    uint64_t carry = 0;
+    int j;
+    for (j = 0; j < nwords; j++) {
+      uint64_t high = r2 [j] >> 63;
+      r2 [j] = (r2 [j] << 1) | carry;
+      carry = high;
+    }
+    if (carry || (! less_than_reversed (nwords, r2, ctx->mod))) {
+      uint64_t borrow = 0;
+      for (j = 0; j < nwords; j++) {
+        uint64_t d = r2 [j] - ctx->mod [j];
+        uint64_t b = (r2 [j] < ctx->mod [j]);
+        r2 [j] = d - borrow;
+        borrow = b | (d < borrow);
+      }
+    }
+  }
+  /* 1 in montgomery form is r modulo mod = r^2 * 1 / r */
+  uint64_t t [WP_MONTGOMERY_MAX_WORDS + 2];
+  uint64_t one [WP_MONTGOMERY_MAX_WORDS];
+  memset (one, 0, nwords * sizeof (uint64_t));
+  one [0] = 1;
+  mont_mul (nwords, ctx->one, r2, one, ctx->mod, ctx->n0, t);
+  ctx->nbits = nbits;
+  return 1;
+}
+
+/* returns 1 if the context was initialized for this modulus, 0 otherwise */
+int wp_montgomery_matches (const struct wp_montgomery * ctx, int nbits,
+                           const uint64_t * mod)
+{
+  if ((ctx->nbits == 0) || (ctx->nbits != nbits))
+    return 0;
+  int nwords = NUM_WORDS (nbits);
+  int i;
+  for (i = 0; i < nwords; i++)
+    if (ctx->mod [i] != mod [nwords - 1 - i])
+      return 0;
+  return 1;
+}
+
+/* returns bits pos..pos+count-1 (count < 64) of the number, which is
+ * stored most significant word first */
+static uint64_t get_exp_bits (int nwords, const uint64_t * exp,
+                              int pos, int count)
+{
+  int word = pos / 64;
+  int shift = pos % 64;
+  uint64_t bits = exp [nwords - 1 - word] >> shift;
+  if ((shift + count > 64) && (word + 1 < nwords))
+    bits |= exp [nwords - 2 - word] << (64 - shift);
+  return bits & ((((uint64_t) 1) << count) - 1);
+}
+
+/* copies table [index] to dst, reading every entry of the table, so
+ * the memory accesses do not depend on the index */
+static void select_entry (int nwords, uint64_t * dst, const uint64_t * table,
+                          uint64_t index)
+{
+  memset (dst, 0, nwords * sizeof (uint64_t));
+  uint64_t k;
+  for (k = 0; k < WP_MONTGOMERY_TABLE; k++) {
+    /* mask is all ones if k == index, and zero otherwise */
+    uint64_t mask = ((uint64_t) 0) - (((k ^ index) - 1) >> 63);
+    const uint64_t * entry = table + k * nwords;
+    int i;
+    for (i = 0; i < nwords; i++)
+      dst [i] |= entry [i] & mask;
+  }
+}
+
+/* res = base ^ exp modulo the context's modulus, where res, base, and
+ * exp have ctx->nbits bits, base < modulus, and temp has at least
+ * WP_MONTGOMERY_TEMP_WORDS (ctx->nbits) words.
+ * uses fixed windows of WP_MONTGOMERY_WINDOW bits, always doing the
+ * same squarings and multiplications and reading every table entry, so
+ * the time taken and memory accessed do not depend on the exponent */
+void wp_montgomery_exp (const struct wp_montgomery * ctx, uint64_t * res,
+                        const uint64_t * base, const uint64_t * exp,
+                        uint64_t * temp)
+{
+  int nwords = NUM_WORDS (ctx->nbits);
+  const uint64_t * mod = ctx->mod;
+  uint64_t n0 = ctx->n0;
+  uint64_t * table = temp;  /* table [k] is base^k in montgomery form */
+  uint64_t * acc = table + WP_MONTGOMERY_TABLE * nwords;
+  uint64_t * x = acc + nwords;
+  uint64_t * t = x + nwords;
+  reverse_words (nwords, x, base);
+  memcpy (table, ctx->one, nwords * sizeof (uint64_t));
+  mont_mul (nwords, table + nwords, x, ctx->r_squared, mod, n0, t);
+  int k;
+  for (k = 2; k < WP_MONTGOMERY_TABLE; k++)
+    mont_mul (nwords, table + k * nwords, table + (k - 1) * nwords,
+              table + nwords, mod, n0, t);
+  /* the first window has the leftover bits, if any */
+  int pos = ctx->nbits;
+  int count = pos % WP_MONTGOMERY_WINDOW;
+  if (count == 0)
+    count = WP_MONTGOMERY_WINDOW;
+  pos -= count;
+  select_entry (nwords, acc, table, get_exp_bits (nwords, exp, pos, count));
+  while (pos > 0) {
+    pos -= WP_MONTGOMERY_WINDOW;
+    for (k = 0; k < WP_MONTGOMERY_WINDOW; k++)
+      mont_mul (nwords, acc, acc, acc, mod, n0, t);
+    uint64_t bits = get_exp_bits (nwords, exp, pos, WP_MONTGOMERY_WINDOW);
+    select_entry (nwords, x, table, bits);
+    mont_mul (nwords, acc, acc, x, mod, n0, t);
+  }
+  /* convert out of montgomery form by multiplying by 1 */
+  memset (x, 0, nwords * sizeof (uint64_t));
+  x [0] = 1;
+  mont_mul (nwords, acc, acc, x, mod, n0, t);
+  reverse_words (nwords, res, acc);
+}
+
+/* same as wp_montgomery_exp, but only for exponents that are not secret,
+ * such as public keys.  Skips the leading zero bits of the exponent,
+ * and only multiplies for the one bits, so is much faster for small
+ * exponents such as 65537.  temp is as for wp_montgomery_exp */
+void wp_montgomery_exp_public (const struct wp_montgomery * ctx,
+                               uint64_t * res, const uint64_t * base,
+                               const uint64_t * exp, uint64_t * temp)
+{
+  int nwords = NUM_WORDS (ctx->nbits);
+  const uint64_t * mod = ctx->mod;
+  uint64_t n0 = ctx->n0;
+  uint64_t * mbase = temp;
+  uint64_t * acc = mbase + nwords;
+  uint64_t * x = acc + nwords;
+  uint64_t * t = x + nwords;
+  reverse_words (nwords, x, base);
+  mont_mul (nwords, mbase, x, ctx->r_squared, mod, n0, t);
+  memcpy (acc, ctx->one, nwords * sizeof (uint64_t));
+  int pos = ctx->nbits - 1;
+  while ((pos >= 0) && (get_exp_bits (nwords, exp, pos, 1) == 0))
+    pos--;
+  for ( ; pos >= 0; pos--) {
+    mont_mul (nwords, acc, acc, acc, mod, n0, t);
+    if (get_exp_bits (nwords, exp, pos, 1))
+      mont_mul (nwords, acc, acc, mbase, mod, n0, t);
+  }
+  memset (x, 0, nwords * sizeof (uint64_t));
+  x [0] = 1;
+  mont_mul (nwords, acc, acc, x, mod, n0, t);
+  reverse_words (nwords, res, acc);
+}
+
 #ifdef UNIT_TEST
 
 #include <stdio.h>
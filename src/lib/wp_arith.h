@@ -112,4 +112,44 @@ extern void wp_exp_mod_montgomery (int nbits, uint64_t * res,
                                    const uint64_t * base, const uint64_t * exp,
                                    const uint64_t * mod, uint64_t * temp);
 
+/* a montgomery context holds the values that depend only on the modulus,
+ * so they can be computed once (for example, when a key is loaded) and
+ * used for every exponentiation with that modulus.  The context does not
+ * point to anything, so it may be copied. */
+#define WP_MONTGOMERY_MAX_BITS	4096
+#define WP_MONTGOMERY_MAX_WORDS	NUM_WORDS (WP_MONTGOMERY_MAX_BITS)
+struct wp_montgomery {
+  int nbits;                                /* 0 if not initialized */
+  uint64_t n0;                              /* -1/mod modulo 2^64 */
+  /* these are least significant word first */
+  uint64_t mod [WP_MONTGOMERY_MAX_WORDS];
+  uint64_t r_squared [WP_MONTGOMERY_MAX_WORDS];  /* 2^(2*nbits) % mod */
+  uint64_t one [WP_MONTGOMERY_MAX_WORDS];        /* 2^nbits % mod */
+};
+
+/* returns 1 if the context was initialized, or 0 if mod is even, or
+ * nbits is not a multiple of 64 or is more than WP_MONTGOMERY_MAX_BITS */
+extern int wp_montgomery_init (struct wp_montgomery * ctx, int nbits,
+                               const uint64_t * mod);
+/* returns 1 if ctx was initialized for this nbits and mod, 0 otherwise */
+extern int wp_montgomery_matches (const struct wp_montgomery * ctx,
+                                  int nbits, const uint64_t * mod);
+
+#define WP_MONTGOMERY_WINDOW	5
+#define WP_MONTGOMERY_TABLE	(1 << WP_MONTGOMERY_WINDOW)
+#define WP_MONTGOMERY_TEMP_WORDS(nbits)	\
+  ((NUM_WORDS (nbits) + 2) * (WP_MONTGOMERY_TABLE + 4))
+
+/* res = base ^ exp % mod, with base < mod.  res, base, and exp have
+ * ctx->nbits, and temp has WP_MONTGOMERY_TEMP_WORDS (ctx->nbits) words.
+ * res may be the same as base.
+ * the time taken does not depend on the value of exp or base */
+extern void wp_montgomery_exp (const struct wp_montgomery * ctx,
+                               uint64_t * res, const uint64_t * base,
+                               const uint64_t * exp, uint64_t * temp);
+/* faster for small exponents, but only use if exp is not secret */
+extern void wp_montgomery_exp_public (const struct wp_montgomery * ctx,
+                                      uint64_t * res, const uint64_t * base,
+                                      const uint64_t * exp, uint64_t * temp);
+
 #endif /* WES_ARITH_H */
@@ -45,9 +45,38 @@ wp_rsa_key wp_rsa_get_public_key (wp_rsa_key_pair * key)
   result.nbits = key->nbits;
   wp_copy (key->nbits, result.n, key->n);
   result.e = key->e;
+  result.mont = key->mont;
   return result;
 }
 
+void wp_rsa_key_prepare (wp_rsa_key * key)
+{
+  wp_montgomery_init (&(key->mont), key->nbits, key->n);
+}
+
+void wp_rsa_key_pair_prepare (wp_rsa_key_pair * key)
+{
+  wp_rsa_key_prepare ((wp_rsa_key *) key);
+  int nhalf = key->nbits / 2;
+  /* init fails and leaves the context unused if p or q are zero */
+  wp_montgomery_init (&(key->mont_p), nhalf, key->p);
+  wp_montgomery_init (&(key->mont_q), nhalf, key->q);
+}
+
+/* returns the key's context if it is up to date, otherwise computes
+ * a context in local.  The key itself is never modified, so keys may be
+ * shared among threads.  Returns NULL if there can be no context */
+static const struct wp_montgomery *
+  rsa_context (const struct wp_montgomery * cached,
+               struct wp_montgomery * local, int nbits, const uint64_t * mod)
+{
+  if (wp_montgomery_matches (cached, nbits, mod))
+    return cached;
+  if (wp_montgomery_init (local, nbits, mod))
+    return local;
+  return NULL;
+}
+
 static int is_set_bit (char * a, int bitpos)
 {
   int bytepos = bitpos / 8;
@@ -777,6 +806,7 @@ int wp_rsa_generate_key_pair_e (int nbits, wp_rsa_key_pair * key, long int e,
       }
     }
     if (! do_over) {
+      wp_rsa_key_pair_prepare (key);
       char test [WP_RSA_MAX_KEY_BYTES];
       memset (test, 0, sizeof (test));
       test [nbits / 8 - 1] = 99;
@@ -1167,7 +1197,13 @@ static void rsa_do_encrypt (wp_rsa_key * key, uint64_t * data, char * result)
   /* compute data^e mod key->n and place the result in result */
 #ifdef USE_EXP_MOD_MONTGOMERY
   rsa_temp temp;
-  wp_exp_mod_montgomery (key->nbits, ri, data, efull, key->n, temp);
+  struct wp_montgomery local;
+  const struct wp_montgomery * ctx =
+    rsa_context (&(key->mont), &local, key->nbits, key->n);
+  if (ctx != NULL)  /* e is public, so may use the faster exponentiation */
+    wp_montgomery_exp_public (ctx, ri, data, efull, temp);
+  else
+    wp_exp_mod_montgomery (key->nbits, ri, data, efull, key->n, temp);
 #else /* USE_EXP_MOD_MONTGOMERY */
 #ifdef USE_EXP_MOD64
   rsa_temp temp;
@@ -1219,7 +1255,13 @@ static void rsa_decrypt_slow (wp_rsa_key_pair * key, uint64_t * data,
 #endif /* DEBUG_PRINT */
 #ifdef USE_EXP_MOD_MONTGOMERY
   rsa_temp temp;
-  wp_exp_mod_montgomery (key->nbits, result, data, key->d, key->n, temp);
+  struct wp_montgomery local;
+  const struct wp_montgomery * ctx =
+    rsa_context (&(key->mont), &local, key->nbits, key->n);
+  if (ctx != NULL)
+    wp_montgomery_exp (ctx, result, data, key->d, temp);
+  else
+    wp_exp_mod_montgomery (key->nbits, result, data, key->d, key->n, temp);
 #else /* USE_EXP_MOD_MONTGOMERY */
 #ifdef USE_EXP_MOD64
   rsa_temp temp;
@@ -1265,9 +1307,19 @@ static void rsa_decrypt_fast (wp_rsa_key_pair * key, uint64_t * data,
   rsa_half m1;
 #ifdef USE_EXP_MOD_MONTGOMERY
   rsa_temp_half temp;
-  wp_exp_mod_montgomery (nhalf, m1, data_mod_p, key->dp, key->p, temp);
+  struct wp_montgomery local;
+  const struct wp_montgomery * ctx =
+    rsa_context (&(key->mont_p), &local, nhalf, key->p);
+  if (ctx != NULL)
+    wp_montgomery_exp (ctx, m1, data_mod_p, key->dp, temp);
+  else
+    wp_exp_mod_montgomery (nhalf, m1, data_mod_p, key->dp, key->p, temp);
   rsa_half m2;
-  wp_exp_mod_montgomery (nhalf, m2, data_mod_q, key->dq, key->q, temp);
+  ctx = rsa_context (&(key->mont_q), &local, nhalf, key->q);
+  if (ctx != NULL)
+    wp_montgomery_exp (ctx, m2, data_mod_q, key->dq, temp);
+  else
+    wp_exp_mod_montgomery (nhalf, m2, data_mod_q, key->dq, key->q, temp);
 #else /* USE_EXP_MOD_MONTGOMERY */
 #ifdef USE_EXP_MOD64
   rsa_temp_half temp;
@@ -1839,3 +1891,67 @@ int main (int argc, char ** argv)
   return 0;
 }
 #endif /* RSA_UNIT_TEST */
+
+#ifdef RSA_BENCHMARK
+/* gcc -O2 -DRSA_BENCHMARK -o rsa_benchmark wp_rsa.c wp_arith.c asn1.c wp_aes.c sha.c
+ * ./rsa_benchmark key.pem [seconds]
+ * key.pem can be created with: openssl genrsa -traditional -out key.pem 4096
+ * reports sign, verify, and decrypt operations per second */
+static void benchmark (const char * desc, int seconds, wp_rsa_key_pair * key,
+                       wp_rsa_key * pubkey, int op)
+{
+  int nbytes = key->nbits / 8;
+  char hash [SHA512_SIZE];
+  sha512 (desc, (int) strlen (desc), hash);
+  char sig [WP_RSA_MAX_KEY_BYTES];
+  char cipher [WP_RSA_MAX_KEY_BYTES];
+  char plain [WP_RSA_MAX_KEY_BYTES];
+  wp_rsa_sign (key, hash, SHA512_SIZE, sig, nbytes,
+               WP_RSA_SIG_ENCODING_SHA512);
+  wp_rsa_encrypt (pubkey, hash, SHA512_SIZE, cipher, nbytes,
+                  WP_RSA_PADDING_PKCS1_OAEP);
+  struct timeval start;
+  gettimeofday (&start, NULL);
+  uint64_t limit = ((uint64_t) seconds) * 1000000;
+  int count = 0;
+  int errors = 0;
+  while (time_usec_since (&start) < limit) {
+    if (op == 0)
+      errors += (! wp_rsa_sign (key, hash, SHA512_SIZE, sig, nbytes,
+                                WP_RSA_SIG_ENCODING_SHA512));
+    else if (op == 1)
+      errors += (! wp_rsa_verify (pubkey, hash, SHA512_SIZE, sig, nbytes,
+                                  WP_RSA_SIG_ENCODING_SHA512));
+    else
+      errors += (wp_rsa_decrypt (key, cipher, nbytes, plain, sizeof (plain),
+                                 WP_RSA_PADDING_PKCS1_OAEP) != SHA512_SIZE);
+    count++;
+  }
+  uint64_t usec = time_usec_since (&start);
+  printf ("RSA-%d %-8s %9.2f ops/s (%d in %.2fs)", key->nbits, desc,
+          count * 1000000.0 / usec, count, usec / 1000000.0);
+  if (errors > 0)
+    printf (", %d errors", errors);
+  printf ("\n");
+}
+
+int main (int argc, char ** argv)
+{
+  if (argc < 2) {
+    printf ("usage: %s key.pem [seconds]\n", argv [0]);
+    return 1;
+  }
+  int seconds = ((argc > 2) ? atoi (argv [2]) : 5);
+  wp_rsa_key_pair key;
+  int nbits;
+  if (! wp_rsa_read_key_from_file (argv [1], &nbits, &key)) {
+    printf ("unable to read private key from %s\n", argv [1]);
+    return 1;
+  }
+  wp_rsa_key pubkey = wp_rsa_get_public_key (&key);
+  benchmark ("sign", seconds, &key, &pubkey, 0);
+  benchmark ("verify", seconds, &key, &pubkey, 1);
+  benchmark ("decrypt", seconds, &key, &pubkey, 2);
+  return 0;
+}
+#endif /* RSA_BENCHMARK */
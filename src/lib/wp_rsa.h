@@ -10,6 +10,7 @@
 #include <stdint.h>
 
 #include "sha.h"
+#include "wp_arith.h"
 
 #define WP_RSA_MAX_KEY_BITS	4096
 
@@ -19,16 +20,23 @@
 #define WP_RSA_MAX_KEY_BYTES	(WP_RSA_MAX_KEY_BITS / 8)
 #define WP_RSA_HALF_KEY_BYTES	(WP_RSA_MAX_KEY_BYTES / 2)
 
+/* mont is computed by wp_rsa_key_prepare or wp_rsa_key_pair_prepare.
+ * An out-of-date context is detected and not used, but then every
+ * operation has to compute the context again, which is slower.
+ * a pointer to a wp_rsa_key_pair may be used as a pointer to wp_rsa_key,
+ * so the first fields must be the same in both */
 typedef struct {
   int nbits;
   uint64_t n [WP_RSA_MAX_KEY_WORDS];
   uint64_t e;
+  struct wp_montgomery mont;		/* for computing modulo n */
 } wp_rsa_key;
 
 typedef struct {
   int nbits;
   uint64_t n [WP_RSA_MAX_KEY_WORDS];
   uint64_t e;   			/* usually 65537 */
+  struct wp_montgomery mont;		/* for computing modulo n */
   uint64_t d [WP_RSA_MAX_KEY_WORDS];
 /* used for faster implementation of decryption and signing */
   uint64_t p [WP_RSA_HALF_KEY_WORDS];
@@ -36,11 +44,18 @@ typedef struct {
   uint64_t dp [WP_RSA_HALF_KEY_WORDS];
   uint64_t dq [WP_RSA_HALF_KEY_WORDS];
   uint64_t qinv [WP_RSA_HALF_KEY_WORDS];
+  struct wp_montgomery mont_p;		/* for computing modulo p */
+  struct wp_montgomery mont_q;		/* for computing modulo q */
 } wp_rsa_key_pair;
 
-/* get the public key part of the key pair */
+/* get the public key part of the key pair, including its context */
 extern wp_rsa_key wp_rsa_get_public_key (wp_rsa_key_pair * key);
 
+/* compute the montgomery contexts once the other fields of the key
+ * are set.  Keys read or generated by this library are already prepared */
+extern void wp_rsa_key_prepare (wp_rsa_key * key);
+extern void wp_rsa_key_pair_prepare (wp_rsa_key_pair * key);
+
 /* read the key from the given bytes, returning 1 if read a private
  * and public key pair, 2 for just the public key, or 0 for error
  * if this is a public key, key->d will be set to zero */
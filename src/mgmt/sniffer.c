@@ -17,6 +17,7 @@
 #include "lib/priority.h"
 #include "lib/cipher.h"
 #include "lib/keys.h"
+#include "lib/capture.h"
 
 /* whenever we set the types variable, the low bit will be 0 because 0 is
  * not a valid packet type.  So we can distinguish ALL_PACKET_TYPES from
@@ -208,10 +209,22 @@ static int received_before (char * message, unsigned int mlen)
 #undef MESSAGE_STORAGE
 }
 
+/* the daemon does not tell us where a packet came from, but it increments
+ * the hop count of every packet it receives from another daemon, so
+ * packets with zero hops were sent by a local application */
+static int capture_source (const char * message, int msize)
+{
+  const struct allnet_header * hp = (const struct allnet_header *) message;
+  if (msize < ALLNET_HEADER_SIZE)
+    return CAPTURE_SOURCE_UNKNOWN;
+  return ((hp->hops == 0) ? CAPTURE_SOURCE_LOCAL : CAPTURE_SOURCE_REMOTE);
+}
+
 static void main_loop (int debug, int max, int verify, int unique,
                        int types, int subtypes, int full,
                        unsigned char * src, unsigned int src_bits,
-                       unsigned char * dst, unsigned int dst_bits)
+                       unsigned char * dst, unsigned int dst_bits,
+                       struct allnet_capture * capture)
 {
   while (1) {
     unsigned int pri;
@@ -221,6 +234,9 @@ static void main_loop (int debug, int max, int verify, int unique,
       printf ("packet sniffer pipe closed, exiting\n");
       exit (1);
     }  /* found > 0 */
+    if (capture != NULL)  /* save every packet, even if not printed */
+      capture_write (capture, message, found, pri,
+                     capture_source (message, found));
     if ((! unique) || (! received_before (message, found))) {
       int received = 0;
       if (handle_packet (message, found, &received, debug, verify,
@@ -258,13 +274,17 @@ static int debug_switch (int * argc, char ** argv)
 static void usage (const char * command)
 {
   printf ("usage: %s [-v] [-d] [-y] [-u] [-f] [-t type]* "
-          " [-a destination address] [-s source] [number-of-messages]\n",
+          " [-a destination address] [-s source] [-w capture-file"
+          " [-m megabytes] [-i seconds]] [number-of-messages]\n",
           command);
   printf ("       -v: verbose, -d: debug, -y: verify sig, -u: unique only");
   printf ("       -f: print full message payloads, not abbreviated");
   printf ("       -t n: only show messages of type n -- may be repeated\n");
   printf ("       -a x, -s x: only show messages with source/dest x\n");
   printf ("       (repeating the SAME type, toggles it)\n");
+  printf ("       -w f: save all packets in capture files f.0, f.1, ...\n");
+  printf ("       -m n, -i n: start a new capture file after n megabytes"
+          " or n seconds\n");
   exit (1);
 }
 
@@ -296,13 +316,19 @@ int main (int argc, char ** argv)
   unsigned int dst_bits = 0;
   unsigned int src_bits = 0;
   char * end = NULL;
-  while ((opt = getopt (argc, argv, "vdyufa:s:t:")) != -1) {
+  char * capture_base = NULL;
+  long long int capture_bytes = 0;
+  long long int capture_seconds = 0;
+  while ((opt = getopt (argc, argv, "vdyufa:s:t:w:m:i:")) != -1) {
     switch (opt) {
     case 'd': debug = 1; break;
     case 'v': verbose = 1; break;
     case 'y': verify = 1; break;
     case 'u': unique = 1; break;
     case 'f': full_payloads = 1; break;
+    case 'w': capture_base = optarg; break;
+    case 'm': capture_bytes = atoll (optarg) * 1000 * 1000; break;
+    case 'i': capture_seconds = atoll (optarg); break;
     case 's': /* source address */
       addr_int = strtoll (optarg, &end, 16);
       src_bits = (end - optarg) * 4;
@@ -360,8 +386,15 @@ int main (int argc, char ** argv)
   if (argc > optind)
     max = atoi (argv [optind]);
 
+  struct allnet_capture * capture = NULL;
+  if (capture_base != NULL) {
+    capture = capture_open (capture_base, capture_bytes, capture_seconds);
+    if (capture == NULL)
+      return 1;
+  }
   main_loop (debug, max, verify, unique, types, subtypes, full_payloads,
-             src, src_bits, dst, dst_bits);
+             src, src_bits, dst, dst_bits, capture);
+  capture_close (capture);
   return 0;
 }
 
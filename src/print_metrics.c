@@ -0,0 +1,67 @@
+/* print the metrics of the running allnet daemon */
+/* usage: allnet-print-metrics [-p port] [-t seconds] */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "lib/metrics.h"
+
+int main (int argc, char ** argv)
+{
+  int port = ALLNET_METRICS_PORT;
+  int timeout = 2;
+  int opt;
+  while ((opt = getopt (argc, argv, "p:t:")) != -1) {
+    switch (opt) {
+    case 'p': port = atoi (optarg); break;
+    case 't': timeout = atoi (optarg); break;
+    default:
+      printf ("usage: %s [-p port] [-t seconds]\n", argv [0]);
+      return 1;
+    }
+  }
+  int sockfd = socket (AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+  if (sockfd < 0) {
+    perror ("print_metrics socket");
+    return 1;
+  }
+  struct timeval tv = { .tv_sec = ((timeout > 0) ? timeout : 1),
+                        .tv_usec = 0 };
+  if (setsockopt (sockfd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof (tv)) != 0)
+    perror ("print_metrics setsockopt");
+  struct sockaddr_in sin;
+  memset (&sin, 0, sizeof (sin));
+  sin.sin_family = AF_INET;
+  sin.sin_addr.s_addr = htonl (INADDR_LOOPBACK);
+  sin.sin_port = htons (port);
+  if (sendto (sockfd, "metrics", 7, 0,
+              (struct sockaddr *) (&sin), sizeof (sin)) != 7) {
+    perror ("print_metrics sendto");
+    return 1;
+  }
+  char buffer [65536];
+  int received = 0;
+  while (1) {
+    ssize_t n = recv (sockfd, buffer, sizeof (buffer), 0);
+    if (n < 0) {
+      if (received == 0)
+        printf ("no metrics received on port %d, is allnetd running?\n",
+                port);
+      else
+        printf ("metrics incomplete, timed out\n");
+      return 1;
+    }
+    if (n == 0)   /* end of the metrics */
+      break;
+    fwrite (buffer, 1, n, stdout);
+    received += n;
+  }
+  close (sockfd);
+  return 0;
+}
@@ -2,13 +2,16 @@
 /* social level 0 (our own contacts) is tracked independently by keys.c,
  * so here we (a) return the results from key.c for level 0, and
  * (b) keep track of and return the results for social levels 1 and 2 */
-/* to do: lots!!!  Including keeping track by source address and
- * by packet signature.
- */
+/* signature verification results are cached by source address and
+ * by a hash of the signed bytes and signature, and only keys whose
+ * address matches the source address are tried. */
+/* to do: lots!!! */
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
+#include <string.h>
+#include <pthread.h>
 
 #include "social.h"
 #include "lib/packet.h"
@@ -19,6 +22,8 @@
 #include "lib/keys.h"
 #include "lib/cipher.h"
 #include "lib/priority.h"
+#include "lib/sha.h"
+#include "lib/metrics.h"
 
 /* keep track of people up to distance 3, friends of friends of friends */
 #ifndef MAX_SOCIAL_TIER   /* usually defined in priority.h */
@@ -61,21 +66,77 @@ static void print_social_tier (int tier, struct social_one_tier * soc,
  */
 }
 
+/* a key that might have signed a message.  Candidates are kept in
+ * one list per value of the first byte of their address, and a separate
+ * list for addresses with fewer than 8 bits */
+struct social_candidate {
+  keyset k;          /* -1 for broadcast keys */
+  int bc_index;      /* index into get_other_keys, or -1 for contact keys */
+  unsigned char address [ADDRESS_SIZE];
+  int nbits;
+  int next;          /* next candidate in the same list, or -1 */
+};
+#define SOCIAL_SHORT_LIST	256
+#define SOCIAL_LISTS		(SOCIAL_SHORT_LIST + 1)
+/* rebuild the candidates at least this often, to find new keys */
+#define SOCIAL_INDEX_SECONDS	60
+
+/* the result of verifying one signature on one message from one source.
+ * Entries from an older generation of the candidates are not trusted:
+ * if verified, only the saved key is checked again, if not, all the
+ * candidates are checked again */
+struct social_verified {
+  char hash [16];    /* of the signed bytes followed by the signature */
+  unsigned char source [ADDRESS_SIZE];
+  int sbits;
+  int generation;    /* 0 for unused entries, else same as candidates */
+  keyset k;          /* the contact key that verified it, or -1 */
+  int bc_index;      /* the bc key that verified it, or -1 */
+};
+#define SOCIAL_VERIFIED_CACHE	1024   /* must be a power of two */
+
 struct social_info {
   struct social_one_tier info [MAX_SOCIAL_TIER];
   int max_bytes;    /* should not use more than max_bytes of storage */
   int max_check;    /* should not check more than max_check sigs per call */
   struct allnet_log * log;
+  /* candidate keys for verification, built by build_candidates */
+  struct social_candidate * candidates;
+  int num_candidates;
+  int lists [SOCIAL_LISTS];   /* first candidate in each list, or -1 */
+  int tails [SOCIAL_LISTS];   /* last candidate in each list, or -1 */
+  int generation;             /* incremented each time candidates are built */
+  time_t candidates_built;
+  int candidate_contacts;     /* num_contacts () when candidates built */
+  int candidate_key_changes;  /* contact_key_changes () when built */
+  int candidate_bc_keys;      /* get_other_keys () when candidates built */
+  struct social_verified verified [SOCIAL_VERIFIED_CACHE];
+  /* social_connection may be called from multiple threads.  The candidates
+   * are read-locked while verifying, and write-locked to rebuild them.
+   * The mutex protects the verified cache and the log */
+  pthread_rwlock_t candidates_lock;
+  pthread_mutex_t mutex;
 };
 
-struct social_info * init_social (int max_bytes, int max_check,
-                                  struct allnet_log * log)
+struct social_info * init_social (int max_bytes, int max_check)
 {
   struct social_info * result = malloc_or_fail (sizeof (struct social_info),
                                                 "init_social");
   result->max_bytes = max_bytes;
   result->max_check = max_check;
-  result->log = log;
+  /* social_connection is called from several threads, so use our own
+   * log rather than share the caller's (the mutex protects it) */
+  result->log = init_log ("social");
+  result->candidates = NULL;
+  result->num_candidates = 0;
+  result->generation = 0;
+  result->candidates_built = 0;
+  result->candidate_contacts = -1;
+  result->candidate_key_changes = -1;
+  result->candidate_bc_keys = -1;
+  memset (result->verified, 0, sizeof (result->verified));
+  pthread_rwlock_init (&(result->candidates_lock), NULL);
+  pthread_mutex_init (&(result->mutex), NULL);
   int bytes = ADDRESS_SIZE;
   int i;
   for (i = 0; i < MAX_SOCIAL_TIER; i++) {
@@ -143,62 +204,239 @@ time_t update_social (struct social_info * soc, int update_seconds)
   static int only_print_if_new = 0;
   int free_bytes = soc->max_bytes;
   int i;
+  pthread_mutex_lock (&(soc->mutex));  /* protects the log */
   for (i = 1; i < MAX_SOCIAL_TIER; i++) {  /* skip social level 0 */
     free_bytes -= update_social_tier (i, soc->info + i, free_bytes, soc->log);
     print_social_tier (i, soc->info + i, only_print_if_new, soc->log);
   }
   only_print_if_new = 1;
+  pthread_mutex_unlock (&(soc->mutex));
   return (time (NULL) + update_seconds);
 }
 
-/* returns 1 if this message is from my contact, and 0 otherwise */
-static int is_my_contact (char * message, int msize,
-                          unsigned char * sender, int bits,
-                          int algo, char * sig, int ssize,
-                          struct allnet_log * log)
+static void add_candidate (struct social_info * soc, keyset k, int bc_index,
+                           const unsigned char * address, int nbits)
 {
-  char ** contacts = NULL;
-  int nc = all_contacts (&contacts);
-  int ic;
-  for (ic = 0; ic < nc; ic++) {
-    keyset * keysets = NULL;
-    int nk = all_keys (contacts [ic], &keysets);
-    int ink;
-    for (ink = 0; ink < nk; ink++) {
-      unsigned char address [ADDRESS_SIZE];
-      int na_bits = get_remote (keysets [ink], address);
-      allnet_rsa_pubkey key;
-      int ksize = get_contact_pubkey (keysets [ink], &key);
-      if ((ksize > 0) && (matches (sender, bits, address, na_bits) > 0) &&
-          (allnet_verify (message, msize, sig, ssize, key))) {
-        snprintf (log->b, LOG_SIZE, "verified from contact %d %d\n", ic, ink);
-        log_print (log);
-        free (keysets);
-        free (contacts);
-        return 1;
-      }
-    }
-    if (keysets != NULL)
-      free (keysets);
-  }
-  if (contacts != NULL)
-    free (contacts);
+  struct social_candidate * c = soc->candidates + soc->num_candidates;
+  c->k = k;
+  c->bc_index = bc_index;
+  memcpy (c->address, address, ADDRESS_SIZE);
+  c->nbits = nbits;
+  int list = ((nbits < 8) ? SOCIAL_SHORT_LIST : address [0]);
+  /* append at the end of the list, so contacts are tried before bc keys */
+  c->next = -1;
+  if (soc->tails [list] < 0)
+    soc->lists [list] = soc->num_candidates;
+  else
+    soc->candidates [soc->tails [list]].next = soc->num_candidates;
+  soc->tails [list] = soc->num_candidates;
+  soc->num_candidates++;
+}
+
+/* returns 1 if the keys may have changed since the candidates were built */
+static int candidates_stale (struct social_info * soc)
+{
+  struct bc_key_info * bc;
+  return ((soc->candidates == NULL) ||
+          (num_contacts () != soc->candidate_contacts) ||
+          (contact_key_changes () != soc->candidate_key_changes) ||
+          (get_other_keys (&bc) != soc->candidate_bc_keys) ||
+          (time (NULL) >= soc->candidates_built + SOCIAL_INDEX_SECONDS));
+}
 
+/* rebuild the candidates if the keys may have changed.
+ * called with the candidates write-locked */
+static void build_candidates (struct social_info * soc)
+{
+  if (! candidates_stale (soc))
+    return;    /* no change, or another thread just rebuilt them */
   struct bc_key_info * bc;
   int nbc = get_other_keys (&bc);
-  int ibc;
-  for (ibc = 0; ibc < nbc; ibc++) {
-    if ((matches (sender, bits,
-                  (unsigned char *) (bc [ibc].address), ADDRESS_BITS) > 0) &&
-        (allnet_verify (message, msize, sig, ssize, bc [ibc].pub_key))) {
-      snprintf (log->b, LOG_SIZE, "verified from bc contact %d\n", ibc);
-      log_print (log);
+  int ncontacts = num_contacts ();
+  int key_changes = contact_key_changes ();
+  time_t now = time (NULL);
+  /* count the contacts' keysets, then collect them */
+  int nks = 0;
+  int iter = 0;
+  char * contact = NULL;
+  int csize = 0;
+  while (next_contact (&iter, &contact, &csize)) {
+    int n = contact_keysets (contact, NULL, 0);
+    if (n > 0)
+      nks += n;
+  }
+  keyset * keysets = malloc_or_fail ((nks + 1) * sizeof (keyset),
+                                     "build_candidates keysets");
+  int used = 0;
+  iter = 0;
+  while ((used < nks) && (next_contact (&iter, &contact, &csize))) {
+    int n = contact_keysets (contact, keysets + used, nks - used);
+    if (n > nks - used)   /* added since we counted */
+      n = nks - used;
+    if (n > 0)
+      used += n;
+  }
+  if (contact != NULL)
+    free (contact);
+  int total = nbc + used;
+  if (soc->candidates != NULL)
+    free (soc->candidates);
+  soc->candidates = malloc_or_fail ((total + 1) *
+                                    sizeof (struct social_candidate),
+                                    "build_candidates");
+  soc->num_candidates = 0;
+  int i;
+  for (i = 0; i < SOCIAL_LISTS; i++) {
+    soc->lists [i] = -1;
+    soc->tails [i] = -1;
+  }
+  for (i = 0; i < used; i++) {
+    unsigned char address [ADDRESS_SIZE];
+    int na_bits = get_remote (keysets [i], address);
+    allnet_rsa_pubkey key;
+    if (get_contact_pubkey (keysets [i], &key) > 0)
+      add_candidate (soc, keysets [i], -1, address, na_bits);
+  }
+  free (keysets);
+  for (i = 0; i < nbc; i++)
+    add_candidate (soc, -1, i, (unsigned char *) (bc [i].address),
+                   ADDRESS_BITS);
+  soc->candidate_contacts = ncontacts;
+  soc->candidate_key_changes = key_changes;
+  soc->candidate_bc_keys = nbc;
+  soc->candidates_built = now;
+  soc->generation++;
+  if (soc->generation <= 0)   /* wrapped around, 0 means unused */
+    soc->generation = 1;
+}
+
+/* allnet_verify, counted and timed in the metrics */
+static int timed_verify (char * message, int msize, char * sig, int ssize,
+                         allnet_rsa_pubkey key)
+{
+  unsigned long long int start = metrics_now_ns ();
+  int result = allnet_verify (message, msize, sig, ssize, key);
+  METRICS_RECORD ("social.verify_ns", metrics_now_ns () - start);
+  if (result)
+    METRICS_COUNT ("social.verified", 1);
+  else
+    METRICS_COUNT ("social.not_verified", 1);
+  return result;
+}
+
+/* returns 1 if the contact key k (if k >= 0) or else the broadcast key
+ * bc_index verifies the signature, 0 otherwise */
+static int key_verifies (struct social_info * soc, keyset k, int bc_index,
+                         char * message, int msize, char * sig, int ssize)
+{
+  if (k >= 0) {
+    allnet_rsa_pubkey key;
+    if ((get_contact_pubkey (k, &key) > 0) &&
+        (timed_verify (message, msize, sig, ssize, key))) {
+      pthread_mutex_lock (&(soc->mutex));
+      snprintf (soc->log->b, LOG_SIZE, "verified from contact keyset %d\n",
+                k);
+      log_print (soc->log);
+      pthread_mutex_unlock (&(soc->mutex));
       return 1;
     }
+    return 0;
+  }
+  struct bc_key_info * bc;
+  int nbc = get_other_keys (&bc);
+  if ((bc_index >= 0) && (bc_index < nbc) &&
+      (timed_verify (message, msize, sig, ssize, bc [bc_index].pub_key))) {
+    pthread_mutex_lock (&(soc->mutex));
+    snprintf (soc->log->b, LOG_SIZE, "verified from bc contact %d\n",
+              bc_index);
+    log_print (soc->log);
+    pthread_mutex_unlock (&(soc->mutex));
+    return 1;
   }
   return 0;
 }
 
+/* returns the index of the first candidate in the list that verifies
+ * the signature, or -1 if none do */
+static int list_verifies (struct social_info * soc, int list,
+                          unsigned char * sender, int bits,
+                          char * message, int msize, char * sig, int ssize)
+{
+  int ci;
+  for (ci = soc->lists [list]; ci >= 0; ci = soc->candidates [ci].next) {
+    struct social_candidate * c = soc->candidates + ci;
+    if ((matches (sender, bits, c->address, c->nbits) > 0) &&
+        (key_verifies (soc, c->k, c->bc_index, message, msize, sig, ssize)))
+      return ci;
+  }
+  return -1;
+}
+
+/* returns 1 if this message is from my contact, and 0 otherwise.
+ * called with the candidates read-locked */
+static int is_my_contact (struct social_info * soc, char * message, int msize,
+                          unsigned char * sender, int bits,
+                          int algo, char * sig, int ssize)
+{
+  /* look in the cache first */
+  char buffer [ALLNET_MTU];
+  struct social_verified * cache = NULL;
+  char hash [sizeof (cache->hash)];
+  if ((msize >= 0) && (ssize >= 0) && (msize + ssize <= sizeof (buffer)) &&
+      (bits >= 0) && (bits <= ADDRESS_BITS)) {
+    memcpy (buffer, message, msize);
+    memcpy (buffer + msize, sig, ssize);
+    sha512_bytes (buffer, msize + ssize, hash, sizeof (hash));
+    cache = soc->verified + (readb16 (hash) & (SOCIAL_VERIFIED_CACHE - 1));
+    pthread_mutex_lock (&(soc->mutex));
+    int found = ((cache->generation != 0) &&
+                 (cache->sbits == bits) &&
+                 (memcmp (cache->hash, hash, sizeof (hash)) == 0) &&
+                 (matches (cache->source, bits, sender, bits) >= bits));
+    int current = (cache->generation == soc->generation);
+    keyset k = cache->k;
+    int bc_index = cache->bc_index;
+    pthread_mutex_unlock (&(soc->mutex));
+    int verified = ((k >= 0) || (bc_index >= 0));
+    if ((found) && (current))
+      return verified;
+    /* the keys may have changed since, so check again, but if it was
+     * verified, only with the key that verified it */
+    if ((found) && (verified) &&
+        (key_verifies (soc, k, bc_index, message, msize, sig, ssize))) {
+      pthread_mutex_lock (&(soc->mutex));
+      cache->generation = soc->generation;
+      pthread_mutex_unlock (&(soc->mutex));
+      return 1;
+    }
+  }
+  int ci = -1;
+  if (bits >= 8) {
+    ci = list_verifies (soc, sender [0], sender, bits,
+                        message, msize, sig, ssize);
+    if (ci < 0)
+      ci = list_verifies (soc, SOCIAL_SHORT_LIST, sender, bits,
+                          message, msize, sig, ssize);
+  } else {   /* short source address, any list may match */
+    int list;
+    for (list = 0; (list < SOCIAL_LISTS) && (ci < 0); list++)
+      ci = list_verifies (soc, list, sender, bits,
+                          message, msize, sig, ssize);
+  }
+  if (cache != NULL) {   /* save the result */
+    pthread_mutex_lock (&(soc->mutex));
+    memcpy (cache->hash, hash, sizeof (hash));
+    memset (cache->source, 0, sizeof (cache->source));
+    memcpy (cache->source, sender, (bits + 7) / 8);
+    cache->sbits = bits;
+    cache->generation = soc->generation;
+    cache->k = ((ci >= 0) ? soc->candidates [ci].k : -1);
+    cache->bc_index = ((ci >= 0) ? soc->candidates [ci].bc_index : -1);
+    pthread_mutex_unlock (&(soc->mutex));
+  }
+  return (ci >= 0);
+}
+
 /* checks the signature, and sets valid accordingly.
  * returns the social distance if known, and UNKNOWN_SOCIAL_TIER otherwise */
 int social_connection (struct social_info * soc, char * vmessage, int vsize,
@@ -208,7 +446,18 @@ int social_connection (struct social_info * soc, char * vmessage, int vsize,
   if (algo == ALLNET_SIGTYPE_NONE)
     return UNKNOWN_SOCIAL_TIER;
   *valid = 0;
-  if (is_my_contact (vmessage, vsize, src, sbits, algo, sig, ssize, soc->log)) {
+  pthread_rwlock_rdlock (&(soc->candidates_lock));
+  if (candidates_stale (soc)) {
+    pthread_rwlock_unlock (&(soc->candidates_lock));
+    pthread_rwlock_wrlock (&(soc->candidates_lock));
+    build_candidates (soc);
+    METRICS_COUNT ("social.candidates_rebuilt", 1);
+    pthread_rwlock_unlock (&(soc->candidates_lock));
+    pthread_rwlock_rdlock (&(soc->candidates_lock));
+  }
+  int mine = is_my_contact (soc, vmessage, vsize, src, sbits, algo, sig, ssize);
+  pthread_rwlock_unlock (&(soc->candidates_lock));
+  if (mine) {
     *valid = 1;
     return 1;
   }
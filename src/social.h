@@ -18,8 +18,7 @@
 /* max bytes is the maximum size for the data structure.
  * max_checks is the maximum number of times signature verification
  * should be attempted per call to social_connection */
-extern struct social_info * init_social (int max_bytes, int max_checks,
-                                         struct allnet_log * log);
+extern struct social_info * init_social (int max_bytes, int max_checks);
 
 extern time_t update_social (struct social_info * soc, int update_seconds);
 
@@ -2,6 +2,7 @@
 
 #include <stdio.h>
 #include <string.h>
+#include <pthread.h>
 
 #include "lib/packet.h"
 #include "lib/priority.h"
@@ -19,6 +20,9 @@ static struct rate_record record [SAVED_ADDRESSES];
 
 static int next = -1;
 
+/* ad may call track_rate from multiple threads */
+static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+
 #define DEFAULT_MAX	(ALLNET_PRIORITY_MAX - 1)
 
 unsigned int largest_rate ()
@@ -35,6 +39,7 @@ unsigned int track_rate (unsigned char * source, unsigned int sbits,
                          unsigned int packet_size)
 {
   int i;
+  pthread_mutex_lock (&mutex);
   if (next < 0) {    /* initialize */
     for (i = 0; i < SAVED_ADDRESSES; i++) {
       memset (record [i].address, 0, ADDRESS_SIZE);
@@ -60,6 +65,7 @@ unsigned int track_rate (unsigned char * source, unsigned int sbits,
   record [next].num_bits = sbits;
   record [next].packet_size = packet_size;
   next = (next + 1) % SAVED_ADDRESSES;
+  pthread_mutex_unlock (&mutex);
 
   nmatches += packet_size;    /* add in this packet */
   total += packet_size;    /* add in this packet */
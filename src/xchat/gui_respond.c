@@ -32,31 +32,63 @@
 
 static int send_bytes (int sock, char *buffer, int64_t length)
 {
-  while (length > 0) {   /* inefficient implementation for now */
-    if (write (sock, buffer, 1) != 1) {
+  while (length > 0) {
+    ssize_t sent = write (sock, buffer, length);
+    if ((sent < 0) && (errno == EINTR))
+      continue;
+    if (sent <= 0) {
       perror ("gui.c send_bytes");
       return 0;
     }
-    buffer++;
-    length--;
+    buffer += sent;
+    length -= sent;
   }
   return 1;              /* success */
 }
 
+/* requests from the GUI are only read by gui_respond_thread, so one
+ * buffer is enough.  Each read gets as many bytes as are available,
+ * which may include several requests if the GUI sends them back to back */
+static char receive_buf [ALLNET_MTU];
+static int receive_buf_pos = 0;
+static int receive_buf_len = 0;
+
 static int receive_bytes (int sock, char *buffer, int64_t length)
 {
   while (length > 0) {
-    /* get one byte at a time -- for now, inefficient implementation */
-    if (read (sock, buffer, 1) != 1) {
-      if ((errno != ENOENT) &&      /* ENOENT when the socket is closed */
+    if (receive_buf_pos < receive_buf_len) {  /* use the buffered bytes */
+      int64_t n = receive_buf_len - receive_buf_pos;
+      if (n > length)
+        n = length;
+      memcpy (buffer, receive_buf + receive_buf_pos, n);
+      receive_buf_pos += n;
+      buffer += n;
+      length -= n;
+      continue;
+    }
+    /* large requests are read directly into the caller's buffer */
+    int direct = (length >= (int64_t) sizeof (receive_buf));
+    char * dest = (direct ? buffer : receive_buf);
+    size_t dsize = (direct ? length : sizeof (receive_buf));
+    ssize_t r = read (sock, dest, dsize);
+    if ((r < 0) && (errno == EINTR))
+      continue;
+    if (r <= 0) {
+      if ((r < 0) &&
+          (errno != ENOENT) &&      /* ENOENT when the socket is closed */
           (errno != ECONNRESET)) {  /* or ECONNRESET */
         perror ("gui_respond.c receive_bytes");
         printf ("errno %d on connection %d\n", errno, sock);
       }
       return 0;
     }
-    buffer++;
-    length--;
+    if (direct) {
+      buffer += r;
+      length -= r;
+    } else {
+      receive_buf_pos = 0;
+      receive_buf_len = r;
+    }
   }
   return 1;              /* success */
 }
@@ -67,15 +99,20 @@ int gui_send_buffer (int sock, char *buffer, int64_t length)
 {
   if (length < 1)
     return 0;
-  char length_buf [8];
-  writeb64 (length_buf, length);
   int result = 0;
   /* use a mutex to ensure only one message is sent at a time */
   static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+  /* most replies are small, send them with the length in one write */
+  static char frame [8 + 4096];
   pthread_mutex_lock (&mutex);
-  if ((send_bytes (sock, length_buf, 8)) &&
-      (send_bytes (sock, buffer, length)))
-    result = 1;
+  writeb64 (frame, length);
+  if (length <= (int64_t) (sizeof (frame) - 8)) {
+    memcpy (frame + 8, buffer, length);
+    result = send_bytes (sock, frame, 8 + length);
+  } else {
+    result = ((send_bytes (sock, frame, 8)) &&
+              (send_bytes (sock, buffer, length)));
+  }
   pthread_mutex_unlock (&mutex);
   return result;
 }
@@ -159,15 +196,8 @@ static void gui_contacts (int sock)
   }
   int ii;    /* counts through the "incompletes" array */
   for (ii = 0; ii < ni; ii++) {
-    int ic;  /* counts through the "contacts" array */
-    int found = 0;
-    for (ic = 0; ic < nc; ic++) {
-      if (strcmp (contacts [ic], incompletes [ii]) == 0) {
-        found = 1;
-        break;
-      }
-    }
-    if (! found) {    /* incomplete contact is not also in contacts, add */
+    /* all_contacts lists exactly the visible contacts */
+    if (! is_visible (incompletes [ii])) {  /* not also in contacts, add */
       all [ia] = incompletes [ii];
       ia++;
     } /* else incompletes is also in contacts, do not add */
@@ -539,12 +569,14 @@ static void gui_variable (char * message, int64_t length, int op, int gui_sock)
   gui_send_buffer (gui_sock, reply, sizeof (reply));
 }
 
+/* if next is negative, it is not sent */
 static void gui_send_result_messages (int code,
                                       struct message_store_info * msgs,
-                                      int count, int sock,
+                                      int count, int64_t next, int sock,
                                       unsigned long long int lr)
 {
-/* format: code, 64-bit number of messages, then the messages
+/* format: code, 64-bit number of messages, 64-bit cursor for the next page
+   (only for GUI_GET_MESSAGES_PAGE), then the messages
    each message has type, sequence, number of missing prior sequence
    numbers, time sent, timezone sent, time received, and
    null-terminated message contents.
@@ -557,19 +589,21 @@ static void gui_send_result_messages (int code,
    is_new              1 byte     byte  35
    message             n+1 bytes  bytes 36...
  */
-#define MESSAGE_ARRAY_HEADER_SIZE	9
 #define MESSAGE_HEADER_SIZE		36
+  int header_size = ((next < 0) ? 9 : 17);
   size_t message_alloc = 0;
   int i;
   for (i = 0; i < count; i++)
     message_alloc += (MESSAGE_HEADER_SIZE + strlen (msgs [i].message) + 1);
-  size_t alloc = MESSAGE_ARRAY_HEADER_SIZE + message_alloc;
+  size_t alloc = header_size + message_alloc;
 /* printf ("gui_send_result_mesages (%d, %p, %d, %d, %llu) allocating %zd(%zd)\n", code, msgs, count, sock, lr, alloc, message_alloc); */
   char * reply = malloc_or_fail (alloc, "gui_send_messages");
   memset (reply, 0, alloc);  /* clear everything */
   reply [0] = code;
   writeb64 (reply + 1, count);
-  char * dest = reply + MESSAGE_ARRAY_HEADER_SIZE;
+  if (next >= 0)
+    writeb64 (reply + 9, next);
+  char * dest = reply + header_size;
   for (i = 0; i < count; i++) {
     if (msgs [i].msg_type == MSG_TYPE_RCVD)
       dest [0] = 3;
@@ -598,7 +632,24 @@ print_buffer (dest, len, s, 40, 1);
   gui_send_buffer (sock, reply, alloc);
   free (reply);
 #undef MESSAGE_HEADER_SIZE
-#undef MESSAGE_ARRAY_HEADER_SIZE
+}
+
+/* the time the contact's messages were last read */
+static unsigned long long int last_read_time (const char * contact)
+{
+  keyset * k = NULL;
+  int nk = all_keys (contact, &k);
+  int ik;
+  unsigned long long int latest = 0;
+  for (ik = 0; ik < nk; ik++) {
+    unsigned long long int time =
+      xchat_file_time (contact, k [ik], "last_read", 0) / ALLNET_US_PER_S;
+    if (time > latest)
+      latest = time;
+  }
+  if (k != NULL)
+    free (k);
+  return latest;
 }
 
 static void gui_get_messages (char * message, int64_t length, int gui_sock)
@@ -615,39 +666,67 @@ static void gui_get_messages (char * message, int64_t length, int gui_sock)
     message += 8;
     length -= 8;
     char * contact = contact_name_from_buffer (message, length);
-    keyset * k = NULL;
-    int nk = all_keys (contact, &k);
-    int ik;
-    unsigned long long int latest = 0;
-    for (ik = 0; ik < nk; ik++) {
-      unsigned long long int time =
-        xchat_file_time (contact, k [ik], "last_read", 0) / ALLNET_US_PER_S;
-      if (time > latest)
-        latest = time;
-    }
-    if (k != NULL)
-      free (k);
-    if (nk > 0) {  /* contact exists */
-      /* for now, use list_all_messages.  Later, modify list_all_messages
-       * to accept a maximum number of messages */
-      struct message_store_info * msgs = NULL;
-      int num_alloc = 0;
-      int num_used = 0;
-      if (list_all_messages (contact, &msgs, &num_alloc, &num_used)) {
-        int nresult = num_used;
-        if ((max > 0) && (nresult > max))
-          nresult = max;
-        gui_send_result_messages (GUI_GET_MESSAGES, msgs, nresult,
-                                  gui_sock, latest);
-        free_all_messages (msgs, num_used);
-        return;
-      }
+    unsigned long long int latest = last_read_time (contact);
+    struct message_store_info * msgs = NULL;
+    int num_alloc = 0;
+    int num_used = 0;
+    if (list_messages (contact, 0, ((max > 0) ? max : 0),
+                       &msgs, &num_alloc, &num_used, NULL)) {
+      gui_send_result_messages (GUI_GET_MESSAGES, msgs, num_used, -1,
+                                gui_sock, latest);
+      free_all_messages (msgs, num_used);
+      free (msgs);
+      free (contact);
+      return;
     }
+    free (contact);
   }
   /* if we didn't reply above, something went wrong.  Send 0 messages */
   gui_send_buffer (gui_sock, reply_header, sizeof (reply_header));
 }
 
+static void gui_get_messages_page (char * message, int64_t length,
+                                   int gui_sock)
+{
+/* message format: 64-bit cursor, 64-bit max, contact name (not null
+ * terminated).  The cursor is 0 for the first page, otherwise the
+ * cursor returned with the previous page.  The most recent messages are
+ * sent first.  Pages are bounded by message times, so messages that
+ * arrive while paging do not shift the later pages. */
+/* reply format: 1-byte code, 64-bit number of messages, 64-bit cursor
+ * for the next page, then the messages in the format shown under
+ * gui_send_result_messages.  The next cursor is 0 after the last page */
+  char reply_header [17];
+  reply_header [0] = GUI_GET_MESSAGES_PAGE;
+  writeb64 (reply_header + 1, 0);   /* in case of failure */
+  writeb64 (reply_header + 9, 0);
+  if (length >= 17) {
+    uint64_t cursor = readb64 (message);
+    int64_t max = readb64 (message + 8);
+    message += 16;
+    length -= 16;
+    if ((max <= 0) || (max > GUI_MAX_MESSAGES_PAGE))
+      max = GUI_MAX_MESSAGES_PAGE;
+    char * contact = contact_name_from_buffer (message, length);
+    unsigned long long int latest = last_read_time (contact);
+    struct message_store_info * msgs = NULL;
+    int num_alloc = 0;
+    int num_used = 0;
+    uint64_t next = 0;
+    if (list_messages (contact, cursor, max, &msgs, &num_alloc, &num_used,
+                       &next)) {
+      gui_send_result_messages (GUI_GET_MESSAGES_PAGE, msgs, num_used,
+                                next, gui_sock, latest);
+      free_all_messages (msgs, num_used);
+      free (msgs);
+      free (contact);
+      return;
+    }
+    free (contact);
+  }
+  gui_send_buffer (gui_sock, reply_header, sizeof (reply_header));
+}
+
 struct send_args_struct {
   int sock;
   char * contact;
@@ -839,6 +918,9 @@ static void interpret_from_gui (char * message, int64_t length,
   case GUI_GET_MESSAGES:
     gui_get_messages (message + 1, length - 1, gui_sock);
     break;
+  case GUI_GET_MESSAGES_PAGE:
+    gui_get_messages_page (message + 1, length - 1, gui_sock);
+    break;
   case GUI_SEND_MESSAGE:
     gui_send_message (message + 1, length - 1, 0, gui_sock, allnet_sock);
     break;
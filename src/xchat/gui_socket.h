@@ -35,6 +35,10 @@
 #define GUI_GET_MESSAGES			40
 #define GUI_SEND_MESSAGE			41
 #define GUI_SEND_BROADCAST			42
+#define GUI_GET_MESSAGES_PAGE			43
+/* the most messages sent in one reply to GUI_GET_MESSAGES_PAGE, plus any
+ * that have the same time as the last one */
+#define GUI_MAX_MESSAGES_PAGE			1000
 
 #define GUI_KEY_EXCHANGE			50
 #define GUI_SUBSCRIBE				51
@@ -1,7 +1,7 @@
 /* message.c: use store.c to provide non-volatile storage of chat messages */
 
-/* messages are stored in each contact's directory under a day file, e.g.
- * ~/.allnet/xchat/20130101174522/20140302.txt
+/* messages are stored in each contact's directory in a log file, e.g.
+ * ~/.allnet/xchat/20130101174522/messages.log
  * group messages are stored in that group's directory (not yet implemented).
  *
  * each contact may have multiple keys, and thus multiple directories.
@@ -22,6 +22,9 @@
 #include <string.h>
 #include <inttypes.h>
 #include <pthread.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
 #ifdef CHECK_ASSERTIONS
 #include <assert.h>
 #endif /* CHECK_ASSERTIONS */
@@ -33,6 +36,7 @@
 #include "lib/util.h"
 #include "lib/keys.h"
 #include "lib/sha.h"
+#include "lib/configfiles.h"
 
 /* return the lowest unused counter, used as sequence number when sending
  * messages to this contact.  returns 0 if the contact cannot be found */
@@ -179,7 +183,7 @@ seq, MSG_TYPE_SENT, mseq, result);
 }
 
 /* forward declaration, implemented below */
-static void add_to_message_id_cache (char * ack);
+static void save_message_id (const char * ack);
 
 /* save a received message */
 void save_incoming (const char * contact, keyset k,
@@ -193,7 +197,7 @@ void save_incoming (const char * contact, keyset k,
     eliminate_nulls (text, tsize);
     save_record (contact, k, MSG_TYPE_RCVD, readb64u (cp->counter),
                  time, tz, allnet_time (), ack, text, tsize);
-    add_to_message_id_cache (ack);
+    save_message_id (ack);
   }
 }
 
@@ -590,25 +594,9 @@ int is_acked (const char * contact, uint64_t seq)
 int is_acked_one (const char * contact, keyset k, uint64_t wanted,
                   uint64_t * timep)
 {
-  struct msg_iter * iter = start_iter (contact, k);
-  if (iter == NULL)
-    return 0;
-  int type;
-  uint64_t seq;
-  char ack [MESSAGE_ID_SIZE];
-  while ((type = prev_message (iter, &seq, timep, NULL, NULL, ack, NULL, NULL))
-         != MSG_TYPE_DONE) {
-    if ((type == MSG_TYPE_SENT) && (seq == wanted)) {
-/* this is the first (most recent) message sent with this sequence number.
- * we simply report whether this one has been acked -- the others are not
- * so important */
-      uint64_t result_seq = find_ack (contact, k, ack, MSG_TYPE_ACK, NULL);
-      free_iter (iter);
-      return (result_seq > 0);
-    }
-  }
-  free_iter (iter);
-  return 0;
+/* only the most recent message sent with this sequence number matters,
+ * the others are not so important */
+  return sent_is_acked (contact, k, wanted, timep);
 }
 
 /* if add != 0, and not found, it is added to the cache
@@ -768,115 +756,290 @@ int was_received (const char * contact, keyset k, uint64_t wanted)
   return found;
 }
 
-static char * message_id_cache = NULL;
-static char * message_ack_cache = NULL;
-static int current_cache_index = 0; /* must multiply by MESSAGE_ID_SIZE */
-static int current_cache_size = 0;  /* in multiples of MESSAGE_ID_SIZE */
+/* the message ID index maps the ID of each message we received (the
+ * hash of its ack) to its ack.  It is saved in ~/.allnet/xchat/message_ids
+ * as a sequence of records, each the ID followed by the ack.
+ * save_incoming appends to the file, so the file is only built from the
+ * message history if it does not exist.  In memory, the records are
+ * found through an open-addressing hash table.  Other processes may
+ * also append to the file, so the file is kept open, and any records
+ * added since it was last read are added to the table, at most every
+ * MESSAGE_ID_CHECK_US, or on the first lookup after we append to it */
+#define MESSAGE_ID_FILE		"message_ids"
+#define MESSAGE_ID_RECORD_SIZE	(2 * MESSAGE_ID_SIZE)
+#define MESSAGE_ID_CHECK_US	1000000   /* one second */
+
+static pthread_mutex_t message_id_mutex = PTHREAD_MUTEX_INITIALIZER;
+static char * message_id_records = NULL;
+static int message_id_count = 0;
+static int message_id_alloc = 0;
+static int * message_id_table = NULL;   /* record index, or -1 if free */
+static int message_id_table_size = 0;   /* always a power of two */
+static off_t message_id_file_bytes = 0; /* bytes of the file in memory */
+static char * message_id_fname = NULL;  /* only computed once */
+static int message_id_fd = -1;          /* the file, kept open */
+static ino_t message_id_ino = 0;        /* to see if the file was replaced */
+static unsigned long long int message_id_next_check = 0;  /* 0 to check now */
+static int message_id_create_failed = 0; /* do not build the file again */
+
+static void message_id_table_insert (int index)
+{
+  unsigned int mask = message_id_table_size - 1;
+  const char * id = message_id_records + (index * MESSAGE_ID_RECORD_SIZE);
+  unsigned int pos = ((unsigned int) readb32 (id)) & mask;  /* ids are hashes */
+  while (message_id_table [pos] != -1)
+    pos = (pos + 1) & mask;
+  message_id_table [pos] = index;
+}
+
+static void message_id_add_record (const char * record)
+{
+  if (message_id_count >= message_id_alloc) {
+    message_id_alloc = ((message_id_alloc <= 0) ? 500 : message_id_alloc * 2);
+    message_id_records = realloc (message_id_records,
+                                  message_id_alloc * MESSAGE_ID_RECORD_SIZE);
+    if (message_id_records == NULL) {
+      perror ("realloc");
+      printf ("message.c unable to allocate %d message ids\n",
+              message_id_alloc);
+      exit (1);
+    }
+  }
+  memcpy (message_id_records + (message_id_count * MESSAGE_ID_RECORD_SIZE),
+          record, MESSAGE_ID_RECORD_SIZE);
+  message_id_count++;
+  if (2 * message_id_count > message_id_table_size) {
+    int size = 1024;
+    while (size < 2 * message_id_count)
+      size = size * 2;
+    if (message_id_table != NULL)
+      free (message_id_table);
+    message_id_table = malloc_or_fail (size * sizeof (int),
+                                       "message_id_add_record");
+    message_id_table_size = size;
+    memset (message_id_table, 0xff, size * sizeof (int));   /* all -1 */
+    int i;
+    for (i = 0; i < message_id_count; i++)
+      message_id_table_insert (i);
+  } else {
+    message_id_table_insert (message_id_count - 1);
+  }
+}
+
+/* returns the name of the message ID file, or NULL.
+ * must be called with message_id_mutex held */
+static const char * message_id_file_name ()
+{
+  if (message_id_fname == NULL)
+    config_file_name ("xchat", MESSAGE_ID_FILE, &message_id_fname);
+  return message_id_fname;
+}
 
-static void add_to_message_id_cache (char * ack)
+/* adds to memory any records added to the file since it was last read,
+ * unless it was read less than MESSAGE_ID_CHECK_US ago.
+ * returns 1 if the file exists, 0 otherwise.
+ * must be called with message_id_mutex held */
+static int read_message_id_file ()
 {
-  if (current_cache_index >= current_cache_size) {
-    int total = ((current_cache_size > 0) ? (current_cache_size * 2) : 500);
-    size_t size = total * MESSAGE_ID_SIZE;
-    char * new_ids = realloc (message_id_cache, size);
-    char * new_acks = realloc (message_ack_cache, size); 
-    if ((new_ids == NULL) || (new_acks == NULL)) {
-      printf ("allocation error in add_to_message_id: %zd %d %p/%p %p/%p\n",
-              size, total, new_ids, message_id_cache,
-              new_acks, message_ack_cache);
-      return;  /* don't add */
+  unsigned long long int now = allnet_time_us ();
+  if (now < message_id_next_check)
+    return (message_id_fd >= 0);
+  message_id_next_check = now + MESSAGE_ID_CHECK_US;
+  const char * fname = message_id_file_name ();
+  struct stat st;
+  if ((fname == NULL) || (stat (fname, &st) != 0)) {  /* no file */
+    if (message_id_fd >= 0)
+      close (message_id_fd);
+    message_id_fd = -1;
+    return 0;
+  }
+  if ((message_id_fd < 0) || (st.st_ino != message_id_ino) ||
+      (st.st_size < message_id_file_bytes)) {  /* new or replaced */
+    if (message_id_fd >= 0)
+      close (message_id_fd);
+    message_id_fd = open (fname, O_RDONLY);
+    if ((message_id_fd >= 0) && (fstat (message_id_fd, &st) != 0)) {
+      close (message_id_fd);
+      message_id_fd = -1;
     }
-    message_id_cache = new_ids;
-    message_ack_cache = new_acks;
-    current_cache_size = total;
-  }
-  char * idp = message_id_cache + (current_cache_index * MESSAGE_ID_SIZE);
-  char * ackp = message_ack_cache + (current_cache_index * MESSAGE_ID_SIZE);
-  memcpy (ackp, ack, MESSAGE_ID_SIZE);
-  sha512_bytes (ack, MESSAGE_ID_SIZE, idp, MESSAGE_ID_SIZE);
-  current_cache_index++;
+    if (message_id_fd < 0)
+      return 0;
+    message_id_ino = st.st_ino;
+    message_id_count = 0;    /* read it all again */
+    message_id_file_bytes = 0;
+    if (message_id_table != NULL)
+      memset (message_id_table, 0xff, message_id_table_size * sizeof (int));
+  }
+  /* only read complete records, in case a record is being appended */
+  off_t new_bytes = st.st_size - message_id_file_bytes;
+  new_bytes -= new_bytes % MESSAGE_ID_RECORD_SIZE;
+  if (new_bytes > 0) {
+    char * buffer = malloc_or_fail (new_bytes, "read_message_id_file");
+    if (pread (message_id_fd, buffer, new_bytes, message_id_file_bytes) ==
+        new_bytes) {
+      off_t off;
+      for (off = 0; off < new_bytes; off += MESSAGE_ID_RECORD_SIZE)
+        message_id_add_record (buffer + off);
+      message_id_file_bytes += new_bytes;
+    } else {
+      perror ("read_message_id_file");
+    }
+    free (buffer);
+  }
+  return 1;
 }
 
-static void fill_message_id_cache ()
+/* adds the acks of all the messages received from keyset k */
+static void add_history_acks (const char * contact, keyset k,
+                              char ** acks, int * count, int * alloc)
 {
-  static int initialized = 0;
-  if (initialized)
+  struct msg_iter * iter = start_iter (contact, k);
+  if (iter == NULL)
     return;
-  initialized = 1;
-#ifdef DEBUG_PRINT
-  unsigned long long int start = allnet_time_us ();
-#endif /* DEBUG_PRINT */
-  char ** contacts = NULL;
-  int ncontacts = all_contacts (&contacts);
-  int icontacts;
-  for (icontacts = 0; icontacts < ncontacts; icontacts++) {
-    keyset * keys = NULL;
-    int nkeys = all_keys (contacts [icontacts], &keys);
-    int ikeys;
-    for (ikeys = 0; ikeys < nkeys; ikeys++) {
-      struct msg_iter * iter = start_iter (contacts [icontacts], keys [ikeys]);
-      if (iter != NULL) {
-        int type;
-        char ack [MESSAGE_ID_SIZE];
-        while ((type = prev_message (iter, NULL, NULL, NULL, NULL, ack,
-                                     NULL, NULL)) != MSG_TYPE_DONE) {
-          if (type == MSG_TYPE_RCVD) {
-            add_to_message_id_cache (ack);
-          }
+  int type;
+  char ack [MESSAGE_ID_SIZE];
+  while ((type = prev_message (iter, NULL, NULL, NULL, NULL, ack,
+                               NULL, NULL)) != MSG_TYPE_DONE) {
+    if (type == MSG_TYPE_RCVD) {
+      if (*count >= *alloc) {
+        *alloc = ((*alloc <= 0) ? 500 : (*alloc * 2));
+        *acks = realloc (*acks, *alloc * MESSAGE_ID_SIZE);
+        if (*acks == NULL) {
+          perror ("realloc");
+          printf ("message.c unable to allocate %d acks\n", *alloc);
+          exit (1);
         }
-        free_iter (iter);
       }
+      memcpy (*acks + (*count * MESSAGE_ID_SIZE), ack, MESSAGE_ID_SIZE);
+      (*count)++;
     }
-    if ((nkeys > 0) && (keys != NULL))
-      free (keys);
   }
-  if ((ncontacts > 0) && (contacts != NULL))
-    free (contacts);
-#ifdef DEBUG_PRINT
-  printf ("fill_message_id_cache took %lluus, %d/%d saved\n",
-  allnet_time_us () - start, current_cache_index, current_cache_size);
-#endif /* DEBUG_PRINT */
+  free_iter (iter);
 }
 
-/* returns 1 if this message ID has been saved before, 0 otherwise
- * if it returns 1, also fills message_ack with the corresponding ack */
-static int is_in_message_id_cache (const char * message_id, char * message_ack)
+/* creates the message ID file from the acks of every message received
+ * from every contact.  Only needed once, after that save_incoming keeps
+ * the file up to date.  must be called with message_id_mutex held */
+static void create_message_id_file ()
 {
 #ifdef DEBUG_PRINT
   unsigned long long int start = allnet_time_us ();
 #endif /* DEBUG_PRINT */
+  char * acks = NULL;
+  int count = 0;
+  int alloc = 0;
+  keyset * keys = NULL;   /* reused for each contact, grown as needed */
+  int kalloc = 0;
+  int icontacts = 0;
+  char * contact = NULL;
+  int csize = 0;
+  while (next_contact (&icontacts, &contact, &csize)) {
+    int nkeys = contact_keysets (contact, keys, kalloc);
+    if (nkeys > kalloc) {
+      if (keys != NULL)
+        free (keys);
+      kalloc = nkeys;
+      keys = malloc_or_fail (kalloc * sizeof (keyset),
+                             "create_message_id_file");
+      nkeys = contact_keysets (contact, keys, kalloc);
+      if (nkeys > kalloc)
+        nkeys = kalloc;
+    }
+    int ikeys;
+    for (ikeys = 0; ikeys < nkeys; ikeys++)
+      add_history_acks (contact, keys [ikeys], &acks, &count, &alloc);
+  }
+  if (keys != NULL)
+    free (keys);
+  if (contact != NULL)
+    free (contact);
+  size_t size = count * MESSAGE_ID_RECORD_SIZE;
+  char * records = malloc_or_fail (size + 1, "create_message_id_file");
+  char * ids = malloc_or_fail (count * MESSAGE_ID_SIZE + 1,
+                               "create_message_id_file ids");
+  sha512_bytes_batch (acks, MESSAGE_ID_SIZE, count, ids, MESSAGE_ID_SIZE);
   int i;
-  for (i = 0; i < current_cache_index; i++) {
-    if (same_message_id (message_id_cache + (i * MESSAGE_ID_SIZE),
-                         message_id)) {
-      memcpy (message_ack,  /* fill in the message ack */
-              message_ack_cache + (i * MESSAGE_ID_SIZE), MESSAGE_ID_SIZE);
-#ifdef DEBUG_PRINT
-      printf ("is_in_message_id_cache found at %d: ", i);
-      print_buffer (message_id, MESSAGE_ID_SIZE, "id", 100, 0);
-      print_buffer (message_ack, MESSAGE_ID_SIZE, ", ack", 100, 1);
-#endif /* DEBUG_PRINT */
-#ifdef DEBUG_PRINT
-      printf ("call to is_in_message_id_cache took %lluus, result 1/%d\n",
-              allnet_time_us () - start, current_cache_index);
-#endif /* DEBUG_PRINT */
-      return 1;
+  for (i = 0; i < count; i++) {
+    char * r = records + (i * MESSAGE_ID_RECORD_SIZE);
+    memcpy (r, ids + (i * MESSAGE_ID_SIZE), MESSAGE_ID_SIZE);
+    memcpy (r + MESSAGE_ID_SIZE, acks + (i * MESSAGE_ID_SIZE),
+            MESSAGE_ID_SIZE);
+  }
+  /* write a temporary file and rename it, so readers never see a
+   * partial file */
+  const char * fname = message_id_file_name ();
+  if (fname != NULL) {
+    char * tmp = strcat_malloc (fname, ".tmp", "create_message_id_file");
+    int fd = open (tmp, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+    if (fd >= 0) {
+      int ok = (write (fd, records, size) == (ssize_t) size);
+      close (fd);
+      if ((! ok) || (rename (tmp, fname) != 0)) {
+        perror ("create_message_id_file");
+        unlink (tmp);
+      }
     }
+    free (tmp);
   }
+  free (records);
+  free (ids);
+  if (acks != NULL)
+    free (acks);
 #ifdef DEBUG_PRINT
-  printf ("call to is_in_message_id_cache took %lluus, result 0/%d\n",
-          allnet_time_us () - start, current_cache_index);
+  printf ("create_message_id_file took %lluus, %d acks\n",
+          allnet_time_us () - start, count);
 #endif /* DEBUG_PRINT */
-  return 0;
 }
 
-/* returns 1 if this message ID is in the (limited size) saved cache,
- * 0 otherwise
- * in other words, may return 0 even though the message was saved,
- * just because it is not in the cache
+/* appends the ID and ack of a newly received message to the message ID
+ * file.  If the file does not exist, it will be created from the message
+ * history (which includes this message) the first time it is needed */
+static void save_message_id (const char * ack)
+{
+  char record [MESSAGE_ID_RECORD_SIZE];
+  sha512_bytes (ack, MESSAGE_ID_SIZE, record, MESSAGE_ID_SIZE);
+  memcpy (record + MESSAGE_ID_SIZE, ack, MESSAGE_ID_SIZE);
+  pthread_mutex_lock (&message_id_mutex);
+  const char * fname = message_id_file_name ();
+  if (fname != NULL) {
+    int fd = open (fname, O_WRONLY | O_APPEND);   /* do not create */
+    if (fd >= 0) {
+      if (write (fd, record, sizeof (record)) != sizeof (record))
+        perror ("save_message_id write");
+      close (fd);
+      message_id_next_check = 0;   /* read it on the next lookup */
+    }
+  }
+  pthread_mutex_unlock (&message_id_mutex);
+}
+
+/* returns 1 if this message ID is the ID of a message we received and
+ * saved, 0 otherwise.  Builds the message ID file if it does not exist.
+ * If that fails, does not try again, since it reads all the history.
  * if it returns 1, also fills message_ack with the corresponding ack */
 int message_id_is_in_saved_cache (const char * message_id, char * message_ack)
 {
-  fill_message_id_cache ();
-  return (is_in_message_id_cache (message_id, message_ack));
+  int result = 0;
+  pthread_mutex_lock (&message_id_mutex);
+  if ((! read_message_id_file ()) && (! message_id_create_failed)) {
+    create_message_id_file ();
+    message_id_next_check = 0;   /* look for the new file now */
+    if (! read_message_id_file ())
+      message_id_create_failed = 1;
+  }
+  if (message_id_table_size > 0) {
+    unsigned int mask = message_id_table_size - 1;
+    unsigned int pos = ((unsigned int) readb32 (message_id)) & mask;
+    for ( ; message_id_table [pos] != -1; pos = (pos + 1) & mask) {
+      char * r = message_id_records +
+                 (message_id_table [pos] * MESSAGE_ID_RECORD_SIZE);
+      if (same_message_id (r, message_id)) {
+        memcpy (message_ack, r + MESSAGE_ID_SIZE, MESSAGE_ID_SIZE);
+        result = 1;
+        break;
+      }
+    }
+  }
+  pthread_mutex_unlock (&message_id_mutex);
+  return result;
 }
@@ -1,7 +1,7 @@
 /* message.h: provide non-volatile storage of chat messages */
 
-/* messages are stored in each contact's directory under a day file, e.g.
- * ~/.allnet/xchat/20130101174522/20140302.txt
+/* messages are stored in each contact's directory in a log file, e.g.
+ * ~/.allnet/xchat/20130101174522/messages.log
  * group messages are stored in that group's directory (not yet implemented).
  *
  * each contact may have multiple keys, and thus multiple directories.
@@ -100,10 +100,10 @@ extern int is_acked_one (const char * contact, keyset k, uint64_t seq,
 /* returns 1 if this sequence number has been received, 0 otherwise */
 extern int was_received (const char * contact, keyset k, uint64_t seq);
 
-/* returns 1 if this message ID is in the (limited size) saved cache,
- * 0 otherwise
- * in other words, may return 0 even though the message was saved,
- * just because it is not in the cache
+/* returns 1 if this message ID is the ID of a message we received and
+ * saved, 0 otherwise.  The IDs are indexed in ~/.allnet/xchat/message_ids,
+ * which is built from the saved messages the first time it is needed
+ * and is then kept up to date by save_incoming.
  * if it returns 1, also fills message_ack with the corresponding ack */
 extern int message_id_is_in_saved_cache (const char * message_id,
                                          char * message_ack);
@@ -1,9 +1,12 @@
 /* store.c: provide access to chat messages stored in ~/.allnet/xchat/ */
 /* messages are stored in a directory specific to a contact+keyset pair,
- * in a file that is updated every day.  So a typical message might be
- * stored in ~/.allnet/xchat/20140301044819/20140307.txt, where the first
- * part matches the keyset (found in ~/.allnet/contacts/20140301044819/),
- * and the second part is the date (in UTC) that the chats were stored. */
+ * in a binary log to which each new message is appended.  So a typical
+ * message might be stored in ~/.allnet/xchat/20140301044819/messages.log,
+ * where the directory name matches the keyset (found in
+ * ~/.allnet/contacts/20140301044819/).
+ * Older versions stored the messages as text, in a file for each day
+ * (in UTC), e.g. ~/.allnet/xchat/20140301044819/20140307.txt.  These
+ * are converted to the binary log the first time the keyset is used. */
 
 #include <stdio.h>
 #include <stdlib.h>
@@ -39,11 +42,9 @@ struct msg_iter {
   keyset k;
   int is_in_memory;
   /* used in case the data is not already in memory */
-  char * dirname;         /* dynamically allocated */
-  char * current_fname;   /* dynamically allocated */
-  char * current_file;    /* dynamically allocated */
-  uint64_t current_size;
-  int64_t current_pos;
+  int log_pos;            /* number of records not yet returned, -1 at start */
+  uint64_t log_ino;       /* the log being read, to detect replacement */
+  int log_fd;             /* -1 if not open */
   /* used only if the data is already in memory */
   int message_cache_index;
   int last_message_index;
@@ -112,15 +113,13 @@ static int start_iter_from_file (const char * contact, keyset k,
   char * directory = key_dir (k);
   if (directory == NULL)
     return 0;
+  free (directory);
   result->contact = strcpy_malloc (contact, "start_iter contact");
   result->k = k;
   result->is_in_memory = 0;
-  result->dirname = string_replace_once (directory, "contacts", "xchat", 1);
-  result->current_fname = NULL;
-  result->current_file = NULL;
-  result->current_size = 0;
-  result->current_pos = 0;
-  free (directory);
+  result->log_pos = -1;
+  result->log_ino = 0;
+  result->log_fd = -1;
   return 1;
 }
 
@@ -163,11 +162,9 @@ struct msg_iter * start_iter (const char * contact, keyset k)
     result->last_message_index = -1;
     result->ack_returned = 0;
     /* set the other values to reasonable defaults */
-    result->dirname = NULL;
-    result->current_fname = NULL;
-    result->current_file = NULL;
-    result->current_size = 0;
-    result->current_pos = 0;
+    result->log_pos = -1;
+    result->log_ino = 0;
+    result->log_fd = -1;
   } else { /* unable to cache, use file */
     /* *result = file_iter -- file_iter is only initialized if
           (message_cache_count < MESSAGE_CACHE_NUM_CONTACTS) */
@@ -177,6 +174,17 @@ struct msg_iter * start_iter (const char * contact, keyset k)
   return result;
 }
 
+/* an iterator over the text files used before the binary log,
+ * only used to convert them to the log */
+struct text_iter {
+  int valid;              /* 0 after the last file has been read */
+  char * dirname;         /* dynamically allocated */
+  char * current_fname;   /* dynamically allocated */
+  char * current_file;    /* dynamically allocated */
+  uint64_t current_size;
+  int64_t current_pos;
+};
+
 static int is_data_file (char * fname)
 {
   struct stat st;
@@ -223,7 +231,7 @@ static int end_ndigits (char * path, unsigned int ndigits, char * ext)
 /* returns 1 for success, 0 for failure */
 /* if successful, reads the file contents into memory and updates iter
  */
-static int find_prev_file (struct msg_iter * iter)
+static int find_prev_file (struct text_iter * iter)
 {
   create_dir (iter->dirname);
   DIR * dir = opendir (iter->dirname);
@@ -262,7 +270,7 @@ printf ("debug time: %d\n", 5 / debug);  /* crash */
   }
   closedir (dir);
   if (greatest_less_than_current == NULL) {
-    iter->k = -1;   /* at end, invalidate the iterator */
+    iter->valid = 0;   /* at end, invalidate the iterator */
     return 0;
   }
   if (iter->current_fname != NULL)
@@ -297,7 +305,7 @@ static int found_at_line_start (char * p, uint64_t pos, char * pattern)
 #define PATTERN_SENT    "sent id: "
 #define PATTERN_RCVD    "rcvd id: "
 #define PATTERN_ACK     "got ack: "
-static int match_record_start (struct msg_iter * iter)
+static int match_record_start (struct text_iter * iter)
 {
   if (iter->current_pos < 0)
     return 0;
@@ -463,10 +471,10 @@ static int parse_record (char * record, uint64_t * seq, uint64_t * time,
   return type;
 }
 
-static char * find_prev_record (struct msg_iter * iter)
+static char * find_prev_record (struct text_iter * iter)
 {
   while (1) {
-    if (iter->k < 0)  /* invalid iterator */
+    if (! iter->valid)  /* invalid iterator */
       return NULL;
     if (((iter->current_file == NULL) ||  /* at start */
          (iter->current_pos <= 0)) &&       /* update file */
@@ -512,6 +520,687 @@ static void set_result (
   if (msizep != NULL) *msizep = (int)msize;
 }
 
+static char * get_xchat_dir (keyset k)
+{
+  char * contact_dir = key_dir (k);
+  if (contact_dir == NULL)
+    return NULL;
+  char * xchat_dir = string_replace_once (contact_dir, "contacts", "xchat", 1);
+  free (contact_dir);
+  return xchat_dir;
+}
+
+static char * get_xchat_path (keyset k, const char * fname)
+{
+  char * xchat_dir = get_xchat_dir (k);  /* must be free'd */
+  if (xchat_dir == NULL)
+    return NULL;
+  char * path = strcat3_malloc (xchat_dir, "/", fname, "find_prev_file");
+  free (xchat_dir);
+  return path;
+}
+
+/* the log is only ever appended to, except by reduce_conversation, which
+ * replaces it with a log that only has the more recent records.
+ * Each record has a fixed-size header, the message if any, and the size
+ * of the record, so the log can also be read backwards.  All numbers
+ * are big-endian.  The header is:
+ *    magic (2 bytes), type (1), 0 (1), tz_min (2), 0 (2),
+ *    seq (8), time (8), rcvd_time (8), ack (MESSAGE_ID_SIZE), msize (4), 0 (4)
+ */
+#define LOG_FILE_NAME		"messages.log"
+#define LOG_TMP_NAME		"messages.log.tmp"
+#define LOG_LOCK_NAME		"messages.lock"
+#define LOG_MAGIC		0xa11e
+#define LOG_HEADER_SIZE		(32 + MESSAGE_ID_SIZE + 8)
+#define LOG_RECORD_SIZE(msize)	(LOG_HEADER_SIZE + (msize) + 4)
+#define LOG_MAX_MSIZE		(ALLNET_MTU * 1000)   /* sanity check */
+
+static void log_write_header (char * header, int type, uint64_t seq,
+                              uint64_t time, int tz_min, uint64_t rcvd_time,
+                              const char * ack, int msize)
+{
+  memset (header, 0, LOG_HEADER_SIZE);
+  writeb16 (header, LOG_MAGIC);
+  header [2] = type;
+  writeb16 (header + 4, ((unsigned int) tz_min) & 0xffff);
+  writeb64 (header + 8, seq);
+  writeb64 (header + 16, time);
+  writeb64 (header + 24, rcvd_time);
+  if (ack != NULL)
+    memcpy (header + 32, ack, MESSAGE_ID_SIZE);
+  writeb32 (header + 32 + MESSAGE_ID_SIZE, msize);
+}
+
+/* the index of a log has one entry for each record, in log order */
+struct log_entry {
+  int64_t offset;
+  uint64_t seq;
+  uint64_t time;
+  char ack [MESSAGE_ID_SIZE];
+  int msize;
+  int type;
+  int ack_index;           /* for a sent record, the position in the index
+                            * of the latest ack record with the same ack,
+                            * or -1 if it has not been acked */
+};
+
+/* returns 1 and fills in the entry (except the offset) if the header
+ * is valid, otherwise returns 0 */
+static int log_read_header (const char * header, struct log_entry * e,
+                            int * tz_min, uint64_t * rcvd_time)
+{
+  if (readb16 (header) != LOG_MAGIC)
+    return 0;
+  e->type = header [2];
+  e->seq = readb64 (header + 8);
+  e->time = readb64 (header + 16);
+  memcpy (e->ack, header + 32, MESSAGE_ID_SIZE);
+  e->msize = (int) readb32 (header + 32 + MESSAGE_ID_SIZE);
+  if (((e->type != MSG_TYPE_RCVD) && (e->type != MSG_TYPE_SENT) &&
+       (e->type != MSG_TYPE_ACK)) ||
+      (e->msize < 0) || (e->msize > LOG_MAX_MSIZE))
+    return 0;
+  if (tz_min != NULL) {
+    int tz = (int) readb16 (header + 4);
+    *tz_min = ((tz >= 0x8000) ? (tz - 0x10000) : tz);
+  }
+  if (rcvd_time != NULL)
+    *rcvd_time = readb64 (header + 24);
+  return 1;
+}
+
+/* returns 1 and fills in the entry if there is a complete record with
+ * a valid header and trailer at this offset of a log of the given size */
+static int log_valid_record (int fd, int64_t offset, int64_t size,
+                             struct log_entry * e)
+{
+  char header [LOG_HEADER_SIZE];
+  if ((offset + LOG_RECORD_SIZE (0) > size) ||
+      (pread (fd, header, LOG_HEADER_SIZE, offset) != LOG_HEADER_SIZE) ||
+      (! log_read_header (header, e, NULL, NULL)) ||
+      (offset + LOG_RECORD_SIZE (e->msize) > size))
+    return 0;
+  char trailer [4];
+  if ((pread (fd, trailer, 4, offset + LOG_RECORD_SIZE (e->msize) - 4) != 4)
+      || (readb32 (trailer) != LOG_RECORD_SIZE (e->msize)))
+    return 0;
+  e->offset = offset;
+  return 1;
+}
+
+/* after an invalid or torn record at offset, returns the offset of the
+ * next valid record, or size if there is none */
+static int64_t log_resync (int fd, int64_t offset, int64_t size)
+{
+  char buffer [4096];
+  int64_t pos = offset + 1;
+  while (pos + LOG_RECORD_SIZE (0) <= size) {
+    ssize_t n = pread (fd, buffer, sizeof (buffer), pos);
+    if (n < 2)
+      break;
+    int i;
+    for (i = 0; i + 1 < n; i++) {
+      struct log_entry e;
+      if ((readb16 (buffer + i) == LOG_MAGIC) &&
+          (log_valid_record (fd, pos + i, size, &e)))
+        return pos + i;
+    }
+    pos += n - 1;   /* the last byte may start the magic */
+  }
+  return size;
+}
+
+/* the offset just past the last valid record of the log */
+static int64_t log_valid_end (int fd, int64_t size)
+{
+  char trailer [4];
+  struct log_entry e;
+  if (size == 0)
+    return 0;
+  if ((pread (fd, trailer, 4, size - 4) == 4) &&
+      (readb32 (trailer) <= size) &&
+      (log_valid_record (fd, size - readb32 (trailer), size, &e)))
+    return size;   /* the usual case, the last record is complete */
+  int64_t end = 0;
+  int64_t pos = 0;
+  while (pos < size) {
+    if (log_valid_record (fd, pos, size, &e)) {
+      pos += LOG_RECORD_SIZE (e.msize);
+      end = pos;
+    } else {
+      pos = log_resync (fd, pos, size);
+    }
+  }
+  return end;
+}
+
+/* returns 1 for success, 0 for failure */
+static int log_write_record (int fd, int type, uint64_t seq, uint64_t time,
+                             int tz_min, uint64_t rcvd_time, const char * ack,
+                             const char * message, int msize)
+{
+  if ((message == NULL) || (msize < 0))
+    msize = 0;
+  int rsize = LOG_RECORD_SIZE (msize);
+  char * buffer = malloc_or_fail (rsize, "store.c log_write_record");
+  log_write_header (buffer, type, seq, time, tz_min, rcvd_time, ack, msize);
+  if (msize > 0)
+    memcpy (buffer + LOG_HEADER_SIZE, message, msize);
+  writeb32 (buffer + LOG_HEADER_SIZE + msize, rsize);
+  int result = (write (fd, buffer, rsize) == rsize);
+  if (! result)
+    perror ("store.c log_write_record");
+  free (buffer);
+  return result;
+}
+
+struct log_index {
+  keyset k;
+  char * path;             /* the log */
+  uint64_t dev;            /* to detect when the log has been replaced */
+  uint64_t ino;
+  int64_t size;            /* number of bytes of the log that are indexed */
+  struct log_entry * entries;
+  int num_entries;
+  int num_alloc;
+  /* open-addressing hash tables of entry indices (-1 if empty), to find
+   * records by sequence number (only sent and received records) or ack */
+  int * seq_table;
+  int * ack_table;
+  int table_size;          /* a power of two, or 0 */
+  /* positions of the sent and received entries, sorted by time and then
+   * by position, oldest first, so a page of messages can be found
+   * without looking at the rest of the log */
+  int * by_time;
+  int num_by_time;
+  /* sorted sequence numbers of the received entries, to compute the
+   * number of messages missing before each received message */
+  uint64_t * rcvd_seqs;
+  int num_rcvd;
+};
+
+#define LOG_INDEX_MAX		1000
+static struct log_index * log_indices [LOG_INDEX_MAX];
+static int log_indices_count = 0;
+static int log_indices_replace = 0;  /* next to replace when full */
+/* this mutex must be held when using any log_index.  If message_cache_mutex
+ * is also needed, it must be acquired before this mutex */
+static pthread_mutex_t log_index_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static unsigned int seq_hash (uint64_t seq)
+{
+  return (unsigned int) ((seq * 0x9e3779b97f4a7c15ULL) >> 32);
+}
+
+static unsigned int ack_hash (const char * ack)
+{
+  return (unsigned int) readb32 (ack);  /* acks are random */
+}
+
+static void table_insert (int * table, int size, unsigned int hash, int value)
+{
+  unsigned int mask = size - 1;
+  unsigned int pos = hash & mask;
+  while (table [pos] != -1)
+    pos = (pos + 1) & mask;
+  table [pos] = value;
+}
+
+static void index_insert (struct log_index * idx, int i)
+{
+  struct log_entry * e = idx->entries + i;
+  if (e->type != MSG_TYPE_ACK)
+    table_insert (idx->seq_table, idx->table_size, seq_hash (e->seq), i);
+  table_insert (idx->ack_table, idx->table_size, ack_hash (e->ack), i);
+}
+
+static void index_rebuild_tables (struct log_index * idx)
+{
+  int size = 64;
+  while (size < 2 * idx->num_entries)
+    size = size * 2;
+  if (size != idx->table_size) {
+    if (idx->seq_table != NULL)
+      free (idx->seq_table);
+    if (idx->ack_table != NULL)
+      free (idx->ack_table);
+    idx->seq_table = malloc_or_fail (size * sizeof (int), "store.c seq_table");
+    idx->ack_table = malloc_or_fail (size * sizeof (int), "store.c ack_table");
+    idx->table_size = size;
+  }
+  memset (idx->seq_table, 0xff, size * sizeof (int));   /* all -1 */
+  memset (idx->ack_table, 0xff, size * sizeof (int));
+  int i;
+  for (i = 0; i < idx->num_entries; i++)
+    index_insert (idx, i);
+}
+
+static int index_find_ack (struct log_index * idx, int type, const char * ack);
+
+static void index_add_entry (struct log_index * idx, struct log_entry * e)
+{
+  if (idx->num_entries >= idx->num_alloc) {
+    idx->num_alloc = ((idx->num_alloc <= 0) ? 100 : (idx->num_alloc * 2));
+    idx->entries = realloc (idx->entries,
+                            idx->num_alloc * sizeof (struct log_entry));
+    idx->by_time = realloc (idx->by_time, idx->num_alloc * sizeof (int));
+    idx->rcvd_seqs = realloc (idx->rcvd_seqs,
+                              idx->num_alloc * sizeof (uint64_t));
+    if ((idx->entries == NULL) || (idx->by_time == NULL) ||
+        (idx->rcvd_seqs == NULL)) {
+      perror ("realloc");
+      printf ("store.c unable to allocate %d log entries\n", idx->num_alloc);
+      exit (1);
+    }
+  }
+  int n = idx->num_entries++;
+  idx->entries [n] = *e;
+  idx->entries [n].ack_index = -1;
+  if (2 * idx->num_entries > idx->table_size)
+    index_rebuild_tables (idx);
+  else
+    index_insert (idx, n);
+  /* keep track of which sent records have been acked */
+  if (e->type == MSG_TYPE_SENT) {
+    idx->entries [n].ack_index = index_find_ack (idx, MSG_TYPE_ACK, e->ack);
+  } else if (e->type == MSG_TYPE_ACK) {
+    unsigned int mask = idx->table_size - 1;
+    unsigned int pos = ack_hash (e->ack) & mask;
+    for ( ; idx->ack_table [pos] != -1; pos = (pos + 1) & mask) {
+      struct log_entry * sent = idx->entries + idx->ack_table [pos];
+      if ((sent->type == MSG_TYPE_SENT) &&
+          (memcmp (sent->ack, e->ack, MESSAGE_ID_SIZE) == 0))
+        sent->ack_index = n;
+    }
+  }
+  /* new records are usually the newest, so these loops are usually short */
+  if (e->type == MSG_TYPE_RCVD) {
+    int pos = idx->num_rcvd++;
+    while ((pos > 0) && (idx->rcvd_seqs [pos - 1] > e->seq)) {
+      idx->rcvd_seqs [pos] = idx->rcvd_seqs [pos - 1];
+      pos--;
+    }
+    idx->rcvd_seqs [pos] = e->seq;
+  }
+  if (e->type != MSG_TYPE_ACK) {
+    int pos = idx->num_by_time++;
+    while ((pos > 0) &&
+           (idx->entries [idx->by_time [pos - 1]].time > e->time)) {
+      idx->by_time [pos] = idx->by_time [pos - 1];
+      pos--;
+    }
+    idx->by_time [pos] = n;
+  }
+}
+
+/* returns the position of the most recent entry with the given sequence
+ * number and type (MSG_TYPE_SENT, MSG_TYPE_RCVD, or MSG_TYPE_ANY for
+ * either), or -1 if none */
+static int index_find_seq (struct log_index * idx, int type, uint64_t seq)
+{
+  int result = -1;
+  if (idx->table_size <= 0)
+    return result;
+  unsigned int mask = idx->table_size - 1;
+  unsigned int pos = seq_hash (seq) & mask;
+  for ( ; idx->seq_table [pos] != -1; pos = (pos + 1) & mask) {
+    int i = idx->seq_table [pos];
+    if ((i > result) && (idx->entries [i].seq == seq) &&
+        ((type == MSG_TYPE_ANY) || (idx->entries [i].type == type)))
+      result = i;
+  }
+  return result;
+}
+
+/* same as index_find_seq, but for the ack, and any type of record */
+static int index_find_ack (struct log_index * idx, int type, const char * ack)
+{
+  int result = -1;
+  if (idx->table_size <= 0)
+    return result;
+  unsigned int mask = idx->table_size - 1;
+  unsigned int pos = ack_hash (ack) & mask;
+  for ( ; idx->ack_table [pos] != -1; pos = (pos + 1) & mask) {
+    int i = idx->ack_table [pos];
+    if ((i > result) &&
+        (memcmp (idx->entries [i].ack, ack, MESSAGE_ID_SIZE) == 0) &&
+        ((type == MSG_TYPE_ANY) || (idx->entries [i].type == type)))
+      result = i;
+  }
+  return result;
+}
+
+static void index_clear (struct log_index * idx)
+{
+  idx->dev = 0;
+  idx->ino = 0;
+  idx->size = 0;
+  idx->num_entries = 0;
+  idx->num_by_time = 0;
+  idx->num_rcvd = 0;
+  if (idx->table_size > 0)
+    index_rebuild_tables (idx);
+}
+
+/* bring the index up to date with the log, which may have been
+ * extended or replaced, possibly by another process */
+static void index_update (struct log_index * idx)
+{
+  struct stat st;
+  if (stat (idx->path, &st) != 0) {
+    index_clear (idx);
+    return;
+  }
+  if ((idx->dev != (uint64_t) st.st_dev) ||
+      (idx->ino != (uint64_t) st.st_ino) || (idx->size > st.st_size)) {
+    index_clear (idx);
+    idx->dev = st.st_dev;
+    idx->ino = st.st_ino;
+  }
+  if (idx->size >= st.st_size)
+    return;
+  int fd = open (idx->path, O_RDONLY);
+  if (fd < 0)
+    return;
+  while (idx->size < st.st_size) {
+    struct log_entry e;
+    if (! log_valid_record (fd, idx->size, st.st_size, &e)) {
+      /* either still being written, or torn by a writer that failed.
+       * Only skip it once a valid record follows, which means that
+       * nobody is still writing it */
+      int64_t next = log_resync (fd, idx->size, st.st_size);
+      if (next >= st.st_size)
+        break;
+      printf ("store.c: skipping invalid records at %" PRId64 "..%" PRId64
+              " in %s\n", idx->size, next, idx->path);
+      idx->size = next;
+      continue;
+    }
+    index_add_entry (idx, &e);
+    idx->size += LOG_RECORD_SIZE (e.msize);
+  }
+  close (fd);
+}
+
+struct text_record {
+  int type;
+  uint64_t seq;
+  uint64_t time;
+  int tz_min;
+  uint64_t rcvd_time;
+  char ack [MESSAGE_ID_SIZE];
+  char * message;
+  int msize;
+};
+
+/* convert the text files (if any) in this directory to a binary log.
+ * only done if there is no log yet.  The text files are deleted
+ * once the log has been completely written */
+static void convert_text_files (const char * dir)
+{
+  char * log_path = strcat3_malloc (dir, "/", LOG_FILE_NAME, "convert log");
+  char * lock_path = strcat3_malloc (dir, "/", LOG_LOCK_NAME, "convert lock");
+  char * tmp_path = strcat3_malloc (dir, "/", LOG_TMP_NAME, "convert tmp");
+  struct stat st;
+  int lock_fd = -1;
+  if ((stat (log_path, &st) == 0) ||   /* already converted */
+      ((lock_fd = open (lock_path, O_RDWR | O_CREAT, 0600)) < 0))
+    goto cleanup;
+  flock (lock_fd, LOCK_EX);  /* in case another process is converting */
+  if (stat (log_path, &st) == 0)   /* the other process converted */
+    goto cleanup;
+  struct text_iter iter =
+    { .valid = 1, .dirname = strcpy_malloc (dir, "convert_text_files"),
+      .current_fname = NULL, .current_file = NULL,
+      .current_size = 0, .current_pos = 0 };
+  /* the text iterator returns the records newest first */
+  struct text_record * records = NULL;
+  int num_records = 0;
+  char ** files = NULL;
+  int num_files = 0;
+  char * record;
+  while ((record = find_prev_record (&iter)) != NULL) {
+    if ((num_files == 0) ||
+        (strcmp (files [num_files - 1], iter.current_fname) != 0)) {
+      files = realloc (files, (num_files + 1) * sizeof (char *));
+      files [num_files++] = strcpy_malloc (iter.current_fname, "convert");
+    }
+    struct text_record r;
+    r.rcvd_time = 0;
+    r.message = NULL;
+    r.type = parse_record (record, &r.seq, &r.time, &r.tz_min, &r.rcvd_time,
+                           r.ack, &r.message, &r.msize);
+    if (r.message != record)
+      free (record);
+    if (r.type == MSG_TYPE_DONE)
+      continue;
+    if (r.type == MSG_TYPE_ACK)
+      r.rcvd_time = 0;
+    records = realloc (records, (num_records + 1) * sizeof (r));
+    records [num_records++] = r;
+  }
+  free (iter.dirname);
+  if (iter.current_fname != NULL)
+    free (iter.current_fname);
+  if (iter.current_file != NULL)
+    free (iter.current_file);
+  if (num_files > 0) {
+    int fd = open (tmp_path, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+    int success = (fd >= 0);
+    int i;
+    for (i = num_records - 1; (success) && (i >= 0); i--)
+      success = log_write_record (fd, records [i].type, records [i].seq,
+                                  records [i].time, records [i].tz_min,
+                                  records [i].rcvd_time, records [i].ack,
+                                  records [i].message, records [i].msize);
+    if ((fd >= 0) && (fsync (fd) != 0))
+      success = 0;
+    if (fd >= 0)
+      close (fd);
+    if ((success) && (rename (tmp_path, log_path) == 0)) {
+      for (i = 0; i < num_files; i++)
+        unlink (files [i]);
+      printf ("converted %d records in %d files to %s\n",
+              num_records, num_files, log_path);
+    } else {
+      perror ("convert_text_files");
+      printf ("unable to convert text files to %s\n", log_path);
+      unlink (tmp_path);
+    }
+  }
+  int i;
+  for (i = 0; i < num_records; i++)
+    if (records [i].message != NULL)
+      free (records [i].message);
+  for (i = 0; i < num_files; i++)
+    free (files [i]);
+  if (records != NULL)
+    free (records);
+  if (files != NULL)
+    free (files);
+cleanup:
+  if (lock_fd >= 0) {
+    flock (lock_fd, LOCK_UN);
+    close (lock_fd);
+  }
+  free (log_path);
+  free (lock_path);
+  free (tmp_path);
+}
+
+/* returns the up-to-date index for this keyset's log, or NULL.
+ * Must be called with log_index_mutex held */
+static struct log_index * get_log_index (keyset k)
+{
+  char * dir = get_xchat_dir (k);
+  if (dir == NULL)
+    return NULL;
+  char * path = strcat3_malloc (dir, "/", LOG_FILE_NAME, "get_log_index");
+  struct log_index * idx = NULL;
+  int i;
+  for (i = 0; i < log_indices_count; i++) {
+    if ((log_indices [i]->k == k) &&
+        (strcmp (log_indices [i]->path, path) == 0)) {
+      idx = log_indices [i];
+      break;
+    }
+  }
+  if (idx == NULL) {  /* first use of this log, convert any old files */
+    create_dir (dir);
+    convert_text_files (dir);
+    idx = malloc_or_fail (sizeof (struct log_index), "get_log_index");
+    memset (idx, 0, sizeof (struct log_index));
+    idx->k = k;
+    idx->path = path;
+    path = NULL;   /* do not free */
+    if (log_indices_count < LOG_INDEX_MAX) {
+      log_indices [log_indices_count++] = idx;
+    } else {      /* replace an existing index */
+      struct log_index * old = log_indices [log_indices_replace];
+      free (old->path);
+      if (old->entries != NULL)
+        free (old->entries);
+      if (old->seq_table != NULL)
+        free (old->seq_table);
+      if (old->ack_table != NULL)
+        free (old->ack_table);
+      if (old->by_time != NULL)
+        free (old->by_time);
+      if (old->rcvd_seqs != NULL)
+        free (old->rcvd_seqs);
+      free (old);
+      log_indices [log_indices_replace] = idx;
+      log_indices_replace = (log_indices_replace + 1) % LOG_INDEX_MAX;
+    }
+  }
+  if (path != NULL)
+    free (path);
+  free (dir);
+  index_update (idx);
+  return idx;
+}
+
+/* append a record to this keyset's log */
+static void log_append (keyset k, int type, uint64_t seq, uint64_t time,
+                        int tz_min, uint64_t rcvd_time, const char * ack,
+                        const char * message, int msize)
+{
+  pthread_mutex_lock (&log_index_mutex);
+  struct log_index * idx = get_log_index (k);  /* converts if needed */
+  char * path = NULL;
+  if (idx != NULL)
+    path = strcpy_malloc (idx->path, "log_append");
+  pthread_mutex_unlock (&log_index_mutex);
+  if (path == NULL)
+    return;
+  while (1) {
+    int fd = open (path, O_RDWR | O_APPEND | O_CREAT, 0600);
+    if (fd < 0) {
+      perror ("open");
+      printf ("unable to open file %s\n", path);
+      break;
+    }
+    flock (fd, LOCK_EX);  /* exclusive write, otherwise multiple writers
+                           * make a mess of the file */
+    struct stat st;
+    int have_st = (fstat (fd, &st) == 0);
+    if ((have_st) && (st.st_nlink == 0)) {
+      /* reduce_conversation replaced the log while we were waiting */
+      flock (fd, LOCK_UN);
+      close (fd);
+      continue;
+    }
+    /* with the lock held nobody else is writing, so an incomplete
+     * record at the end was torn by a writer that failed.  Remove it,
+     * so readers don't take our record as part of it */
+    int64_t end = ((have_st) ? log_valid_end (fd, st.st_size) : 0);
+    if ((have_st) && (end < st.st_size) && (ftruncate (fd, end) != 0))
+      perror ("store.c log_append ftruncate");
+    log_write_record (fd, type, seq, time, tz_min, rcvd_time, ack,
+                      message, msize);
+    flock (fd, LOCK_UN);  /* remove the file lock */
+    close (fd);
+    break;
+  }
+  free (path);
+}
+
+/* read the record of the entry that precedes the last one returned */
+static int prev_message_in_log
+  (struct msg_iter * iter, uint64_t * seq, uint64_t * time,
+   int * tz_min, uint64_t * rcvd_time, char * message_ack,
+   char ** message, int * msize)
+{
+  static const char zero_ack [MESSAGE_ID_SIZE];
+  set_result (seq, 0, time, 0, tz_min, 0, rcvd_time, 0,
+              message_ack, zero_ack, message, NULL, msize, 0);
+  pthread_mutex_lock (&log_index_mutex);
+  struct log_index * idx = NULL;
+  if (iter->log_pos < 0) {
+    idx = get_log_index (iter->k);
+  } else {  /* only read the records that were in the log at the start */
+    int i;
+    for (i = 0; i < log_indices_count; i++)
+      if ((log_indices [i]->k == iter->k) &&
+          (log_indices [i]->ino == iter->log_ino))
+        idx = log_indices [i];
+  }
+  if (idx == NULL) {
+    /* no log, or the log was replaced while we were reading it */
+    pthread_mutex_unlock (&log_index_mutex);
+    iter->log_pos = 0;
+    return MSG_TYPE_DONE;
+  }
+  if (iter->log_pos < 0) {   /* first call */
+    iter->log_pos = idx->num_entries;
+    iter->log_ino = idx->ino;
+  }
+  if (iter->log_pos == 0) {  /* no more records */
+    pthread_mutex_unlock (&log_index_mutex);
+    return MSG_TYPE_DONE;
+  }
+  iter->log_pos--;
+  struct log_entry e = idx->entries [iter->log_pos];
+  if ((iter->log_fd < 0) &&
+      ((tz_min != NULL) || (rcvd_time != NULL) || (message != NULL)))
+    iter->log_fd = open (idx->path, O_RDONLY);
+  pthread_mutex_unlock (&log_index_mutex);
+  if (e.type == MSG_TYPE_ACK) {
+    set_result (seq, 0, time, 0, tz_min, 0, rcvd_time, 0,
+                message_ack, e.ack, message, NULL, msize, 0);
+    return e.type;
+  }
+  int record_tz = 0;
+  uint64_t record_rcvd_time = e.time;
+  char * record = NULL;
+  if ((tz_min != NULL) || (rcvd_time != NULL) || (message != NULL)) {
+    size_t size = LOG_HEADER_SIZE + ((message != NULL) ? e.msize : 0);
+    record = malloc_or_fail (size + 1, "prev_message_in_log");
+    struct log_entry check;
+    if ((iter->log_fd < 0) ||
+        (pread (iter->log_fd, record, size, e.offset) != (ssize_t) size) ||
+        (! log_read_header (record, &check, &record_tz, &record_rcvd_time)) ||
+        (check.seq != e.seq) || (check.type != e.type)) {
+      printf ("store.c: unable to read record at %" PRId64 "\n", e.offset);
+      free (record);
+      iter->log_pos = 0;
+      return MSG_TYPE_DONE;
+    }
+  }
+  set_result (seq, e.seq, time, e.time, tz_min, record_tz,
+              rcvd_time, record_rcvd_time, message_ack, e.ack,
+              NULL, NULL, msize, e.msize);
+  if (message != NULL) {  /* reuse the buffer, with the message at the start */
+    memmove (record, record + LOG_HEADER_SIZE, e.msize);
+    record [e.msize] = '\0';
+    *message = record;
+  } else if (record != NULL) {
+    free (record);
+  }
+  return e.type;
+}
+
 /* must be called with the mutex held */
 static int prev_message_in_memory
   (struct msg_iter * iter, uint64_t * seq, uint64_t * time,
@@ -580,14 +1269,8 @@ int prev_message (struct msg_iter * iter, uint64_t * seq, uint64_t * time,
     pthread_mutex_unlock (&message_cache_mutex);
     return r;
   }
-  char * record = find_prev_record (iter);
-  if (record == NULL)  /* finished */
-    return MSG_TYPE_DONE;
-  int result = parse_record (record, seq, time, tz_min, rcvd_time,
-                             message_ack, message, msize);
-  if ((message == NULL) || (*message != record))
-    free (record);
-  return result;
+  return prev_message_in_log (iter, seq, time, tz_min, rcvd_time,
+                              message_ack, message, msize);
 }
 
 void free_unallocated_iter (struct msg_iter * iter)
@@ -596,22 +1279,14 @@ void free_unallocated_iter (struct msg_iter * iter)
     return;
   if (iter->contact != NULL)
     free (iter->contact);
-  if (! iter->is_in_memory) {
-    if (iter->dirname != NULL)
-      free (iter->dirname);
-    if (iter->current_fname != NULL)
-      free (iter->current_fname);
-    if (iter->current_file != NULL)
-      free (iter->current_file);
-  }
+  if ((! iter->is_in_memory) && (iter->log_fd >= 0))
+    close (iter->log_fd);
   iter->contact = NULL;
   iter->k = -1;            /* invalidate */
   iter->is_in_memory = 0;
-  iter->dirname = NULL;
-  iter->current_fname = NULL;
-  iter->current_file = NULL;
-  iter->current_size = 0;
-  iter->current_pos = 0;
+  iter->log_pos = -1;
+  iter->log_ino = 0;
+  iter->log_fd = -1;
   iter->message_cache_index = 0;
   iter->last_message_index = 0;
   iter->ack_returned = 0;
@@ -623,6 +1298,28 @@ void free_iter (struct msg_iter * iter)
   free (iter);
 }
 
+/* returns 1 if the most recent message sent to k with this sequence
+ * number has been acked, and 0 otherwise, including if there is no such
+ * message.  If there is, and timep is not NULL, sets *timep to the time
+ * the message was sent */
+int sent_is_acked (const char * contact, keyset k, uint64_t seq,
+                   uint64_t * timep)
+{
+  int result = 0;
+  pthread_mutex_lock (&log_index_mutex);
+  struct log_index * idx = get_log_index (k);
+  if (idx != NULL) {
+    int i = index_find_seq (idx, MSG_TYPE_SENT, seq);
+    if (i >= 0) {
+      if (timep != NULL)
+        *timep = idx->entries [i].time;
+      result = (idx->entries [i].ack_index >= 0);
+    }
+  }
+  pthread_mutex_unlock (&log_index_mutex);
+  return result;
+}
+
 /* returns the message type, or MSG_TYPE_DONE if none are available.
  * most recent refers to the most recently saved in the file.  This may
  * not be very useful, highest_seq_record may be more useful */ 
@@ -720,26 +1417,6 @@ int highest_seq_record (const char * contact, keyset k, int type_wanted,
   return max_type;
 }
 
-static char * get_xchat_dir (keyset k)
-{
-  char * contact_dir = key_dir (k);
-  if (contact_dir == NULL)
-    return NULL;
-  char * xchat_dir = string_replace_once (contact_dir, "contacts", "xchat", 1);
-  free (contact_dir);
-  return xchat_dir;
-}
-
-static char * get_xchat_path (keyset k, const char * fname)
-{
-  char * xchat_dir = get_xchat_dir (k);  /* must be free'd */
-  if (xchat_dir == NULL)
-    return NULL;
-  char * path = strcat3_malloc (xchat_dir, "/", fname, "find_prev_file");
-  free (xchat_dir);
-  return path;
-}
-
 static uint64_t read_int_from_file (const char * contact, keyset k,
                                     const char * fname)
 {
@@ -769,65 +1446,6 @@ static void save_int_to_file (const char * contact, keyset k,
   free (path);
 }
 
-#ifdef IMPLEMENTING_SEQ_CACHING
-struct cached_seq_value {
-  uint64_t seq;
-  uint64_t time;
-};
-
-struct cached_seq_pair {
-  keyset k;
-  struct cached_seq_value sent;
-  struct cached_seq_value rcvd;
-};
-
-#define NUM_CACHE_ENTRIES	1000
-static struct cached_seq_pair cached_seq [NUM_CACHE_ENTRIES];
-static int cached_seq_index = 0;
-
-/* returns -1 if not found */
-static int get_cached (keyset k)
-{
-  int i;
-  for (i = 0; i < cached_seq_index; i++) {
-    if (cached_seq [i].k == k)
-      return i;
-  }
-  return -1;
-}
-
-static void cache_seq (keyset k, uint64_t seq, uint64_t time, int sent)
-{
-  int i = 0;
-  int index = cached_seq_index;
-  int need_new = 1;
-  for (i = 0; i < cached_seq_index; i++) {
-    if (cached_seq [i].k == k) {
-      need_new = 0;
-      index = i;
-      break;
-    }
-  }
-  if (need_new && (index >= NUM_CACHE_ENTRIES))
-    return;  /* no room, don't cache */
-  if (need_new) {  /* initialize the new entry to default values */
-    cached_seq [index].k = k;
-    cached_seq [index].sent.seq = 0;
-    cached_seq [index].sent.time = 0;
-    cached_seq [index].rcvd.seq = 0;
-    cached_seq [index].rcvd.time = 0;
-    cached_seq_index++;
-  }
-  if (sent) {
-    cached_seq [index].sent.seq = seq;
-    cached_seq [index].sent.time = time;
-  } else {
-    cached_seq [index].rcvd.seq = seq;
-    cached_seq [index].rcvd.time = time;
-  }
-}
-#endif /* IMPLEMENTING_SEQ_CACHING */
-
 /* returns the sequence number, or 0 if none are available */
 /* type_wanted must be MSG_TYPE_ANY, MSG_TYPE_RCVD, or MSG_TYPE_SENT,
  * otherwise returns 0 */
@@ -850,64 +1468,29 @@ uint64_t highest_seq_value (const char * contact, keyset k, int type_wanted)
   }
   if (seq > 0)
     return seq;
-  /* no such message found, iterate through all messages to find it. */
-  struct msg_iter * iter = start_iter (contact, k);
-  if (iter == NULL)
-    return 0;
-#ifdef IMPLEMENTING_SEQ_CACHING
-  uint64_t saved_seq = 0;
-  uint64_t saved_time = 0;
-  int cache_index = get_cached (k);
-  if (cache_index >= 0) {
-    int save_sent = (type_wanted == MSG_TYPE_SENT);
-    if ((type_wanted == MSG_TYPE_ANY) &&
-        (cached_seq [cache_index].sent.seq > cached_seq [cache_index].rcvd.seq))
-      save_sent = 1;
-    if (save_sent) {
-      saved_seq  = cached_seq [cache_index].sent.seq;
-      saved_time = cached_seq [cache_index].sent.time;
-    } else {
-      saved_seq  = cached_seq [cache_index].rcvd.seq;
-      saved_time = cached_seq [cache_index].rcvd.time;
-    }
-  }
-#endif /* IMPLEMENTING_SEQ_CACHING */
+  /* no such message found, look through the log to find it. */
   int max_type = MSG_TYPE_DONE;
   uint64_t max_seq = 0;
   uint64_t max_time = 0;
-  while (1) {
-    uint64_t this_seq = 0;
-    uint64_t this_time = 0;
-    int type = prev_message (iter, &this_seq, &this_time,
-                             NULL, NULL, NULL, NULL, NULL);
-    if (type == MSG_TYPE_DONE)  /* no (more) messages */
-      break;
-    if (((type == MSG_TYPE_SENT) || (type == MSG_TYPE_RCVD)) && /* no acks */
-        ((type_wanted == MSG_TYPE_ANY) || (type == type_wanted))) { /* match */
-      if ((this_seq > max_seq) ||
-          ((this_seq == max_seq) && (this_time > max_time))) {
-        max_type = type;
-        max_seq = this_seq;
-        max_time = this_time;
-      }
-#ifdef IMPLEMENTING_SEQ_CACHING
-      if ((cache_index >= 0) &&
-          (this_seq == saved_seq) && (this_time == saved_time))
-        break; /* reached the cached value, no point going further */
-#endif /* IMPLEMENTING_SEQ_CACHING */
+  pthread_mutex_lock (&log_index_mutex);
+  struct log_index * idx = get_log_index (k);
+  int i;
+  for (i = 0; (idx != NULL) && (i < idx->num_entries); i++) {
+    struct log_entry * e = idx->entries + i;
+    if (((e->type == MSG_TYPE_SENT) || (e->type == MSG_TYPE_RCVD)) && /* no acks */
+        ((type_wanted == MSG_TYPE_ANY) || (e->type == type_wanted)) && /* match */
+        ((e->seq > max_seq) ||
+         ((e->seq == max_seq) && (e->time > max_time)))) {
+      max_type = e->type;
+      max_seq = e->seq;
+      max_time = e->time;
     }
   }
-  free_iter (iter);
+  pthread_mutex_unlock (&log_index_mutex);
   if (max_seq > 0) {   /* save the result of all this hard work */
     if (max_type == MSG_TYPE_SENT) {
-#ifdef IMPLEMENTING_SEQ_CACHING
-      cache_seq (k, max_seq, max_time, 1);
-#endif /* IMPLEMENTING_SEQ_CACHING */
       save_int_to_file (contact, k, "last_sent", max_seq);
     } else if (max_type == MSG_TYPE_RCVD) {
-#ifdef IMPLEMENTING_SEQ_CACHING
-      cache_seq (k, max_seq, max_time, 0);
-#endif /* IMPLEMENTING_SEQ_CACHING */
       save_int_to_file (contact, k, "last_received", max_seq);
     }
   }
@@ -976,7 +1559,7 @@ static void ack_one_message (struct message_store_info * msgs, int num_used,
   }
 }
 
-/* set the message_has_been_acked of each acked sent message.  quadratic loop */
+/* set the message_has_been_acked of each sent message acked in k's log */
 static void ack_all_messages (struct message_store_info * msgs, int num_used,
                               const char * contact, keyset k)
 {
@@ -988,123 +1571,20 @@ static void ack_all_messages (struct message_store_info * msgs, int num_used,
     /* no messages to ack, nothing to do */
     return;
   }
-  struct msg_iter iter;
-  if (! start_iter_from_file (contact, k, &iter)) {
-    printf ("error: ack_all_messages unable to create iter for %s/%d\n",
-            contact, k);
-    return;
-  }
-  char ack [MESSAGE_ID_SIZE];
-  uint64_t ack_time;
-  int next = prev_message (&iter, NULL, &ack_time, NULL, NULL, ack, NULL, NULL);
-  while (next != MSG_TYPE_DONE) {
-    if (next == MSG_TYPE_ACK)
-      ack_one_message (msgs, num_used, ack, ack_time);
-    next = prev_message (&iter, NULL, NULL, NULL, NULL, ack, NULL, NULL);
-  }
-  free_unallocated_iter (&iter);
-}
-
-static void store_save_string_len (int fd, char * string, int mlen)
-{
-  if (write (fd, string, mlen) != mlen) {
-    perror ("write/len");
-    printf ("unable to write '%s' to file (%d)\n", string, mlen);
-    exit (1);
-  }
-}
-
-static void store_save_string (int fd, char * string)
-{
-  if (write (fd, string, strlen (string)) != (int) (strlen (string))) {
-    perror ("write");
-    printf ("unable to write '%s' to file\n", string);
-    exit (1);
-  }
-}
-
-static void store_save_64 (int fd, uint64_t value)
-{
-  /* 2^64 < 10^20, so 30 bytes are more than needed for the digits */
-  char buffer [30];
-  snprintf (buffer, sizeof (buffer), "%ju", (uintmax_t)value);
-  store_save_string (fd, buffer);
-}
-
-static void store_save_message (int fd, const char * message, int mlen)
-{
-  int num_indents = 1;  /* have to insert a blank before the message */
+  pthread_mutex_lock (&log_index_mutex);
+  struct log_index * idx = get_log_index (k);
   int i;
-  for (i = 0; i + 1 < mlen; i++)
-    if (message [i] == '\n')
-      num_indents++;
-  char * buffer = malloc_or_fail (mlen + num_indents + 2, "store_save_message");
-  int from;
-  buffer [0] = ' ';
-  int to = 1;
-  for (from = 0; from < mlen; from++) {
-    if ((from + 1 < mlen) || (message [from] != '\n')) {
-    /* the if is so we don't copy the last \n, if any */
-      buffer [to++] = message [from];
-      if (message [from] == '\n')
-        buffer [to++] = ' ';
+  for (i = 0; (idx != NULL) && (i < num_used); i++) {
+    if ((msgs [i].msg_type == MSG_TYPE_SENT) &&
+        (! msgs [i].message_has_been_acked)) {
+      int found = index_find_ack (idx, MSG_TYPE_ACK, msgs [i].ack);
+      if (found >= 0) {
+        msgs [i].rcvd_ackd_time = idx->entries [found].time;
+        msgs [i].message_has_been_acked = 1;
+      }
     }
   }
-  buffer [to++] = '\n';
-  buffer [to] = '\0';
-  store_save_string_len (fd, buffer, to);
-  free (buffer);
-}
-
-static void store_save_message_type (int fd, int type)
-{
-  switch (type) {
-  case MSG_TYPE_RCVD:
-    store_save_string (fd, "rcvd id:");
-    break;
-  case MSG_TYPE_SENT:
-    store_save_string (fd, "sent id:");
-    break;
-  case MSG_TYPE_ACK:
-    store_save_string (fd, "got ack:");
-    break;
-  default:
-    printf ("unknown message type %d\n", type);
-    exit (1);
-  }
-}
-
-static void store_save_message_id (int fd, const char * id)
-{
-  store_save_string (fd, " ");
-  char buffer [MESSAGE_ID_SIZE * 2 + 1];
-  int i;
-  for (i = 0; i < MESSAGE_ID_SIZE; i++)
-    snprintf (buffer + 2 * i, sizeof (buffer) - 2 * i, "%02x", (id [i]) & 0xff);
-  store_save_string (fd, buffer);
-}
-
-static void store_save_message_seq_time (int fd, uint64_t seq,
-                                         uint64_t time, int tz, uint64_t rcvd)
-{
-  store_save_string (fd, "sequence ");
-  store_save_64 (fd, seq);
-  store_save_string (fd, ", time ");
-  char time_buf [ALLNET_TIME_STRING_SIZE];
-  allnet_time_string (time, time_buf);
-  store_save_string (fd, time_buf);
-  store_save_string (fd, " (");
-  store_save_64 (fd, time);
-  if (tz < 0) {
-    store_save_string (fd, " -");
-    tz = -tz;
-  } else {
-    store_save_string (fd, " +");
-  }
-  store_save_64 (fd, tz);
-  store_save_string (fd, ")/");
-  store_save_64 (fd, rcvd);
-  store_save_string (fd, "\n");
+  pthread_mutex_unlock (&log_index_mutex);
 }
 
 void save_record (const char * contact, keyset k, int type, uint64_t seq,
@@ -1114,44 +1594,8 @@ void save_record (const char * contact, keyset k, int type, uint64_t seq,
   if ((type != MSG_TYPE_RCVD) && (type != MSG_TYPE_SENT) &&
       (type != MSG_TYPE_ACK))
     return;
-  struct msg_iter iter;
-  if (! start_iter_from_file (contact, k, &iter))
-    return;
-  time_t now;
-  time (&now);
-  struct tm * tm = gmtime (&now);
-#define EXTENSION		".txt"
-#define EXTENSION_LENGTH	4  /* number of characters in ".txt" */
-  char fname [DATE_LEN + EXTENSION_LENGTH + 1];
-  snprintf (fname, sizeof (fname), "%04d%02d%02d%s", tm->tm_year + 1900,
-            tm->tm_mon + 1, tm->tm_mday, EXTENSION);
-  char * path = strcat3_malloc (iter.dirname, "/", fname, "save_record");
-  free_unallocated_iter (&iter);
-  int fd = open (path, O_WRONLY | O_APPEND | O_CREAT, 0600);
-  if (fd < 0) {
-    perror ("open");
-    printf ("unable to open file %s\n", path);
-    free (path);
-    return;
-  }
- 
-  flock (fd, LOCK_EX);  /* exclusive write, otherwise multiple writers
-                         * make a mess of the file */
-  store_save_message_type (fd, type);
-  store_save_message_id (fd, message_ack);
-  char id [MESSAGE_ID_SIZE];
-  sha512_bytes (message_ack, MESSAGE_ID_SIZE, id, MESSAGE_ID_SIZE);
-  store_save_message_id (fd, id);
-  store_save_string (fd, "\n");
-
-  if (type != MSG_TYPE_ACK) {
-    store_save_message_seq_time (fd, seq, t, tz_min, rcvd_time);
-    store_save_message (fd, message, msize);
-  }
-  flock (fd, LOCK_UN);  /* remove the file lock */
-
-  close (fd);
-  free (path);
+  log_append (k, type, seq, t, tz_min, rcvd_time, message_ack,
+              ((type == MSG_TYPE_ACK) ? NULL : message), msize);
   /* now save it internally, if we are caching this contact's data */
   pthread_mutex_lock (&message_cache_mutex);
   int index = find_message_cache_record (contact);
@@ -1364,6 +1808,215 @@ int list_all_messages (const char * contact,
   return 1;
 }
 
+/* a sent or received message found in the log index of one keyset */
+struct message_ref {
+  int key_index;       /* index into the contact's keysets */
+  int log_pos;         /* position of the record in its log */
+  struct log_entry e;  /* the indexed part of the record */
+  uint64_t missing;
+  uint64_t ack_time;
+  int acked;
+};
+
+/* newest first, in the same order as list_all_messages */
+static int compare_message_ref (const void * a, const void * b)
+{
+  const struct message_ref * x = (const struct message_ref *) a;
+  const struct message_ref * y = (const struct message_ref *) b;
+  if (x->e.time != y->e.time)
+    return ((x->e.time > y->e.time) ? -1 : 1);
+  if (x->key_index != y->key_index)
+    return x->key_index - y->key_index;
+  return y->log_pos - x->log_pos;
+}
+
+/* adds to *refs a reference to each of the newest sent or received
+ * messages in k's log that are older than before (all if before is 0),
+ * up to max of them (all if max <= 0) plus any others with the same time
+ * as the oldest one, with missing and acked computed from the index.
+ * Sets *more to 1 if the log has older messages, and to 0 otherwise.
+ * Returns the path of the log (must be free'd), or NULL if there is no log */
+static char * add_message_refs (keyset k, int key_index,
+                                uint64_t before, int max,
+                                struct message_ref ** refs,
+                                int * num_refs, int * num_alloc, int * more)
+{
+  *more = 0;
+  pthread_mutex_lock (&log_index_mutex);
+  struct log_index * idx = get_log_index (k);
+  if (idx == NULL) {
+    pthread_mutex_unlock (&log_index_mutex);
+    return NULL;
+  }
+  int end = idx->num_by_time;  /* by_time [end - 1] is the newest wanted */
+  if (before > 0) {
+    int low = 0;
+    while (low < end) {
+      int mid = (low + end) / 2;
+      if (idx->entries [idx->by_time [mid]].time < before)
+        low = mid + 1;
+      else
+        end = mid;
+    }
+  }
+  int start = 0;               /* by_time [start] is the oldest wanted */
+  if ((max > 0) && (end > max)) {
+    start = end - max;
+    uint64_t oldest = idx->entries [idx->by_time [start]].time;
+    while ((start > 0) && (idx->entries [idx->by_time [start - 1]].time ==
+                           oldest))
+      start--;
+    *more = (start > 0);
+  }
+  if (*num_refs + (end - start) > *num_alloc) {
+    *num_alloc = *num_refs + (end - start) + 100;
+    *refs = realloc (*refs, *num_alloc * sizeof (struct message_ref));
+    if (*refs == NULL) {
+      printf ("add_message_refs unable to allocate %d refs\n", *num_alloc);
+      exit (1);
+    }
+  }
+  int i;
+  for (i = end - 1; i >= start; i--) {
+    struct log_entry * e = idx->entries + idx->by_time [i];
+    struct message_ref * r = (*refs) + ((*num_refs)++);
+    r->key_index = key_index;
+    r->log_pos = idx->by_time [i];
+    r->e = *e;
+    r->missing = 0;
+    r->ack_time = 0;
+    r->acked = 0;
+    if (e->type == MSG_TYPE_SENT) {
+      int found = e->ack_index;
+      if (found >= 0) {
+        r->acked = 1;
+        r->ack_time = idx->entries [found].time;
+      }
+    } else {  /* find the largest received seq less than this one */
+      int low = 0;                /* rcvd_seqs [low - 1] < seq, if low > 0 */
+      int high = idx->num_rcvd;   /* rcvd_seqs [high] >= seq */
+      while (low < high) {
+        int mid = (low + high) / 2;
+        if (idx->rcvd_seqs [mid] < e->seq)
+          low = mid + 1;
+        else
+          high = mid;
+      }
+      uint64_t prev_seq = ((low > 0) ? idx->rcvd_seqs [low - 1] : 0);
+      r->missing = e->seq - (prev_seq + 1);
+    }
+  }
+  char * path = strcpy_malloc (idx->path, "add_message_refs path");
+  pthread_mutex_unlock (&log_index_mutex);
+  return path;
+}
+
+/* reads the record for r from the log, returning the message (to be
+ * free'd) and setting tz_min and rcvd_time, or returning NULL if the
+ * log no longer has this record */
+static char * read_message_ref (int fd, struct message_ref * r,
+                                int * tz_min, uint64_t * rcvd_time)
+{
+  if (fd < 0)
+    return NULL;
+  size_t size = LOG_HEADER_SIZE + r->e.msize;
+  char * record = malloc_or_fail (size + 1, "read_message_ref");
+  struct log_entry check;
+  if ((pread (fd, record, size, r->e.offset) != (ssize_t) size) ||
+      (! log_read_header (record, &check, tz_min, rcvd_time)) ||
+      (check.seq != r->e.seq) || (check.type != r->e.type)) {
+    free (record);
+    return NULL;
+  }
+  memmove (record, record + LOG_HEADER_SIZE, r->e.msize);
+  record [r->e.msize] = '\0';
+  return record;
+}
+
+/* same as list_all_messages, but only returns the messages older than
+ * before (all if before is 0), up to max of them (all if max <= 0) plus
+ * any others with the same time as the oldest one.  Each log index keeps
+ * its messages sorted by time, so only the newest max messages of each
+ * keyset are looked at, and only the selected messages are read from
+ * the log.  If next is not NULL, it is set to the before for the next
+ * page, or to 0 if there are no older messages */
+int list_messages (const char * contact, uint64_t before, int max,
+                   struct message_store_info ** msgs,
+                   int * num_alloc, int * num_used, uint64_t * next)
+{
+  if (next != NULL)
+    *next = 0;
+  if ((contact == NULL) || (msgs == NULL) ||
+      (num_alloc == NULL) || (num_used == NULL))
+    return 0;
+  *num_used = 0;
+  keyset * k = NULL;
+  int nk = all_keys (contact, &k);
+  if (nk <= 0)  /* no such contact, or this contact has no keys */
+    return 0;
+  struct message_ref * refs = NULL;
+  int num_refs = 0;
+  int refs_alloc = 0;
+  int more = 0;    /* some keyset has older messages than its refs */
+  char ** paths = malloc_or_fail (nk * sizeof (char *), "list_messages paths");
+  int * fds = malloc_or_fail (nk * sizeof (int), "list_messages fds");
+  int ik;
+  for (ik = 0; ik < nk; ik++) {
+    int key_more = 0;
+    paths [ik] = add_message_refs (k [ik], ik, before, max,
+                                   &refs, &num_refs, &refs_alloc, &key_more);
+    fds [ik] = -1;
+    more = more || key_more;
+  }
+  /* each keyset's refs are sorted, and include all the ones that may be
+   * on this page.  Merge them and keep the newest max */
+  qsort (refs, num_refs, sizeof (struct message_ref), compare_message_ref);
+  int last = num_refs;
+  if ((max > 0) && (max < last)) {
+    last = max;
+    /* times are the page boundaries, so do not split messages with
+     * the same time across pages */
+    while ((last < num_refs) && (refs [last].e.time == refs [last - 1].e.time))
+      last++;
+  }
+  if ((next != NULL) && (last > 0) && ((last < num_refs) || (more)))
+    *next = refs [last - 1].e.time;  /* > 0, since older ones remain */
+  int i;
+  for (i = 0; i < last; i++) {
+    struct message_ref * r = refs + i;
+    int key_index = r->key_index;
+    if ((fds [key_index] < 0) && (paths [key_index] != NULL))
+      fds [key_index] = open (paths [key_index], O_RDONLY);
+    int tz_min = 0;
+    uint64_t rcvd_time = r->e.time;
+    char * message = read_message_ref (fds [key_index], r, &tz_min,
+                                       &rcvd_time);
+    if (message == NULL) {  /* log was replaced, e.g. by reduce_conversation */
+      printf ("list_messages: unable to read record at %" PRId64 "\n",
+              r->e.offset);
+      continue;
+    }
+    if (r->acked)
+      rcvd_time = r->ack_time;
+    add_message (msgs, num_alloc, num_used, *num_used, k [key_index],
+                 r->e.type, r->e.seq, r->missing, r->e.time, tz_min,
+                 rcvd_time, r->acked, r->e.ack, message, r->e.msize);
+    free (message);
+  }
+  for (ik = 0; ik < nk; ik++) {
+    if (fds [ik] >= 0)
+      close (fds [ik]);
+    if (paths [ik] != NULL)
+      free (paths [ik]);
+  }
+  free (fds);
+  free (paths);
+  if (refs != NULL)
+    free (refs);
+  free (k);
+  return 1;
+}
+
 /* frees the message storage pointed to by each message entry */
 void free_all_messages (struct message_store_info * msgs, int num_used)
 {
@@ -1504,15 +2157,108 @@ static char * oldest_nonempty_file (const char * contact)
   return oldest_fname;
 }
 
-/* remove older files one by one until the remaining conversation size
- * is less than or equal to max_size
+/* returns the keyset whose log has the oldest message, or -1 if
+ * none of the logs have any records */
+static keyset oldest_log (const char * contact)
+{
+  keyset * k = NULL;
+  int n = all_keys (contact, &k);
+  keyset result = -1;
+  uint64_t oldest_time = 0;
+  pthread_mutex_lock (&log_index_mutex);
+  int i;
+  for (i = 0; i < n; i++) {
+    struct log_index * idx = get_log_index (k [i]);
+    if ((idx == NULL) || (idx->num_entries <= 0))
+      continue;
+    uint64_t time = 0;   /* if only acks, use this log first */
+    int e;
+    for (e = 0; e < idx->num_entries; e++) {
+      if (idx->entries [e].type != MSG_TYPE_ACK) {
+        time = idx->entries [e].time;
+        break;
+      }
+    }
+    if ((result == -1) || (time < oldest_time)) {
+      result = k [i];
+      oldest_time = time;
+    }
+  }
+  pthread_mutex_unlock (&log_index_mutex);
+  if (k != NULL)
+    free (k);
+  return result;
+}
+
+/* remove the oldest records of the log, totaling at least remove_bytes
+ * (or all the records), by replacing the log with a copy of the
+ * remaining records.  Returns 1 for success, 0 for failure */
+static int trim_log (keyset k, int64_t remove_bytes)
+{
+  int result = 0;
+  pthread_mutex_lock (&log_index_mutex);
+  struct log_index * idx = get_log_index (k);
+  if ((idx == NULL) || (idx->num_entries <= 0)) {
+    pthread_mutex_unlock (&log_index_mutex);
+    return 0;
+  }
+  int first = 0;
+  while ((first < idx->num_entries) &&
+         (idx->entries [first].offset < remove_bytes))
+    first++;
+  int fd = open (idx->path, O_RDONLY);
+  if (fd < 0) {
+    pthread_mutex_unlock (&log_index_mutex);
+    return 0;
+  }
+  flock (fd, LOCK_EX);  /* no appends while we copy */
+  if (first >= idx->num_entries) {
+    result = (unlink (idx->path) == 0);
+  } else {
+    char * tmp_path = string_replace_once (idx->path, LOG_FILE_NAME,
+                                           LOG_TMP_NAME, 1);
+    int64_t start = idx->entries [first].offset;
+    struct stat st;
+    int tmp_fd = open (tmp_path, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+    if ((tmp_fd >= 0) && (fstat (fd, &st) == 0) && (st.st_size > start)) {
+      size_t size = st.st_size - start;
+      char * buffer = malloc_or_fail (size, "store.c trim_log");
+      result = ((pread (fd, buffer, size, start) == (ssize_t) size) &&
+                (write (tmp_fd, buffer, size) == (ssize_t) size) &&
+                (fsync (tmp_fd) == 0));
+      free (buffer);
+    }
+    if (tmp_fd >= 0)
+      close (tmp_fd);
+    if ((result) && (rename (tmp_path, idx->path) != 0))
+      result = 0;
+    if (! result) {
+      perror ("trim_log");
+      printf ("unable to remove old records from %s\n", idx->path);
+      unlink (tmp_path);
+    }
+    free (tmp_path);
+  }
+  flock (fd, LOCK_UN);
+  close (fd);
+  pthread_mutex_unlock (&log_index_mutex);
+  return result;
+}
+
+/* remove the oldest messages until the remaining conversation size
+ * is less than or equal to max_size.  Once there are no more messages,
+ * remove older files one by one.
  * returns 1 for success, 0 for failure. */
 int reduce_conversation (const char * contact, uint64_t max_size_u)
 {
   int64_t max_size = (int64_t) max_size_u;
   if (contact == NULL)
     return 0;
-  while (conversation_size (contact) > max_size) {
+  int64_t size;
+  while ((size = conversation_size (contact)) > max_size) {
+    keyset k = oldest_log (contact);
+    if ((k >= 0) && (trim_log (k, size - max_size)))
+      continue;
     char * fname = oldest_nonempty_file (contact);
     if (fname == NULL) {
     /* could be an error, but more likely, no files left and
@@ -1562,6 +2308,7 @@ int clear_conversation (const char * contact)
   for (i = 0; i < n; i++) {
     char * xchat_dir = get_xchat_dir (k [i]);
     rmdir_matching (xchat_dir, ".txt");
+    rmdir_matching (xchat_dir, LOG_FILE_NAME);
     free (xchat_dir);
   }
   return 1;
@@ -56,6 +56,13 @@ extern int most_recent_record (const char * contact, keyset k, int type_wanted,
                                uint64_t * rcvd_time, char * message_ack,
                                char ** message, int * msize);
 
+/* returns 1 if the most recent message sent to k with this sequence
+ * number has been acked, and 0 otherwise, including if there is no such
+ * message.  If there is, and timep is not NULL, sets *timep to the time
+ * the message was sent.  Takes constant time, using the index of the log */
+extern int sent_is_acked (const char * contact, keyset k, uint64_t seq,
+                          uint64_t * timep);
+
 extern void save_record (const char * contact, keyset k, int type, uint64_t seq,
                          uint64_t time, int tz_min, uint64_t rcvd_time,
                          const char * message_ack, const char * message,
@@ -90,6 +97,16 @@ struct message_store_info {
 extern int list_all_messages (const char * contact,
                               struct message_store_info ** msgs,
                               int * num_alloc, int * num_used);
+/* same as list_all_messages, but only gets the messages sent or received
+ * before the given time (all if before is 0), most recent first.  Gets
+ * up to max messages (all if max <= 0), plus any others with the same
+ * time as the oldest one.
+ * So a conversation can be read one page at a time, newest first, even
+ * as new messages arrive: start with before = 0, then use the *next from
+ * the previous page.  *next is set to 0 when there are no more pages */
+extern int list_messages (const char * contact, uint64_t before, int max,
+                          struct message_store_info ** msgs,
+                          int * num_alloc, int * num_used, uint64_t * next);
 /* frees the message storage pointed to by each message entry */
 extern void free_all_messages (struct message_store_info * msgs, int num_used);
 
@@ -353,6 +353,8 @@ int xchat_init (const char * arg0, const char * path)
     random_bytes (global_token, sizeof (global_token));
     save_token ();
   }
+  /* handle_data may try many keysets for each packet */
+  decrypt_verify_start_workers (-1);
 #ifdef HAVE_REQUEST_THREAD
   int * arg = malloc_or_fail (sizeof (int), "xchat_init");
   *arg = sock;
@@ -720,12 +722,25 @@ static int handle_data (int sock, struct allnet_header * hp, unsigned int psize,
   }
   char * message_id = ALLNET_MESSAGE_ID (hp, hp->transport, psize);
   char message_ack [MESSAGE_ID_SIZE];
-/* relatively quick check to see if we may have gotten this message before */
-  if ((hp->transport & ALLNET_TRANSPORT_ACK_REQ) && (message_id != NULL) &&
-      (idhash_check (MESSAGE_ID_HASH_INDEX, (unsigned char *) message_id))) {
+/* relatively quick check to see if we may have gotten this message before,
+ * first in memory, then in the saved index of received messages.  Either
+ * way, we can ack it without trying to decrypt it */
+  int cached = 0;
+  if ((hp->transport & ALLNET_TRANSPORT_ACK_REQ) && (message_id != NULL)) {
     int index = idhash_index ((unsigned char *)message_id);
-    memcpy (message_ack, id_hashes [MESSAGE_ID_ACK_INDEX] [index],
-            MESSAGE_ID_SIZE);
+    if (idhash_check (MESSAGE_ID_HASH_INDEX, (unsigned char *) message_id)) {
+      memcpy (message_ack, id_hashes [MESSAGE_ID_ACK_INDEX] [index],
+              MESSAGE_ID_SIZE);
+      cached = 1;
+    } else if (message_id_is_in_saved_cache (message_id, message_ack)) {
+      memcpy (id_hashes [MESSAGE_ID_HASH_INDEX] [index],
+              message_id, MESSAGE_ID_SIZE);
+      memcpy (id_hashes [MESSAGE_ID_ACK_INDEX] [index],
+              message_ack, MESSAGE_ID_SIZE);
+      cached = 1;
+    }
+  }
+  if (cached) {
 #ifdef DEBUG_PRINT
     print_buffer (message_ack, MESSAGE_ID_SIZE,
                   "xcommon handle_data sending quick ack",